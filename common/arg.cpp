@@ -435,7 +435,7 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
                 params.draft_cpuparams.n_threads = std::thread::hardware_concurrency();
             }
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE}));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}));
     add_opt(llama_arg(
         {"-tbd", "--threads-batch-draft"}, "N",
         "number of threads to use during batch and prompt processing (default: same as --threads-draft)",
@@ -445,7 +445,7 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
                 params.draft_cpuparams_batch.n_threads = std::thread::hardware_concurrency();
             }
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE}));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}));
     add_opt(llama_arg(
         {"-C", "--cpu-mask"}, "M",
         "CPU affinity mask: arbitrarily long hex. Complements cpu-range (default: \"\")",
@@ -484,10 +484,14 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
         }
     ));
     add_opt(llama_arg(
-        {"--poll"}, "<0...100>",
-        format("use polling level to wait for work (0 - no polling, default: %u)\n", (unsigned) params.cpuparams.poll),
+        {"--poll"}, "<0...100|adaptive>",
+        format("use polling level to wait for work (0 - no polling, adaptive - pick from the gap between graphs, default: %u)\n", (unsigned) params.cpuparams.poll),
         [](gpt_params & params, const std::string & value) {
-            params.cpuparams.poll = std::stoul(value);
+            if (value == "adaptive") {
+                params.cpuparams.poll = GGML_THREADPOOL_POLL_ADAPTIVE;
+            } else {
+                params.cpuparams.poll = std::stoul(value);
+            }
         }
     ));
     add_opt(llama_arg(
@@ -628,7 +632,7 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
         [](gpt_params & params, int value) {
             params.n_draft = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_LOOKUP}));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_LOOKUP, LLAMA_EXAMPLE_SERVER}));
     add_opt(llama_arg(
         {"-ps", "--p-split"}, "N",
         format("speculative decoding split probability (default: %.1f)", (double)params.p_split),
@@ -642,7 +646,7 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
         [](gpt_params & params, const std::string & value) {
             params.lookup_cache_static = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_LOOKUP}));
+    ).set_examples({LLAMA_EXAMPLE_LOOKUP, LLAMA_EXAMPLE_SERVER}));
     add_opt(llama_arg(
         {"-lcd", "--lookup-cache-dynamic"}, "FNAME",
         "path to dynamic lookup cache to use for lookup decoding (updated by generation)",
@@ -723,6 +727,20 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
             params.sparams.no_perf = true;
         }
     ).set_env("LLAMA_ARG_NO_PERF"));
+    add_opt(llama_arg(
+        {"--profile-trace"}, "FNAME",
+        "profile the scheduler splits and input copies and write a Chrome trace (chrome://tracing) to FNAME on exit",
+        [](gpt_params & params, const std::string & value) {
+            params.profile_trace = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_MAIN}));
+    add_opt(llama_arg(
+        {"--profile-nodes"},
+        format("also time the individual graph nodes in the profile trace (default: %s)", params.profile_nodes ? "true" : "false"),
+        [](gpt_params & params) {
+            params.profile_nodes = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_MAIN}));
     add_opt(llama_arg(
         {"-f", "--file"}, "FNAME",
         "a file containing the prompt (default: none)",
@@ -1102,7 +1120,7 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
             else if (value == "last") { params.pooling_type = LLAMA_POOLING_TYPE_LAST; }
             else { throw std::invalid_argument("invalid value"); }
         }
-    ).set_examples({LLAMA_EXAMPLE_EMBEDDING}));
+    ).set_examples({LLAMA_EXAMPLE_EMBEDDING, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_POOLING"));
     add_opt(llama_arg(
         {"--attention"}, "{causal,non,causal}",
         "attention type for embeddings, use model default if unspecified",
@@ -1222,6 +1240,28 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
             params.cache_type_v = value;
         }
     ));
+    add_opt(llama_arg(
+        {"-ctkl", "--cache-type-k-layers"}, "SPEC",
+        "KV cache data types for K of some layers, as <layers>=<type>,... where <layers> is a layer or a range a..b\n"
+        "negative layers count from the end, e.g. 0..1=f16,-1=f16",
+        [](gpt_params & params, const std::string & value) {
+            params.cache_type_k_layers = value;
+        }
+    ));
+    add_opt(llama_arg(
+        {"-ctvl", "--cache-type-v-layers"}, "SPEC",
+        "KV cache data types for V of some layers, same format as --cache-type-k-layers",
+        [](gpt_params & params, const std::string & value) {
+            params.cache_type_v_layers = value;
+        }
+    ));
+    add_opt(llama_arg(
+        {"--kv-mixed"},
+        format("keep the first two and the last layer of a quantized KV cache in F16 (default: %s)", params.kv_mixed ? "true" : "false"),
+        [](gpt_params & params) {
+            params.kv_mixed = true;
+        }
+    ).set_env("LLAMA_ARG_KV_MIXED"));
     add_opt(llama_arg(
         {"--perplexity", "--all-logits"},
         format("return logits for all tokens in the batch (default: %s)", params.logits_all ? "true" : "false"),
@@ -1306,6 +1346,48 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
             params.defrag_thold = std::stof(value);
         }
     ).set_env("LLAMA_ARG_DEFRAG_THOLD"));
+    add_opt(llama_arg(
+        {"--defrag-budget"}, "N",
+        format("max KV cache cells moved by the defragmentation per decode, the rest is moved by the next decodes (default: %d, 0 = no limit)", params.defrag_budget),
+        [](gpt_params & params, int value) {
+            params.defrag_budget = value;
+        }
+    ).set_env("LLAMA_ARG_DEFRAG_BUDGET"));
+    add_opt(llama_arg(
+        {"-kvb", "--kv-block-size"}, "N",
+        format("allocate the KV cache in blocks of N cells per sequence instead of contiguous slots, power of 2 (default: %d, 0 = disabled)", params.kv_block_size),
+        [](gpt_params & params, int value) {
+            params.kv_block_size = value;
+        }
+    ).set_env("LLAMA_ARG_KV_BLOCK_SIZE"));
+    add_opt(llama_arg(
+        {"--kv-sink"}, "N",
+        format("evict the old tokens of a sequence from the KV cache instead of shifting the context, keeping its first N tokens as attention sinks (default: %d, 0 = disabled)", params.kv_sink),
+        [](gpt_params & params, int value) {
+            params.kv_sink = value;
+        }
+    ).set_env("LLAMA_ARG_KV_SINK"));
+    add_opt(llama_arg(
+        {"--kv-window"}, "N",
+        format("max tokens of a sequence kept in the KV cache with --kv-sink, including the sinks (default: %d, 0 = context size per sequence)", params.kv_window),
+        [](gpt_params & params, int value) {
+            params.kv_window = value;
+        }
+    ).set_env("LLAMA_ARG_KV_WINDOW"));
+    add_opt(llama_arg(
+        {"--kv-hh-budget"}, "N",
+        format("keep at most N tokens of a sequence in the KV cache, evicting the ones that received the least attention (default: %d, 0 = disabled)", params.kv_hh_budget),
+        [](gpt_params & params, int value) {
+            params.kv_hh_budget = value;
+        }
+    ).set_env("LLAMA_ARG_KV_HH_BUDGET"));
+    add_opt(llama_arg(
+        {"--kv-hh-recent"}, "N",
+        format("number of recent tokens of a sequence that are never evicted with --kv-hh-budget (default: %d)", params.kv_hh_recent),
+        [](gpt_params & params, int value) {
+            params.kv_hh_recent = value;
+        }
+    ).set_env("LLAMA_ARG_KV_HH_RECENT"));
     add_opt(llama_arg(
         {"-np", "--parallel"}, "N",
         format("number of parallel sequences to decode (default: %d)", params.n_parallel),
@@ -1340,7 +1422,7 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
         [](gpt_params & params, const std::string & value) {
             params.mmproj = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_LLAVA}));
+    ).set_examples({LLAMA_EXAMPLE_LLAVA, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_MMPROJ"));
     add_opt(llama_arg(
         {"--image"}, "FILE",
         "path to an image file. use with multimodal models. Specify multiple times for batching",
@@ -1377,12 +1459,14 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
         "- distribute: spread execution evenly over all nodes\n"
         "- isolate: only spawn threads on CPUs on the node that execution started on\n"
         "- numactl: use the CPU map provided by numactl\n"
+        "- pipeline: split the layers across the nodes, each node computes its layers with local memory\n"
         "if run without this previously, it is recommended to drop the system page cache before using this\n"
         "see https://github.com/ggerganov/llama.cpp/issues/1437",
         [](gpt_params & params, const std::string & value) {
             /**/ if (value == "distribute" || value == "") { params.numa = GGML_NUMA_STRATEGY_DISTRIBUTE; }
             else if (value == "isolate") { params.numa = GGML_NUMA_STRATEGY_ISOLATE; }
             else if (value == "numactl") { params.numa = GGML_NUMA_STRATEGY_NUMACTL; }
+            else if (value == "pipeline") { params.numa = GGML_NUMA_STRATEGY_PIPELINE; }
             else { throw std::invalid_argument("invalid value"); }
         }
     ));
@@ -1407,7 +1491,7 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
                 fprintf(stderr, "warning: see main README.md for information on enabling GPU BLAS support\n");
             }
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE}));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}));
     add_opt(llama_arg(
         {"-sm", "--split-mode"}, "{none,layer,row}",
         "how to split the model across multiple GPUs, one of:\n"
@@ -1552,7 +1636,7 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
         [](gpt_params & params, const std::string & value) {
             params.model_draft = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE}));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}));
     add_opt(llama_arg(
         {"-mu", "--model-url"}, "MODEL_URL",
         "model download url (default: unused)",
@@ -1802,6 +1886,13 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
             params.n_threads_http = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_THREADS_HTTP"));
+    add_opt(llama_arg(
+        {"--http-event-loop"},
+        format("serve the connections from an event loop, streamed responses do not hold an HTTP thread and slow clients get backpressure (Linux only, without SSL) (default: %s)", params.http_event_loop ? "enabled" : "disabled"),
+        [](gpt_params & params) {
+            params.http_event_loop = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_HTTP_EVENT_LOOP"));
     add_opt(llama_arg(
         {"-spf", "--system-prompt-file"}, "FNAME",
         "set a file to load a system prompt (initial prompt of all slots), this is useful for chat applications",
@@ -1844,6 +1935,59 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
             }
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(llama_arg(
+        {"--slot-cache-size"}, "N",
+        format("MiB of prompt caches saved automatically under --slot-save-path when the requests finish, and loaded by the requests that start with the same tokens, also after a restart (default: %d, 0 = disabled)", params.slot_cache_size),
+        [](gpt_params & params, int value) {
+            params.slot_cache_size = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SLOT_CACHE_SIZE"));
+    add_opt(llama_arg(
+        {"--prefill-budget"}, "N",
+        format("max number of prompt tokens added to a batch that also decodes the tokens of other slots, so that long prompts are processed in chunks between the generated tokens (default: %d, 0 = batch size)", params.n_prefill_budget),
+        [](gpt_params & params, int value) {
+            params.n_prefill_budget = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFILL_BUDGET"));
+    add_opt(llama_arg(
+        {"--preemption"},
+        format("let a request take the slot of a request of lower \"priority\" when no slot is free, the preempted request resumes from its saved state when a slot is free (default: %s)", params.preemption ? "enabled" : "disabled"),
+        [](gpt_params & params) {
+            params.preemption = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREEMPTION"));
+    add_opt(llama_arg(
+        {"--spec-ngram"},
+        format("speculative decoding with the tokens drafted from the n-grams of the prompt and the generated text, the finished requests and --lookup-cache-static, when there is no draft model (default: %s)", params.spec_ngram ? "enabled" : "disabled"),
+        [](gpt_params & params) {
+            params.spec_ngram = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SPEC_NGRAM"));
+    add_opt(llama_arg(
+        {"--radix-cache"}, "N",
+        format("max number of prompt tokens whose KV cache is kept in a prefix tree shared by all the slots, so that a request reuses the prefixes computed by any slot with \"cache_prompt\" (default: %d, 0 = disabled)", params.radix_cache),
+        [](gpt_params & params, int value) {
+            params.radix_cache = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_RADIX_CACHE"));
+    add_opt(llama_arg(
+        {"--kv-tier-ram"}, "N",
+        format("MiB of host memory used to keep the KV cache of the conversations evicted from the slots (default: %d, 0 = disabled)", params.kv_tier_ram),
+        [](gpt_params & params, int value) {
+            params.kv_tier_ram = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_TIER_RAM"));
+    add_opt(llama_arg(
+        {"--kv-tier-path"}, "PATH",
+        "directory for the evicted KV caches that do not fit in --kv-tier-ram (default: disabled)",
+        [](gpt_params & params, const std::string & value) {
+            params.kv_tier_path = value;
+            // if doesn't end with DIRECTORY_SEPARATOR, add it
+            if (!params.kv_tier_path.empty() && params.kv_tier_path[params.kv_tier_path.size() - 1] != DIRECTORY_SEPARATOR) {
+                params.kv_tier_path += DIRECTORY_SEPARATOR;
+            }
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_TIER_PATH"));
     add_opt(llama_arg(
         {"--chat-template"}, "JINJA_TEMPLATE",
         "set custom jinja chat template (default: template taken from model's metadata)\n"
@@ -819,6 +819,91 @@ std::string fs_get_cache_file(const std::string & filename) {
 //
 // Model utils
 //
+
+static ggml_type kv_cache_type_from_str(const std::string & s) {
+    if (s == "f32") {
+        return GGML_TYPE_F32;
+    }
+    if (s == "f16") {
+        return GGML_TYPE_F16;
+    }
+    if (s == "q8_0") {
+        return GGML_TYPE_Q8_0;
+    }
+    if (s == "q4_0") {
+        return GGML_TYPE_Q4_0;
+    }
+    if (s == "q4_1") {
+        return GGML_TYPE_Q4_1;
+    }
+    if (s == "iq4_nl") {
+        return GGML_TYPE_IQ4_NL;
+    }
+    if (s == "q5_0") {
+        return GGML_TYPE_Q5_0;
+    }
+    if (s == "q5_1") {
+        return GGML_TYPE_Q5_1;
+    }
+
+    throw std::runtime_error("Invalid cache type: " + s);
+}
+
+std::vector<ggml_type> kv_cache_types_from_str(const std::string & s, int n_layer) {
+    std::vector<ggml_type> types(n_layer, GGML_TYPE_COUNT);
+
+    auto parse_layer = [&](const std::string & str) {
+        size_t n_parsed = 0;
+        int il = 0;
+        try {
+            il = std::stoi(str, &n_parsed);
+        } catch (const std::exception &) {
+            n_parsed = 0;
+        }
+        if (n_parsed == 0 || n_parsed != str.size() || il < -n_layer || il >= n_layer) {
+            throw std::runtime_error("Invalid cache type layer: " + str);
+        }
+        return il < 0 ? n_layer + il : il;
+    };
+
+    for (const auto & item : string_split(s, ',')) {
+        const size_t pos_eq = item.find('=');
+        if (pos_eq == std::string::npos) {
+            throw std::runtime_error("Invalid cache type layers: " + item);
+        }
+
+        const std::string layers = item.substr(0, pos_eq);
+        const ggml_type   type   = kv_cache_type_from_str(item.substr(pos_eq + 1));
+
+        const size_t pos_range = layers.find("..");
+
+        const int il0 = parse_layer(layers.substr(0, pos_range));
+        const int il1 = pos_range == std::string::npos ? il0 : parse_layer(layers.substr(pos_range + 2));
+        if (il1 < il0) {
+            throw std::runtime_error("Invalid cache type layers: " + item);
+        }
+
+        for (int il = il0; il <= il1; ++il) {
+            types[il] = type;
+        }
+    }
+
+    return types;
+}
+
+void gpt_params_resolve_cache_types(gpt_params & params, const struct llama_model * model) {
+    // the per-layer KV cache types can refer to the layers from the end
+    params.cache_types_k.clear();
+    params.cache_types_v.clear();
+
+    if (!params.cache_type_k_layers.empty()) {
+        params.cache_types_k = kv_cache_types_from_str(params.cache_type_k_layers, llama_n_layer(model));
+    }
+    if (!params.cache_type_v_layers.empty()) {
+        params.cache_types_v = kv_cache_types_from_str(params.cache_type_v_layers, llama_n_layer(model));
+    }
+}
+
 struct llama_init_result llama_init_from_gpt_params(gpt_params & params) {
     llama_init_result iparams;
     auto mparams = llama_model_params_from_gpt_params(params);
@@ -838,6 +923,8 @@ struct llama_init_result llama_init_from_gpt_params(gpt_params & params) {
         return iparams;
     }
 
+    gpt_params_resolve_cache_types(params, model);
+
     auto cparams = llama_context_params_from_gpt_params(params);
 
     llama_context * lctx = llama_new_context_with_model(model, cparams);
@@ -928,6 +1015,10 @@ struct llama_init_result llama_init_from_gpt_params(gpt_params & params) {
         llama_perf_context_reset(lctx);
     }
 
+    if (!params.profile_trace.empty()) {
+        llama_perf_profile_set(lctx, params.profile_nodes ? 2 : 1);
+    }
+
     iparams.model   = model;
     iparams.context = lctx;
     return iparams;
@@ -965,35 +1056,6 @@ struct llama_model_params llama_model_params_from_gpt_params(const gpt_params &
     return mparams;
 }
 
-static ggml_type kv_cache_type_from_str(const std::string & s) {
-    if (s == "f32") {
-        return GGML_TYPE_F32;
-    }
-    if (s == "f16") {
-        return GGML_TYPE_F16;
-    }
-    if (s == "q8_0") {
-        return GGML_TYPE_Q8_0;
-    }
-    if (s == "q4_0") {
-        return GGML_TYPE_Q4_0;
-    }
-    if (s == "q4_1") {
-        return GGML_TYPE_Q4_1;
-    }
-    if (s == "iq4_nl") {
-        return GGML_TYPE_IQ4_NL;
-    }
-    if (s == "q5_0") {
-        return GGML_TYPE_Q5_0;
-    }
-    if (s == "q5_1") {
-        return GGML_TYPE_Q5_1;
-    }
-
-    throw std::runtime_error("Invalid cache type: " + s);
-}
-
 struct llama_context_params llama_context_params_from_gpt_params(const gpt_params & params) {
     auto cparams = llama_context_default_params();
 
@@ -1017,6 +1079,12 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
     cparams.pooling_type      = params.pooling_type;
     cparams.attention_type    = params.attention_type;
     cparams.defrag_thold      = params.defrag_thold;
+    cparams.defrag_budget     = params.defrag_budget;
+    cparams.kv_block_size     = params.kv_block_size;
+    cparams.kv_sink           = params.kv_sink;
+    cparams.kv_window         = params.kv_window;
+    cparams.kv_hh_budget      = params.kv_hh_budget;
+    cparams.kv_hh_recent      = params.kv_hh_recent;
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
     cparams.offload_kqv       = !params.no_kv_offload;
@@ -1026,6 +1094,15 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
     cparams.type_k = kv_cache_type_from_str(params.cache_type_k);
     cparams.type_v = kv_cache_type_from_str(params.cache_type_v);
 
+    if ((!params.cache_type_k_layers.empty() && params.cache_types_k.empty()) ||
+        (!params.cache_type_v_layers.empty() && params.cache_types_v.empty())) {
+        throw std::runtime_error("the per-layer KV cache types are not resolved, call gpt_params_resolve_cache_types");
+    }
+
+    cparams.type_k_layer = params.cache_types_k.empty() ? nullptr : params.cache_types_k.data();
+    cparams.type_v_layer = params.cache_types_v.empty() ? nullptr : params.cache_types_v.data();
+    cparams.kv_mixed     = params.kv_mixed;
+
     return cparams;
 }
 
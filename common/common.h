@@ -51,7 +51,7 @@ struct cpu_params {
     bool     mask_valid                  = false;   // Default: any CPU
     enum ggml_sched_priority  priority   = GGML_SCHED_PRIO_NORMAL;  // Scheduling prio : (0 - normal, 1 - medium, 2 - high, 3 - realtime)
     bool     strict_cpu                  = false;   // Use strict CPU placement
-    uint32_t poll                        = 50;      // Polling (busywait) level (0 - no polling, 100 - mostly polling)
+    uint32_t poll                        = 50;      // Polling (busywait) level (0 - no polling, 100 - mostly polling, GGML_THREADPOOL_POLL_ADAPTIVE)
 };
 
 int32_t cpu_get_num_physical_cores();
@@ -167,6 +167,12 @@ struct gpt_params {
     float   yarn_beta_slow        =  1.0f; // YaRN high correction dim
     int32_t yarn_orig_ctx         =     0; // YaRN original context length
     float   defrag_thold          = -1.0f; // KV cache defragmentation threshold
+    int32_t defrag_budget         =     0; // max KV cells moved by the defragmentation per decode (0 = no limit)
+    int32_t kv_block_size         =     0; // KV cache block size for the paged layout (0 = contiguous)
+    int32_t kv_sink               =     0; // sliding window eviction: sink tokens kept per sequence (0 = disabled)
+    int32_t kv_window             =     0; // sliding window eviction: max tokens per sequence (0 = n_ctx / n_parallel)
+    int32_t kv_hh_budget          =     0; // heavy-hitter eviction: max tokens per sequence (0 = disabled)
+    int32_t kv_hh_recent          =    64; // heavy-hitter eviction: recent tokens per sequence that are never evicted
 
     struct cpu_params cpuparams;
     struct cpu_params cpuparams_batch;
@@ -200,6 +206,7 @@ struct gpt_params {
     std::string logdir               = ""; // directory in which to save YAML log files                     // NOLINT
     std::string lookup_cache_static  = ""; // path of static ngram cache file for lookup decoding           // NOLINT
     std::string lookup_cache_dynamic = ""; // path of dynamic ngram cache file for lookup decoding          // NOLINT
+    std::string profile_trace        = ""; // write a Chrome trace of the scheduler splits to this file     // NOLINT
     std::string logits_file          = ""; // file for saving *all* logits                                  // NOLINT
     std::string rpc_servers          = ""; // comma separated list of RPC servers                           // NOLINT
 
@@ -247,6 +254,7 @@ struct gpt_params {
     bool flash_attn        = false; // flash attention
     bool no_perf           = false; // disable performance metrics
     bool ctx_shift         = true;  // context shift on inifinite text generation
+    bool profile_nodes     = false; // include individual graph nodes in the profile trace
 
     bool input_prefix_bos  = false; // prefix BOS to user inputs, preceding input_prefix
     bool logits_all        = false; // return logits for all tokens in the batch
@@ -258,10 +266,17 @@ struct gpt_params {
     bool no_kv_offload     = false; // disable KV offloading
     bool warmup            = true;  // warmup run
     bool check_tensors     = false; // validate tensor data
+    bool kv_mixed          = false; // keep the first two and the last layer of a quantized KV cache in F16
 
     std::string cache_type_k = "f16"; // KV cache data type for the K
     std::string cache_type_v = "f16"; // KV cache data type for the V
 
+    std::string cache_type_k_layers = ""; // per-layer KV cache data types for the K, "<layers>=<type>,..."
+    std::string cache_type_v_layers = ""; // per-layer KV cache data types for the V
+
+    std::vector<ggml_type> cache_types_k; // resolved per-layer types, set by gpt_params_resolve_cache_types
+    std::vector<ggml_type> cache_types_v;
+
     // multimodal models (see examples/llava)
     std::string mmproj = "";        // path to multimodal projector                                         // NOLINT
     std::vector<std::string> image; // path to image file(s)
@@ -273,10 +288,11 @@ struct gpt_params {
     std::string embd_sep   = "\n";  // separator of embendings
 
     // server params
-    int32_t port           = 8080;         // server listens on this network port
-    int32_t timeout_read   = 600;          // http read timeout in seconds
-    int32_t timeout_write  = timeout_read; // http write timeout in seconds
-    int     n_threads_http = -1;           // number of threads to process HTTP requests (TODO: support threadpool)
+    int32_t port            = 8080;         // server listens on this network port
+    int32_t timeout_read    = 600;          // http read timeout in seconds
+    int32_t timeout_write   = timeout_read; // http write timeout in seconds
+    int     n_threads_http  = -1;           // number of threads to process HTTP requests (TODO: support threadpool)
+    bool    http_event_loop = false;        // serve the connections from an epoll loop instead of a thread each (Linux only)
 
     std::string hostname      = "127.0.0.1";
     std::string public_path   = "";                                                                         // NOLINT
@@ -295,9 +311,18 @@ struct gpt_params {
     bool log_json = false;
 
     std::string slot_save_path;
+    int32_t     slot_cache_size = 0; // MiB of prompt caches saved automatically under slot_save_path (0 = disabled)
 
     float slot_prompt_similarity = 0.5f;
 
+    int32_t n_prefill_budget = 0; // max prompt tokens per batch while other slots are generating (0 = n_batch)
+    int32_t radix_cache      = 0; // max prompt tokens kept in a prefix tree shared by the slots (0 = disabled)
+    bool    preemption       = false; // requests of higher priority take the slots of lower ones, which resume later
+    bool    spec_ngram       = false; // draft the tokens from the n-grams of the slots for speculative decoding
+
+    int32_t     kv_tier_ram  = 0;  // MiB of host memory for the KV cache of idle slots (0 = disabled)
+    std::string kv_tier_path = ""; // directory for the KV cache of idle slots that do not fit in kv_tier_ram // NOLINT
+
     // batched-bench params
     bool is_pp_shared = false;
 
@@ -408,10 +433,19 @@ struct llama_init_result {
 
 struct llama_init_result    llama_init_from_gpt_params(gpt_params & params);
 
+// resolve --cache-type-k-layers / --cache-type-v-layers for the layers of the model, which the context params need
+// call it before llama_context_params_from_gpt_params when creating the context without llama_init_from_gpt_params
+void gpt_params_resolve_cache_types(gpt_params & params, const struct llama_model * model);
+
 struct llama_model_params     llama_model_params_from_gpt_params    (const gpt_params & params);
 struct llama_context_params   llama_context_params_from_gpt_params  (const gpt_params & params);
 struct ggml_threadpool_params ggml_threadpool_params_from_cpu_params(const cpu_params & params);
 
+// per-layer KV cache data types from "<layers>=<type>,...", where <layers> is a layer or a range of layers a..b
+// negative layers count from the end (-1 is the last layer), the other layers are set to GGML_TYPE_COUNT
+// throws std::runtime_error if the spec is invalid for n_layer layers
+std::vector<ggml_type> kv_cache_types_from_str(const std::string & s, int n_layer);
+
 struct llama_model * llama_load_model_from_url(const char * model_url, const char * path_model, const char * hf_token, const struct llama_model_params & params);
 struct llama_model * llama_load_model_from_hf(const char * repo, const char * file, const char * path_model, const char * hf_token, const struct llama_model_params & params);
 
@@ -0,0 +1,295 @@
+#include "kv-store.h"
+#include "common.h"
+#include "log.h"
+
+#include "json.hpp"
+
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+
+using json = nlohmann::ordered_json;
+
+static uint64_t llama_kv_store_hash(const void * data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL) {
+    const uint8_t * p = (const uint8_t *) data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL; // FNV-1a
+    }
+    return hash;
+}
+
+static std::string llama_kv_store_hex(uint64_t hash) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016" PRIx64, hash);
+    return buf;
+}
+
+static std::string llama_kv_store_index_fname(const llama_kv_store & store) {
+    return store.params.path + "kv-store-" + store.group + ".json";
+}
+
+// replace a file by a temporary file, as atomically as the platform allows
+static bool llama_kv_store_replace(const std::string & fname_tmp, const std::string & fname) {
+    if (std::rename(fname_tmp.c_str(), fname.c_str()) == 0) {
+        return true;
+    }
+    // the rename does not replace an existing file on Windows
+    std::remove(fname.c_str());
+    return std::rename(fname_tmp.c_str(), fname.c_str()) == 0;
+}
+
+// the files have the layout of llama_state_seq_save_file
+static bool llama_kv_store_write_file(const std::string & fname, const std::vector<llama_token> & tokens, const std::vector<uint8_t> & data) {
+    const std::string fname_tmp = fname + ".tmp";
+
+    {
+        std::ofstream file(fname_tmp, std::ios::binary);
+
+        const uint32_t header[3] = { LLAMA_STATE_SEQ_MAGIC, LLAMA_STATE_SEQ_VERSION, (uint32_t) tokens.size() };
+        file.write((const char *) header, sizeof(header));
+        file.write((const char *) tokens.data(), tokens.size()*sizeof(llama_token));
+        file.write((const char *) data.data(), data.size());
+
+        if (!file) {
+            LOG_WRN("%s: failed to write %s\n", __func__, fname_tmp.c_str());
+            file.close();
+            std::remove(fname_tmp.c_str());
+            return false;
+        }
+    }
+
+    return llama_kv_store_replace(fname_tmp, fname);
+}
+
+static bool llama_kv_store_read_tokens(const std::string & fname, std::vector<llama_token> & tokens) {
+    std::ifstream file(fname, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+
+    uint32_t header[3] = { 0, 0, 0 };
+    if (!file.read((char *) header, sizeof(header)) || header[0] != LLAMA_STATE_SEQ_MAGIC || header[1] != LLAMA_STATE_SEQ_VERSION) {
+        return false;
+    }
+
+    tokens.resize(header[2]);
+
+    return (bool) file.read((char *) tokens.data(), tokens.size()*sizeof(llama_token));
+}
+
+static void llama_kv_store_write_index(const llama_kv_store & store) {
+    json entries = json::array();
+    for (const auto & entry : store.entries) {
+        entries.push_back({
+            {"file",        entry.fname},
+            {"size",        entry.size},
+            {"t_last_used", entry.t_last_used},
+        });
+    }
+
+    const json index = {
+        {"clock",   store.clock},
+        {"entries", entries},
+    };
+
+    const std::string fname     = llama_kv_store_index_fname(store);
+    const std::string fname_tmp = fname + ".tmp";
+
+    {
+        std::ofstream file(fname_tmp);
+        file << index.dump(1);
+        if (!file) {
+            LOG_WRN("%s: failed to write %s\n", __func__, fname_tmp.c_str());
+            return;
+        }
+    }
+
+    llama_kv_store_replace(fname_tmp, fname);
+}
+
+static void llama_kv_store_erase(llama_kv_store & store, std::list<llama_kv_store_entry>::iterator it) {
+    if (it->pending.valid()) {
+        it->pending.wait();
+    }
+    std::remove((store.params.path + it->fname).c_str());
+
+    store.size -= it->size;
+    store.entries.erase(it);
+}
+
+static std::list<llama_kv_store_entry>::iterator llama_kv_store_get(llama_kv_store & store, const std::string & fname) {
+    for (auto it = store.entries.begin(); it != store.entries.end(); ++it) {
+        if (it->fname == fname) {
+            return it;
+        }
+    }
+    return store.entries.end();
+}
+
+static void llama_kv_store_touch(llama_kv_store & store, std::list<llama_kv_store_entry>::iterator it) {
+    it->t_last_used = ++store.clock;
+    store.entries.splice(store.entries.begin(), store.entries, it);
+}
+
+llama_kv_store::~llama_kv_store() {
+    for (auto & entry : entries) {
+        if (entry.pending.valid()) {
+            entry.pending.wait();
+        }
+    }
+}
+
+bool llama_kv_store_init(llama_kv_store & store, const llama_kv_store_params & params) {
+    store.params = params;
+    store.group  = llama_kv_store_hex(llama_kv_store_hash(params.fingerprint.data(), params.fingerprint.size()));
+
+    store.entries.clear();
+    store.size  = 0;
+    store.clock = 0;
+
+    if (!fs_create_directory_with_parents(params.path)) {
+        LOG_ERR("%s: failed to create the directory %s\n", __func__, params.path.c_str());
+        return false;
+    }
+
+    std::ifstream file(llama_kv_store_index_fname(store));
+    if (!file) {
+        return true; // new group
+    }
+
+    json index;
+    try {
+        file >> index;
+    } catch (const std::exception & e) {
+        LOG_WRN("%s: ignoring the invalid index %s: %s\n", __func__, llama_kv_store_index_fname(store).c_str(), e.what());
+        return true;
+    }
+
+    store.clock = index.value("clock", (uint64_t) 0);
+
+    for (const auto & item : index.value("entries", json::array())) {
+        llama_kv_store_entry entry;
+        entry.fname       = item.value("file", std::string());
+        entry.size        = item.value("size", (size_t) 0);
+        entry.t_last_used = item.value("t_last_used", (uint64_t) 0);
+
+        if (!fs_validate_filename(entry.fname) || !llama_kv_store_read_tokens(params.path + entry.fname, entry.tokens)) {
+            LOG_WRN("%s: dropping the missing or invalid entry %s\n", __func__, entry.fname.c_str());
+            continue;
+        }
+
+        store.size += entry.size;
+        store.entries.push_back(std::move(entry));
+    }
+
+    // the index is written in this order, but keep it robust to edits
+    store.entries.sort([](const llama_kv_store_entry & a, const llama_kv_store_entry & b) {
+        return a.t_last_used > b.t_last_used;
+    });
+
+    LOG_INF("%s: loaded %zu entries (%.2f MiB) from %s\n", __func__, store.entries.size(), store.size/1024.0/1024.0, params.path.c_str());
+
+    return true;
+}
+
+bool llama_kv_store_save(llama_kv_store & store, llama_context * ctx, llama_seq_id seq_id, const std::vector<llama_token> & tokens) {
+    if (tokens.size() < store.params.n_tokens_min) {
+        return false;
+    }
+
+    const std::string fname = "kv-store-" + store.group + "-" + llama_kv_store_hex(llama_kv_store_hash(tokens.data(), tokens.size()*sizeof(llama_token))) + ".bin";
+
+    auto it = llama_kv_store_get(store, fname);
+    if (it != store.entries.end()) {
+        llama_kv_store_touch(store, it);
+        llama_kv_store_write_index(store);
+        return true;
+    }
+
+    const size_t n_data = llama_state_seq_get_size(ctx, seq_id);
+    const size_t size   = 3*sizeof(uint32_t) + tokens.size()*sizeof(llama_token) + n_data;
+    if (n_data == 0 || size > store.params.size_max) {
+        return false;
+    }
+
+    std::vector<uint8_t> data(n_data);
+    if (llama_state_seq_get_data(ctx, data.data(), n_data, seq_id) != n_data) {
+        LOG_WRN("%s: failed to copy the state of seq_id %d\n", __func__, seq_id);
+        return false;
+    }
+
+    // make room before writing
+    while (!store.entries.empty() && store.size + size > store.params.size_max) {
+        LOG_DBG("%s: evicting %s (%zu tokens)\n", __func__, store.entries.back().fname.c_str(), store.entries.back().tokens.size());
+
+        llama_kv_store_erase(store, std::prev(store.entries.end()));
+        store.n_evicted++;
+    }
+
+    llama_kv_store_entry entry;
+    entry.fname       = fname;
+    entry.tokens      = tokens;
+    entry.size        = size;
+    entry.t_last_used = ++store.clock;
+    entry.pending     = std::async(std::launch::async, llama_kv_store_write_file, store.params.path + fname, tokens, std::move(data)).share();
+
+    LOG_DBG("%s: saving seq_id %d to %s (%zu tokens, %.2f MiB)\n", __func__, seq_id, fname.c_str(), tokens.size(), size/1024.0/1024.0);
+
+    store.entries.push_front(std::move(entry));
+    store.size += size;
+    store.n_saved++;
+
+    llama_kv_store_write_index(store);
+
+    return true;
+}
+
+const llama_kv_store_entry * llama_kv_store_find(const llama_kv_store & store, const std::vector<llama_token> & tokens, size_t & n_match) {
+    const llama_kv_store_entry * res = nullptr;
+
+    n_match = 0;
+
+    for (const auto & entry : store.entries) {
+        size_t n = 0;
+        while (n < entry.tokens.size() && n < tokens.size() && entry.tokens[n] == tokens[n] && tokens[n] != LLAMA_TOKEN_NULL) {
+            n++;
+        }
+
+        if (n > n_match) {
+            n_match = n;
+            res     = &entry;
+        }
+    }
+
+    return res;
+}
+
+bool llama_kv_store_load(llama_kv_store & store, llama_context * ctx, const std::string & fname, llama_seq_id seq_id, std::vector<llama_token> & tokens) {
+    auto it = llama_kv_store_get(store, fname);
+    if (it == store.entries.end()) {
+        return false;
+    }
+
+    if (it->pending.valid() && !it->pending.get()) {
+        return false;
+    }
+
+    tokens.resize(it->tokens.size());
+
+    size_t n_tokens = 0;
+    if (llama_state_seq_load_file(ctx, (store.params.path + fname).c_str(), seq_id, tokens.data(), tokens.size(), &n_tokens) == 0) {
+        LOG_WRN("%s: failed to load %s into seq_id %d\n", __func__, fname.c_str(), seq_id);
+        tokens.clear();
+        return false;
+    }
+    tokens.resize(n_tokens);
+
+    LOG_DBG("%s: loaded %s into seq_id %d (%zu tokens)\n", __func__, fname.c_str(), seq_id, n_tokens);
+
+    llama_kv_store_touch(store, it);
+    llama_kv_store_write_index(store);
+    store.n_loaded++;
+
+    return true;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "llama.h"
+
+#include <cstdint>
+#include <future>
+#include <list>
+#include <string>
+#include <vector>
+
+// Persistent, content-addressed store for the KV cache of token sequences:
+//
+// the state of a sequence is saved to a file named after a hash of its tokens, in a directory shared by the runs of
+// a program, so that a later run (e.g. after a restart) loads it instead of recomputing the tokens
+// the entries are grouped by a fingerprint of the model and the KV cache layout, each group has an index file and a
+// size cap, over which the least recently used entries are deleted
+
+struct llama_kv_store_params {
+    std::string path;              // directory of the files, ending with a separator
+    size_t      size_max     = 0;  // max bytes of the files of the group
+    size_t      n_tokens_min = 64; // shorter sequences are not saved
+
+    std::string fingerprint; // anything that changes the KV cache of the tokens (model, KV cache types, adapters ...)
+};
+
+struct llama_kv_store_entry {
+    std::string fname; // relative to the directory
+
+    std::vector<llama_token> tokens;
+
+    size_t   size        = 0;
+    uint64_t t_last_used = 0; // clock of the store, persisted in the index
+
+    std::shared_future<bool> pending; // write of the file in progress
+};
+
+struct llama_kv_store {
+    llama_kv_store_params params;
+
+    std::string group; // hash of the fingerprint
+
+    std::list<llama_kv_store_entry> entries; // most recently used first
+
+    size_t   size  = 0; // bytes of the files
+    uint64_t clock = 0;
+
+    // stats
+    uint64_t n_saved   = 0;
+    uint64_t n_loaded  = 0;
+    uint64_t n_evicted = 0;
+
+    ~llama_kv_store();
+};
+
+// Read the index of the group of params.fingerprint in params.path. The entries whose file is missing or invalid
+// are dropped. returns: false if the directory cannot be used.
+bool llama_kv_store_init(llama_kv_store & store, const llama_kv_store_params & params);
+
+// Save the KV cache of seq_id, which holds tokens from position 0. The file is written in the background.
+// returns: false if the sequence was not saved (too short, too large or failed).
+bool llama_kv_store_save(llama_kv_store & store, llama_context * ctx, llama_seq_id seq_id, const std::vector<llama_token> & tokens);
+
+// Find the entry with the longest common prefix with tokens. LLAMA_TOKEN_NULL (e.g. an image position) never matches.
+// n_match: the length of the common prefix.
+// returns: the entry, or null if no entry has a common prefix.
+const llama_kv_store_entry * llama_kv_store_find(const llama_kv_store & store, const std::vector<llama_token> & tokens, size_t & n_match);
+
+// Load an entry into seq_id of the context (replacing its content). An entry that fails to load is not marked as
+// used, so it ages out of the store.
+// tokens:  set to the tokens of the entry.
+// returns: false if the entry does not exist or could not be loaded.
+bool llama_kv_store_load(llama_kv_store & store, llama_context * ctx, const std::string & fname, llama_seq_id seq_id, std::vector<llama_token> & tokens);
@@ -0,0 +1,220 @@
+#include "kv-tier.h"
+#include "common.h"
+#include "log.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+
+static std::vector<uint8_t> llama_kv_tier_read_file(const std::string & fname, size_t size) {
+    std::vector<uint8_t> data;
+
+    std::ifstream file(fname, std::ios::binary);
+    if (!file) {
+        return data;
+    }
+
+    data.resize(size);
+    if (!file.read((char *) data.data(), size)) {
+        data.clear();
+    }
+
+    return data;
+}
+
+static bool llama_kv_tier_write_file(const std::string & fname, const std::vector<uint8_t> & data) {
+    std::ofstream file(fname, std::ios::binary);
+    file.write((const char *) data.data(), data.size());
+    file.close();
+
+    if (!file) {
+        LOG_WRN("%s: failed to write %s\n", __func__, fname.c_str());
+        std::remove(fname.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// read an entry that was moved to disk, once its file is written
+static std::vector<uint8_t> llama_kv_tier_load_file(std::shared_future<bool> writing, const std::string & fname, size_t size) {
+    if (writing.valid() && !writing.get()) {
+        return {};
+    }
+
+    return llama_kv_tier_read_file(fname, size);
+}
+
+// move the least recently used entries out of host memory until the budget is met
+// the files are written in the background, the data is released from host memory when the write is done
+static void llama_kv_tier_spill(llama_kv_tier & tier) {
+    for (auto it = tier.entries.rbegin(); it != tier.entries.rend() && tier.host_size > tier.params.host_budget; ) {
+        llama_kv_tier_entry & entry = *it;
+
+        if (entry.data.empty()) {
+            ++it;
+            continue;
+        }
+
+        tier.host_size -= entry.size;
+
+        if (!tier.params.path.empty()) {
+            const std::string fname = tier.params.path + "kv-tier-" + std::to_string(entry.id) + ".bin";
+
+            LOG_DBG("%s: moving entry %" PRIu64 " (%zu tokens, %.2f MiB) to %s\n", __func__,
+                    entry.id, entry.tokens.size(), entry.size/1024.0/1024.0, fname.c_str());
+
+            entry.fname   = fname;
+            entry.writing = std::async(std::launch::async, llama_kv_tier_write_file, fname, std::move(entry.data)).share();
+            entry.data.clear();
+
+            tier.n_spilled++;
+            ++it;
+            continue;
+        }
+
+        LOG_DBG("%s: dropped entry %" PRIu64 " (%zu tokens)\n", __func__, entry.id, entry.tokens.size());
+
+        tier.n_dropped++;
+        it = std::list<llama_kv_tier_entry>::reverse_iterator(tier.entries.erase(std::next(it).base()));
+    }
+}
+
+static void llama_kv_tier_erase(llama_kv_tier & tier, std::list<llama_kv_tier_entry>::iterator it) {
+    if (it->pending.valid()) {
+        it->pending.wait();
+    }
+    if (it->writing.valid()) {
+        it->writing.wait();
+    }
+    if (!it->data.empty()) {
+        tier.host_size -= it->size;
+    }
+    if (!it->fname.empty()) {
+        std::remove(it->fname.c_str());
+    }
+    tier.entries.erase(it);
+}
+
+static std::list<llama_kv_tier_entry>::iterator llama_kv_tier_get(llama_kv_tier & tier, uint64_t id) {
+    for (auto it = tier.entries.begin(); it != tier.entries.end(); ++it) {
+        if (it->id == id) {
+            return it;
+        }
+    }
+    return tier.entries.end();
+}
+
+llama_kv_tier::~llama_kv_tier() {
+    llama_kv_tier_clear(*this);
+}
+
+int64_t llama_kv_tier_store(llama_kv_tier & tier, llama_context * ctx, llama_seq_id seq_id, const std::vector<llama_token> & tokens) {
+    const size_t size = llama_state_seq_get_size(ctx, seq_id);
+    if (size == 0) {
+        return -1;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    std::vector<uint8_t> data(size);
+    if (llama_state_seq_get_data(ctx, data.data(), size, seq_id) != size) {
+        LOG_WRN("%s: failed to copy the state of seq_id %d\n", __func__, seq_id);
+        return -1;
+    }
+
+    const int64_t id = llama_kv_tier_add(tier, tokens, std::move(data));
+
+    LOG_DBG("%s: stored seq_id %d as entry %" PRId64 " (%zu tokens, %.2f MiB) in %.2f ms\n", __func__,
+            seq_id, id, tokens.size(), size/1024.0/1024.0, (ggml_time_us() - t_start_us)/1000.0);
+
+    return id;
+}
+
+int64_t llama_kv_tier_add(llama_kv_tier & tier, std::vector<llama_token> tokens, std::vector<uint8_t> data) {
+    llama_kv_tier_entry entry;
+    entry.id     = tier.next_id++;
+    entry.tokens = std::move(tokens);
+    entry.size   = data.size();
+    entry.data   = std::move(data);
+
+    const int64_t id = entry.id;
+
+    tier.host_size += entry.size;
+    tier.entries.push_front(std::move(entry));
+    tier.n_stored++;
+
+    llama_kv_tier_spill(tier);
+
+    return id;
+}
+
+int64_t llama_kv_tier_find(const llama_kv_tier & tier, const std::vector<llama_token> & tokens, size_t & n_match) {
+    int64_t res = -1;
+
+    n_match = 0;
+
+    for (const auto & entry : tier.entries) {
+        size_t n = 0;
+        while (n < entry.tokens.size() && n < tokens.size() && entry.tokens[n] == tokens[n] && tokens[n] != LLAMA_TOKEN_NULL) {
+            n++;
+        }
+
+        if (n > n_match) {
+            n_match = n;
+            res     = entry.id;
+        }
+    }
+
+    return res;
+}
+
+void llama_kv_tier_prefetch(llama_kv_tier & tier, uint64_t id) {
+    auto it = llama_kv_tier_get(tier, id);
+    if (it == tier.entries.end() || !it->data.empty() || it->pending.valid()) {
+        return;
+    }
+
+    it->pending = std::async(std::launch::async, llama_kv_tier_load_file, it->writing, it->fname, it->size);
+}
+
+bool llama_kv_tier_restore(llama_kv_tier & tier, llama_context * ctx, uint64_t id, llama_seq_id seq_id, std::vector<llama_token> & tokens) {
+    auto it = llama_kv_tier_get(tier, id);
+    if (it == tier.entries.end()) {
+        return false;
+    }
+
+    llama_kv_tier_entry & entry = *it;
+
+    std::vector<uint8_t> data;
+    if (!entry.data.empty()) {
+        data = std::move(entry.data);
+        tier.host_size -= entry.size;
+    } else if (entry.pending.valid()) {
+        data = entry.pending.get();
+    } else {
+        data = llama_kv_tier_load_file(entry.writing, entry.fname, entry.size);
+    }
+
+    bool ok = !data.empty() && llama_state_seq_set_data(ctx, data.data(), data.size(), seq_id) != 0;
+    if (ok) {
+        tokens = std::move(entry.tokens);
+        tier.n_restored++;
+
+        LOG_DBG("%s: restored entry %" PRIu64 " into seq_id %d (%zu tokens)\n", __func__, id, seq_id, tokens.size());
+    } else {
+        LOG_WRN("%s: failed to restore entry %" PRIu64 " into seq_id %d\n", __func__, id, seq_id);
+    }
+
+    llama_kv_tier_erase(tier, it);
+
+    return ok;
+}
+
+void llama_kv_tier_clear(llama_kv_tier & tier) {
+    while (!tier.entries.empty()) {
+        llama_kv_tier_erase(tier, tier.entries.begin());
+    }
+    tier.host_size = 0;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "llama.h"
+
+#include <cstdint>
+#include <future>
+#include <list>
+#include <string>
+#include <vector>
+
+// Tiered storage for the KV cache of idle sequences:
+//
+// a sequence that is about to be overwritten in the KV cache of a context can be stored in the tier and restored
+// later into any sequence of the context, instead of being recomputed from its tokens
+// the stored sequences are kept in host memory up to a byte budget, the least recently used ones are then moved
+// to files in a directory (or dropped if no directory is set)
+//
+// storing a sequence copies its state out of the KV cache on the calling thread, as the cells are about to be reused
+// (about the cost of a memcpy of the cells of the sequence); the files are written and read on background threads
+
+struct llama_kv_tier_params {
+    size_t      host_budget = 0; // max bytes of KV data kept in host memory
+    std::string path;            // directory for the sequences moved out of host memory, empty to drop them
+};
+
+struct llama_kv_tier_entry {
+    uint64_t id = 0;
+
+    std::vector<llama_token> tokens; // tokens of the sequence
+
+    std::vector<uint8_t> data;       // sequence state in host memory (empty if on disk)
+    size_t               size = 0;   // size of the sequence state
+
+    std::string                       fname;   // file of the sequence state if on disk
+    std::shared_future<bool>          writing; // write of the file, false if it failed
+    std::future<std::vector<uint8_t>> pending; // prefetch of the file in progress
+};
+
+struct llama_kv_tier {
+    llama_kv_tier_params params;
+
+    std::list<llama_kv_tier_entry> entries; // most recently used first
+
+    uint64_t next_id = 0;
+
+    size_t host_size = 0; // bytes of KV data in host memory
+
+    // stats
+    uint64_t n_stored   = 0;
+    uint64_t n_restored = 0;
+    uint64_t n_spilled  = 0; // moved to disk
+    uint64_t n_dropped  = 0; // removed to meet the host budget without a directory
+
+    ~llama_kv_tier();
+};
+
+// Store the KV cache of seq_id in the tier. The KV cache of the context is not modified.
+// tokens:  the tokens of the sequence, used to match the entry with later prompts.
+// returns: the id of the new entry, or -1 on failure.
+int64_t llama_kv_tier_store(llama_kv_tier & tier, llama_context * ctx, llama_seq_id seq_id, const std::vector<llama_token> & tokens);
+
+// Add a sequence state, as returned by llama_state_seq_get_data, as the most recently used entry.
+// The least recently used entries are then moved out of host memory until the budget is met.
+// returns: the id of the new entry.
+int64_t llama_kv_tier_add(llama_kv_tier & tier, std::vector<llama_token> tokens, std::vector<uint8_t> data);
+
+// Find the entry with the longest common prefix with tokens. LLAMA_TOKEN_NULL (e.g. an image position) never matches.
+// n_match: the length of the common prefix.
+// returns: the id of the entry, or -1 if no entry has a common prefix.
+int64_t llama_kv_tier_find(const llama_kv_tier & tier, const std::vector<llama_token> & tokens, size_t & n_match);
+
+// Start loading an entry that was moved to disk back into host memory, so that a later restore does not wait for
+// the file. Does nothing if the entry is in host memory.
+void llama_kv_tier_prefetch(llama_kv_tier & tier, uint64_t id);
+
+// Restore an entry into seq_id of the context (replacing its content) and remove it from the tier.
+// tokens:  set to the tokens of the entry.
+// returns: false if the entry does not exist or could not be loaded.
+bool llama_kv_tier_restore(llama_kv_tier & tier, llama_context * ctx, uint64_t id, llama_seq_id seq_id, std::vector<llama_token> & tokens);
+
+// Remove all the entries.
+void llama_kv_tier_clear(llama_kv_tier & tier);
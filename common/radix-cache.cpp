@@ -0,0 +1,248 @@
+#include "radix-cache.h"
+#include "log.h"
+
+#include <functional>
+
+// number of tokens of the edge of node that match tokens from i
+static size_t llama_radix_cache_match(const llama_radix_node & node, const std::vector<llama_token> & tokens, size_t i) {
+    size_t k = 0;
+    while (k < node.tokens.size() && i + k < tokens.size() && tokens[i + k] == node.tokens[k] && tokens[i + k] != LLAMA_TOKEN_NULL) {
+        k++;
+    }
+    return k;
+}
+
+// the least recently used leaf that was not used by the current operation, or null
+static llama_radix_node * llama_radix_cache_lru_leaf(llama_radix_cache & cache) {
+    llama_radix_node * res = nullptr;
+
+    std::function<void(llama_radix_node &)> visit = [&](llama_radix_node & node) {
+        if (node.children.empty()) {
+            if (&node != &cache.root && node.t_last_used < cache.clock && (res == nullptr || node.t_last_used < res->t_last_used)) {
+                res = &node;
+            }
+            return;
+        }
+        for (auto & it : node.children) {
+            visit(*it.second);
+        }
+    };
+    visit(cache.root);
+
+    return res;
+}
+
+static size_t llama_radix_cache_remove_leaf(llama_radix_cache & cache, llama_context * ctx, llama_radix_node * node) {
+    const size_t n = node->tokens.size();
+
+    LOG_DBG("%s: evicting seq_id %d (%zu tokens at pos %d)\n", __func__, node->seq_id, n, node->pos);
+
+    llama_kv_cache_seq_rm(ctx, node->seq_id, -1, -1);
+
+    cache.seq_ids_free.push_back(node->seq_id);
+    cache.n_tokens -= n;
+    cache.n_evicted++;
+
+    node->parent->children.erase(node->tokens[0]);
+
+    return n;
+}
+
+// a free sequence id, evicting a leaf if needed, or -1
+static llama_seq_id llama_radix_cache_seq_alloc(llama_radix_cache & cache, llama_context * ctx) {
+    if (cache.seq_ids_free.empty()) {
+        llama_radix_node * leaf = llama_radix_cache_lru_leaf(cache);
+        if (leaf == nullptr) {
+            return -1;
+        }
+        llama_radix_cache_remove_leaf(cache, ctx, leaf);
+    }
+
+    const llama_seq_id seq_id = cache.seq_ids_free.back();
+    cache.seq_ids_free.pop_back();
+
+    return seq_id;
+}
+
+void llama_radix_cache_init(llama_radix_cache & cache, const llama_radix_cache_params & params) {
+    cache.params = params;
+
+    llama_radix_cache_clear(cache, nullptr);
+}
+
+size_t llama_radix_cache_find(const llama_radix_cache & cache, const std::vector<llama_token> & tokens) {
+    const llama_radix_node * node = &cache.root;
+
+    size_t i = 0;
+    while (i < tokens.size()) {
+        auto it = node->children.find(tokens[i]);
+        if (it == node->children.end()) {
+            break;
+        }
+
+        const size_t k = llama_radix_cache_match(*it->second, tokens, i);
+        i += k;
+        if (k < it->second->tokens.size()) {
+            break;
+        }
+
+        node = it->second.get();
+    }
+
+    return i;
+}
+
+size_t llama_radix_cache_attach(llama_radix_cache & cache, llama_context * ctx, llama_seq_id seq_id, const std::vector<llama_token> & tokens) {
+    cache.clock++;
+    cache.n_lookups++;
+
+    llama_radix_node * node = &cache.root;
+
+    size_t i = 0;
+    while (i < tokens.size()) {
+        auto it = node->children.find(tokens[i]);
+        if (it == node->children.end()) {
+            break;
+        }
+
+        llama_radix_node * child = it->second.get();
+
+        const size_t k = llama_radix_cache_match(*child, tokens, i);
+
+        llama_kv_cache_seq_cp(ctx, child->seq_id, seq_id, child->pos, child->pos + k);
+        child->t_last_used = cache.clock;
+
+        i += k;
+        if (k < child->tokens.size()) {
+            break;
+        }
+
+        node = child;
+    }
+
+    if (i > 0) {
+        cache.n_hits++;
+        cache.n_tokens_hit += i;
+    }
+
+    return i;
+}
+
+size_t llama_radix_cache_insert(llama_radix_cache & cache, llama_context * ctx, llama_seq_id seq_id, const std::vector<llama_token> & tokens) {
+    cache.clock++;
+
+    size_t n = 0;
+    while (n < tokens.size() && tokens[n] != LLAMA_TOKEN_NULL) {
+        n++;
+    }
+
+    const llama_pos pos_base = cache.params.pos_base;
+
+    llama_radix_node * node = &cache.root;
+
+    size_t n_added = 0;
+
+    size_t i = 0;
+    while (i < n) {
+        auto it = node->children.find(tokens[i]);
+
+        if (it == node->children.end()) {
+            const llama_seq_id seq_id_leaf = llama_radix_cache_seq_alloc(cache, ctx);
+            if (seq_id_leaf < 0) {
+                break;
+            }
+
+            llama_radix_node * leaf = new llama_radix_node;
+            leaf->tokens.assign(tokens.begin() + i, tokens.begin() + n);
+            leaf->pos         = pos_base + i;
+            leaf->seq_id      = seq_id_leaf;
+            leaf->parent      = node;
+            leaf->t_last_used = cache.clock;
+
+            llama_kv_cache_seq_cp(ctx, seq_id, leaf->seq_id, leaf->pos, pos_base + n);
+
+            node->children[tokens[i]].reset(leaf);
+
+            cache.n_tokens += n - i;
+            n_added        += n - i;
+            break;
+        }
+
+        llama_radix_node * child = it->second.get();
+        child->t_last_used = cache.clock;
+
+        const size_t k = llama_radix_cache_match(*child, tokens, i);
+
+        // the tokens diverge inside the edge: split it, the first part gets a new sequence
+        if (k < child->tokens.size()) {
+            const llama_seq_id seq_id_mid = llama_radix_cache_seq_alloc(cache, ctx);
+            if (seq_id_mid < 0) {
+                break;
+            }
+
+            llama_radix_node * mid = new llama_radix_node;
+            mid->tokens.assign(child->tokens.begin(), child->tokens.begin() + k);
+            mid->pos         = child->pos;
+            mid->seq_id      = seq_id_mid;
+            mid->parent      = node;
+            mid->t_last_used = cache.clock;
+
+            llama_kv_cache_seq_cp(ctx, child->seq_id, mid->seq_id, child->pos, child->pos + k);
+            llama_kv_cache_seq_rm(ctx, child->seq_id, child->pos, child->pos + k);
+
+            child->tokens.erase(child->tokens.begin(), child->tokens.begin() + k);
+            child->pos   += k;
+            child->parent = mid;
+
+            mid->children[child->tokens[0]] = std::move(it->second);
+            it->second.reset(mid);
+
+            child = mid;
+        }
+
+        node = child;
+        i += k;
+    }
+
+    if (cache.n_tokens > cache.params.n_tokens_max) {
+        llama_radix_cache_evict(cache, ctx, cache.n_tokens - cache.params.n_tokens_max);
+    }
+
+    return n_added;
+}
+
+size_t llama_radix_cache_evict(llama_radix_cache & cache, llama_context * ctx, size_t n_min) {
+    cache.clock++;
+
+    size_t n_evicted = 0;
+    while (n_evicted < n_min) {
+        llama_radix_node * leaf = llama_radix_cache_lru_leaf(cache);
+        if (leaf == nullptr) {
+            break;
+        }
+        n_evicted += llama_radix_cache_remove_leaf(cache, ctx, leaf);
+    }
+
+    return n_evicted;
+}
+
+void llama_radix_cache_clear(llama_radix_cache & cache, llama_context * ctx) {
+    if (ctx != nullptr) {
+        std::function<void(const llama_radix_node &)> visit = [&](const llama_radix_node & node) {
+            for (const auto & it : node.children) {
+                llama_kv_cache_seq_rm(ctx, it.second->seq_id, -1, -1);
+                visit(*it.second);
+            }
+        };
+        visit(cache.root);
+    }
+
+    cache.root.children.clear();
+
+    cache.seq_ids_free.clear();
+    for (int32_t i = cache.params.n_seq - 1; i >= 0; --i) {
+        cache.seq_ids_free.push_back(cache.params.seq_id_base + i);
+    }
+
+    cache.n_tokens = 0;
+}
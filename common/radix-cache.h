@@ -0,0 +1,75 @@
+#pragma once
+
+#include "llama.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+
+// Radix tree of token prefixes whose KV cache is kept in a context, shared by all its sequences:
+//
+// each node holds the tokens of an edge of the tree and a sequence id of the context, whose cells hold the KV cache
+// of these tokens only. a sequence attaches to a cached prefix by copying the ranges of the nodes along its path with
+// llama_kv_cache_seq_cp, which shares the cells instead of copying their data
+// the least recently used leaves are evicted when the tree holds too many tokens or runs out of sequence ids
+
+struct llama_radix_cache_params {
+    size_t n_tokens_max = 0; // max tokens held by the tree
+
+    llama_seq_id seq_id_base = 0; // the nodes use the sequence ids [seq_id_base, seq_id_base + n_seq)
+    int32_t      n_seq       = 0;
+
+    llama_pos pos_base = 0; // position of the first token of the prefixes (e.g. after a system prompt)
+};
+
+struct llama_radix_node {
+    std::vector<llama_token> tokens; // tokens of the edge from the parent
+
+    llama_pos    pos    = 0;  // position of tokens[0]
+    llama_seq_id seq_id = -1; // sequence holding the KV cache of the tokens (-1 for the root)
+
+    llama_radix_node * parent = nullptr;
+
+    std::map<llama_token, std::unique_ptr<llama_radix_node>> children; // by first token
+
+    uint64_t t_last_used = 0;
+};
+
+struct llama_radix_cache {
+    llama_radix_cache_params params;
+
+    llama_radix_node root;
+
+    std::vector<llama_seq_id> seq_ids_free;
+
+    size_t   n_tokens = 0; // tokens held by the tree
+    uint64_t clock    = 0; // incremented by every operation, for the LRU order
+
+    // stats
+    uint64_t n_lookups     = 0;
+    uint64_t n_hits        = 0;
+    uint64_t n_tokens_hit  = 0; // tokens attached from the tree
+    uint64_t n_evicted     = 0; // evicted nodes
+};
+
+void llama_radix_cache_init(llama_radix_cache & cache, const llama_radix_cache_params & params);
+
+// Length of the longest prefix of tokens held by the tree. LLAMA_TOKEN_NULL (e.g. an image position) never matches.
+size_t llama_radix_cache_find(const llama_radix_cache & cache, const std::vector<llama_token> & tokens);
+
+// Copy the longest prefix of tokens held by the tree into seq_id, which must hold no cell from params.pos_base on.
+// returns: the length of the prefix.
+size_t llama_radix_cache_attach(llama_radix_cache & cache, llama_context * ctx, llama_seq_id seq_id, const std::vector<llama_token> & tokens);
+
+// Add the prefixes of tokens, whose KV cache is held by seq_id from params.pos_base on, to the tree.
+// The tokens after the first LLAMA_TOKEN_NULL are not added.
+// returns: the number of tokens added.
+size_t llama_radix_cache_insert(llama_radix_cache & cache, llama_context * ctx, llama_seq_id seq_id, const std::vector<llama_token> & tokens);
+
+// Evict least recently used leaves until at least n_min tokens were evicted or the tree is empty.
+// returns: the number of tokens evicted.
+size_t llama_radix_cache_evict(llama_radix_cache & cache, llama_context * ctx, size_t n_min);
+
+// Remove all the nodes. ctx can be null if the KV cache of the context was cleared.
+void llama_radix_cache_clear(llama_radix_cache & cache, llama_context * ctx);
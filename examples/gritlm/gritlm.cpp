@@ -161,12 +161,15 @@ int main(int argc, char * argv[]) {
     gpt_init();
 
     llama_model_params mparams = llama_model_params_from_gpt_params(params);
-    llama_context_params cparams = llama_context_params_from_gpt_params(params);
 
     llama_backend_init();
 
     llama_model * model = llama_load_model_from_file(params.model.c_str(), mparams);
 
+    gpt_params_resolve_cache_types(params, model);
+
+    llama_context_params cparams = llama_context_params_from_gpt_params(params);
+
     // create generation context
     llama_context * ctx = llama_new_context_with_model(model, cparams);
 
@@ -304,6 +304,8 @@ struct llava_context * llava_init_context(gpt_params * params, llama_model * mod
     auto ctx_clip = clip_model_load(clip_path, /*verbosity=*/ 1);
 
 
+    gpt_params_resolve_cache_types(*params, model);
+
     llama_context_params ctx_params = llama_context_params_from_gpt_params(*params);
     ctx_params.n_ctx           = params->n_ctx < 2048 ? 2048 : params->n_ctx; // we need a longer context size to process image embeddings
 
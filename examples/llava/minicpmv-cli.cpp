@@ -45,6 +45,8 @@ static struct llava_context * llava_init_context(gpt_params * params, llama_mode
         prompt = "describe the image in detail.";
     }
 
+    gpt_params_resolve_cache_types(*params, model);
+
     llama_context_params ctx_params = llama_context_params_from_gpt_params(*params);
     if (params->n_ctx < 2048) {
         // warn user here, "Image processing requires at least 2048 context, setting context to 2048"
@@ -6,6 +6,7 @@
 #include "llama.h"
 
 #include <cassert>
+#include <cinttypes>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
@@ -564,8 +565,9 @@ int main(int argc, char ** argv) {
                 // if we run out of context:
                 // - take the n_keep first tokens from the original prompt (via n_past)
                 // - take half of the last (n_ctx - n_keep) tokens and recompute the logits in batches
+                // with --kv-sink, the KV cache evicts the old tokens by itself and n_past keeps growing
 
-                if (n_past + (int) embd.size() >= n_ctx) {
+                if (params.kv_sink == 0 && n_past + (int) embd.size() >= n_ctx) {
                     if (!params.ctx_shift){
                         LOG_DBG("\n\n%s: context full and context shift is disabled => stopping\n", __func__);
                         break;
@@ -926,6 +928,19 @@ int main(int argc, char ** argv) {
 
     LOG("\n\n");
     gpt_perf_print(ctx, smpl);
+
+    if (!params.profile_trace.empty()) {
+        if (llama_perf_profile_dump_trace(ctx, params.profile_trace.c_str())) {
+            LOG_INF("%s: profile trace written to '%s'\n", __func__, params.profile_trace.c_str());
+        }
+    }
+
+    if (tpp.poll == GGML_THREADPOOL_POLL_ADAPTIVE) {
+        struct ggml_threadpool_stats tps;
+        ggml_threadpool_get_stats(threadpool, &tps);
+        LOG_INF("%s: threadpool: graphs = %" PRId64 ", avg gap = %.2f ms, spin = %.2f ms (%" PRId64 " hits, %" PRId64 " misses), pauses = %" PRId64 "\n",
+                __func__, tps.n_graphs, tps.t_gap_us / 1000.0, tps.t_spin_us / 1000.0, tps.n_spin_hits, tps.n_spin_misses, tps.n_pauses);
+    }
     write_logfile(ctx, params, model, input_tokens, output_ss.str(), output_tokens);
 
     gpt_sampler_free(smpl);
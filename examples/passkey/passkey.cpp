@@ -72,6 +72,8 @@ int main(int argc, char ** argv) {
 
     // initialize the context
 
+    gpt_params_resolve_cache_types(params, model);
+
     llama_context_params ctx_params = llama_context_params_from_gpt_params(params);
 
     ctx_params.n_ctx = llama_n_ctx_train(model)*n_grp + n_keep;
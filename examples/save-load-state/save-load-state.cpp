@@ -211,6 +211,38 @@ int main(int argc, char ** argv) {
             return 1;
         }
         fprintf(stderr, "%s : seq 1 restored, %zd bytes\n", __func__, nset);
+
+        // round trip seq 1 through a file, the KV data is streamed from and to the cache tensors
+        const int64_t t_save_start_us = ggml_time_us();
+        const size_t nsave = llama_state_seq_save_file(ctx3, "dump_seq_state.bin", 1, tokens.data(), tokens.size());
+        const int64_t t_save_us = ggml_time_us() - t_save_start_us;
+        if (nsave == 0) {
+            fprintf(stderr, "\n%s : failed to save seq 1 to file\n", __func__);
+            std::remove("dump_seq_state.bin");
+            llama_free(ctx3);
+            llama_free_model(model);
+            return 1;
+        }
+
+        llama_kv_cache_seq_rm(ctx3, 1, -1, -1);
+
+        std::vector<llama_token> seq_tokens(tokens.size());
+        size_t n_seq_tokens = 0;
+
+        const int64_t t_load_start_us = ggml_time_us();
+        const size_t nload = llama_state_seq_load_file(ctx3, "dump_seq_state.bin", 1, seq_tokens.data(), seq_tokens.size(), &n_seq_tokens);
+        const int64_t t_load_us = ggml_time_us() - t_load_start_us;
+        std::remove("dump_seq_state.bin");
+        if (nload != nsave || n_seq_tokens != tokens.size()) {
+            fprintf(stderr, "\n%s : seq file load length %zd does not match the saved length %zd\n", __func__, nload, nsave);
+            llama_free(ctx3);
+            llama_free_model(model);
+            return 1;
+        }
+
+        fprintf(stderr, "%s : seq 1 saved to file in %.3f ms (%.2f MiB/s), loaded in %.3f ms (%.2f MiB/s), %zd bytes\n", __func__,
+                t_save_us/1e3, nsave/1024.0/1024.0/(t_save_us/1e6),
+                t_load_us/1e3, nload/1024.0/1024.0/(t_load_us/1e6), nsave);
     }
 
     // third run with seq 1 instead of 0
@@ -0,0 +1,184 @@
+from __future__ import annotations
+
+import argparse
+import asyncio
+import json
+import socket
+import time
+from statistics import quantiles
+from urllib.parse import urlparse
+
+
+# Load test of the streamed completions: many concurrent SSE clients (some of them reading slowly), idle keep-alive
+# connections, and a /health probe measuring how responsive the server stays under the load.
+# Only the python standard library is needed.
+
+def percentile(values: list[float], p: int) -> float:
+    if not values:
+        return 0.0
+    if len(values) == 1:
+        return values[0]
+    return quantiles(values, n=100, method="inclusive")[p - 1]
+
+
+class Stats:
+    def __init__(self) -> None:
+        self.n_streams = 0
+        self.n_errors = 0
+        self.n_events = 0
+        self.ttft_ms: list[float] = []
+        self.gap_ms: list[float] = []
+        self.health_ms: list[float] = []
+        self.n_threads_max = 0
+
+
+async def http_request(host: str, port: int, method: str, path: str, body: dict | None = None,
+                       rcvbuf: int = 0) -> tuple[asyncio.StreamReader, asyncio.StreamWriter, int]:
+    reader, writer = await asyncio.open_connection(host, port)
+    if rcvbuf > 0:
+        writer.get_extra_info("socket").setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, rcvbuf)
+
+    data = json.dumps(body).encode() if body is not None else b""
+    writer.write(f"{method} {path} HTTP/1.1\r\nHost: {host}:{port}\r\nContent-Type: application/json\r\n"
+                 f"Content-Length: {len(data)}\r\n\r\n".encode() + data)
+    await writer.drain()
+
+    status = int((await reader.readline()).split()[1])
+    while (await reader.readline()) not in (b"\r\n", b""):
+        pass
+
+    return reader, writer, status
+
+
+async def stream_client(args, host: str, port: int, stats: Stats, slow: bool, t_end: float) -> None:
+    while time.time() < t_end:
+        body = {
+            "prompt": args.prompt,
+            "n_predict": args.n_predict,
+            "stream": True,
+            "cache_prompt": True,
+        }
+        if args.n_probs > 0:
+            body["n_probs"] = args.n_probs
+        try:
+            t_start = time.time()
+            reader, writer, status = await http_request(host, port, "POST", "/completion", body,
+                                                        rcvbuf=4096 if slow else 0)
+            if status != 200:
+                stats.n_errors += 1
+                writer.close()
+                await asyncio.sleep(1)
+                continue
+
+            t_last = None
+            done = False
+            while not done:
+                line = await reader.readline()
+                if not line:
+                    break
+                if not line.startswith(b"data: ") and not line.startswith(b"error: "):
+                    continue
+                if line.startswith(b"error: "):
+                    stats.n_errors += 1
+                    break
+                event = json.loads(line[6:])
+                t = time.time()
+                if t_last is None:
+                    stats.ttft_ms.append((t - t_start) * 1e3)
+                else:
+                    stats.gap_ms.append((t - t_last) * 1e3)
+                t_last = t
+                stats.n_events += 1
+                done = event.get("stop", False)
+                if slow:
+                    await asyncio.sleep(args.slow_delay)
+            if done:
+                stats.n_streams += 1
+            else:
+                stats.n_errors += 1
+            writer.close()
+        except (ConnectionError, OSError, ValueError, IndexError):
+            stats.n_errors += 1
+            await asyncio.sleep(1)
+
+
+async def idle_client(host: str, port: int, t_end: float) -> None:
+    try:
+        _, writer = await asyncio.open_connection(host, port)
+        await asyncio.sleep(max(0.0, t_end - time.time()))
+        writer.close()
+    except (ConnectionError, OSError):
+        pass
+
+
+async def health_probe(host: str, port: int, stats: Stats, t_end: float) -> None:
+    while time.time() < t_end:
+        t_start = time.time()
+        try:
+            reader, writer, status = await asyncio.wait_for(http_request(host, port, "GET", "/health"), timeout=30)
+            if status == 200:
+                stats.health_ms.append((time.time() - t_start) * 1e3)
+            writer.close()
+        except (ConnectionError, OSError, asyncio.TimeoutError):
+            stats.n_errors += 1
+        await asyncio.sleep(0.2)
+
+
+async def thread_monitor(pid: int, stats: Stats, t_end: float) -> None:
+    while time.time() < t_end:
+        try:
+            with open(f"/proc/{pid}/status") as f:
+                for line in f:
+                    if line.startswith("Threads:"):
+                        stats.n_threads_max = max(stats.n_threads_max, int(line.split()[1]))
+        except OSError:
+            return
+        await asyncio.sleep(0.5)
+
+
+async def run(args) -> Stats:
+    url = urlparse(args.url)
+    host, port = url.hostname or "localhost", url.port or 80
+
+    stats = Stats()
+    t_end = time.time() + args.duration
+
+    tasks = [stream_client(args, host, port, stats, i < args.slow, t_end) for i in range(args.clients)]
+    tasks += [idle_client(host, port, t_end) for _ in range(args.idle)]
+    tasks += [health_probe(host, port, stats, t_end)]
+    if args.pid > 0:
+        tasks += [thread_monitor(args.pid, stats, t_end)]
+
+    await asyncio.gather(*tasks)
+    return stats
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description="Load test of the server with concurrent streaming clients")
+    parser.add_argument("--url", type=str, help="Server url", default="http://localhost:8080")
+    parser.add_argument("--clients", type=int, help="Concurrent streaming clients", default=64)
+    parser.add_argument("--slow", type=int, help="Streaming clients reading slowly, among --clients", default=8)
+    parser.add_argument("--slow-delay", type=float, help="Delay of the slow clients after each event, in seconds", default=0.5)
+    parser.add_argument("--idle", type=int, help="Idle keep-alive connections held open", default=0)
+    parser.add_argument("--n-predict", type=int, help="Tokens to predict per request", default=64)
+    parser.add_argument("--n-probs", type=int, help="Probabilities of the top tokens returned with each token", default=0)
+    parser.add_argument("--prompt", type=str, help="Prompt of the requests", default="Write a story about a llama.")
+    parser.add_argument("--duration", type=float, help="Duration of the test, in seconds", default=30)
+    parser.add_argument("--pid", type=int, help="PID of a local server, to report its max number of threads", default=0)
+    args = parser.parse_args()
+
+    t_start = time.time()
+    stats = asyncio.run(run(args))
+    t = time.time() - t_start
+
+    print(f"streams completed:  {stats.n_streams} ({stats.n_streams / t:.2f}/s), errors: {stats.n_errors}")
+    print(f"events:             {stats.n_events} ({stats.n_events / t:.1f}/s)")
+    print(f"time to first event p50/p99: {percentile(stats.ttft_ms, 50):8.1f} / {percentile(stats.ttft_ms, 99):8.1f} ms")
+    print(f"time between events p50/p99: {percentile(stats.gap_ms, 50):8.1f} / {percentile(stats.gap_ms, 99):8.1f} ms")
+    print(f"/health latency     p50/p99: {percentile(stats.health_ms, 50):8.1f} / {percentile(stats.health_ms, 99):8.1f} ms")
+    if args.pid > 0:
+        print(f"server threads max: {stats.n_threads_max}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,709 @@
+#pragma once
+
+#include "utils.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+// Event-loop front end of the HTTP server (Linux only):
+//
+// a single thread multiplexes the connections with epoll and reads the requests, the complete requests are handled by
+// the routes of the httplib::Server on its task queue (as usual), but a streamed response is handed back to the loop,
+// which sends its chunks as the results arrive instead of blocking an HTTP thread per client until the end
+// backpressure: the loop stops reading the stream of a client whose pending output exceeds n_out_max until the client
+// catches up, and closes the connection (cancelling the stream) if the client makes no progress for the write timeout.
+// in the other direction, it stops reading the socket of a client whose pipelined data exceeds the size of a request
+
+// data of a streamed response, read by the event loop
+struct server_http_stream {
+    // tasks whose results wake up the stream, see server_http_loop::notify()
+    std::unordered_set<int> id_tasks;
+
+    // append the available data to out, without blocking, stopping once out holds n_max bytes or more
+    // returns: false after the last data
+    std::function<bool(std::string & out, size_t n_max)> read;
+
+    // called once when the stream ends. done: false if the connection was closed before the last data
+    std::function<void(bool done)> on_close;
+};
+
+struct server_http_loop : httplib::Server {
+    // max pending output of a stream before the loop stops reading it
+    static constexpr size_t n_out_max = 64*1024;
+
+    // max size of the headers of a request
+    static constexpr size_t n_headers_max = 64*1024;
+
+    ~server_http_loop() override {
+#if defined(__linux__)
+        for (auto & it : conns) {
+            ::close(it.second.fd);
+        }
+        if (fd_epoll >= 0) {
+            ::close(fd_epoll);
+        }
+        if (fd_wake >= 0) {
+            ::close(fd_wake);
+        }
+#endif
+    }
+
+    // set up the loop on the socket bound by bind_to_port()
+    // returns: false if the platform is not supported, the server is then used as a httplib::Server
+    bool init() {
+#if defined(__linux__)
+        fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+        fd_wake  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd_epoll < 0 || fd_wake < 0) {
+            LOG_ERR("%s: failed to create the epoll instance: %s\n", __func__, strerror(errno));
+            return false;
+        }
+
+        const int fd_listen = svr_sock_;
+        fcntl(fd_listen, F_SETFL, fcntl(fd_listen, F_GETFL) | O_NONBLOCK);
+
+        epoll_event ev = {};
+        ev.events   = EPOLLIN;
+        ev.data.u64 = ID_LISTEN;
+        epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd_listen, &ev);
+
+        ev.data.u64 = ID_WAKE;
+        epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd_wake, &ev);
+
+        task_queue.reset(new_task_queue());
+
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // run the loop until terminate() is called
+    void run() {
+#if defined(__linux__)
+        std::vector<epoll_event> events(256);
+
+        int64_t t_check = t_now();
+
+        while (!terminated) {
+            const int n = epoll_wait(fd_epoll, events.data(), (int) events.size(), 1000);
+            if (n < 0 && errno != EINTR) {
+                LOG_ERR("%s: epoll_wait failed: %s\n", __func__, strerror(errno));
+                break;
+            }
+
+            for (int i = 0; i < n; ++i) {
+                const uint64_t id = events[i].data.u64;
+                if (id == ID_LISTEN) {
+                    accept_all();
+                } else if (id == ID_WAKE) {
+                    uint64_t val;
+                    while (::read(fd_wake, &val, sizeof(val)) > 0) {}
+                } else {
+                    handle_io(id, events[i].events);
+                }
+            }
+
+            handle_responses();
+            handle_notified();
+
+            if (t_now() - t_check >= 1000) {
+                check_timeouts();
+                t_check = t_now();
+            }
+        }
+
+        std::vector<uint64_t> ids;
+        for (const auto & it : conns) {
+            ids.push_back(it.first);
+        }
+        for (uint64_t id : ids) {
+            close_conn(id, false);
+        }
+
+        task_queue->shutdown();
+#endif
+    }
+
+    void terminate() {
+        terminated = true;
+        wake();
+    }
+
+    // wake up the stream waiting for the results of id_task, thread-safe
+    void notify(int id_task) {
+        bool was_empty;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            was_empty = notified.empty();
+            notified.push_back(id_task);
+        }
+        if (was_empty) {
+            wake();
+        }
+    }
+
+    // hand a response over to the loop, called by a route handler instead of setting a content provider
+    void set_stream(httplib::Response & res, const std::shared_ptr<server_http_stream> & stream) {
+        // the provider is called by the handling thread after writing the headers
+        res.set_chunked_content_provider("text/event-stream", [stream](size_t, httplib::DataSink &) {
+            *stream_current() = stream;
+            return false;
+        });
+    }
+
+    // stats
+    std::atomic<size_t> n_conns   {0};
+    std::atomic<size_t> n_streams {0};
+
+private:
+    static constexpr uint64_t ID_LISTEN = 0;
+    static constexpr uint64_t ID_WAKE   = 1;
+
+    struct connection {
+        int fd = -1;
+
+        std::string remote_addr;
+        int         remote_port = 0;
+        std::string local_addr;
+        int         local_port  = 0;
+
+        std::string in;  // received data, not handled yet
+        std::string out; // data to send
+
+        bool busy      = false; // a request is being handled
+        bool continued = false; // 100 Continue was sent for the current request
+        bool closing   = false; // close after sending out
+        bool eof       = false; // the client closed its side, the requests received are still answered
+        bool in_full   = false; // in reached its max size, the socket may hold more data
+
+        size_t n_requests = 0;
+
+        std::shared_ptr<server_http_stream> stream;
+
+        int64_t t_last = 0; // last progress, in ms
+    };
+
+    // response of a handled request
+    struct response {
+        uint64_t id;
+
+        std::string out;
+        bool        close;
+
+        std::shared_ptr<server_http_stream> stream;
+    };
+
+    // request and response data of process_request()
+    struct buffer_stream : httplib::Stream {
+        std::string in;
+        size_t      pos = 0;
+        std::string out;
+
+        std::string remote_addr;
+        int         remote_port = 0;
+        std::string local_addr;
+        int         local_port  = 0;
+
+        bool is_readable() const override { return pos < in.size(); }
+        bool is_writable() const override { return true; }
+
+        ssize_t read(char * ptr, size_t size) override {
+            size = std::min(size, in.size() - pos);
+            memcpy(ptr, in.data() + pos, size);
+            pos += size;
+            return (ssize_t) size;
+        }
+
+        ssize_t write(const char * ptr, size_t size) override {
+            out.append(ptr, size);
+            return (ssize_t) size;
+        }
+
+        void get_remote_ip_and_port(std::string & ip, int & port) const override {
+            ip   = remote_addr;
+            port = remote_port;
+        }
+
+        void get_local_ip_and_port(std::string & ip, int & port) const override {
+            ip   = local_addr;
+            port = local_port;
+        }
+
+        // not a socket, also keeps process_request() from checking FD_SETSIZE
+        socket_t socket() const override { return INVALID_SOCKET; }
+    };
+
+    int fd_epoll = -1;
+    int fd_wake  = -1;
+
+    std::atomic<bool> terminated {false};
+
+    std::unique_ptr<httplib::TaskQueue> task_queue;
+
+    uint64_t id_next = 2;
+
+    std::unordered_map<uint64_t, connection> conns;
+    std::unordered_map<int, uint64_t>        conn_by_task; // connections of the streams
+
+    // shared with the other threads
+    std::mutex            mutex;
+    std::vector<response> responses;
+    std::vector<int>      notified;
+
+    static int64_t t_now() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // the stream set by the route handler of the request handled by the current thread
+    static std::shared_ptr<server_http_stream> *& stream_current() {
+        static thread_local std::shared_ptr<server_http_stream> * ptr = nullptr;
+        return ptr;
+    }
+
+    void wake() {
+#if defined(__linux__)
+        const uint64_t val = 1;
+        if (::write(fd_wake, &val, sizeof(val)) < 0) {
+            // the counter is already non-zero
+        }
+#endif
+    }
+
+#if defined(__linux__)
+    // size of the first request of data (headers and body)
+    // returns: 0 if the request is incomplete, std::string::npos if it is invalid
+    static size_t request_size(const std::string & data, size_t & n_headers, bool & expect_continue) {
+        n_headers       = 0;
+        expect_continue = false;
+
+        const size_t pos = data.find("\r\n\r\n");
+        if (pos == std::string::npos) {
+            return data.size() > n_headers_max ? std::string::npos : 0;
+        }
+        n_headers = pos + 4;
+
+        size_t n_body  = 0;
+        bool   chunked = false;
+
+        // header lines, after the request line
+        size_t beg = data.find("\r\n") + 2;
+        while (beg < pos) {
+            const size_t end   = data.find("\r\n", beg);
+            const size_t colon = data.find(':', beg);
+            if (colon != std::string::npos && colon < end) {
+                const std::string key = data.substr(beg, colon - beg);
+                std::string val = data.substr(colon + 1, end - colon - 1);
+                val.erase(0, val.find_first_not_of(" \t"));
+
+                if (strcasecmp(key.c_str(), "Content-Length") == 0) {
+                    n_body = std::strtoull(val.c_str(), nullptr, 10);
+                } else if (strcasecmp(key.c_str(), "Transfer-Encoding") == 0) {
+                    chunked = val.find("chunked") != std::string::npos;
+                } else if (strcasecmp(key.c_str(), "Expect") == 0) {
+                    expect_continue = strcasecmp(val.c_str(), "100-continue") == 0;
+                }
+            }
+            beg = end + 2;
+        }
+
+        if (!chunked) {
+            return data.size() >= n_headers + n_body ? n_headers + n_body : 0;
+        }
+
+        // walk the chunks up to the last one (trailers are not supported)
+        size_t i = n_headers;
+        while (true) {
+            const size_t end = data.find("\r\n", i);
+            if (end == std::string::npos) {
+                return 0;
+            }
+            const size_t n_chunk = std::strtoull(data.c_str() + i, nullptr, 16);
+            if (n_chunk == 0) {
+                return data.size() >= end + 4 ? end + 4 : 0;
+            }
+            i = end + 2 + n_chunk + 2;
+            if (i > data.size()) {
+                return 0;
+            }
+        }
+    }
+
+    void accept_all() {
+        while (true) {
+            const int fd = accept4(svr_sock_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    LOG_WRN("%s: accept failed: %s\n", __func__, strerror(errno));
+                }
+                break;
+            }
+
+            // the events are small and sent as they come
+            const int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+            const uint64_t id = id_next++;
+
+            connection & conn = conns[id];
+            conn.fd     = fd;
+            conn.t_last = t_now();
+            httplib::detail::get_remote_ip_and_port(fd, conn.remote_addr, conn.remote_port);
+            httplib::detail::get_local_ip_and_port (fd, conn.local_addr,  conn.local_port);
+
+            epoll_event ev = {};
+            ev.events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.u64 = id;
+            epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd, &ev);
+
+            n_conns++;
+        }
+    }
+
+    // read the socket into the input of the connection, up to its max size: one request while the connection is idle,
+    // only the headers of the next one while a request is handled or streamed. the events are edge-triggered, so the
+    // data left in the socket is not read (and the client gets TCP backpressure) until dispatch() makes room
+    // returns: false on a socket error
+    bool receive(connection & conn) {
+        const size_t n_in_max = conn.busy || conn.stream || conn.closing ? n_headers_max :
+            n_headers_max + std::min(payload_max_length_, std::numeric_limits<size_t>::max() - n_headers_max);
+
+        conn.in_full = false;
+
+        char buf[16*1024];
+        while (!conn.eof) {
+            if (conn.in.size() >= n_in_max) {
+                conn.in_full = true;
+                break;
+            }
+
+            const ssize_t n = ::recv(conn.fd, buf, std::min(sizeof(buf), n_in_max - conn.in.size()), 0);
+            if (n > 0) {
+                conn.in.append(buf, n);
+                conn.t_last = t_now();
+                continue;
+            }
+            if (n == 0) {
+                conn.eof = true;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return false;
+            }
+            break;
+        }
+
+        return true;
+    }
+
+    void handle_io(uint64_t id, uint32_t events) {
+        auto it = conns.find(id);
+        if (it == conns.end()) {
+            return;
+        }
+        connection & conn = it->second;
+
+        // nothing can be sent anymore: a streamed response is cancelled, a response being handled is dropped
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            close_conn(id, false);
+            return;
+        }
+
+        // EPOLLRDHUP: the client closed its side after sending its requests, they are read and answered before closing
+        if (events & (EPOLLIN | EPOLLRDHUP)) {
+            if (!receive(conn)) {
+                close_conn(id, false);
+                return;
+            }
+        }
+
+        if (events & EPOLLOUT) {
+            if (!flush(id)) {
+                return;
+            }
+        }
+
+        dispatch(id);
+    }
+
+    // start handling the next request of the connection, if it is complete
+    void dispatch(uint64_t id) {
+        connection & conn = conns.at(id);
+        if (conn.busy || conn.stream || conn.closing) {
+            return;
+        }
+
+        // the data left in the socket while the input was full
+        if (conn.in_full && !receive(conn)) {
+            close_conn(id, false);
+            return;
+        }
+
+        size_t n_headers       = 0;
+        bool   expect_continue = false;
+
+        const size_t n = conn.in.empty() ? 0 : request_size(conn.in, n_headers, expect_continue);
+        if (n == std::string::npos || (n == 0 && n_headers > 0 && conn.in.size() - n_headers >= payload_max_length_)) {
+            conn.out += "HTTP/1.1 400 Bad Request\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+            conn.closing = true;
+            flush(id);
+            return;
+        }
+        if (n == 0 && conn.eof) {
+            // no complete request left, close once the responses are sent
+            conn.closing = true;
+            flush(id);
+            return;
+        }
+        if (n == 0) {
+            // the client waits for this before sending a large body
+            if (expect_continue && n_headers > 0 && !conn.continued) {
+                conn.out += "HTTP/1.1 100 Continue\r\n\r\n";
+                conn.continued = true;
+                flush(id);
+            }
+            return;
+        }
+
+        buffer_stream * strm = new buffer_stream();
+        strm->in          = conn.in.substr(0, n);
+        strm->remote_addr = conn.remote_addr;
+        strm->remote_port = conn.remote_port;
+        strm->local_addr  = conn.local_addr;
+        strm->local_port  = conn.local_port;
+
+        conn.in.erase(0, n);
+        conn.busy      = true;
+        conn.continued = false;
+        conn.n_requests++;
+
+        const bool close_connection = conn.n_requests >= keep_alive_max_count_;
+
+        task_queue->enqueue([this, id, strm, close_connection]() {
+            std::unique_ptr<buffer_stream> strm_ptr(strm);
+
+            std::shared_ptr<server_http_stream> stream;
+            stream_current() = &stream;
+
+            bool connection_closed = false;
+            process_request(*strm, close_connection, connection_closed, [](httplib::Request & req) {
+                // already answered by the loop if needed
+                req.headers.erase("Expect");
+            });
+
+            stream_current() = nullptr;
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                responses.push_back({ id, std::move(strm->out), close_connection || connection_closed, std::move(stream) });
+            }
+            wake();
+        });
+    }
+
+    void handle_responses() {
+        std::vector<response> batch;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            batch.swap(responses);
+        }
+
+        for (auto & res : batch) {
+            auto it = conns.find(res.id);
+            if (it == conns.end()) {
+                // the connection was closed while the request was handled
+                if (res.stream) {
+                    res.stream->on_close(false);
+                }
+                continue;
+            }
+            connection & conn = it->second;
+
+            conn.busy    = false;
+            conn.closing = res.close;
+            conn.out    += res.out;
+            conn.t_last  = t_now();
+
+            if (res.stream) {
+                conn.stream = std::move(res.stream);
+                for (int id_task : conn.stream->id_tasks) {
+                    conn_by_task[id_task] = res.id;
+                }
+                n_streams++;
+
+                // results may have arrived before the stream was handed over
+                pump(res.id);
+            }
+
+            if (flush(res.id)) {
+                dispatch(res.id);
+            }
+        }
+    }
+
+    void handle_notified() {
+        std::vector<int> ids;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            ids.swap(notified);
+        }
+
+        for (int id_task : ids) {
+            auto it = conn_by_task.find(id_task);
+            if (it == conn_by_task.end()) {
+                continue;
+            }
+            const uint64_t id = it->second;
+            pump(id);
+            if (flush(id)) {
+                dispatch(id);
+            }
+        }
+    }
+
+    // read the stream of the connection into its output, up to n_out_max
+    void pump(uint64_t id) {
+        connection & conn = conns.at(id);
+
+        while (conn.stream && conn.out.size() < n_out_max) {
+            std::string data;
+            const bool more = conn.stream->read(data, n_out_max - conn.out.size());
+
+            if (!data.empty()) {
+                conn.out += httplib::detail::from_i_to_hex(data.size()) + "\r\n" + data + "\r\n";
+            }
+
+            if (!more) {
+                conn.out += "0\r\n\r\n";
+                end_stream(conn, true);
+                break;
+            }
+
+            if (data.empty()) {
+                break;
+            }
+        }
+    }
+
+    void end_stream(connection & conn, bool done) {
+        for (int id_task : conn.stream->id_tasks) {
+            conn_by_task.erase(id_task);
+        }
+        conn.stream->on_close(done);
+        conn.stream.reset();
+        n_streams--;
+    }
+
+    // send the output of the connection, until the socket would block
+    // returns: false if the connection was closed
+    bool flush(uint64_t id) {
+        connection & conn = conns.at(id);
+
+        size_t n_sent = 0;
+        while (n_sent < conn.out.size()) {
+            const ssize_t n = ::send(conn.fd, conn.out.data() + n_sent, conn.out.size() - n_sent, MSG_NOSIGNAL);
+            if (n > 0) {
+                n_sent += n;
+                conn.t_last = t_now();
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            close_conn(id, false);
+            return false;
+        }
+        conn.out.erase(0, n_sent);
+
+        if (conn.out.empty()) {
+            if (conn.stream) {
+                // the client caught up
+                pump(id);
+                if (!conn.out.empty()) {
+                    return flush(id);
+                }
+            } else if (conn.closing && !conn.busy) {
+                close_conn(id, true);
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void close_conn(uint64_t id, bool done) {
+        auto it = conns.find(id);
+        if (it == conns.end()) {
+            return;
+        }
+        connection & conn = it->second;
+
+        if (conn.stream) {
+            end_stream(conn, done);
+        }
+
+        epoll_ctl(fd_epoll, EPOLL_CTL_DEL, conn.fd, nullptr);
+        ::close(conn.fd);
+
+        conns.erase(it);
+        n_conns--;
+    }
+
+    void check_timeouts() {
+        const int64_t t = t_now();
+
+        const int64_t t_read  = read_timeout_sec_*1000  + read_timeout_usec_/1000;
+        const int64_t t_write = write_timeout_sec_*1000 + write_timeout_usec_/1000;
+        const int64_t t_idle  = keep_alive_timeout_sec_*1000;
+
+        std::vector<uint64_t> ids;
+        for (const auto & it : conns) {
+            const connection & conn = it.second;
+            if (conn.busy) {
+                continue;
+            }
+            if (!conn.out.empty()) {
+                if (t - conn.t_last > t_write) {
+                    if (conn.stream) {
+                        LOG_WRN("%s: closing the stream of %s:%d, the client did not read %zu bytes for %d ms\n", __func__,
+                                conn.remote_addr.c_str(), conn.remote_port, conn.out.size(), (int) t_write);
+                    }
+                    ids.push_back(it.first);
+                }
+            } else if (!conn.stream) {
+                if (t - conn.t_last > (conn.in.empty() ? t_idle : t_read)) {
+                    ids.push_back(it.first);
+                }
+            }
+        }
+
+        for (uint64_t id : ids) {
+            close_conn(id, false);
+        }
+    }
+#endif
+};
@@ -1,11 +1,18 @@
 #include "utils.hpp"
+#include "http-loop.hpp"
 
 #include "arg.h"
 #include "common.h"
 #include "log.h"
 #include "sampling.h"
 #include "json-schema-to-grammar.h"
+#include "kv-store.h"
+#include "kv-tier.h"
+#include "ngram-cache.h"
+#include "radix-cache.h"
 #include "llama.h"
+#include "clip.h"
+#include "llava.h"
 
 // Change JSON_ASSERT from assert() to GGML_ASSERT:
 #define JSON_ASSERT GGML_ASSERT
@@ -36,6 +43,7 @@
 #include <cstddef>
 #include <cinttypes>
 #include <deque>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <signal.h>
@@ -95,6 +103,15 @@ enum server_task_cmpl_type {
     SERVER_TASK_CMPL_TYPE_INFILL,
 };
 
+struct server_image {
+    int id = 0; // referenced as [img-<id>] in the prompt
+
+    std::vector<float> embd;  // n_pos embeddings of the image, projected to the embedding size of the model
+    int32_t            n_pos = 0;
+
+    int32_t i_pos = 0; // index of the first position of the image in the prompt tokens
+};
+
 struct server_task {
     int id        = -1; // to be filled by server_queue
     int id_target = -1; // used by SERVER_TASK_TYPE_CANCEL
@@ -104,6 +121,14 @@ struct server_task {
 
     server_task_cmpl_type cmpl_type = SERVER_TASK_CMPL_TYPE_NORMAL;
 
+    // scheduling
+    int     priority   = 0;     // class of the task, higher classes get more of the slots and can preempt lower ones
+    int64_t t_deadline = -1;    // time (us) by which the task must start, -1 = none
+    bool    resume     = false; // resume a preempted task, see server_context::preempt_slot
+
+    // the images of the prompt, encoded by the HTTP thread (see server_context::load_images)
+    std::shared_ptr<const std::vector<server_image>> images;
+
     // utility function
     static std::unordered_set<int> get_list_id(const std::vector<server_task> & tasks) {
         std::unordered_set<int> ids(tasks.size());
@@ -130,6 +155,7 @@ struct slot_params {
     int32_t  n_keep    =  0; // number of tokens to keep from initial prompt
     int32_t  n_discard =  0; // number of tokens after n_keep that may be discarded when shifting context, 0 defaults to half
     int32_t  n_predict = -1; // new tokens to predict
+    int32_t  n_draft   =  0; // max tokens drafted for speculative decoding, 0 = disabled
 
     std::vector<std::string> antiprompt;
 
@@ -165,13 +191,20 @@ struct server_slot {
     json prompt; // can be either a string, array of strings or array of token ids
 
     // when a task is submitted, we first tokenize the prompt and store it here
+    // (the positions of the images hold LLAMA_TOKEN_NULL)
     std::vector<llama_token> prompt_tokens;
 
+    // multimodal
+    std::vector<server_image> images; // in the order of the prompt
+
+    int32_t img_token_step = 0; // image tokens dropped in each layer (visual token dropping), 0 = disabled
+
     std::string generated_text;
     std::vector<llama_token> cache_tokens;
     std::vector<completion_token_output> generated_token_probs;
 
     server_task_cmpl_type cmpl_type = SERVER_TASK_CMPL_TYPE_NORMAL;
+    int priority = 0; // of the task
     bool has_next_token = true;
     bool truncated      = false;
     bool stopped_eos    = false;
@@ -207,6 +240,20 @@ struct server_slot {
     double t_prompt_processing; // ms
     double t_token_generation; // ms
 
+    int64_t            t_last_token = 0;
+    std::vector<float> t_between_tokens; // ms, time between the generated tokens
+
+    // speculative decoding
+    std::vector<llama_token> spec_inp;   // tokens of the task: the prompt and the sampled tokens
+    std::vector<llama_token> spec_draft; // tokens drafted after `sampled`, verified by the current batch
+    std::vector<llama_token> dft_tokens; // tokens in the KV cache of the draft model, system prompt included
+    llama_ngram_cache        ngram_cache; // n-grams of spec_inp
+
+    int32_t  n_drafted        = 0;
+    int32_t  n_draft_accepted = 0;
+    uint64_t n_drafted_total        = 0; // over the tasks of the slot
+    uint64_t n_draft_accepted_total = 0;
+
     std::function<void(int)> callback_on_release;
 
     void reset() {
@@ -223,10 +270,20 @@ struct server_slot {
         n_sent_text        = 0;
         n_sent_token_probs = 0;
         cmpl_type          = SERVER_TASK_CMPL_TYPE_NORMAL;
+        priority           = 0;
         ga_i               = 0;
         n_past_se          = 0;
+        img_token_step     = 0;
 
         generated_token_probs.clear();
+        images.clear();
+        t_between_tokens.clear();
+
+        spec_inp.clear();
+        spec_draft.clear();
+        ngram_cache.clear();
+        n_drafted        = 0;
+        n_draft_accepted = 0;
     }
 
     bool has_budget(gpt_params &global_params) {
@@ -263,6 +320,12 @@ struct server_slot {
 
             t_token_generation = (ggml_time_us() - t_start_generation) / 1e3;
             state = SLOT_STATE_IDLE;
+
+            // the visual token dropping leaves a different number of tokens in each layer of the KV cache, so the
+            // sequence cannot be continued by another task
+            if (img_token_step > 0) {
+                cache_tokens.clear();
+            }
             callback_on_release(id);
         }
     }
@@ -278,6 +341,11 @@ struct server_slot {
             {"predicted_ms",           t_token_generation},
             {"predicted_per_token_ms", t_token_generation / n_decoded},
             {"predicted_per_second",   1e3 / t_token_generation * n_decoded},
+            {"predicted_tbt_p50_ms",   percentile(t_between_tokens, 50)},
+            {"predicted_tbt_p99_ms",   percentile(t_between_tokens, 99)},
+
+            {"draft_n",                n_drafted},
+            {"draft_n_accepted",       n_draft_accepted},
         };
     }
 
@@ -344,6 +412,26 @@ struct server_metrics {
     uint64_t n_decode_total     = 0;
     uint64_t n_busy_slots_total = 0;
 
+    uint64_t n_preempted_total = 0; // tasks preempted by a task of higher priority
+    uint64_t n_drafted_total        = 0; // speculative decoding
+    uint64_t n_draft_accepted_total = 0;
+    uint64_t n_expired_total   = 0; // tasks that did not start before their deadline
+
+    uint64_t n_embd_inputs_total  = 0; // pooled embeddings batched without a slot
+    uint64_t n_embd_batches_total = 0;
+
+    // time of the main loop between two llama_decode() of the slots while they are busy (sampling, detokenization,
+    // results ...), during which the compute is idle
+    uint64_t n_decode_gaps       = 0;
+    double   t_decode_gaps_total = 0.0; // ms
+
+    // time between the generated tokens of all the slots, since the last bucket reset
+    // the oldest samples are overwritten past max_between_tokens
+    static constexpr size_t max_between_tokens = 65536;
+
+    std::vector<float> t_between_tokens; // ms
+    size_t             i_between_tokens = 0;
+
     void init() {
         t_start = ggml_time_us();
     }
@@ -362,6 +450,25 @@ struct server_metrics {
         t_tokens_generation_total  += slot.t_token_generation;
     }
 
+    void on_draft(int32_t n_drafted, int32_t n_accepted) {
+        n_drafted_total        += n_drafted;
+        n_draft_accepted_total += n_accepted;
+    }
+
+    void on_token(float t_between) {
+        if (t_between_tokens.size() < max_between_tokens) {
+            t_between_tokens.push_back(t_between);
+        } else {
+            t_between_tokens[i_between_tokens] = t_between;
+        }
+        i_between_tokens = (i_between_tokens + 1) % max_between_tokens;
+    }
+
+    void on_decode_gap(double t_gap) {
+        n_decode_gaps++;
+        t_decode_gaps_total += t_gap;
+    }
+
     void on_decoded(const std::vector<server_slot> & slots) {
         n_decode_total++;
         for (const auto & slot : slots) {
@@ -376,6 +483,9 @@ struct server_metrics {
         t_prompt_processing       = 0;
         n_tokens_predicted        = 0;
         t_tokens_generation       = 0;
+
+        t_between_tokens.clear();
+        i_between_tokens = 0;
     }
 };
 
@@ -390,6 +500,10 @@ struct server_queue {
     std::mutex mutex_tasks;
     std::condition_variable condition_tasks;
 
+    // virtual time of the priority classes, for the weighted fair order of the deferred tasks
+    std::map<int, double> vtime_class;
+    double                vtime = 0.0;
+
     // callback functions
     std::function<void(server_task&)> callback_new_task;
     std::function<void(void)>         callback_update_slots;
@@ -453,16 +567,78 @@ struct server_queue {
         callback_update_slots = std::move(callback);
     }
 
+    // Move the deferred tasks past their deadline to the main queue, so that they fail without waiting for a slot
+    void expire_deferred_tasks() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        if (move_expired_tasks() > 0) {
+            condition_tasks.notify_one();
+        }
+    }
+
     // Call when the state of one slot is changed, it will move one task from deferred to main queue
     void pop_deferred_task() {
         std::unique_lock<std::mutex> lock(mutex_tasks);
+        move_expired_tasks();
         if (!queue_tasks_deferred.empty()) {
-            queue_tasks.emplace_back(std::move(queue_tasks_deferred.front()));
-            queue_tasks_deferred.pop_front();
+            auto it = next_deferred_task();
+            queue_tasks.emplace_back(std::move(*it));
+            queue_tasks_deferred.erase(it);
         }
         condition_tasks.notify_one();
     }
 
+    // Call with mutex_tasks held. returns: the number of tasks moved.
+    size_t move_expired_tasks() {
+        const int64_t t_now = ggml_time_us();
+
+        size_t n_moved = 0;
+        for (auto it = queue_tasks_deferred.begin(); it != queue_tasks_deferred.end();) {
+            if (it->t_deadline >= 0 && it->t_deadline < t_now) {
+                QUE_DBG("task past its deadline, id = %d\n", it->id);
+                queue_tasks.emplace_back(std::move(*it));
+                it = queue_tasks_deferred.erase(it);
+                n_moved++;
+            } else {
+                ++it;
+            }
+        }
+
+        return n_moved;
+    }
+
+    // The next deferred task: the priority classes get the freed slots in proportion to priority + 1 (weighted fair
+    // queuing, each task costs 1 / weight of virtual time to its class), and in a class the task with the earliest
+    // deadline goes first, then the oldest one. Call with mutex_tasks held and queue_tasks_deferred not empty.
+    std::deque<server_task>::iterator next_deferred_task() {
+        int    priority = 0;
+        double start    = 0.0;
+        bool   found    = false;
+        for (const auto & task : queue_tasks_deferred) {
+            const double s = std::max(vtime_class[task.priority], vtime);
+            if (!found || s < start || (s == start && task.priority > priority)) {
+                priority = task.priority;
+                start    = s;
+                found    = true;
+            }
+        }
+
+        vtime = start;
+        vtime_class[priority] = start + 1.0/(priority + 1);
+
+        auto res = queue_tasks_deferred.end();
+        for (auto it = queue_tasks_deferred.begin(); it != queue_tasks_deferred.end(); ++it) {
+            if (it->priority != priority) {
+                continue;
+            }
+            if (res == queue_tasks_deferred.end() ||
+                (it->t_deadline >= 0 && (res->t_deadline < 0 || it->t_deadline < res->t_deadline))) {
+                res = it;
+            }
+        }
+
+        return res;
+    }
+
     // end the start_loop routine
     void terminate() {
         std::unique_lock<std::mutex> lock(mutex_tasks);
@@ -520,67 +696,110 @@ struct server_queue {
 };
 
 struct server_response {
-    // for keeping track of all tasks waiting for the result
-    std::unordered_set<int> waiting_task_ids;
+    // results of the tasks of a request, with their own notification, so that a result only wakes up the thread
+    // waiting for it instead of all the waiting threads
+    struct channel {
+        std::deque<server_task_result> results;
+
+        std::mutex mutex;
+        std::condition_variable condition;
+    };
 
-    // the main result queue
-    std::vector<server_task_result> queue_results;
+    // the channels of the tasks waiting for a result, the tasks of a request share one
+    std::unordered_map<int, std::shared_ptr<channel>> waiting_tasks;
 
     std::mutex mutex_results;
-    std::condition_variable condition_results;
+
+    // called after a result is queued, e.g. to wake up the HTTP event loop
+    std::function<void(int)> callback_new_result;
+
+    void on_new_result(std::function<void(int)> callback) {
+        callback_new_result = std::move(callback);
+    }
 
     // add the id_task to the list of tasks waiting for response
     void add_waiting_task_id(int id_task) {
-        SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) waiting_task_ids.size());
+        SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) waiting_tasks.size());
 
         std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.insert(id_task);
+        waiting_tasks[id_task] = std::make_shared<channel>();
     }
 
     void add_waiting_tasks(const std::vector<server_task> & tasks) {
+        auto chan = std::make_shared<channel>();
+
         std::unique_lock<std::mutex> lock(mutex_results);
 
         for (const auto & task : tasks) {
-            SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id, (int) waiting_task_ids.size());
-            waiting_task_ids.insert(task.id);
+            SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id, (int) waiting_tasks.size());
+            waiting_tasks[task.id] = chan;
         }
     }
 
     // when the request is finished, we can remove task associated with it
     void remove_waiting_task_id(int id_task) {
-        SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
+        SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_tasks.size());
 
         std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.erase(id_task);
+        waiting_tasks.erase(id_task);
     }
 
     void remove_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
         std::unique_lock<std::mutex> lock(mutex_results);
 
         for (const auto & id_task : id_tasks) {
-            SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
-            waiting_task_ids.erase(id_task);
+            SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_tasks.size());
+            waiting_tasks.erase(id_task);
+        }
+    }
+
+    // false once the task was cancelled, or its request finished
+    bool is_waiting(int id_task) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+        return waiting_tasks.find(id_task) != waiting_tasks.end();
+    }
+
+    // the channel of the id_tasks, which were added together. nullptr once they were removed, e.g. after a cancel
+    std::shared_ptr<channel> get_channel(const std::unordered_set<int> & id_tasks) {
+        if (id_tasks.empty()) {
+            return nullptr;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_results);
+
+        auto it = waiting_tasks.find(*id_tasks.begin());
+        if (it == waiting_tasks.end()) {
+            return nullptr;
         }
+
+        return it->second;
+    }
+
+    // the result received for id_tasks that are no longer waiting
+    static server_task_result cancelled_result(const std::unordered_set<int> & id_tasks) {
+        server_task_result res;
+        res.id    = id_tasks.empty() ? -1 : *id_tasks.begin();
+        res.data  = format_error_response("the task was cancelled", ERROR_TYPE_SERVER);
+        res.stop  = true;
+        res.error = true;
+        return res;
     }
 
     // This function blocks the thread until there is a response for one of the id_tasks
     server_task_result recv(const std::unordered_set<int> & id_tasks) {
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex_results);
-            condition_results.wait(lock, [&]{
-                return !queue_results.empty();
-            });
-
-            for (int i = 0; i < (int) queue_results.size(); i++) {
-                if (id_tasks.find(queue_results[i].id) != id_tasks.end()) {
-                    server_task_result res = queue_results[i];
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
-            }
+        auto chan = get_channel(id_tasks);
+        if (!chan) {
+            return cancelled_result(id_tasks);
         }
 
-        // should never reach here
+        std::unique_lock<std::mutex> lock(chan->mutex);
+        chan->condition.wait(lock, [&]{
+            return !chan->results.empty();
+        });
+
+        server_task_result res = std::move(chan->results.front());
+        chan->results.pop_front();
+        return res;
     }
 
     // single-task version of recv()
@@ -589,19 +808,128 @@ struct server_response {
         return recv(id_tasks);
     }
 
+    // non-blocking version of recv(). returns: false if there is no result for the id_tasks yet
+    bool try_recv(const std::unordered_set<int> & id_tasks, server_task_result & result) {
+        auto chan = get_channel(id_tasks);
+        if (!chan) {
+            result = cancelled_result(id_tasks);
+            return true;
+        }
+
+        std::unique_lock<std::mutex> lock(chan->mutex);
+        if (chan->results.empty()) {
+            return false;
+        }
+
+        result = std::move(chan->results.front());
+        chan->results.pop_front();
+        return true;
+    }
+
     // Send a new result to a waiting id_task
     void send(server_task_result & result) {
         SRV_DBG("sending result for task id = %d\n", result.id);
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        for (const auto & id_task : waiting_task_ids) {
-            if (result.id == id_task) {
-                SRV_DBG("task id = %d moved to result queue\n", result.id);
+        const int id = result.id;
 
-                queue_results.push_back(std::move(result));
-                condition_results.notify_all();
+        std::shared_ptr<channel> chan;
+        {
+            std::unique_lock<std::mutex> lock(mutex_results);
+            auto it = waiting_tasks.find(id);
+            if (it == waiting_tasks.end()) {
                 return;
             }
+            chan = it->second;
+        }
+
+        SRV_DBG("task id = %d moved to result queue\n", id);
+
+        {
+            std::unique_lock<std::mutex> lock(chan->mutex);
+            chan->results.push_back(std::move(result));
+        }
+        chan->condition.notify_one();
+
+        if (callback_new_result) {
+            callback_new_result(id);
+        }
+    }
+};
+
+// Runs the jobs of the main loop that do not need the model to wait for them, i.e. formatting the results of the slots
+// into json and sending them, on a thread of its own so that they overlap with the next llama_decode().
+// The jobs run in the order they were posted, so the results of a task keep their order. The posted jobs are handed
+// over to the thread by flush(), once per decode, which wakes it up once instead of once per token.
+struct server_result_worker {
+    std::vector<std::function<void()>> jobs_posted; // main loop only
+
+    std::vector<std::function<void()>> jobs;
+
+    bool running = false;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+
+    std::thread thread;
+
+    void start() {
+        running = true;
+        thread  = std::thread([this]() {
+            std::vector<std::function<void()>> jobs_cur;
+
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    condition.wait(lock, [&]{
+                        return !jobs.empty() || !running;
+                    });
+                    if (jobs.empty()) {
+                        return;
+                    }
+                    jobs_cur.swap(jobs);
+                }
+
+                for (auto & job : jobs_cur) {
+                    job();
+                }
+                jobs_cur.clear();
+            }
+        });
+    }
+
+    // the job runs after the next flush()
+    void post(std::function<void()> job) {
+        jobs_posted.push_back(std::move(job));
+    }
+
+    void flush() {
+        if (jobs_posted.empty()) {
+            return;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (auto & job : jobs_posted) {
+                jobs.push_back(std::move(job));
+            }
+        }
+        jobs_posted.clear();
+
+        condition.notify_one();
+    }
+
+    // run the remaining jobs and end the thread
+    void stop() {
+        flush();
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            running = false;
+        }
+        condition.notify_one();
+
+        if (thread.joinable()) {
+            thread.join();
         }
     }
 };
@@ -611,6 +939,10 @@ struct server_context {
     llama_context * ctx = nullptr;
     std::vector<llama_lora_adapter_container> loras;
 
+    // multimodal projector (--mmproj), used by the HTTP threads to encode the images of the requests
+    clip_ctx * ctx_clip = nullptr;
+    std::mutex mutex_clip;
+
     gpt_params params;
 
     llama_batch batch = {};
@@ -634,12 +966,60 @@ struct server_context {
     server_queue    queue_tasks;
     server_response queue_results;
 
+    server_result_worker result_worker; // formats and sends the results of the slots
+
     server_metrics metrics;
 
     // Necessary similarity of prompt for slot selection
     float slot_prompt_similarity = 0.0f;
 
+    // KV cache of the conversations evicted from the slots
+    bool          kv_tier_enabled = false;
+    llama_kv_tier kv_tier;
+
+    // KV cache of the prompt prefixes, shared by the slots
+    bool              radix_cache_enabled = false;
+    llama_radix_cache radix_cache;
+
+    // KV cache of the finished requests saved under --slot-save-path, kept across restarts
+    bool           kv_store_enabled = false;
+    llama_kv_store kv_store;
+
+    // state of the tasks preempted by a task of higher priority (--preemption), until a slot is free to resume them
+    struct server_preempted {
+        server_slot          slot; // copy of the slot, owns its sampler
+        std::vector<uint8_t> kv;   // state of the sequence of the slot
+    };
+    std::unordered_map<int, server_preempted> preempted; // by id_task
+
+    // speculative decoding: the generating slots draft up to n_draft tokens with a draft model (-md) or from n-grams
+    // (--spec-ngram), which the target model verifies in the batch of the tokens of all the slots
+    bool spec_enabled = false;
+
+    llama_model   * model_dft = nullptr;
+    llama_context * ctx_dft   = nullptr;
+    llama_batch     batch_dft = {};
+
+    llama_ngram_cache ngram_cache_dynamic; // n-grams of the finished tasks
+    llama_ngram_cache ngram_cache_static;  // --lookup-cache-static
+
+    // pooled embeddings (--embeddings): the inputs of all the requests are packed into batches as separate sequences,
+    // without a slot, so that the throughput scales with the batch size instead of the number of slots
+    struct server_embd_input {
+        int id_task;
+        int index;
+
+        std::vector<llama_token> tokens;
+    };
+    bool embd_batched = false;
+    std::deque<server_embd_input> embd_queue;
+
+    int64_t t_last_decode = -1; // end of the last llama_decode() of the slots, while they are busy
+
     ~server_context() {
+        // the pending results are formatted with the context
+        result_worker.stop();
+
         if (ctx) {
             llama_free(ctx);
             ctx = nullptr;
@@ -650,14 +1030,38 @@ struct server_context {
             model = nullptr;
         }
 
+        if (ctx_dft) {
+            llama_free(ctx_dft);
+            ctx_dft = nullptr;
+        }
+
+        if (model_dft) {
+            llama_free_model(model_dft);
+            model_dft = nullptr;
+        }
+
+        if (ctx_clip) {
+            clip_free(ctx_clip);
+            ctx_clip = nullptr;
+        }
+
         // Clear any sampling context
         for (server_slot & slot : slots) {
             if (slot.smpl != nullptr) {
                 gpt_sampler_free(slot.smpl);
             }
         }
+        for (auto & it : preempted) {
+            if (it.second.slot.smpl != nullptr) {
+                gpt_sampler_free(it.second.slot.smpl);
+            }
+        }
 
         llama_batch_free(batch);
+
+        if (batch_dft.token != nullptr) {
+            llama_batch_free(batch_dft);
+        }
     }
 
     bool load_model(const gpt_params & params_) {
@@ -672,15 +1076,69 @@ struct server_context {
         ctx   = llama_init.context;
         loras = llama_init.lora_adapters;
 
-        params.n_parallel -= 1; // but be sneaky about it
-
         if (model == nullptr) {
+            params.n_parallel -= 1;
             SRV_ERR("failed to load model, '%s'\n", params.model.c_str());
             return false;
         }
 
+        if (!params.model_draft.empty()) {
+            gpt_params params_dft = params;
+
+            params_dft.model        = params.model_draft;
+            params_dft.model_url    = "";
+            params_dft.hf_repo      = "";
+            params_dft.hf_file      = "";
+            params_dft.n_gpu_layers = params.n_gpu_layers_draft;
+            params_dft.lora_adapters.clear();
+            params_dft.control_vectors.clear();
+
+            // the layers of the per-layer KV cache types are the ones of the target model
+            params_dft.cache_type_k_layers.clear();
+            params_dft.cache_type_v_layers.clear();
+            if (params.draft_cpuparams.n_threads > 0) {
+                params_dft.cpuparams = params.draft_cpuparams;
+            }
+            if (params.draft_cpuparams_batch.n_threads > 0) {
+                params_dft.cpuparams_batch = params.draft_cpuparams_batch;
+            }
+
+            llama_init_result llama_init_dft = llama_init_from_gpt_params(params_dft);
+
+            model_dft = llama_init_dft.model;
+            ctx_dft   = llama_init_dft.context;
+
+            if (model_dft == nullptr) {
+                params.n_parallel -= 1;
+                SRV_ERR("failed to load draft model, '%s'\n", params.model_draft.c_str());
+                return false;
+            }
+
+            // the drafted tokens are verified by id
+            if (llama_vocab_type(model_dft) != llama_vocab_type(model) || llama_n_vocab(model_dft) != llama_n_vocab(model) ||
+                llama_token_bos(model_dft) != llama_token_bos(model) || llama_token_eos(model_dft) != llama_token_eos(model)) {
+                params.n_parallel -= 1;
+                SRV_ERR("the vocab of the draft model '%s' does not match the vocab of the model\n", params.model_draft.c_str());
+                return false;
+            }
+        }
+
+        params.n_parallel -= 1; // but be sneaky about it
+
         n_ctx = llama_n_ctx(ctx);
 
+        if (!params.mmproj.empty()) {
+            ctx_clip = clip_model_load(params.mmproj.c_str(), /*verbosity=*/ 1);
+            if (ctx_clip == nullptr) {
+                SRV_ERR("failed to load multimodal projector, '%s'\n", params.mmproj.c_str());
+                return false;
+            }
+
+            if (!llava_validate_embed_size(ctx, ctx_clip)) {
+                return false;
+            }
+        }
+
         add_bos_token = llama_add_bos_token(model);
         has_eos_token = !llama_add_eos_token(model);
 
@@ -698,6 +1156,77 @@ struct server_context {
     void init() {
         const int32_t n_ctx_slot = n_ctx / params.n_parallel;
 
+        kv_tier_enabled = params.kv_tier_ram > 0 || !params.kv_tier_path.empty();
+        if (kv_tier_enabled && (params.kv_sink > 0 || params.kv_hh_budget > 0)) {
+            SRV_WRN("%s", "the KV tier is not supported with the KV cache eviction, disabling it\n");
+            kv_tier_enabled = false;
+        }
+        if (kv_tier_enabled) {
+            kv_tier.params.host_budget = (size_t) params.kv_tier_ram*1024*1024;
+            kv_tier.params.path        = params.kv_tier_path;
+
+            SRV_INF("KV tier: %d MiB of host memory, path = '%s'\n", params.kv_tier_ram, params.kv_tier_path.c_str());
+        }
+
+        radix_cache_enabled = params.radix_cache > 0;
+        if (radix_cache_enabled && (llama_model_is_recurrent(model) || params.kv_sink > 0 || params.kv_hh_budget > 0)) {
+            SRV_WRN("%s", "the radix cache is not supported with recurrent models or the KV cache eviction, disabling it\n");
+            radix_cache_enabled = false;
+        }
+        if (radix_cache_enabled) {
+            llama_radix_cache_params rparams;
+            rparams.n_tokens_max = params.radix_cache;
+            rparams.seq_id_base  = params.n_parallel + 1; // after the system prompt and the slots
+
+            // max nodes: the cells of the KV cache store the seq ids below 64 inline, use the ones left after the slots
+            // (at least 16, the ids from 64 on are valid but slower)
+            rparams.n_seq = std::max(64 - rparams.seq_id_base, 16);
+
+            llama_radix_cache_init(radix_cache, rparams);
+
+            SRV_INF("radix cache: %d tokens\n", params.radix_cache);
+        }
+
+        kv_store_enabled = params.slot_cache_size > 0;
+        if (kv_store_enabled && params.slot_save_path.empty()) {
+            SRV_WRN("%s", "--slot-cache-size requires --slot-save-path, disabling it\n");
+            kv_store_enabled = false;
+        }
+        if (kv_store_enabled && (params.kv_sink > 0 || params.kv_hh_budget > 0)) {
+            SRV_WRN("%s", "the prompt cache store is not supported with the KV cache eviction, disabling it\n");
+            kv_store_enabled = false;
+        }
+        if (kv_store_enabled) {
+            kv_store_enabled = kv_store_init();
+        }
+
+        // the sequences of a batch are numbered from 0, as the pooling requires, which leaves no room for a system prompt
+        embd_batched = params.embedding && llama_pooling_type(ctx) != LLAMA_POOLING_TYPE_NONE &&
+            !llama_model_is_recurrent(model) && params.system_prompt.empty();
+        if (embd_batched) {
+            SRV_INF("%s", "pooled embeddings: the inputs are batched without a slot\n");
+        }
+
+        spec_enabled = (ctx_dft != nullptr || params.spec_ngram) && params.n_draft > 0;
+        if (spec_enabled && (llama_model_is_recurrent(model) || params.kv_sink > 0 || params.kv_hh_budget > 0)) {
+            SRV_WRN("%s", "speculative decoding is not supported with recurrent models or the KV cache eviction, disabling it\n");
+            spec_enabled = false;
+        }
+        if (spec_enabled) {
+            if (ctx_dft != nullptr) {
+                batch_dft = llama_batch_init(std::max(llama_n_batch(ctx_dft), (uint32_t) params.n_parallel), 0, 1);
+            }
+            if (!params.lookup_cache_static.empty()) {
+                try {
+                    ngram_cache_static = llama_ngram_cache_load(params.lookup_cache_static);
+                } catch (const std::exception &) {
+                    SRV_WRN("failed to open the static lookup cache '%s'\n", params.lookup_cache_static.c_str());
+                }
+            }
+
+            SRV_INF("speculative decoding: n_draft = %d, drafts from %s\n", params.n_draft, ctx_dft != nullptr ? "the draft model" : "n-grams");
+        }
+
         SRV_INF("initializing slots, n_slots = %d\n", params.n_parallel);
 
         for (int i = 0; i < params.n_parallel; i++) {
@@ -749,6 +1278,8 @@ struct server_context {
         }
 
         metrics.init();
+
+        result_worker.start();
     }
 
     std::vector<llama_token> tokenize(const json & json_prompt, bool add_special) const {
@@ -869,48 +1400,303 @@ struct server_context {
         return ret;
     }
 
-    bool launch_slot_with_task(server_slot & slot, const server_task & task) {
-        slot_params default_params;
-        // Sampling parameter defaults are loaded from the global server context (but individual requests can still override them)
-        auto default_sparams = params.sparams;
-        const auto & data = task.data;
+    // the processing slot that a task of the given priority can preempt: the lowest priority below it, then the
+    // task that started last
+    server_slot * get_preemptible_slot(int priority) {
+        server_slot * ret = nullptr;
 
-        if (data.count("__oaicompat") != 0) {
-            slot.oaicompat = true;
-            slot.oaicompat_model = json_value(data, "model", std::string(DEFAULT_OAICOMPAT_MODEL));
-        } else {
-            slot.oaicompat = false;
-            slot.oaicompat_model = "";
+        for (server_slot & slot : slots) {
+            if (slot.state != SLOT_STATE_PROCESSING_PROMPT && slot.state != SLOT_STATE_GENERATING) {
+                continue;
+            }
+            if (slot.priority >= priority) {
+                continue;
+            }
+
+            // the embeddings are computed in a single batch, and the KV cache of the images is not worth saving
+            if (slot.cmpl_type == SERVER_TASK_CMPL_TYPE_EMBEDDING || !slot.images.empty()) {
+                continue;
+            }
+
+            if (ret == nullptr || slot.priority < ret->priority ||
+                (slot.priority == ret->priority && slot.t_start_process_prompt > ret->t_start_process_prompt)) {
+                ret = &slot;
+            }
         }
 
-        slot.params.stream             = json_value(data, "stream",            false);
-        slot.params.cache_prompt       = json_value(data, "cache_prompt",      false);
-        slot.params.n_predict          = json_value(data, "n_predict",         json_value(data, "max_tokens", default_params.n_predict));
-        slot.sparams.top_k             = json_value(data, "top_k",             default_sparams.top_k);
-        slot.sparams.top_p             = json_value(data, "top_p",             default_sparams.top_p);
-        slot.sparams.min_p             = json_value(data, "min_p",             default_sparams.min_p);
-        slot.sparams.tfs_z             = json_value(data, "tfs_z",             default_sparams.tfs_z);
-        slot.sparams.typ_p             = json_value(data, "typical_p",         default_sparams.typ_p);
-        slot.sparams.temp              = json_value(data, "temperature",       default_sparams.temp);
-        slot.sparams.dynatemp_range    = json_value(data, "dynatemp_range",    default_sparams.dynatemp_range);
-        slot.sparams.dynatemp_exponent = json_value(data, "dynatemp_exponent", default_sparams.dynatemp_exponent);
-        slot.sparams.penalty_last_n    = json_value(data, "repeat_last_n",     default_sparams.penalty_last_n);
-        slot.sparams.penalty_repeat    = json_value(data, "repeat_penalty",    default_sparams.penalty_repeat);
-        slot.sparams.penalty_freq      = json_value(data, "frequency_penalty", default_sparams.penalty_freq);
-        slot.sparams.penalty_present   = json_value(data, "presence_penalty",  default_sparams.penalty_present);
-        slot.sparams.mirostat          = json_value(data, "mirostat",          default_sparams.mirostat);
-        slot.sparams.mirostat_tau      = json_value(data, "mirostat_tau",      default_sparams.mirostat_tau);
-        slot.sparams.mirostat_eta      = json_value(data, "mirostat_eta",      default_sparams.mirostat_eta);
-        slot.sparams.penalize_nl       = json_value(data, "penalize_nl",       default_sparams.penalize_nl);
-        slot.params.n_keep             = json_value(data, "n_keep",            slot.params.n_keep);
-        slot.params.n_discard          = json_value(data, "n_discard",         default_params.n_discard);
-        slot.sparams.seed              = json_value(data, "seed",              default_sparams.seed);
-        slot.sparams.n_probs           = json_value(data, "n_probs",           default_sparams.n_probs);
-        slot.sparams.min_keep          = json_value(data, "min_keep",          default_sparams.min_keep);
+        return ret;
+    }
 
-        // process "json_schema" and "grammar"
-        if (data.contains("json_schema") && !data.at("json_schema").is_null() && data.contains("grammar") && !data.at("grammar").is_null()) {
-            send_error(task, "Either \"json_schema\" or \"grammar\" can be specified, but not both", ERROR_TYPE_INVALID_REQUEST);
+    // Save the state of the task of a processing slot and defer a task to resume it when a slot is free. The slot is
+    // left idle with its KV cache, so that the next task can reuse the common prefix.
+    bool preempt_slot(server_slot & slot) {
+        const llama_seq_id seq_id = slot.id + 1;
+
+        server_preempted p;
+        p.kv.resize(llama_state_seq_get_size(ctx, seq_id));
+        if (p.kv.empty() || llama_state_seq_get_data(ctx, p.kv.data(), p.kv.size(), seq_id) != p.kv.size()) {
+            SLT_WRN(slot, "failed to save the state of task %d\n", slot.id_task);
+            return false;
+        }
+
+        SLT_INF(slot, "preempting task %d, priority = %d, n_past = %d, n_decoded = %d, state = %.2f MiB\n",
+                slot.id_task, slot.priority, slot.n_past, slot.n_decoded, p.kv.size()/1024.0/1024.0);
+
+        p.slot = slot;
+
+        slot.smpl  = nullptr; // owned by the copy
+        slot.state = SLOT_STATE_IDLE;
+
+        server_task task;
+        task.id        = slot.id_task;
+        task.type      = SERVER_TASK_TYPE_COMPLETION;
+        task.cmpl_type = slot.cmpl_type;
+        task.priority  = slot.priority;
+        task.resume    = true;
+
+        preempted[task.id] = std::move(p);
+        queue_tasks.defer(task);
+
+        metrics.n_preempted_total++;
+
+        return true;
+    }
+
+    // Continue a preempted task in a free slot.
+    void resume_slot(server_slot & slot, server_preempted & p) {
+        const llama_seq_id seq_id = slot.id + 1;
+
+        if (llama_state_seq_set_data(ctx, p.kv.data(), p.kv.size(), seq_id) == 0) {
+            // the sequence was cleared, give it the system prompt back
+            slot.cache_tokens.clear();
+            if (!system_tokens.empty()) {
+                llama_kv_cache_seq_cp(ctx, 0, seq_id, -1, -1);
+            }
+
+            if (p.slot.smpl != nullptr) {
+                gpt_sampler_free(p.slot.smpl);
+            }
+            send_error(p.slot, "failed to restore the state of the preempted task", ERROR_TYPE_SERVER);
+            return;
+        }
+
+        if (slot.smpl != nullptr) {
+            gpt_sampler_free(slot.smpl);
+        }
+
+        const int id = slot.id;
+
+        // the KV cache of the draft model and the stats belong to the slot
+        std::vector<llama_token> dft_tokens = std::move(slot.dft_tokens);
+        const uint64_t n_drafted_total        = slot.n_drafted_total;
+        const uint64_t n_draft_accepted_total = slot.n_draft_accepted_total;
+
+        slot    = p.slot;
+        slot.id = id;
+
+        slot.dft_tokens             = std::move(dft_tokens);
+        slot.n_drafted_total        = n_drafted_total;
+        slot.n_draft_accepted_total = n_draft_accepted_total;
+
+        SLT_INF(slot, "resumed task %d, n_past = %d, n_decoded = %d\n", slot.id_task, slot.n_past, slot.n_decoded);
+    }
+
+    // Draft the tokens that follow the sampled token of the generating slots, with the draft model or from the
+    // n-grams of the slot, the dynamic and the static caches.
+    // n_max_total: max tokens drafted by all the slots, they are added to the batch of the model
+    void spec_draft_slots(int32_t n_max_total) {
+        std::vector<server_slot *> dft_slots;
+        std::vector<int32_t>       dft_n_max;
+
+        for (server_slot & slot : slots) {
+            slot.spec_draft.clear();
+
+            if (slot.state != SLOT_STATE_GENERATING || slot.params.n_draft <= 0 || slot.spec_inp.empty()) {
+                continue;
+            }
+
+            // the drafts must fit in the context of the slot, and are of no use past the tokens left to predict
+            int32_t n_max = std::min(slot.params.n_draft, slot.n_ctx - 2 - (int32_t) system_tokens.size() - slot.n_past);
+
+            const int32_t n_predict = slot.params.n_predict != -1 ? slot.params.n_predict : params.n_predict;
+            if (n_predict != -1) {
+                n_max = std::min(n_max, n_predict - slot.n_decoded - 1);
+            }
+            n_max = std::min(n_max, n_max_total);
+            if (n_max <= 0) {
+                continue;
+            }
+
+            if (ctx_dft != nullptr) {
+                dft_slots.push_back(&slot);
+                dft_n_max.push_back(n_max);
+            } else {
+                std::vector<llama_token> draft = { slot.sampled };
+                llama_ngram_cache_draft(slot.spec_inp, draft, n_max, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.ngram_cache, ngram_cache_dynamic, ngram_cache_static);
+                slot.spec_draft.assign(draft.begin() + 1, draft.end());
+            }
+
+            n_max_total -= ctx_dft != nullptr ? n_max : (int32_t) slot.spec_draft.size();
+        }
+
+        if (!dft_slots.empty()) {
+            spec_draft_model(dft_slots, dft_n_max);
+        }
+    }
+
+    // Draft greedily with the draft model, one decode per drafted token for all the slots.
+    void spec_draft_model(const std::vector<server_slot *> & dft_slots, std::vector<int32_t> & n_max) {
+        const int32_t n_batch_dft = llama_n_batch(ctx_dft);
+        const int32_t n_vocab     = llama_n_vocab(model_dft);
+
+        // on failure, the KV cache of the draft model is rebuilt by the next drafts
+        const auto fail = [&](const char * what) {
+            SRV_WRN("failed to %s with the draft model\n", what);
+            for (server_slot * slot : dft_slots) {
+                llama_kv_cache_seq_rm(ctx_dft, slot->id + 1, -1, -1);
+                slot->dft_tokens.clear();
+                slot->spec_draft.clear();
+            }
+        };
+
+        // the draft model holds the system prompt and the tokens of the slot, up to the sampled token
+        llama_batch_clear(batch_dft);
+
+        for (server_slot * slot : dft_slots) {
+            const size_t n_sys    = system_tokens.size();
+            const size_t n_target = n_sys + slot->spec_inp.size() - 1;
+
+            const auto token_at = [&](size_t i) {
+                return i < n_sys ? system_tokens[i] : slot->spec_inp[i - n_sys];
+            };
+
+            size_t n_common = 0;
+            while (n_common < slot->dft_tokens.size() && n_common < n_target && slot->dft_tokens[n_common] == token_at(n_common)) {
+                n_common++;
+            }
+
+            llama_kv_cache_seq_rm(ctx_dft, slot->id + 1, n_common, -1);
+            slot->dft_tokens.resize(n_common);
+
+            while (slot->dft_tokens.size() < n_target) {
+                if (batch_dft.n_tokens == n_batch_dft) {
+                    if (llama_decode(ctx_dft, batch_dft) != 0) {
+                        fail("process the prompt");
+                        return;
+                    }
+                    llama_batch_clear(batch_dft);
+                }
+
+                const llama_token id = token_at(slot->dft_tokens.size());
+                llama_batch_add(batch_dft, id, slot->dft_tokens.size(), { slot->id + 1 }, false);
+                slot->dft_tokens.push_back(id);
+            }
+        }
+
+        if (batch_dft.n_tokens > 0 && llama_decode(ctx_dft, batch_dft) != 0) {
+            fail("process the prompt");
+            return;
+        }
+
+        std::vector<llama_token> cur(dft_slots.size());
+        std::vector<int32_t>     idx(dft_slots.size());
+
+        for (size_t k = 0; k < dft_slots.size(); ++k) {
+            cur[k] = dft_slots[k]->sampled;
+        }
+
+        while (true) {
+            llama_batch_clear(batch_dft);
+
+            for (size_t k = 0; k < dft_slots.size(); ++k) {
+                server_slot * slot = dft_slots[k];
+
+                idx[k] = -1;
+                if ((int32_t) slot->spec_draft.size() >= n_max[k]) {
+                    continue;
+                }
+
+                idx[k] = batch_dft.n_tokens;
+                llama_batch_add(batch_dft, cur[k], slot->dft_tokens.size(), { slot->id + 1 }, true);
+                slot->dft_tokens.push_back(cur[k]);
+            }
+
+            if (batch_dft.n_tokens == 0) {
+                break;
+            }
+
+            if (llama_decode(ctx_dft, batch_dft) != 0) {
+                fail("draft");
+                return;
+            }
+
+            for (size_t k = 0; k < dft_slots.size(); ++k) {
+                if (idx[k] < 0) {
+                    continue;
+                }
+
+                const float * logits = llama_get_logits_ith(ctx_dft, idx[k]);
+
+                llama_token id = 0;
+                for (llama_token t = 1; t < n_vocab; ++t) {
+                    if (logits[t] > logits[id]) {
+                        id = t;
+                    }
+                }
+
+                dft_slots[k]->spec_draft.push_back(id);
+                cur[k] = id;
+
+                if (llama_token_is_eog(model, id)) {
+                    n_max[k] = dft_slots[k]->spec_draft.size();
+                }
+            }
+        }
+    }
+
+    bool launch_slot_with_task(server_slot & slot, const server_task & task) {
+        slot_params default_params;
+        // Sampling parameter defaults are loaded from the global server context (but individual requests can still override them)
+        auto default_sparams = params.sparams;
+        const auto & data = task.data;
+
+        if (data.count("__oaicompat") != 0) {
+            slot.oaicompat = true;
+            slot.oaicompat_model = json_value(data, "model", std::string(DEFAULT_OAICOMPAT_MODEL));
+        } else {
+            slot.oaicompat = false;
+            slot.oaicompat_model = "";
+        }
+
+        slot.params.stream             = json_value(data, "stream",            false);
+        slot.params.cache_prompt       = json_value(data, "cache_prompt",      false);
+        slot.params.n_predict          = json_value(data, "n_predict",         json_value(data, "max_tokens", default_params.n_predict));
+        slot.sparams.top_k             = json_value(data, "top_k",             default_sparams.top_k);
+        slot.sparams.top_p             = json_value(data, "top_p",             default_sparams.top_p);
+        slot.sparams.min_p             = json_value(data, "min_p",             default_sparams.min_p);
+        slot.sparams.tfs_z             = json_value(data, "tfs_z",             default_sparams.tfs_z);
+        slot.sparams.typ_p             = json_value(data, "typical_p",         default_sparams.typ_p);
+        slot.sparams.temp              = json_value(data, "temperature",       default_sparams.temp);
+        slot.sparams.dynatemp_range    = json_value(data, "dynatemp_range",    default_sparams.dynatemp_range);
+        slot.sparams.dynatemp_exponent = json_value(data, "dynatemp_exponent", default_sparams.dynatemp_exponent);
+        slot.sparams.penalty_last_n    = json_value(data, "repeat_last_n",     default_sparams.penalty_last_n);
+        slot.sparams.penalty_repeat    = json_value(data, "repeat_penalty",    default_sparams.penalty_repeat);
+        slot.sparams.penalty_freq      = json_value(data, "frequency_penalty", default_sparams.penalty_freq);
+        slot.sparams.penalty_present   = json_value(data, "presence_penalty",  default_sparams.penalty_present);
+        slot.sparams.mirostat          = json_value(data, "mirostat",          default_sparams.mirostat);
+        slot.sparams.mirostat_tau      = json_value(data, "mirostat_tau",      default_sparams.mirostat_tau);
+        slot.sparams.mirostat_eta      = json_value(data, "mirostat_eta",      default_sparams.mirostat_eta);
+        slot.sparams.penalize_nl       = json_value(data, "penalize_nl",       default_sparams.penalize_nl);
+        slot.params.n_keep             = json_value(data, "n_keep",            slot.params.n_keep);
+        slot.params.n_discard          = json_value(data, "n_discard",         default_params.n_discard);
+        slot.params.n_draft            = spec_enabled ? std::max(json_value(data, "n_draft", params.n_draft), 0) : 0;
+        slot.sparams.seed              = json_value(data, "seed",              default_sparams.seed);
+        slot.sparams.n_probs           = json_value(data, "n_probs",           default_sparams.n_probs);
+        slot.sparams.min_keep          = json_value(data, "min_keep",          default_sparams.min_keep);
+
+        // process "json_schema" and "grammar"
+        if (data.contains("json_schema") && !data.at("json_schema").is_null() && data.contains("grammar") && !data.at("grammar").is_null()) {
+            send_error(task, "Either \"json_schema\" or \"grammar\" can be specified, but not both", ERROR_TYPE_INVALID_REQUEST);
             return false;
         }
         if (data.contains("json_schema") && !data.contains("grammar")) {
@@ -930,6 +1716,12 @@ struct server_context {
             SLT_WRN(slot, "%s", "group-attention is not supported with prompt caching. disabling cache\n");
         }
 
+        // the evicted cells leave the KV cache of the slot out of sync with cache_tokens
+        if (slot.params.cache_prompt && (params.kv_sink > 0 || params.kv_hh_budget > 0)) {
+            slot.params.cache_prompt = false;
+            SLT_WRN(slot, "%s", "the KV cache eviction is not supported with prompt caching. disabling cache\n");
+        }
+
         if (slot.n_predict > 0 && slot.params.n_predict > slot.n_predict) {
             // Might be better to reject the request with a 400 ?
             slot.params.n_predict = slot.n_predict;
@@ -960,6 +1752,22 @@ struct server_context {
             }
         }
 
+        // multimodal
+        {
+            if (task.images) {
+                slot.images = *task.images;
+            }
+
+            slot.img_token_step = json_value(data, "image_token_step", 0);
+            if (slot.img_token_step != 0) {
+                std::string error;
+                if (!validate_img_token_step(slot, error)) {
+                    send_error(task, "\"image_token_step\": " + error, ERROR_TYPE_INVALID_REQUEST);
+                    return false;
+                }
+            }
+        }
+
         {
             slot.sparams.logit_bias.clear();
 
@@ -1047,12 +1855,464 @@ struct server_context {
         return true;
     }
 
+    // decode and encode the images of a request, and check that the prompt refers to each of them once with [img-<id>]
+    // this runs in the HTTP thread of the request, so that the vision encoder does not stall the slots
+    // on success, images holds the images in the order of the prompt (nullptr if the request has none)
+    bool load_images(const json & data, server_task_cmpl_type cmpl_type, std::shared_ptr<const std::vector<server_image>> & images, json & error) {
+        const auto & image_data = data.find("image_data");
+        if (image_data == data.end() || !image_data->is_array() || image_data->empty()) {
+            return true;
+        }
+
+        if (ctx_clip == nullptr) {
+            error = format_error_response("images are not supported, the server was started without a multimodal projector (--mmproj)", ERROR_TYPE_NOT_SUPPORTED);
+            return false;
+        }
+
+        const auto & prompt = data.find("prompt");
+        if (cmpl_type != SERVER_TASK_CMPL_TYPE_NORMAL || prompt == data.end() || !prompt->is_string()) {
+            error = format_error_response("\"image_data\" requires a completion with a string prompt", ERROR_TYPE_INVALID_REQUEST);
+            return false;
+        }
+
+        if (params.grp_attn_n != 1) {
+            error = format_error_response("images are not supported with group-attention", ERROR_TYPE_INVALID_REQUEST);
+            return false;
+        }
+
+        std::vector<server_image> loaded;
+        for (const auto & img : *image_data) {
+            server_image image;
+            image.id = json_value(img, "id", 0);
+
+            const auto bytes = base64_decode(json_value(img, "data", std::string()));
+            if (!encode_image(bytes, image)) {
+                error = format_error_response("failed to load image " + std::to_string(image.id), ERROR_TYPE_INVALID_REQUEST);
+                return false;
+            }
+
+            SRV_INF("image %d encoded, n_pos = %d\n", image.id, image.n_pos);
+
+            loaded.push_back(std::move(image));
+        }
+
+        auto res = std::make_shared<std::vector<server_image>>();
+        for (const auto & marker : find_image_markers(prompt->get<std::string>())) {
+            auto it = std::find_if(loaded.begin(), loaded.end(), [&](const server_image & image) { return image.id == marker.id; });
+            if (it == loaded.end()) {
+                error = format_error_response("the prompt refers to [img-" + std::to_string(marker.id) + "], which is not in \"image_data\" or is referred to more than once", ERROR_TYPE_INVALID_REQUEST);
+                return false;
+            }
+
+            res->push_back(std::move(*it));
+            loaded.erase(it);
+        }
+
+        if (!loaded.empty()) {
+            error = format_error_response("image " + std::to_string(loaded.front().id) + " is not referred to in the prompt, use [img-" + std::to_string(loaded.front().id) + "]", ERROR_TYPE_INVALID_REQUEST);
+            return false;
+        }
+
+        images = std::move(res);
+
+        return true;
+    }
+
+    // compute the embeddings of an image with the vision encoder and the projector
+    bool encode_image(const std::vector<uint8_t> & bytes, server_image & image) {
+        // the HTTP threads share the vision encoder
+        std::lock_guard<std::mutex> lock(mutex_clip);
+
+        clip_image_u8 * img = clip_image_u8_init();
+        if (!clip_image_load_from_bytes(bytes.data(), bytes.size(), img)) {
+            clip_image_u8_free(img);
+            return false;
+        }
+
+        const int n_threads = params.cpuparams.n_threads;
+        const int n_embd    = clip_n_mmproj_embd(ctx_clip);
+
+        bool ok;
+
+        if (clip_is_minicpmv(ctx_clip) || strcmp(clip_patch_merge_type(ctx_clip), "spatial_unpad") == 0) {
+            // the slices of the image are encoded separately and merged by llava
+            float * embd = nullptr;
+            int n_pos = 0;
+
+            ok = llava_image_embed_make_with_clip_img(ctx_clip, n_threads, img, &embd, &n_pos);
+            if (ok) {
+                image.n_pos = n_pos;
+                image.embd.assign(embd, embd + (size_t) n_pos*n_embd);
+                free(embd);
+            }
+        } else {
+            clip_image_f32_batch batch = {};
+
+            ok = clip_image_preprocess(ctx_clip, img, &batch);
+            if (ok) {
+                image.n_pos = clip_n_patches(ctx_clip)*batch.size;
+                image.embd.resize((size_t) image.n_pos*n_embd);
+
+                ok = clip_image_batch_encode(ctx_clip, n_threads, &batch, image.embd.data());
+            }
+
+            clip_image_f32_batch_free(&batch);
+        }
+
+        clip_image_u8_free(img);
+
+        return ok;
+    }
+
+    // the visual token dropping (see llm_build_kqv_drop) is implemented for the LLaMA graph with a single image at
+    // the start of the last prefill batch, and it changes the layout of the whole KV cache: it is only available
+    // when the server runs a single slot
+    bool validate_img_token_step(server_slot & slot, std::string & error) const {
+        const int32_t n_layer = llama_n_layer(model);
+
+        if (slot.images.size() != 1) {
+            error = "the visual token dropping requires exactly one image";
+            return false;
+        }
+
+        // -1: drop all the image tokens by the last layer
+        if (slot.img_token_step == -1) {
+            slot.img_token_step = slot.images[0].n_pos / n_layer;
+        }
+
+        if (slot.img_token_step < 0 || slot.img_token_step*n_layer > slot.images[0].n_pos) {
+            error = "must be -1 or between 0 and " + std::to_string(slot.images[0].n_pos / n_layer) + " (image tokens / layers)";
+            return false;
+        }
+
+        char arch[64] = "";
+        llama_model_meta_val_str(model, "general.architecture", arch, sizeof(arch));
+
+        if (strcmp(arch, "llama") != 0) {
+            error = "the visual token dropping is not implemented for the '" + std::string(arch) + "' architecture";
+            return false;
+        }
+
+        if (slots.size() != 1) {
+            error = "the visual token dropping requires a single slot (--parallel 1)";
+            return false;
+        }
+
+        if (!system_tokens.empty()) {
+            error = "the visual token dropping is not compatible with a system prompt";
+            return false;
+        }
+
+        if (params.kv_sink > 0 || params.kv_hh_budget > 0) {
+            error = "the visual token dropping is not compatible with the KV cache eviction";
+            return false;
+        }
+
+        return true;
+    }
+
+    // tokenize a prompt with images, the positions of the images hold LLAMA_TOKEN_NULL
+    std::vector<llama_token> tokenize_images(server_slot & slot, bool add_special) const {
+        const std::string prompt = slot.prompt.get<std::string>();
+
+        const auto markers = find_image_markers(prompt);
+        GGML_ASSERT(markers.size() == slot.images.size());
+
+        std::vector<llama_token> res;
+
+        size_t pos = 0;
+        for (size_t i = 0; i < markers.size(); ++i) {
+            const auto p = ::llama_tokenize(ctx, unescape_image_markers(prompt.substr(pos, markers[i].pos - pos)), add_special && i == 0, true);
+            res.insert(res.end(), p.begin(), p.end());
+
+            slot.images[i].i_pos = res.size();
+            res.insert(res.end(), slot.images[i].n_pos, LLAMA_TOKEN_NULL);
+
+            pos = markers[i].pos + markers[i].len;
+        }
+
+        const auto p = ::llama_tokenize(ctx, unescape_image_markers(prompt.substr(pos)), false, true);
+        res.insert(res.end(), p.begin(), p.end());
+
+        return res;
+    }
+
+    // the input embedding of a token, as the model gets it from the token embeddings matrix
+    void token_embd(llama_token id, float * out) const {
+        const ggml_tensor * tok_embd = llama_get_model_tok_embd(model);
+
+        const size_t row_size = ggml_row_size(tok_embd->type, tok_embd->ne[0]);
+
+        std::vector<uint8_t> row(row_size);
+        ggml_backend_tensor_get(tok_embd, row.data(), id*tok_embd->nb[1], row_size);
+
+        if (tok_embd->type == GGML_TYPE_F32) {
+            memcpy(out, row.data(), row_size);
+        } else {
+            ggml_internal_get_type_traits(tok_embd->type).to_float(row.data(), out, tok_embd->ne[0]);
+        }
+    }
+
+    // the images of a prompt are decoded in batches of embeddings of the slot only, since a batch holds either tokens
+    // or embeddings: when the prompt of a slot reaches an image, the slot decodes the next chunk of the image instead
+    // of adding tokens to the batch of the other slots, one chunk per iteration of update_slots
+    bool ingest_image_chunk(server_slot & slot, int32_t n_max) {
+        const int32_t n_embd = llama_n_embd(model);
+
+        auto it = std::find_if(slot.images.begin(), slot.images.end(), [&](const server_image & image) {
+            return slot.n_past >= image.i_pos && slot.n_past < image.i_pos + image.n_pos;
+        });
+        GGML_ASSERT(it != slot.images.end());
+
+        auto & image = *it;
+
+        const int32_t i        = slot.n_past - image.i_pos;
+        const int32_t n_tokens = std::min(n_max, image.n_pos - i);
+
+        llama_batch batch_img = {
+            n_tokens, nullptr, image.embd.data() + (size_t) i*n_embd, nullptr, nullptr, nullptr, nullptr,
+            (llama_pos) (system_tokens.size() + slot.n_past), 1, slot.id + 1,
+            0, 0, 0,
+        };
+
+        llama_set_embeddings(ctx, false);
+
+        if (llama_decode(ctx, batch_img) != 0) {
+            return false;
+        }
+
+        if (slot.params.cache_prompt) {
+            slot.cache_tokens.insert(slot.cache_tokens.end(), n_tokens, LLAMA_TOKEN_NULL);
+        }
+
+        slot.n_past                    += n_tokens;
+        slot.n_prompt_tokens_processed += n_tokens;
+
+        return true;
+    }
+
+    // with the visual token dropping, all the prompt but its last token is decoded in a single batch of embeddings, in
+    // which the last token selects the image tokens to drop
+    bool ingest_images_drop(server_slot & slot) {
+        const int32_t n_embd = llama_n_embd(model);
+
+        const int32_t n_tokens = slot.n_prompt_tokens - 1;
+        if (slot.n_past >= n_tokens) {
+            return true;
+        }
+
+        const auto & image = slot.images[0];
+
+        std::vector<float> embd((size_t) n_tokens*n_embd);
+        for (int32_t i = 0; i < n_tokens; ++i) {
+            if (slot.prompt_tokens[i] == LLAMA_TOKEN_NULL) {
+                std::copy_n(image.embd.data() + (size_t) (i - image.i_pos)*n_embd, n_embd, embd.data() + (size_t) i*n_embd);
+            } else {
+                token_embd(slot.prompt_tokens[i], embd.data() + (size_t) i*n_embd);
+            }
+        }
+
+        // the layers read past the cells they wrote (each one holds fewer of them), so start from a zeroed cache
+        // as a fresh context would - the slot is the only one and has no system prompt
+        kv_cache_clear();
+
+        llama_batch batch_drop = {
+            n_tokens, nullptr, embd.data(), nullptr, nullptr, nullptr, nullptr,
+            (llama_pos) system_tokens.size(), 1, slot.id + 1,
+            image.i_pos, image.n_pos, slot.img_token_step,
+        };
+
+        llama_set_embeddings(ctx, false);
+
+        if (llama_decode(ctx, batch_drop) != 0) {
+            return false;
+        }
+
+        if (slot.params.cache_prompt) {
+            slot.cache_tokens.insert(slot.cache_tokens.end(), slot.prompt_tokens.begin() + slot.n_past, slot.prompt_tokens.begin() + n_tokens);
+        }
+
+        slot.n_prompt_tokens_processed += n_tokens - slot.n_past;
+        slot.n_past                     = n_tokens;
+
+        return true;
+    }
+
+    // keep the conversation cached in the slot if the new prompt does not continue it, and bring back the cached
+    // conversation that shares the longest prefix with the new prompt
+    void kv_tier_swap(server_slot & slot, const std::vector<llama_token> & prompt_tokens) {
+        const size_t n_cur = common_part(slot.cache_tokens, prompt_tokens);
+
+        if (n_cur < slot.cache_tokens.size()) {
+            llama_kv_tier_store(kv_tier, ctx, slot.id + 1, slot.cache_tokens);
+        }
+
+        size_t n_match = 0;
+        const int64_t id = llama_kv_tier_find(kv_tier, prompt_tokens, n_match);
+        if (id < 0 || n_match <= n_cur) {
+            return;
+        }
+
+        std::vector<llama_token> tokens;
+        if (llama_kv_tier_restore(kv_tier, ctx, id, slot.id + 1, tokens)) {
+            SLT_INF(slot, "restored %zu cached tokens from the KV tier, %zu in common with the prompt\n", tokens.size(), n_match);
+
+            slot.cache_tokens = std::move(tokens);
+        } else {
+            // the content of the sequence is undefined
+            llama_kv_cache_seq_rm(ctx, slot.id + 1, -1, -1);
+            if (!system_tokens.empty()) {
+                llama_kv_cache_seq_cp(ctx, 0, slot.id + 1, -1, -1);
+            }
+            slot.cache_tokens.clear();
+        }
+    }
+
+    void kv_tier_prefetch(const std::string & prompt) {
+        const std::vector<llama_token> tokens = ::llama_tokenize(ctx, prompt, system_prompt.empty(), true);
+
+        size_t n_match = 0;
+        const int64_t id = llama_kv_tier_find(kv_tier, tokens, n_match);
+        if (id >= 0) {
+            llama_kv_tier_prefetch(kv_tier, id);
+        }
+    }
+
+    // replace the cached prompt of the slot by the longest prefix of the new prompt in the radix cache, if longer
+    void radix_cache_attach(server_slot & slot, const std::vector<llama_token> & prompt_tokens) {
+        if (llama_radix_cache_find(radix_cache, prompt_tokens) <= (size_t) slot.n_past) {
+            return;
+        }
+
+        llama_kv_cache_seq_rm(ctx, slot.id + 1, system_tokens.size(), -1);
+
+        slot.n_past = llama_radix_cache_attach(radix_cache, ctx, slot.id + 1, prompt_tokens);
+        slot.cache_tokens.assign(prompt_tokens.begin(), prompt_tokens.begin() + slot.n_past);
+
+        SLT_INF(slot, "attached %d prompt tokens from the radix cache\n", slot.n_past);
+    }
+
+    // add the tokens computed by the slot to the radix cache
+    void radix_cache_insert(const server_slot & slot) {
+        // the KV cache of the slot must hold cache_tokens at their original positions
+        if (!radix_cache_enabled || !slot.params.cache_prompt || slot.truncated || slot.ga_n != 1 || slot.img_token_step > 0 ||
+            slot.cmpl_type == SERVER_TASK_CMPL_TYPE_EMBEDDING) {
+            return;
+        }
+
+        const size_t n_added = llama_radix_cache_insert(radix_cache, ctx, slot.id + 1, slot.cache_tokens);
+        if (n_added > 0) {
+            SLT_DBG(slot, "added %zu tokens to the radix cache, n_tokens = %zu\n", n_added, radix_cache.n_tokens);
+        }
+    }
+
+    // anything that changes the KV cache computed for the same tokens
+    std::string kv_store_fingerprint() const {
+        char buf[256];
+
+        std::string res;
+
+        llama_model_desc(model, buf, sizeof(buf));
+        res += std::string(buf) + "\n";
+        res += std::to_string(llama_model_size(model)) + " " + std::to_string(llama_model_n_params(model)) + "\n";
+
+        for (int32_t i = 0; i < llama_model_meta_count(model); ++i) {
+            llama_model_meta_key_by_index(model, i, buf, sizeof(buf));
+            res += std::string(buf) + "=";
+            llama_model_meta_val_str_by_index(model, i, buf, sizeof(buf));
+            res += std::string(buf) + "\n";
+        }
+
+        res += params.cache_type_k + " " + params.cache_type_v + " " + params.cache_type_k_layers + " " + params.cache_type_v_layers + " " + std::to_string(params.kv_mixed) + "\n";
+
+        // the KV cache of the keys is stored after RoPE
+        res += std::to_string(params.rope_scaling_type) + " " + std::to_string(params.rope_freq_base) + " " + std::to_string(params.rope_freq_scale) + "\n";
+        res += std::to_string(params.yarn_ext_factor) + " " + std::to_string(params.yarn_attn_factor) + " " + std::to_string(params.yarn_beta_fast) + " " +
+               std::to_string(params.yarn_beta_slow)  + " " + std::to_string(params.yarn_orig_ctx) + "\n";
+
+        for (const auto & cv : params.control_vectors) {
+            res += cv.fname + " " + std::to_string(cv.strength) + "\n";
+        }
+        res += std::to_string(params.control_vector_layer_start) + " " + std::to_string(params.control_vector_layer_end) + "\n";
+
+        for (const auto & la : loras) {
+            res += la.path + " " + std::to_string(la.scale) + "\n";
+        }
+
+        return res;
+    }
+
+    bool kv_store_init() {
+        llama_kv_store_params sparams;
+        sparams.path        = params.slot_save_path;
+        sparams.size_max    = (size_t) params.slot_cache_size*1024*1024;
+        sparams.fingerprint = kv_store_fingerprint();
+
+        if (!llama_kv_store_init(kv_store, sparams)) {
+            SRV_WRN("%s", "failed to initialize the prompt cache store, disabling it\n");
+            return false;
+        }
+
+        SRV_INF("prompt cache store: %d MiB in %s, %zu entries\n", params.slot_cache_size, params.slot_save_path.c_str(), kv_store.entries.size());
+
+        return true;
+    }
+
+    // load the stored sequence that shares the longest prefix with the new prompt, if longer than the cached one
+    void kv_store_load(server_slot & slot, const std::vector<llama_token> & prompt_tokens) {
+        // the stored sequences start with the system prompt
+        std::vector<llama_token> tokens = system_tokens;
+        tokens.insert(tokens.end(), prompt_tokens.begin(), prompt_tokens.end());
+
+        size_t n_match = 0;
+        const llama_kv_store_entry * entry = llama_kv_store_find(kv_store, tokens, n_match);
+        if (entry == nullptr || n_match <= system_tokens.size() + slot.n_past) {
+            return;
+        }
+
+        const int64_t t_start = ggml_time_us();
+
+        if (!llama_kv_store_load(kv_store, ctx, entry->fname, slot.id + 1, tokens)) {
+            // the content of the sequence is undefined
+            llama_kv_cache_seq_rm(ctx, slot.id + 1, -1, -1);
+            if (!system_tokens.empty()) {
+                llama_kv_cache_seq_cp(ctx, 0, slot.id + 1, -1, -1);
+            }
+            slot.cache_tokens.clear();
+            slot.n_past = 0;
+            return;
+        }
+
+        slot.cache_tokens.assign(tokens.begin() + system_tokens.size(), tokens.end());
+        slot.n_past = common_part(slot.cache_tokens, prompt_tokens);
+
+        SLT_INF(slot, "loaded %zu cached tokens from the prompt cache store in %.2f ms, %d in common with the prompt\n",
+                slot.cache_tokens.size(), (ggml_time_us() - t_start) / 1e3, slot.n_past);
+    }
+
+    void kv_store_save(const server_slot & slot) {
+        // the stored tokens must match the KV cache of the slot from position 0
+        if (!kv_store_enabled || !slot.params.cache_prompt || slot.truncated || slot.ga_n != 1 || !slot.images.empty() ||
+            slot.cmpl_type == SERVER_TASK_CMPL_TYPE_EMBEDDING) {
+            return;
+        }
+
+        std::vector<llama_token> tokens = system_tokens;
+        tokens.insert(tokens.end(), slot.cache_tokens.begin(), slot.cache_tokens.end());
+
+        if (llama_kv_store_save(kv_store, ctx, slot.id + 1, tokens)) {
+            SLT_DBG(slot, "saved %zu tokens to the prompt cache store\n", tokens.size());
+        }
+    }
+
     void kv_cache_clear() {
         SRV_DBG("%s", "clearing KV cache\n");
 
         // clear the entire KV cache
         llama_kv_cache_clear(ctx);
         clean_kv_cache = false;
+
+        llama_radix_cache_clear(radix_cache, nullptr);
     }
 
     void system_prompt_update() {
@@ -1061,6 +2321,9 @@ struct server_context {
         kv_cache_clear();
         system_tokens.clear();
 
+        // the stored sequences start with the previous system prompt
+        llama_kv_tier_clear(kv_tier);
+
         if (!system_prompt.empty()) {
             system_tokens = ::llama_tokenize(ctx, system_prompt, true);
 
@@ -1088,6 +2351,9 @@ struct server_context {
             }
         }
 
+        // the prefixes of the radix cache start after the system prompt
+        radix_cache.params.pos_base = system_tokens.size();
+
         system_need_update = false;
     }
 
@@ -1181,7 +2447,8 @@ struct server_context {
         }
 
         // if context shift is disabled, we stop when it reaches the context limit
-        if (slot.n_decoded >= slot.n_ctx) {
+        // (with --kv-sink or --kv-hh-budget the KV cache evicts the tokens by itself)
+        if (params.kv_sink == 0 && params.kv_hh_budget == 0 && slot.n_decoded >= slot.n_ctx) {
             slot.truncated      = true;
             slot.stopped_limit  = true;
             slot.has_next_token = false;
@@ -1189,6 +2456,15 @@ struct server_context {
             SLT_DBG(slot, "stopped due to running out of context capacity, n_decoded = %d, n_ctx = %d\n", slot.n_decoded, slot.n_ctx);
         }
 
+        // the KV cache of the visual token dropping cannot be shifted
+        if (slot.img_token_step > 0 && (int) system_tokens.size() + slot.n_past >= slot.n_ctx - 1) {
+            slot.truncated      = true;
+            slot.stopped_limit  = true;
+            slot.has_next_token = false;
+
+            SLT_DBG(slot, "stopped due to running out of context capacity with the visual token dropping, n_past = %d, n_ctx = %d\n", slot.n_past, slot.n_ctx);
+        }
+
         if (llama_token_is_eog(model, result.tok)) {
             slot.stopped_eos    = true;
             slot.has_next_token = false;
@@ -1247,6 +2523,7 @@ struct server_context {
             {"max_tokens",                slot.params.n_predict}, // User configured n_predict
             {"n_keep",                    slot.params.n_keep},
             {"n_discard",                 slot.params.n_discard},
+            {"n_draft",                   slot.params.n_draft},
             {"ignore_eos",                slot.sparams.ignore_eos},
             {"stream",                    slot.params.stream},
           //{"logit_bias",                slot.sparams.logit_bias},
@@ -1268,58 +2545,77 @@ struct server_context {
     void send_error(const int id_task, const std::string & error, const enum error_type type = ERROR_TYPE_SERVER) {
         SRV_ERR("task id = %d, error: %s\n", id_task, error.c_str());
 
-        server_task_result res;
-        res.id       = id_task;
-        res.stop     = false;
-        res.error    = true;
-        res.data     = format_error_response(error, type);
+        // after the results of the task already posted to the result worker
+        result_worker.post([this, id_task, error, type]() {
+            server_task_result res;
+            res.id       = id_task;
+            res.stop     = false;
+            res.error    = true;
+            res.data     = format_error_response(error, type);
 
-        queue_results.send(res);
+            queue_results.send(res);
+        });
     }
 
+    // the results of the slots are formatted by the result worker, in parallel with the next decode, from a copy of
+    // the state of the slot they need
     void send_partial_response(server_slot & slot, completion_token_output tkn) {
-        server_task_result res;
-        res.id       = slot.id_task;
-        res.error    = false;
-        res.stop     = false;
-        res.data     = json {
-            {"content",    tkn.text_to_send},
-            {"stop",       false},
-            {"id_slot",    slot.id},
-            {"multimodal", false},
-            {"index",      slot.index},
-        };
+        std::shared_ptr<std::vector<completion_token_output>> probs;
 
         if (slot.sparams.n_probs > 0) {
             const std::vector<llama_token> to_send_toks = llama_tokenize(ctx, tkn.text_to_send, false);
             const size_t probs_pos      = std::min(slot.n_sent_token_probs,                       slot.generated_token_probs.size());
             const size_t probs_stop_pos = std::min(slot.n_sent_token_probs + to_send_toks.size(), slot.generated_token_probs.size());
 
-            std::vector<completion_token_output> probs_output;
+            probs = std::make_shared<std::vector<completion_token_output>>();
             if (probs_pos < probs_stop_pos) {
-                probs_output = std::vector<completion_token_output>(
+                probs->assign(
                         slot.generated_token_probs.begin() + probs_pos,
                         slot.generated_token_probs.begin() + probs_stop_pos);
             }
             slot.n_sent_token_probs = probs_stop_pos;
-
-            res.data["completion_probabilities"] = probs_vector_to_json(ctx, probs_output);
         }
 
-        if (slot.oaicompat) {
-            res.data["oaicompat_token_ctr"] = slot.n_decoded;
-            res.data["model"] = slot.oaicompat_model;
-        }
+        const int         id_task   = slot.id_task;
+        const int         id_slot   = slot.id;
+        const size_t      index     = slot.index;
+        const bool        oaicompat = slot.oaicompat;
+        const int32_t     n_decoded = slot.n_decoded;
+        const std::string model     = slot.oaicompat ? slot.oaicompat_model : std::string();
+        const std::string content   = tkn.text_to_send;
+
+        result_worker.post([this, id_task, id_slot, index, oaicompat, n_decoded, model, content, probs]() {
+            server_task_result res;
+            res.id       = id_task;
+            res.error    = false;
+            res.stop     = false;
+            res.data     = json {
+                {"content",    content},
+                {"stop",       false},
+                {"id_slot",    id_slot},
+                {"multimodal", ctx_clip != nullptr},
+                {"index",      index},
+            };
+
+            if (probs) {
+                res.data["completion_probabilities"] = probs_vector_to_json(ctx, *probs);
+            }
 
-        queue_results.send(res);
+            if (oaicompat) {
+                res.data["oaicompat_token_ctr"] = n_decoded;
+                res.data["model"] = model;
+            }
+
+            queue_results.send(res);
+        });
     }
 
     void send_final_response(const server_slot & slot) {
-        server_task_result res;
-        res.id       = slot.id_task;
-        res.error    = false;
-        res.stop     = true;
-        res.data     = json {
+        auto res = std::make_shared<server_task_result>();
+        res->id       = slot.id_task;
+        res->error    = false;
+        res->stop     = true;
+        res->data     = json {
             {"content",             !slot.params.stream ? slot.generated_text : ""},
             {"id_slot",             slot.id},
             {"stop",                true},
@@ -1338,30 +2634,40 @@ struct server_context {
             {"index",               slot.index},
         };
 
+        // the probabilities of all the tokens are the bulk of the formatting
+        std::shared_ptr<std::vector<completion_token_output>> probs;
+        std::string stopping_word;
+
         if (slot.sparams.n_probs > 0) {
-            std::vector<completion_token_output> probs;
+            probs = std::make_shared<std::vector<completion_token_output>>(slot.generated_token_probs);
             if (!slot.params.stream && slot.stopped_word) {
-                const std::vector<llama_token> stop_word_toks = llama_tokenize(ctx, slot.stopping_word, false);
-
-                size_t safe_offset = std::min(slot.generated_token_probs.size(), stop_word_toks.size());
-                probs = std::vector<completion_token_output>(
-                        slot.generated_token_probs.begin(),
-                        slot.generated_token_probs.end() - safe_offset);
-            } else {
-                probs = std::vector<completion_token_output>(
-                        slot.generated_token_probs.begin(),
-                        slot.generated_token_probs.end());
+                stopping_word = slot.stopping_word;
             }
-
-            res.data["completion_probabilities"] = probs_vector_to_json(ctx, probs);
         }
 
-        if (slot.oaicompat) {
-            res.data["oaicompat_token_ctr"] = slot.n_decoded;
-            res.data["model"] = slot.oaicompat_model;
-        }
+        const bool        oaicompat = slot.oaicompat;
+        const int32_t     n_decoded = slot.n_decoded;
+        const std::string model     = slot.oaicompat ? slot.oaicompat_model : std::string();
+
+        result_worker.post([this, res, probs, stopping_word, oaicompat, n_decoded, model]() {
+            if (probs) {
+                if (!stopping_word.empty()) {
+                    const std::vector<llama_token> stop_word_toks = llama_tokenize(ctx, stopping_word, false);
+
+                    const size_t safe_offset = std::min(probs->size(), stop_word_toks.size());
+                    probs->resize(probs->size() - safe_offset);
+                }
+
+                res->data["completion_probabilities"] = probs_vector_to_json(ctx, *probs);
+            }
 
-        queue_results.send(res);
+            if (oaicompat) {
+                res->data["oaicompat_token_ctr"] = n_decoded;
+                res->data["model"] = model;
+            }
+
+            queue_results.send(*res);
+        });
     }
 
     void send_embedding(const server_slot & slot, const llama_batch & batch) {
@@ -1384,40 +2690,149 @@ struct server_context {
                 embd = llama_get_embeddings_ith(ctx, i);
             }
 
-            if (embd == NULL) {
-                SLT_ERR(slot, "failed to get embeddings, token = %d, seq_id = %d\n", batch.token[i], batch.seq_id[i][0]);
+            if (embd == NULL) {
+                SLT_ERR(slot, "failed to get embeddings, token = %d, seq_id = %d\n", batch.token[i], batch.seq_id[i][0]);
+
+                res.data = json {
+                    {"embedding", std::vector<float>(n_embd, 0.0f)},
+                };
+
+                continue;
+            }
+
+            llama_embd_normalize(embd, embd_res.data(), n_embd);
+
+            res.data = json {
+                {"embedding", embd_res},
+                {"index",     slot.index},
+            };
+        }
+
+        SLT_DBG(slot, "%s", "sending embeddings\n");
+
+        // through the result worker, like the errors of the slot
+        result_worker.post([this, res]() mutable {
+            queue_results.send(res);
+        });
+    }
+
+    void embd_queue_push(const server_task & task) {
+        // the cancel of a task still in the task queue is processed before it
+        if (!queue_results.is_waiting(task.id)) {
+            return;
+        }
+
+        server_embd_input input;
+        input.id_task = task.id;
+        input.index   = json_value(task.data, "index", 0);
+        input.tokens  = tokenize(task.data.at("prompt"), true);
+
+        if (input.tokens.empty()) {
+            send_error(task, "the input is empty", ERROR_TYPE_INVALID_REQUEST);
+            return;
+        }
+
+        // the whole input must fit in a single ubatch (non-causal attention)
+        if ((int) input.tokens.size() > (int) std::min(llama_n_batch(ctx), llama_n_ubatch(ctx))) {
+            send_error(task, "input is too large to process. increase the physical batch size", ERROR_TYPE_SERVER);
+            return;
+        }
+
+        embd_queue.push_back(std::move(input));
+    }
+
+    // decode a batch of the queued embedding inputs and send their results
+    void update_embeddings() {
+        const int32_t n_batch = std::min(llama_n_batch(ctx), llama_n_ubatch(ctx));
+
+        std::vector<server_embd_input> inputs;
+
+        llama_batch_clear(batch);
+
+        while (!embd_queue.empty() && batch.n_tokens + (int32_t) embd_queue.front().tokens.size() <= n_batch) {
+            const llama_seq_id seq_id = inputs.size();
+
+            const auto & tokens = embd_queue.front().tokens;
+            for (size_t i = 0; i < tokens.size(); ++i) {
+                llama_batch_add(batch, tokens[i], i, { seq_id }, i == tokens.size() - 1);
+            }
+
+            inputs.push_back(std::move(embd_queue.front()));
+            embd_queue.pop_front();
+        }
+
+        SRV_DBG("decoding %d embedding inputs, n_tokens = %d, queued = %d\n", (int) inputs.size(), batch.n_tokens, (int) embd_queue.size());
+
+        const int64_t t_start = ggml_time_us();
 
-                res.data = json {
-                    {"embedding", std::vector<float>(n_embd, 0.0f)},
-                };
+        const int ret = llama_decode(ctx, batch);
+
+        metrics.n_decode_total++;
+        metrics.n_embd_batches_total++;
+        metrics.n_embd_inputs_total += inputs.size();
+
+        const int n_embd = llama_n_embd(model);
 
+        std::vector<float> embd_res(n_embd, 0.0f);
+
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            const float * embd = ret == 0 ? llama_get_embeddings_seq(ctx, i) : nullptr;
+            if (embd == nullptr) {
+                send_error(inputs[i].id_task, "failed to compute the embeddings, ret = " + std::to_string(ret));
                 continue;
             }
 
             llama_embd_normalize(embd, embd_res.data(), n_embd);
 
-            res.data = json {
-                {"embedding", embd_res},
-                {"index",     slot.index},
-            };
+            // formatted and sent by the result worker, in order with the errors of the inputs
+            const int id_task = inputs[i].id_task;
+            const int index   = inputs[i].index;
+
+            result_worker.post([this, id_task, index, embd_res]() {
+                server_task_result res;
+                res.id    = id_task;
+                res.error = false;
+                res.stop  = true;
+                res.data  = json {
+                    {"embedding", embd_res},
+                    {"index",     index},
+                };
+
+                queue_results.send(res);
+            });
         }
 
-        SLT_DBG(slot, "%s", "sending embeddings\n");
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            llama_kv_cache_seq_rm(ctx, i, -1, -1);
+        }
+
+        const int64_t t_prompt_processing = ggml_time_us() - t_start;
 
-        queue_results.send(res);
+        metrics.n_prompt_tokens_processed_total += batch.n_tokens;
+        metrics.n_prompt_tokens_processed       += batch.n_tokens;
+        metrics.t_prompt_processing_total       += t_prompt_processing / 1000;
+        metrics.t_prompt_processing             += t_prompt_processing / 1000;
     }
 
     //
     // Functions to create new task(s) and receive result(s)
     //
 
-    std::vector<server_task> create_tasks_cmpl(json data, server_task_cmpl_type cmpl_type) {
+    std::vector<server_task> create_tasks_cmpl(json data, server_task_cmpl_type cmpl_type, std::shared_ptr<const std::vector<server_image>> images = nullptr) {
+        // the number of classes is bounded, each one has a virtual time in server_queue
+        const int     priority    = std::min(std::max(json_value(data, "priority", 0), 0), 15);
+        const int64_t deadline_ms = json_value(data, "deadline_ms", (int64_t) -1);
+        const int64_t t_deadline  = deadline_ms >= 0 ? ggml_time_us() + deadline_ms*1000 : -1;
+
         std::vector<server_task> tasks;
         auto create_task = [&](json & task_data, bool replace_prompt, json prompt) {
             server_task task;
-            task.id        = queue_tasks.get_new_id();
-            task.cmpl_type = cmpl_type;
-            task.type      = SERVER_TASK_TYPE_COMPLETION;
+            task.id         = queue_tasks.get_new_id();
+            task.cmpl_type  = cmpl_type;
+            task.type       = SERVER_TASK_TYPE_COMPLETION;
+            task.priority   = priority;
+            task.t_deadline = t_deadline;
+            task.images     = images;
             if (replace_prompt) {
                 task.data  = task_data;
                 task.data["prompt"] = std::move(prompt);
@@ -1533,6 +2948,34 @@ struct server_context {
         switch (task.type) {
             case SERVER_TASK_TYPE_COMPLETION:
                 {
+                    if (task.resume) {
+                        auto it = preempted.find(task.id);
+                        if (it == preempted.end()) {
+                            break; // cancelled while preempted
+                        }
+
+                        server_slot * slot = get_available_slot(std::string());
+                        if (slot == nullptr) {
+                            queue_tasks.defer(task);
+                            break;
+                        }
+
+                        resume_slot(*slot, it->second);
+                        preempted.erase(it);
+                        break;
+                    }
+
+                    if (task.t_deadline >= 0 && ggml_time_us() > task.t_deadline) {
+                        metrics.n_expired_total++;
+                        send_error(task, "the request could not start before its deadline", ERROR_TYPE_UNAVAILABLE);
+                        break;
+                    }
+
+                    if (embd_batched && task.cmpl_type == SERVER_TASK_CMPL_TYPE_EMBEDDING) {
+                        embd_queue_push(task);
+                        break;
+                    }
+
                     const int id_slot = json_value(task.data, "id_slot", -1);
 
                     server_slot * slot;
@@ -1546,12 +2989,25 @@ struct server_context {
                         }
 
                         slot = get_available_slot(prompt);
+
+                        // take the slot of a task of lower priority, which resumes when a slot is free
+                        if (slot == nullptr && params.preemption) {
+                            server_slot * victim = get_preemptible_slot(task.priority);
+                            if (victim != nullptr && preempt_slot(*victim)) {
+                                slot = victim;
+                            }
+                        }
                     }
 
                     if (slot == nullptr) {
                         // if no slot is available, we defer this task for processing later
                         SRV_DBG("no slot is available, defer task, id_task = %d\n", task.id);
                         queue_tasks.defer(task);
+
+                        // start loading the KV cache of the conversation while the task waits for a slot
+                        if (kv_tier_enabled && task.data.contains("prompt") && task.data.at("prompt").is_string()) {
+                            kv_tier_prefetch(json_value(task.data, "prompt", std::string()));
+                        }
                         break;
                     }
                     if (slot->is_processing()) {
@@ -1575,6 +3031,7 @@ struct server_context {
 
                     slot->id_task   = task.id;
                     slot->cmpl_type = task.cmpl_type;
+                    slot->priority  = task.priority;
                     slot->index     = json_value(task.data, "index", 0);
 
                     if (!launch_slot_with_task(*slot, task)) {
@@ -1591,6 +3048,23 @@ struct server_context {
                             break;
                         }
                     }
+
+                    // or drop its saved state, if it was preempted
+                    auto it = preempted.find(task.id_target);
+                    if (it != preempted.end()) {
+                        if (it->second.slot.smpl != nullptr) {
+                            gpt_sampler_free(it->second.slot.smpl);
+                        }
+                        preempted.erase(it);
+                    }
+
+                    // or drop its embedding input
+                    for (auto it = embd_queue.begin(); it != embd_queue.end(); ++it) {
+                        if (it->id_task == task.id_target) {
+                            embd_queue.erase(it);
+                            break;
+                        }
+                    }
                 } break;
             case SERVER_TASK_TYPE_NEXT_RESPONSE:
                 {
@@ -1618,6 +3092,10 @@ struct server_context {
                             {"stopped_limit",  slot.stopped_limit},
                             {"stopping_word",  slot.stopping_word},
                         };
+                        slot_data["speculative"] = {
+                            {"n_drafted_total",        slot.n_drafted_total},
+                            {"n_draft_accepted_total", slot.n_draft_accepted_total},
+                        };
 
                         if (slot_data["state"] == SLOT_STATE_IDLE) {
                             n_idle_slots++;
@@ -1629,6 +3107,8 @@ struct server_context {
                     }
                     SRV_DBG("n_idle_slots = %d, n_processing_slots = %d\n", n_idle_slots, n_processing_slots);
 
+                    const auto perf = llama_perf_context(ctx);
+
                     server_task_result res;
                     res.id       = task.id;
                     res.stop     = true;
@@ -1637,6 +3117,8 @@ struct server_context {
                         { "idle",                            n_idle_slots       },
                         { "processing",                      n_processing_slots },
                         { "deferred",                        queue_tasks.queue_tasks_deferred.size() },
+                        { "preempted",                       preempted.size() },
+                        { "embd_queued",                     embd_queue.size() },
                         { "t_start",                         metrics.t_start},
 
                         { "n_prompt_tokens_processed_total", metrics.n_prompt_tokens_processed_total},
@@ -1651,10 +3133,41 @@ struct server_context {
 
                         { "n_decode_total",                  metrics.n_decode_total},
                         { "n_busy_slots_total",              metrics.n_busy_slots_total},
+                        { "n_preempted_total",               metrics.n_preempted_total},
+                        { "n_expired_total",                 metrics.n_expired_total},
+                        { "n_drafted_total",                 metrics.n_drafted_total},
+                        { "n_draft_accepted_total",          metrics.n_draft_accepted_total},
+                        { "n_embd_inputs_total",             metrics.n_embd_inputs_total},
+                        { "n_embd_batches_total",            metrics.n_embd_batches_total},
+                        { "n_decode_gaps",                   metrics.n_decode_gaps},
+                        { "t_decode_gaps_total",             metrics.t_decode_gaps_total},
+
+                        { "tbt_p50_ms",                      percentile(metrics.t_between_tokens, 50)},
+                        { "tbt_p90_ms",                      percentile(metrics.t_between_tokens, 90)},
+                        { "tbt_p99_ms",                      percentile(metrics.t_between_tokens, 99)},
+                        { "tbt_max_ms",                      percentile(metrics.t_between_tokens, 100)},
 
                         { "kv_cache_tokens_count",           llama_get_kv_cache_token_count(ctx)},
                         { "kv_cache_used_cells",             llama_get_kv_cache_used_cells(ctx)},
 
+                        { "kv_tier_entries",                 kv_tier.entries.size()},
+                        { "kv_tier_host_bytes",              kv_tier.host_size},
+                        { "kv_tier_stored_total",            kv_tier.n_stored},
+                        { "kv_tier_restored_total",          kv_tier.n_restored},
+
+                        { "radix_cache_tokens",              radix_cache.n_tokens},
+                        { "radix_cache_hits_total",          radix_cache.n_hits},
+                        { "radix_cache_hit_tokens_total",    radix_cache.n_tokens_hit},
+
+                        { "kv_store_entries",                kv_store.entries.size()},
+                        { "kv_store_bytes",                  kv_store.size},
+                        { "kv_store_loaded_total",           kv_store.n_loaded},
+                        { "kv_store_saved_total",            kv_store.n_saved},
+
+                        { "kv_defrag_total",                 perf.n_defrag},
+                        { "kv_defrag_cells_total",           perf.n_defrag_cells},
+                        { "kv_defrag_ms_total",              perf.t_defrag_ms},
+
                         { "slots",                           slots_data },
                     };
 
@@ -1785,6 +3298,11 @@ struct server_context {
             case SERVER_TASK_TYPE_SET_LORA:
                 {
                     llama_lora_adapters_apply(ctx, loras);
+
+                    // the stored KV caches were computed with the previous adapters
+                    if (kv_store_enabled) {
+                        kv_store_enabled = kv_store_init();
+                    }
                     server_task_result result;
                     result.id = task.id;
                     result.stop = true;
@@ -1800,6 +3318,14 @@ struct server_context {
             system_prompt_update();
         }
 
+        // fail the waiting tasks past their deadline, even if no slot is released
+        queue_tasks.expire_deferred_tasks();
+
+        // the embedding inputs have batches of their own, one per iteration so that the new requests join the queue
+        if (!embd_queue.empty()) {
+            update_embeddings();
+        }
+
         // check if all slots are idle
         {
             bool all_idle = true;
@@ -1811,8 +3337,18 @@ struct server_context {
                 }
             }
 
+            if (all_idle && !embd_queue.empty()) {
+                server_task task;
+                task.type      = SERVER_TASK_TYPE_NEXT_RESPONSE;
+                task.id_target = -1;
+
+                queue_tasks.post(task);
+                return;
+            }
+
             if (all_idle) {
                 SRV_INF("%s", "all slots are idle\n");
+                t_last_decode = -1;
                 if (system_prompt.empty() && clean_kv_cache) {
                     kv_cache_clear();
                 }
@@ -1834,7 +3370,7 @@ struct server_context {
         // apply context-shift if needed
         // TODO: simplify and improve
         for (server_slot & slot : slots) {
-            if (slot.ga_n == 1) {
+            if (slot.ga_n == 1 && params.kv_sink == 0 && params.kv_hh_budget == 0) {
                 if (slot.is_processing() && (int) system_tokens.size() + slot.n_past >= slot.n_ctx - 1) {
                     if (!params.ctx_shift) {
                         // this check is redundant (for good)
@@ -1844,6 +3380,12 @@ struct server_context {
                         continue;
                     }
 
+                    // without the paged layout, shifting the cells that the slot shares with the radix cache would move
+                    // them in the tree as well
+                    if (radix_cache_enabled && params.kv_block_size == 0) {
+                        llama_radix_cache_clear(radix_cache, ctx);
+                    }
+
                     // Shift context
                     const int n_keep    = slot.params.n_keep + add_bos_token;
                     const int n_left    = (int) system_tokens.size() + slot.n_past - n_keep;
@@ -1862,6 +3404,15 @@ struct server_context {
                         slot.cache_tokens.resize(slot.cache_tokens.size() - n_discard);
                     }
 
+                    // the drafts continue from the tokens left in the context
+                    if ((int) slot.spec_inp.size() > n_keep + n_discard) {
+                        slot.spec_inp.erase(slot.spec_inp.begin() + n_keep, slot.spec_inp.begin() + n_keep + n_discard);
+                    }
+                    if (ctx_dft != nullptr) {
+                        llama_kv_cache_seq_rm(ctx_dft, slot.id + 1, -1, -1);
+                        slot.dft_tokens.clear();
+                    }
+
                     slot.n_past -= n_discard;
 
                     slot.truncated = true;
@@ -1872,6 +3423,14 @@ struct server_context {
         // start populating the batch for this iteration
         llama_batch_clear(batch);
 
+        if (spec_enabled) {
+            int32_t n_generating = 0;
+            for (const auto & slot : slots) {
+                n_generating += slot.state == SLOT_STATE_GENERATING;
+            }
+            spec_draft_slots((int32_t) llama_n_batch(ctx) - n_generating);
+        }
+
         // frist, add sampled tokens from any ongoing sequences
         for (auto & slot : slots) {
             if (slot.state != SLOT_STATE_GENERATING) {
@@ -1886,6 +3445,11 @@ struct server_context {
             //       this is not great and needs to be improved somehow
             llama_batch_add(batch, slot.sampled, system_tokens.size() + slot_npast, { slot.id + 1 }, true);
 
+            // the drafts follow, the model verifies them with the logits of this batch
+            for (size_t j = 0; j < slot.spec_draft.size(); ++j) {
+                llama_batch_add(batch, slot.spec_draft[j], system_tokens.size() + slot_npast + 1 + j, { slot.id + 1 }, true);
+            }
+
             slot.n_past += 1;
 
             if (slot.params.cache_prompt) {
@@ -1905,6 +3469,16 @@ struct server_context {
         // -1: none, 0: non-embedding, 1: embedding
         int32_t batch_type = batch.n_tokens > 0 ? 0 : -1;
 
+        // the prompt tokens added to a batch that decodes the tokens of generating slots are capped, so that a long
+        // prompt is processed in chunks between their tokens instead of stalling them until it is done
+        int32_t n_batch_prompt = n_batch;
+        if (params.n_prefill_budget > 0 && batch.n_tokens > 0) {
+            n_batch_prompt = std::min(n_batch, batch.n_tokens + params.n_prefill_budget);
+        }
+
+        // the image tokens decoded by the slots in this iteration, within the same limit as the prompt tokens
+        int32_t n_prompt_embd = 0;
+
         // next, batch any pending prompts without exceeding n_batch
         if (params.cont_batching || batch.n_tokens == 0) {
             for (auto & slot : slots) {
@@ -1951,6 +3525,8 @@ struct server_context {
                             }
 
                             prompt_tokens = embd_inp;
+                        } else if (!slot.images.empty()) {
+                            prompt_tokens = tokenize_images(slot, system_prompt.empty());
                         } else {
                             prompt_tokens = tokenize(slot.prompt, system_prompt.empty()); // add BOS if there isn't system prompt
                         }
@@ -1970,6 +3546,28 @@ struct server_context {
                             continue;
                         }
 
+                        if (!slot.images.empty()) {
+                            // the logits of the prompt come from its last token
+                            if (prompt_tokens.back() == LLAMA_TOKEN_NULL) {
+                                slot.release();
+                                send_error(slot, "the prompt cannot end with an image", ERROR_TYPE_INVALID_REQUEST);
+                                continue;
+                            }
+
+                            // the images are never truncated
+                            if ((int) system_tokens.size() + slot.n_prompt_tokens >= slot.n_ctx) {
+                                slot.release();
+                                send_error(slot, "the request with images exceeds the available context size. try increasing the context size", ERROR_TYPE_INVALID_REQUEST);
+                                continue;
+                            }
+
+                            if (slot.img_token_step > 0 && slot.n_prompt_tokens - 1 > std::min(n_batch, n_ubatch)) {
+                                slot.release();
+                                send_error(slot, "the visual token dropping decodes the prompt in a single batch. increase the batch size", ERROR_TYPE_INVALID_REQUEST);
+                                continue;
+                            }
+                        }
+
                         if (slot.cmpl_type == SERVER_TASK_CMPL_TYPE_EMBEDDING) {
                             // this prompt is too large to process - discard it
                             if (slot.n_prompt_tokens > n_ubatch) {
@@ -1978,7 +3576,7 @@ struct server_context {
                                 continue;
                             }
                         } else {
-                            if (!params.ctx_shift) {
+                            if (!params.ctx_shift && params.kv_sink == 0 && params.kv_hh_budget == 0) {
                                 // if context shift is disabled, we make sure prompt size is smaller than KV size
                                 if ((int) system_tokens.size() + slot.n_prompt_tokens >= slot.n_ctx) {
                                     slot.release();
@@ -1991,8 +3589,8 @@ struct server_context {
                             }
                             slot.params.n_keep = std::min(slot.n_ctx - 4, slot.params.n_keep);
 
-                            // if input prompt is too big, truncate it (if group attention self-extend is disabled)
-                            if (slot.ga_n == 1 && slot.n_prompt_tokens >= slot.n_ctx) {
+                            // if input prompt is too big, truncate it (if group attention self-extend and the KV cache eviction are disabled)
+                            if (slot.ga_n == 1 && params.kv_sink == 0 && params.kv_hh_budget == 0 && slot.n_prompt_tokens >= slot.n_ctx) {
                                 const int n_left = slot.n_ctx - slot.params.n_keep;
 
                                 const int n_block_size = n_left / 2;
@@ -2019,15 +3617,28 @@ struct server_context {
 
                             gpt_sampler_reset(slot.smpl);
 
-                            if (!slot.params.cache_prompt) {
+                            // the visual token dropping needs the whole prompt in one batch
+                            if (!slot.params.cache_prompt || slot.img_token_step > 0) {
                                 slot.n_past_se = 0;
                                 slot.ga_i      = 0;
                             } else {
                                 GGML_ASSERT(slot.ga_n == 1);
 
+                                if (kv_tier_enabled) {
+                                    kv_tier_swap(slot, prompt_tokens);
+                                }
+
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = common_part(slot.cache_tokens, prompt_tokens);
 
+                                if (radix_cache_enabled) {
+                                    radix_cache_attach(slot, prompt_tokens);
+                                }
+
+                                if (kv_store_enabled) {
+                                    kv_store_load(slot, prompt_tokens);
+                                }
+
                                 // push the prompt into the sampling context (do not apply grammar)
                                 for (int i = 0; i < slot.n_past; ++i) {
                                     gpt_sampler_accept(slot.smpl, slot.cache_tokens[i], false);
@@ -2088,6 +3699,28 @@ struct server_context {
 
                     SLT_INF(slot, "kv cache rm [%d, end)\n", p0);
 
+                    if (slot.img_token_step > 0) {
+                        if (!ingest_images_drop(slot)) {
+                            slot.release();
+                            send_error(slot, "failed to decode the images of the prompt", ERROR_TYPE_SERVER);
+                            continue;
+                        }
+                    } else if (slot.n_past < slot.n_prompt_tokens && prompt_tokens[slot.n_past] == LLAMA_TOKEN_NULL) {
+                        const int32_t n_max = n_batch_prompt - batch.n_tokens - n_prompt_embd;
+                        if (n_max <= 0) {
+                            continue;
+                        }
+
+                        const int32_t n_past_prev = slot.n_past;
+                        if (!ingest_image_chunk(slot, n_max)) {
+                            slot.release();
+                            send_error(slot, "failed to decode the images of the prompt", ERROR_TYPE_SERVER);
+                            continue;
+                        }
+
+                        n_prompt_embd += slot.n_past - n_past_prev;
+                    }
+
                     int32_t slot_npast = slot.n_past_se > 0 ? slot.n_past_se : slot.n_past;
 
                     int32_t ga_i = slot.ga_i;
@@ -2096,7 +3729,12 @@ struct server_context {
 
                     // add prompt tokens for processing in the current batch
                     // TODO: the self-extend stuff here is a mess - simplify and/or abstract it somehow
-                    for (; slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch; ++slot.n_past) {
+                    for (; slot.n_past < slot.n_prompt_tokens && batch.n_tokens + n_prompt_embd < n_batch_prompt; ++slot.n_past) {
+                        // the next image is decoded in the next iteration, after the tokens before it
+                        if (prompt_tokens[slot.n_past] == LLAMA_TOKEN_NULL) {
+                            break;
+                        }
+
                         if (slot.ga_n != 1) {
                             while (slot_npast >= ga_i + ga_w) {
                                 const int bd = (ga_w/ga_n)*(ga_n - 1);
@@ -2133,14 +3771,17 @@ struct server_context {
                     }
                 }
 
-                if (batch.n_tokens >= n_batch) {
+                if (batch.n_tokens + n_prompt_embd >= n_batch_prompt) {
                     break;
                 }
             }
         }
 
         if (batch.n_tokens == 0) {
-            SRV_WRN("%s", "no tokens to decode\n");
+            // the slots only decoded images in this iteration
+            if (n_prompt_embd == 0) {
+                SRV_WRN("%s", "no tokens to decode\n");
+            }
             return;
         }
 
@@ -2192,9 +3833,25 @@ struct server_context {
                 0, 0, 0, // unused
             };
 
+            // the visual token dropping applies to all the decodes of the sequence
+            for (const auto & slot : slots) {
+                if (slot.is_processing() && slot.img_token_step > 0) {
+                    batch_view.img_token_step = slot.img_token_step;
+                }
+            }
+
+            // the results of the previous decode are formatted during this one
+            result_worker.flush();
+
+            if (t_last_decode >= 0) {
+                metrics.on_decode_gap((ggml_time_us() - t_last_decode) / 1e3);
+            }
+
             const int ret = llama_decode(ctx, batch_view);
             metrics.on_decoded(slots);
 
+            t_last_decode = ggml_time_us();
+
             if (ret != 0) {
                 if (n_batch == 1 || ret < 0) {
                     // if you get here, it means the KV cache is full - try increasing it via the context size
@@ -2206,6 +3863,14 @@ struct server_context {
                     break; // break loop of n_batch
                 }
 
+                // make room by evicting cached prefixes before reducing the batch size
+                if (radix_cache_enabled && llama_radix_cache_evict(radix_cache, ctx, n_tokens) > 0) {
+                    SRV_WRN("evicted prefixes from the radix cache to find free space in the KV cache, n_tokens = %zu\n", radix_cache.n_tokens);
+
+                    i -= n_batch;
+                    continue;
+                }
+
                 // retry with half the batch size to try to find a free slot in the KV cache
                 n_batch /= 2;
                 i -= n_batch;
@@ -2231,34 +3896,119 @@ struct server_context {
 
                     // prompt evaluated for next-token prediction
                     slot.state = SLOT_STATE_GENERATING;
+
+                    radix_cache_insert(slot);
+
+                    // the images have no token to draft from
+                    if (slot.params.n_draft > 0 && slot.ga_n == 1 && slot.images.empty()) {
+                        slot.spec_inp = slot.prompt_tokens;
+                        if (ctx_dft == nullptr) {
+                            llama_ngram_cache_update(slot.ngram_cache, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.spec_inp, slot.spec_inp.size(), false);
+                        }
+                    }
                 } else if (slot.state != SLOT_STATE_GENERATING) {
                     continue; // continue loop of slots
                 }
 
-                completion_token_output result;
-                const llama_token id = gpt_sampler_sample(slot.smpl, ctx, slot.i_batch - i);
+                // the drafts in this part of the batch, the others are dropped
+                const int32_t n_draft = std::min((int32_t) slot.spec_draft.size(), (int32_t) (i + n_tokens) - slot.i_batch - 1);
 
-                gpt_sampler_accept(slot.smpl, id, true);
+                int32_t n_accepted = 0;
+                bool    stop       = false;
 
-                slot.n_decoded += 1;
-                if (slot.n_decoded == 1) {
-                    slot.t_start_generation = ggml_time_us();
-                    slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
-                    metrics.on_prompt_eval(slot);
-                }
+                // the tokens of a verify step come out of the same decode: the time since the previous step is
+                // recorded once, divided across them
+                const int64_t t_now = ggml_time_us();
 
-                result.tok = id;
+                int32_t n_between = 0;
 
-                const auto * cur_p = gpt_sampler_get_candidates(slot.smpl);
+                // sample the token after the sampled token, then after each draft as long as the model agrees with it
+                for (int32_t j = 0; j <= n_draft; ++j) {
+                    completion_token_output result;
+                    const llama_token id = gpt_sampler_sample(slot.smpl, ctx, slot.i_batch - i + j);
 
-                for (size_t i = 0; i < (size_t) slot.sparams.n_probs; ++i) {
-                    result.probs.push_back({
-                        cur_p->data[i].id,
-                        i >= cur_p->size ? 0.0f : cur_p->data[i].p,
-                    });
+                    gpt_sampler_accept(slot.smpl, id, true);
+
+                    slot.n_decoded += 1;
+                    if (slot.n_decoded == 1) {
+                        slot.t_start_generation = t_now;
+                        slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
+                        metrics.on_prompt_eval(slot);
+                    } else {
+                        n_between++;
+                    }
+
+                    result.tok = id;
+
+                    const auto * cur_p = gpt_sampler_get_candidates(slot.smpl);
+
+                    for (size_t i = 0; i < (size_t) slot.sparams.n_probs; ++i) {
+                        result.probs.push_back({
+                            cur_p->data[i].id,
+                            i >= cur_p->size ? 0.0f : cur_p->data[i].p,
+                        });
+                    }
+
+                    if (!slot.spec_inp.empty()) {
+                        slot.spec_inp.push_back(id);
+                        if (ctx_dft == nullptr) {
+                            llama_ngram_cache_update(slot.ngram_cache, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, slot.spec_inp, 1, false);
+                        }
+                    }
+
+                    if (!process_token(result, slot)) {
+                        stop = true;
+                        break;
+                    }
+
+                    if (j == n_draft || id != slot.spec_draft[j]) {
+                        break;
+                    }
+
+                    // the draft is the sampled token, and is in the KV cache already
+                    slot.n_past += 1;
+                    if (slot.params.cache_prompt) {
+                        slot.cache_tokens.push_back(id);
+                    }
+                    n_accepted++;
+                }
+
+                if (n_between > 0) {
+                    const float t_between = (t_now - slot.t_last_token) / 1e3 / n_between;
+                    slot.t_between_tokens.push_back(t_between);
+                    metrics.on_token(t_between);
+                }
+                slot.t_last_token = t_now;
+
+                if (n_draft > 0) {
+                    slot.n_drafted              += n_draft;
+                    slot.n_draft_accepted       += n_accepted;
+                    slot.n_drafted_total        += n_draft;
+                    slot.n_draft_accepted_total += n_accepted;
+                    metrics.on_draft(n_draft, n_accepted);
+                }
+
+                // drop the rejected drafts from the KV cache, the ones decoded by the next parts of the batch are
+                // dropped after the batch
+                if (!slot.spec_draft.empty()) {
+                    llama_kv_cache_seq_rm(ctx, slot.id + 1, system_tokens.size() + slot.n_past, -1);
+                    if (n_draft == (int32_t) slot.spec_draft.size()) {
+                        slot.spec_draft.clear();
+                    }
                 }
 
-                if (!process_token(result, slot)) {
+                if (stop) {
+                    radix_cache_insert(slot);
+                    kv_store_save(slot);
+
+                    // the n-grams of the task help to draft the next ones, until there are too many to keep
+                    if (ctx_dft == nullptr && !slot.ngram_cache.empty()) {
+                        if (ngram_cache_dynamic.size() > 1000000) {
+                            ngram_cache_dynamic.clear();
+                        }
+                        llama_ngram_cache_merge(ngram_cache_dynamic, slot.ngram_cache);
+                    }
+
                     // release slot because of stop condition
                     slot.release();
                     slot.print_timings();
@@ -2270,6 +4020,13 @@ struct server_context {
             }
         }
 
+        for (auto & slot : slots) {
+            if (!slot.spec_draft.empty()) {
+                llama_kv_cache_seq_rm(ctx, slot.id + 1, system_tokens.size() + slot.n_past, -1);
+                slot.spec_draft.clear();
+            }
+        }
+
         SRV_DBG("%s", "run slots completed\n");
     }
 
@@ -2353,12 +4110,15 @@ int main(int argc, char ** argv) {
         );
     } else {
         LOG_INF("Running without SSL\n");
-        svr.reset(new httplib::Server());
+        svr.reset(params.http_event_loop ? new server_http_loop() : new httplib::Server());
     }
 #else
-    svr.reset(new httplib::Server());
+    svr.reset(params.http_event_loop ? new server_http_loop() : new httplib::Server());
 #endif
 
+    // set after binding the port, if the event loop is used
+    server_http_loop * http_loop = nullptr;
+
     std::atomic<server_state> state{SERVER_STATE_LOADING_MODEL};
 
     svr->set_default_headers({{"Server", "llama.cpp"}});
@@ -2385,6 +4145,66 @@ int main(int argc, char ** argv) {
         res.status = 200;
     };
 
+    // stream the results of the tasks as server-sent events: format_result gives the events of a result, ev_done is
+    // sent after the last one. with the event loop, the response does not hold the HTTP thread
+    auto res_stream = [&ctx_server, &http_loop](httplib::Response & res, const std::unordered_set<int> & task_ids,
+            const std::function<std::string(const server_task_result &)> & format_result, const std::string & ev_done) {
+        if (http_loop) {
+            auto stream = std::make_shared<server_http_stream>();
+            stream->id_tasks = task_ids;
+
+            size_t n_finished = 0;
+            stream->read = [&ctx_server, task_ids, format_result, ev_done, n_finished](std::string & out, size_t n_max) mutable {
+                server_task_result result;
+                while (out.size() < n_max && ctx_server.queue_results.try_recv(task_ids, result)) {
+                    if (result.error) {
+                        out += format_server_sent_event("error", result.data);
+                        out += ev_done;
+                        ctx_server.cancel_tasks(task_ids);
+                        return false;
+                    }
+
+                    out += format_result(result);
+
+                    if (result.stop && ++n_finished == task_ids.size()) {
+                        out += ev_done;
+                        return false;
+                    }
+                }
+                return true;
+            };
+            stream->on_close = [&ctx_server, task_ids](bool done) {
+                if (!done) {
+                    ctx_server.cancel_tasks(task_ids); // connection is closed
+                }
+                ctx_server.queue_results.remove_waiting_task_ids(task_ids);
+            };
+
+            http_loop->set_stream(res, stream);
+            return;
+        }
+
+        const auto chunked_content_provider = [task_ids, &ctx_server, format_result, ev_done](size_t, httplib::DataSink & sink) {
+            ctx_server.receive_cmpl_results_stream(task_ids, [&](const server_task_result & result) -> bool {
+                const std::string str = format_result(result);
+                return str.empty() || sink.write(str.data(), str.size());
+            }, [&](const json & error_data) {
+                server_sent_event(sink, "error", error_data);
+            });
+            if (!ev_done.empty()) {
+                sink.write(ev_done.data(), ev_done.size());
+            }
+            sink.done();
+            return true;
+        };
+
+        auto on_complete = [task_ids, &ctx_server] (bool) {
+            ctx_server.queue_results.remove_waiting_task_ids(task_ids);
+        };
+
+        res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
+    };
+
     svr->set_exception_handler([&res_error](const httplib::Request &, httplib::Response & res, std::exception_ptr ep) {
         std::string message;
         try {
@@ -2576,6 +4396,16 @@ int main(int argc, char ** argv) {
 
         const int32_t kv_cache_used_cells = data.at("kv_cache_used_cells");
 
+        json draft_acceptance = json::array();
+        for (const auto & slot : data.at("slots")) {
+            const uint64_t n_drafted  = slot.at("speculative").at("n_drafted_total");
+            const uint64_t n_accepted = slot.at("speculative").at("n_draft_accepted_total");
+            draft_acceptance.push_back({
+                {"labels", "slot=\"" + std::to_string((int) slot.at("id")) + "\""},
+                {"value",  n_drafted ? (double) n_accepted / n_drafted : 0.},
+            });
+        }
+
         // metrics definition: https://prometheus.io/docs/practices/naming/#metric-names
         json all_metrics_def = json {
             {"counter", {{
@@ -2598,10 +4428,78 @@ int main(int argc, char ** argv) {
                     {"name",  "n_decode_total"},
                     {"help",  "Total number of llama_decode() calls"},
                     {"value",  n_decode_total}
+            }, {
+                    {"name",  "decode_gaps_total"},
+                    {"help",  "Number of intervals between two llama_decode() calls of the busy slots."},
+                    {"value",  (uint64_t) data.at("n_decode_gaps")}
+            }, {
+                    {"name",  "decode_gap_seconds_total"},
+                    {"help",  "Time of the main loop between two llama_decode() calls of the busy slots (sampling, detokenization, results)."},
+                    {"value",  (double) data.at("t_decode_gaps_total") / 1.e3}
             }, {
                     {"name",  "n_busy_slots_per_decode"},
                     {"help",  "Average number of busy slots per llama_decode() call"},
                     {"value",  (float) n_busy_slots_total / (float) n_decode_total}
+            }, {
+                    {"name",  "requests_preempted_total"},
+                    {"help",  "Number of requests preempted by a request of higher priority."},
+                    {"value",  (uint64_t) data.at("n_preempted_total")}
+            }, {
+                    {"name",  "requests_expired_total"},
+                    {"help",  "Number of requests that could not start before their deadline."},
+                    {"value",  (uint64_t) data.at("n_expired_total")}
+            }, {
+                    {"name",  "draft_tokens_total"},
+                    {"help",  "Number of tokens drafted for speculative decoding."},
+                    {"value",  (uint64_t) data.at("n_drafted_total")}
+            }, {
+                    {"name",  "draft_tokens_accepted_total"},
+                    {"help",  "Number of drafted tokens accepted by the model."},
+                    {"value",  (uint64_t) data.at("n_draft_accepted_total")}
+            }, {
+                    {"name",  "embeddings_total"},
+                    {"help",  "Number of pooled embedding inputs computed in batches without a slot."},
+                    {"value",  (uint64_t) data.at("n_embd_inputs_total")}
+            }, {
+                    {"name",  "embedding_batches_total"},
+                    {"help",  "Number of batches of pooled embedding inputs."},
+                    {"value",  (uint64_t) data.at("n_embd_batches_total")}
+            }, {
+                    {"name",  "kv_tier_stored_total"},
+                    {"help",  "Number of conversations evicted from the slots to the KV tier."},
+                    {"value",  (uint64_t) data.at("kv_tier_stored_total")}
+            }, {
+                    {"name",  "kv_tier_restored_total"},
+                    {"help",  "Number of conversations restored from the KV tier."},
+                    {"value",  (uint64_t) data.at("kv_tier_restored_total")}
+            }, {
+                    {"name",  "kv_store_loaded_total"},
+                    {"help",  "Number of prompt caches loaded from the store under --slot-save-path."},
+                    {"value",  (uint64_t) data.at("kv_store_loaded_total")}
+            }, {
+                    {"name",  "kv_store_saved_total"},
+                    {"help",  "Number of prompt caches saved to the store under --slot-save-path."},
+                    {"value",  (uint64_t) data.at("kv_store_saved_total")}
+            }, {
+                    {"name",  "radix_cache_hits_total"},
+                    {"help",  "Number of prompts that reused a prefix from the radix cache."},
+                    {"value",  (uint64_t) data.at("radix_cache_hits_total")}
+            }, {
+                    {"name",  "radix_cache_hit_tokens_total"},
+                    {"help",  "Number of prompt tokens reused from the radix cache."},
+                    {"value",  (uint64_t) data.at("radix_cache_hit_tokens_total")}
+            }, {
+                    {"name",  "kv_defrag_total"},
+                    {"help",  "Number of KV cache defragmentation steps."},
+                    {"value",  (uint64_t) data.at("kv_defrag_total")}
+            }, {
+                    {"name",  "kv_defrag_cells_total"},
+                    {"help",  "Number of KV cache cells moved by the defragmentation."},
+                    {"value",  (uint64_t) data.at("kv_defrag_cells_total")}
+            }, {
+                    {"name",  "kv_defrag_seconds_total"},
+                    {"help",  "KV cache defragmentation time."},
+                    {"value",  (double) data.at("kv_defrag_ms_total") / 1.e3}
             }}},
             {"gauge", {{
                     {"name",  "prompt_tokens_seconds"},
@@ -2627,6 +4525,50 @@ int main(int argc, char ** argv) {
                     {"name",  "requests_deferred"},
                     {"help",  "Number of request deferred."},
                     {"value",  (uint64_t) data.at("deferred")}
+            },{
+                    {"name",  "requests_preempted_waiting"},
+                    {"help",  "Number of preempted requests waiting to resume."},
+                    {"value",  (uint64_t) data.at("preempted")}
+            },{
+                    {"name",  "embeddings_queued"},
+                    {"help",  "Number of pooled embedding inputs waiting for a batch."},
+                    {"value",  (uint64_t) data.at("embd_queued")}
+            },{
+                    {"name",  "kv_tier_entries"},
+                    {"help",  "Number of conversations in the KV tier."},
+                    {"value",  (uint64_t) data.at("kv_tier_entries")}
+            },{
+                    {"name",  "kv_tier_host_bytes"},
+                    {"help",  "Host memory used by the KV tier."},
+                    {"value",  (uint64_t) data.at("kv_tier_host_bytes")}
+            },{
+                    {"name",  "kv_store_bytes"},
+                    {"help",  "Size of the prompt caches in the store under --slot-save-path."},
+                    {"value",  (uint64_t) data.at("kv_store_bytes")}
+            },{
+                    {"name",  "draft_acceptance_ratio"},
+                    {"help",  "Ratio of the drafted tokens accepted by the model, per slot."},
+                    {"samples", draft_acceptance},
+            },{
+                    {"name",  "radix_cache_tokens"},
+                    {"help",  "Number of prompt tokens held by the radix cache."},
+                    {"value",  (uint64_t) data.at("radix_cache_tokens")}
+            },{
+                    {"name",  "time_between_tokens_p50_seconds"},
+                    {"help",  "Median time between the generated tokens of a request."},
+                    {"value",  (double) data.at("tbt_p50_ms") / 1.e3}
+            },{
+                    {"name",  "time_between_tokens_p90_seconds"},
+                    {"help",  "90th percentile of the time between the generated tokens of a request."},
+                    {"value",  (double) data.at("tbt_p90_ms") / 1.e3}
+            },{
+                    {"name",  "time_between_tokens_p99_seconds"},
+                    {"help",  "99th percentile of the time between the generated tokens of a request."},
+                    {"value",  (double) data.at("tbt_p99_ms") / 1.e3}
+            },{
+                    {"name",  "time_between_tokens_max_seconds"},
+                    {"help",  "Max time between the generated tokens of a request."},
+                    {"value",  (double) data.at("tbt_max_ms") / 1.e3}
             }}}
         };
 
@@ -2640,10 +4582,20 @@ int main(int argc, char ** argv) {
                 const std::string name = metric_def.at("name");
                 const std::string help = metric_def.at("help");
 
-                auto value = json_value(metric_def, "value", 0.);
                 prometheus << "# HELP llamacpp:" << name << " " << help  << "\n"
-                            << "# TYPE llamacpp:" << name << " " << type  << "\n"
-                            << "llamacpp:"        << name << " " << value << "\n";
+                            << "# TYPE llamacpp:" << name << " " << type  << "\n";
+
+                // one sample per label set, e.g. per slot
+                if (metric_def.contains("samples")) {
+                    for (const auto & sample : metric_def.at("samples")) {
+                        const std::string labels = sample.at("labels");
+                        prometheus << "llamacpp:" << name << "{" << labels << "} " << json_value(sample, "value", 0.) << "\n";
+                    }
+                    continue;
+                }
+
+                auto value = json_value(metric_def, "value", 0.);
+                prometheus << "llamacpp:" << name << " " << value << "\n";
             }
         }
 
@@ -2777,18 +4729,26 @@ int main(int argc, char ** argv) {
             { "default_generation_settings", ctx_server.default_generation_settings_for_props },
             { "total_slots",                 ctx_server.params.n_parallel },
             { "chat_template",               curr_tmpl.c_str() },
+            { "multimodal",                  ctx_server.ctx_clip != nullptr },
         };
 
         res_ok(res, data);
     };
 
-    const auto handle_completions_generic = [&ctx_server, &res_error, &res_ok](server_task_cmpl_type cmpl_type, json & data, httplib::Response & res) {
+    const auto handle_completions_generic = [&ctx_server, &res_error, &res_ok, &res_stream](server_task_cmpl_type cmpl_type, json & data, httplib::Response & res) {
         if (ctx_server.params.embedding) {
             res_error(res, format_error_response("This server does not support completions. Start it without `--embeddings`", ERROR_TYPE_NOT_SUPPORTED));
             return;
         }
 
-        std::vector<server_task> tasks = ctx_server.create_tasks_cmpl(data, cmpl_type);
+        std::shared_ptr<const std::vector<server_image>> images;
+        json error;
+        if (!ctx_server.load_images(data, cmpl_type, images, error)) {
+            res_error(res, error);
+            return;
+        }
+
+        std::vector<server_task> tasks = ctx_server.create_tasks_cmpl(data, cmpl_type, images);
         ctx_server.queue_results.add_waiting_tasks(tasks);
         ctx_server.queue_tasks.post(tasks);
 
@@ -2814,21 +4774,9 @@ int main(int argc, char ** argv) {
 
             ctx_server.queue_results.remove_waiting_task_ids(task_ids);
         } else {
-            const auto chunked_content_provider = [task_ids, &ctx_server](size_t, httplib::DataSink & sink) {
-                ctx_server.receive_cmpl_results_stream(task_ids, [&](const server_task_result & result) -> bool {
-                    return server_sent_event(sink, "data", result.data);
-                }, [&](const json & error_data) {
-                    server_sent_event(sink, "error", error_data);
-                });
-                sink.done();
-                return false;
-            };
-
-            auto on_complete = [task_ids, &ctx_server] (bool) {
-                ctx_server.queue_results.remove_waiting_task_ids(task_ids);
-            };
-
-            res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
+            res_stream(res, task_ids, [](const server_task_result & result) {
+                return format_server_sent_event("data", result.data);
+            }, std::string());
         }
     };
 
@@ -2843,7 +4791,7 @@ int main(int argc, char ** argv) {
     };
 
     // TODO: maybe merge this function with "handle_completions_generic"
-    const auto handle_chat_completions = [&ctx_server, &params, &res_error, &res_ok, verbose](const httplib::Request & req, httplib::Response & res) {
+    const auto handle_chat_completions = [&ctx_server, &params, &res_error, &res_ok, &res_stream, verbose](const httplib::Request & req, httplib::Response & res) {
         if (ctx_server.params.embedding) {
             res_error(res, format_error_response("This server does not support completions. Start it without `--embeddings`", ERROR_TYPE_NOT_SUPPORTED));
             return;
@@ -2851,7 +4799,14 @@ int main(int argc, char ** argv) {
 
         json data = oaicompat_completion_params_parse(ctx_server.model, json::parse(req.body), params.chat_template);
 
-        std::vector<server_task> tasks = ctx_server.create_tasks_cmpl(data, SERVER_TASK_CMPL_TYPE_NORMAL);
+        std::shared_ptr<const std::vector<server_image>> images;
+        json error;
+        if (!ctx_server.load_images(data, SERVER_TASK_CMPL_TYPE_NORMAL, images, error)) {
+            res_error(res, error);
+            return;
+        }
+
+        std::vector<server_task> tasks = ctx_server.create_tasks_cmpl(data, SERVER_TASK_CMPL_TYPE_NORMAL, images);
         ctx_server.queue_results.add_waiting_tasks(tasks);
         ctx_server.queue_tasks.post(tasks);
 
@@ -2870,32 +4825,17 @@ int main(int argc, char ** argv) {
 
             ctx_server.queue_results.remove_waiting_task_ids(task_ids);
         } else {
-            const auto chunked_content_provider = [task_ids, &ctx_server, completion_id](size_t, httplib::DataSink & sink) {
-                ctx_server.receive_cmpl_results_stream(task_ids, [&](const server_task_result & result) -> bool {
-                    std::vector<json> result_array = format_partial_response_oaicompat(result.data, completion_id);
-                    for (auto & event_data : result_array) {
-                        if (event_data.empty()) {
-                            continue; // skip the stop token
-                        }
-                        if (!server_sent_event(sink, "data", event_data)) {
-                            return false; // connection is closed
-                        }
+            res_stream(res, task_ids, [completion_id](const server_task_result & result) {
+                std::string str;
+                std::vector<json> result_array = format_partial_response_oaicompat(result.data, completion_id);
+                for (auto & event_data : result_array) {
+                    if (event_data.empty()) {
+                        continue; // skip the stop token
                     }
-                    return true; // ok
-                }, [&](const json & error_data) {
-                    server_sent_event(sink, "error", error_data);
-                });
-                static const std::string ev_done = "data: [DONE]\n\n";
-                sink.write(ev_done.data(), ev_done.size());
-                sink.done();
-                return true;
-            };
-
-            auto on_complete = [task_ids, &ctx_server] (bool) {
-                ctx_server.queue_results.remove_waiting_task_ids(task_ids);
-            };
-
-            res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
+                    str += format_server_sent_event("data", event_data);
+                }
+                return str;
+            }, "data: [DONE]\n\n");
         }
     };
 
@@ -3135,7 +5075,13 @@ int main(int argc, char ** argv) {
     svr->new_task_queue = [&params] { return new httplib::ThreadPool(params.n_threads_http); };
 
     // clean up function, to be called before exit
-    auto clean_up = [&svr]() {
+    auto clean_up = [&svr, &http_loop, &ctx_server]() {
+        // the results still being formatted notify the HTTP event loop
+        ctx_server.result_worker.stop();
+
+        if (http_loop) {
+            http_loop->terminate();
+        }
         svr->stop();
         llama_backend_free();
     };
@@ -3150,10 +5096,27 @@ int main(int argc, char ** argv) {
         clean_up();
         return 1;
     }
-    std::thread t([&]() { svr->listen_after_bind(); });
-    svr->wait_until_ready();
 
-    LOG_INF("%s: HTTP server is listening, hostname: %s, port: %d, http threads: %d\n", __func__, params.hostname.c_str(), params.port, params.n_threads_http);
+    if (params.http_event_loop) {
+        http_loop = dynamic_cast<server_http_loop *>(svr.get());
+        if (http_loop == nullptr || !http_loop->init()) {
+            LOG_WRN("%s: the HTTP event loop is not supported with SSL or on this platform, using a thread per connection\n", __func__);
+            http_loop = nullptr;
+        }
+    }
+
+    std::thread t;
+    if (http_loop) {
+        ctx_server.queue_results.on_new_result([http_loop](int id_task) {
+            http_loop->notify(id_task);
+        });
+        t = std::thread([&]() { http_loop->run(); });
+    } else {
+        t = std::thread([&]() { svr->listen_after_bind(); });
+        svr->wait_until_ready();
+    }
+
+    LOG_INF("%s: HTTP server is listening, hostname: %s, port: %d, http threads: %d, event loop: %d\n", __func__, params.hostname.c_str(), params.port, params.n_threads_http, http_loop != nullptr);
 
     // load the model
     LOG_INF("%s: loading model\n", __func__);
@@ -3183,8 +5146,10 @@ int main(int argc, char ** argv) {
 
     ctx_server.queue_tasks.on_new_task(std::bind(
                 &server_context::process_single_task, &ctx_server, std::placeholders::_1));
-    ctx_server.queue_tasks.on_update_slots(std::bind(
-                &server_context::update_slots, &ctx_server));
+    ctx_server.queue_tasks.on_update_slots([&ctx_server]() {
+        ctx_server.update_slots();
+        ctx_server.result_worker.flush();
+    });
 
     shutdown_handler = [&](int) {
         ctx_server.queue_tasks.terminate();
@@ -16,6 +16,7 @@ Feature: llama.cpp server
     And   128 as ubatch size
     And   512 KV cache size
     And   embeddings extraction
+    And   prometheus compatible metrics exposed
     Then  the server is starting
     Then  the server is healthy
 
@@ -106,6 +107,58 @@ Feature: llama.cpp server
     Then the server is idle
     Then all embeddings are generated
 
+  Scenario: Multi users embeddings with multiple inputs are batched together
+    Given a prompt:
+      """
+      In which country Paris is located ?
+      """
+    And a prompt:
+      """
+      Is Madrid the capital of Spain ?
+      """
+    And a prompt:
+      """
+      What is the biggest US city ?
+      """
+    And a prompt:
+      """
+      What is the capital of Bulgaria ?
+      """
+    And   a model bert-bge-small
+    Given 4 concurrent OAI embedding requests for multiple inputs
+    # each embedding matches the one of its input alone, at the index of the input
+    Then  all embeddings are generated in the order of the inputs
+    Given prometheus metrics are exposed
+    # the 16 inputs of the requests, then the 4 inputs alone
+    Then  metric llamacpp:embeddings is 20
+    # the inputs of a request share a batch, which the inputs of the other requests can join
+    And   metric llamacpp:embedding_batches is at most 8
+
+  Scenario: Embeddings with multiple inputs (error: an input is too large for the batch)
+    Given a prompt:
+      """
+      Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua.
+      Ut enim ad minim veniam, quis nostrud exercitation ullamco laboris nisi ut aliquip ex ea commodo consequat.
+      Duis aute irure dolor in reprehenderit in voluptate velit esse cillum dolore eu fugiat nulla pariatur.
+      Excepteur sint occaecat cupidatat non proident, sunt in culpa qui officia deserunt mollit anim id est laborum.
+      Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua.
+      Ut enim ad minim veniam, quis nostrud exercitation ullamco laboris nisi ut aliquip ex ea commodo consequat.
+      Duis aute irure dolor in reprehenderit in voluptate velit esse cillum dolore eu fugiat nulla pariatur.
+      Excepteur sint occaecat cupidatat non proident, sunt in culpa qui officia deserunt mollit anim id est laborum.
+      """
+    And   32 prompts Write a very long story about AI, with many characters, places and events, told slowly so that it takes a lot of words. with seed 42
+    And   a model bert-bge-small
+    When  an OAI compatible embeddings computation request for multiple inputs with 500 api error
+    When  embeddings are computed for:
+    """
+    What is the capital of Bulgaria ?
+    """
+    Then  embeddings are generated
+    Given prometheus metrics are exposed
+    # the error cancels the other inputs of the request, which need several batches: the queued ones are dropped
+    Then  metric llamacpp:embeddings is at most 16
+    And   metric llamacpp:embeddings_queued is 0
+
   Scenario: All embeddings should be the same
     Given 10 fixed prompts
     And   a model bert-bge-small
@@ -0,0 +1,47 @@
+@llama.cpp
+@http_loop
+Feature: llama.cpp server with the HTTP event loop
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   a model file test-model.gguf
+    And   a model alias tinyllama-2
+    And   42 as server seed
+    And   32 as batch size
+    And   2 slots
+    And   prometheus compatible metrics exposed
+    And   the HTTP event loop
+
+  Scenario: Streamed completion
+    Given 256 KV cache size
+    Then  the server is starting
+    Then  the server is healthy
+    Given a prompt I believe the meaning of life is
+    And   0.0 temperature
+    And   32 max tokens to predict
+    And   a completion request with no api error
+    Given a prompt I believe the meaning of life is
+    And   streaming is enabled
+    And   a completion request with no api error
+    Then  all predictions are equal
+
+  Scenario: Pipelined keep-alive requests answered after the client half-closes
+    Given 256 KV cache size
+    Then  the server is starting
+    Then  the server is healthy
+    Given a prompt I believe the meaning of life is
+    And   pipelined completion requests predicting 4,12,8 tokens on one connection
+    Then  the pipelined responses predict 4,12,8 tokens in order
+
+  Scenario: Client disconnect cancels the streamed completion
+    Given 8192 KV cache size
+    Then  the server is starting
+    Then  the server is healthy
+    Given a prompt I believe the meaning of life is
+    And   100000 max tokens to predict
+    And   a streamed completion request closed by the client after 4 events
+    Then  the server is idle
+    And   all slots are idle
+    And   prometheus metrics are exposed
+    And   metric llamacpp:tokens_predicted is 0
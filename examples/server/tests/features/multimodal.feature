@@ -0,0 +1,48 @@
+@llama.cpp
+@multimodal
+Feature: llama.cpp server with a multimodal projector
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   a model file test-model.gguf
+    And   a random multimodal projector test-mmproj.gguf for 64 embeddings
+    And   42 as server seed
+    And   512 KV cache size
+    And   32 as batch size
+    And   2 slots
+    And   8 as prefill budget
+    And   continuous batching
+    And   8 max tokens to predict
+    And   0.0 temperature
+    Then  the server is starting
+    Then  the server is healthy
+
+  Scenario: Completion with an image
+    Given a prompt USER: [img-1] Describe the image. ASSISTANT:
+    And   an image 1
+    And   a completion request with no api error
+    Then  8 tokens are predicted
+
+  Scenario: An escaped image marker is text
+    Given a prompt USER: \[img-2] is text, [img-1] is an image. ASSISTANT:
+    And   an image 1
+    And   a completion request with no api error
+    Then  8 tokens are predicted
+
+  Scenario: The images must match the markers of the prompt
+    Given a prompt USER: [img-2] Describe the image. ASSISTANT:
+    And   an image 1
+    And   a completion request with 400 api error
+
+  Scenario: The images are decoded in chunks between the tokens of the other slots
+    Given a prompt USER: [img-1] and [img-2] are two images. ASSISTANT:
+    And   an image 1
+    And   an image 2
+    And   a completion request with no api error
+    Given a prompt USER: [img-1] and [img-2] are two images. ASSISTANT:
+    And   a prompt USER: [img-1] and [img-2] are two images. ASSISTANT:
+    Given concurrent completion requests
+    Then  the server is idle
+    And   all slots are idle
+    Then  all predictions are equal
@@ -0,0 +1,46 @@
+@llama.cpp
+@priority
+Feature: llama.cpp server request priorities, deadlines and preemption
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   a model file test-model.gguf
+    And   42 as server seed
+    And   1024 KV cache size
+    And   1 slots
+    And   continuous batching
+    And   slot preemption
+    And   prometheus compatible metrics exposed
+    And   0.0 temperature
+    Then  the server is starting
+    Then  the server is healthy
+
+  Scenario: A request that cannot start before its deadline fails
+    Given a prompt Write a very long story about AI.
+    And   1000 max tokens to predict
+    And   concurrent completion requests
+    Then  the server is busy
+    Given a prompt Write another very long music lyrics.
+    And   10 milliseconds as deadline
+    And   a completion request with 503 api error
+    Then  the server is idle
+    Given prometheus metrics are exposed
+    Then  metric llamacpp:requests_expired is 1
+    And   metric llamacpp:requests_preempted is 0
+
+  Scenario: A preempted request resumes with the same output
+    Given a prompt Write a very long story about AI.
+    And   512 max tokens to predict
+    And   a completion request with no api error
+    Given a prompt Write a very long story about AI.
+    And   concurrent completion requests
+    Then  the server is busy
+    Given a prompt Write a very long story about AI.
+    And   1 as priority
+    And   concurrent completion requests
+    Then  the server is idle
+    And   all slots are idle
+    And   all predictions are equal
+    Given prometheus metrics are exposed
+    Then  metric llamacpp:requests_preempted is 1
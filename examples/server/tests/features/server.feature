@@ -54,6 +54,23 @@ Feature: llama.cpp server
     And   109 prompt tokens are processed
 
 
+  Scenario Outline: Stop words and token probabilities of the formatted results
+    Given a prompt I believe the meaning of life is
+    And   0.0 temperature
+    And   32 max tokens to predict
+    And   a completion request with no api error
+    Then  32 tokens are predicted
+    Given a prompt I believe the meaning of life is
+    And   streaming is <enable_streaming>
+    And   a completion request stopped at a word of the previous completion
+    Then  the completion ends before the stop word with the same token probabilities
+
+    Examples: Prompts
+      | enable_streaming |
+      | disabled         |
+      | enabled          |
+
+
   Scenario Outline: OAI Compatibility
     Given a model <model>
     And   a system prompt <system_prompt>
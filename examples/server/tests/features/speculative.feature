@@ -0,0 +1,32 @@
+@llama.cpp
+@speculative
+Feature: llama.cpp server speculative decoding
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file tinyllamas/stories260K.gguf from HF repo ggml-org/models
+    And   a model file test-model.gguf
+    And   42 as server seed
+    And   512 KV cache size
+    And   1 slots
+    And   n-gram speculative decoding
+    And   8 as draft
+    And   0.0 temperature
+    Then  the server is starting
+    Then  the server is healthy
+
+  Scenario: The n-gram speculative decoding generates the same tokens
+    Given 32 max tokens to predict
+    And   a prompt Once upon a time, there was a little girl.
+    And   0 tokens drafted
+    And   a completion request with no api error
+    # the n-grams of the finished requests are drafted once they are seen twice
+    Given 8 tokens drafted
+    And   a prompt Once upon a time, there was a little girl.
+    And   a completion request with no api error
+    Given a prompt Once upon a time, there was a little girl.
+    And   a completion request with no api error
+    Given a prompt Once upon a time, there was a little girl.
+    And   a completion request with no api error
+    Then  drafted tokens are accepted
+    And   all predictions are equal
@@ -2,6 +2,7 @@
 # -*- coding: utf-8 -*-
 
 import asyncio
+import base64
 import json
 import os
 import re
@@ -13,6 +14,7 @@ import time
 import requests
 from collections.abc import Sequence
 from contextlib import closing
+from pathlib import Path
 from re import RegexFlag
 from typing import Any, Literal, cast
 
@@ -24,6 +26,10 @@ from behave import step  # pyright: ignore[reportAttributeAccessIssue]
 from behave.api.async_step import async_run_until_complete
 from prometheus_client import parser
 
+if 'NO_LOCAL_GGUF' not in os.environ:
+    sys.path.insert(1, str(Path(__file__).parents[5] / 'gguf-py'))
+import gguf  # noqa: E402
+
 # pyright: reportRedeclaration=false
 
 DEFAULT_TIMEOUT_SECONDS = aiohttp.ClientTimeout(total=600)
@@ -78,6 +84,16 @@ def step_server_config(context, server_fqdn: str, server_port: str):
     context.temperature = None
     context.lora_file = None
     context.disable_ctx_shift = False
+    context.kv_hh_budget = None
+    context.http_event_loop = False
+    context.mmproj_file = None
+    context.n_prefill_budget = None
+    context.image_data = None
+    context.server_preemption = False
+    context.priority = None
+    context.deadline_ms = None
+    context.server_spec_ngram = False
+    context.n_draft = None
 
     context.tasks_result = []
     context.concurrent_tasks = []
@@ -102,6 +118,12 @@ def step_model_file(context, model_file: str):
     context.model_file = model_file
 
 
+@step('a random multimodal projector {mmproj_file} for {n_embd:d} embeddings')
+def step_random_mmproj_file(context, mmproj_file: str, n_embd: int):
+    context.mmproj_file = mmproj_file
+    write_random_mmproj(mmproj_file, n_embd)
+
+
 @step('a model url {model_url}')
 def step_model_url(context, model_url: str):
     context.model_url = model_url
@@ -137,6 +159,16 @@ def step_draft(context, draft: int):
     context.draft = draft
 
 
+@step('n-gram speculative decoding')
+def step_server_spec_ngram(context):
+    context.server_spec_ngram = True
+
+
+@step('{n_draft:d} tokens drafted')
+def step_n_draft(context, n_draft: int):
+    context.n_draft = n_draft
+
+
 @step('{n_ctx:d} KV cache size')
 def step_n_ctx(context, n_ctx: int):
     context.n_ctx = n_ctx
@@ -181,10 +213,30 @@ def step_server_embeddings(context):
 def step_server_metrics(context):
     context.server_metrics = True
 
+@step('{n_prefill_budget:d} as prefill budget')
+def step_n_prefill_budget(context, n_prefill_budget: int):
+    context.n_prefill_budget = n_prefill_budget
+
+
+@step('slot preemption')
+def step_server_preemption(context):
+    context.server_preemption = True
+
+
 @step('disable context shifting')
 def step_server_disable_ctx_shift(context):
     context.disable_ctx_shift = True
 
+
+@step('the HTTP event loop')
+def step_server_http_event_loop(context):
+    context.http_event_loop = True
+
+
+@step('heavy-hitter KV cache eviction with a budget of {kv_hh_budget:d} tokens')
+def step_server_kv_hh_budget(context, kv_hh_budget: int):
+    context.kv_hh_budget = kv_hh_budget
+
 @step("the server is starting")
 def step_start_server(context):
     start_server_background(context)
@@ -272,7 +324,13 @@ async def step_request_completion(context, api_error: Literal['raised'] | str):
                                           id_slot=context.id_slot,
                                           expect_api_error=expect_api_error,
                                           user_api_key=context.user_api_key,
-                                          temperature=context.temperature)
+                                          temperature=context.temperature,
+                                          image_data=context.image_data,
+                                          priority=context.priority,
+                                          deadline_ms=context.deadline_ms,
+                                          n_draft=context.n_draft,
+                                          stream=context.enable_streaming
+                                          if hasattr(context, 'enable_streaming') else None)
     context.tasks_result.append(completion)
     if context.debug:
         print(f"Completion response: {completion}")
@@ -283,6 +341,99 @@ async def step_request_completion(context, api_error: Literal['raised'] | str):
         assert completion == api_error_code, f"completion must be an {api_error_code} status code: {completion}"
 
 
+@step('a completion request stopped at a word of the previous completion')
+@async_run_until_complete
+async def step_request_completion_stopped(context):
+    context.stop_word = pick_stop_word(context.completion)
+    seeds = await completions_seed(context, num_seeds=1)
+    completion = await request_completion(context.prompts.pop(),
+                                          seeds[0] if seeds is not None else seeds,
+                                          context.base_url,
+                                          debug=context.debug,
+                                          n_predict=context.n_predict,
+                                          temperature=context.temperature,
+                                          stop=[context.stop_word],
+                                          stream=context.enable_streaming
+                                          if hasattr(context, 'enable_streaming') else None)
+    context.tasks_result.append(completion)
+
+
+@step('the completion ends before the stop word with the same token probabilities')
+def step_completion_stopped_at_word(context):
+    completion = context.tasks_result.pop()
+    content = context.completion['content']
+    assert completion['stopped_word'], f'{completion}'
+    assert completion['stopping_word'] == context.stop_word, f'{completion}'
+    assert completion['content'] == content[:content.find(context.stop_word)], \
+        f"content {completion['content']!r} does not end before the stop word {context.stop_word!r} of {content!r}"
+    probs = completion['completion_probabilities']
+    probs_full = context.completion['completion_probabilities']
+    assert len(probs) <= len(probs_full), f"{len(probs)} token probabilities for {len(probs_full)} tokens"
+    for pos, (probs_pos, probs_full_pos) in enumerate(zip(probs, probs_full)):
+        assert probs_pos == probs_full_pos, f"pos {pos}: {probs_pos} != {probs_full_pos}"
+
+
+@step('pipelined completion requests predicting {n_predicts} tokens on one connection')
+@async_run_until_complete
+async def step_pipelined_completion_requests(context, n_predicts):
+    context.n_predicts = [int(n_predict) for n_predict in n_predicts.split(',')]
+    reader, writer = await asyncio.open_connection(context.server_fqdn, context.server_port)
+    try:
+        # all the requests at once, then half-close: the responses must still come, in order
+        for n_predict in context.n_predicts:
+            writer.write(http_request(context, '/completion', {
+                "prompt": context.prompts[0],
+                "n_predict": n_predict,
+                "temperature": 0.0,
+            }))
+        writer.write_eof()
+        await writer.drain()
+
+        context.pipelined_responses = []
+        for _ in context.n_predicts:
+            context.pipelined_responses.append(await read_http_response(reader))
+
+        # the connection is closed after the last response
+        assert await reader.read() == b'', "the connection is still open after the responses"
+    finally:
+        writer.close()
+    context.prompts.clear()
+
+
+@step('the pipelined responses predict {n_predicts} tokens in order')
+def step_pipelined_responses(context, n_predicts):
+    n_predicts = [int(n_predict) for n_predict in n_predicts.split(',')]
+    assert len(context.pipelined_responses) == len(n_predicts)
+    for (status, completion), n_predict in zip(context.pipelined_responses, n_predicts):
+        assert status == 200, f"status {status}: {completion}"
+        assert completion['tokens_predicted'] == n_predict, f"{completion['tokens_predicted']} tokens predicted instead of {n_predict}"
+
+
+@step('a streamed completion request closed by the client after {n_events:d} events')
+@async_run_until_complete
+async def step_streamed_completion_closed(context, n_events):
+    reader, writer = await asyncio.open_connection(context.server_fqdn, context.server_port)
+    try:
+        writer.write(http_request(context, '/completion', {
+            "prompt": context.prompts.pop(),
+            "n_predict": context.n_predict,
+            "stream": True,
+        }))
+        await writer.drain()
+
+        status_line = await reader.readline()
+        assert b' 200 ' in status_line, f"status line {status_line!r}"
+
+        n_read = 0
+        while n_read < n_events:
+            line = await reader.readline()
+            assert line, "the stream ended before the client closed it"
+            if line.startswith(b'data: '):
+                n_read += 1
+    finally:
+        writer.close()
+
+
 @step('{predicted_n:d} tokens are predicted matching {re_content}')
 def step_n_tokens_predicted_with_content(context, predicted_n, re_content):
     context.completion = context.tasks_result.pop()
@@ -295,6 +446,13 @@ def step_n_tokens_predicted(context, predicted_n):
     assert_n_tokens_predicted(context.completion, predicted_n)
 
 
+@step('drafted tokens are accepted')
+def step_drafted_tokens_accepted(context):
+    timings = context.tasks_result[-1]['timings']
+    assert timings['draft_n'] > 0, f"no drafted tokens: {timings}"
+    assert timings['draft_n_accepted'] > 0, f"no accepted tokens: {timings}"
+
+
 @step('all predictions are equal')
 @async_run_until_complete
 async def step_predictions_equal(context):
@@ -338,6 +496,11 @@ def step_impl(context, n_prompt):
     assert n_prompt < 0 or n_prompt == context.completion['timings']['prompt_n'], f"n_prompt={context.completion['timings']['prompt_n']}"
 
 
+@step('more than {n_prompt:d} prompt tokens are processed')
+def step_prompt_tokens_processed_more_than(context, n_prompt):
+    assert context.completion['timings']['prompt_n'] > n_prompt, f"n_prompt={context.completion['timings']['prompt_n']}"
+
+
 @step('a user prompt {user_prompt}')
 def step_user_prompt(context, user_prompt):
     context.prompts.append(user_prompt)
@@ -399,6 +562,16 @@ def step_n_junk(context, n_junk):
     context.n_junk = n_junk
 
 
+@step('{priority:d} as priority')
+def step_priority(context, priority: int):
+    context.priority = priority
+
+
+@step('{deadline_ms:d} milliseconds as deadline')
+def step_deadline_ms(context, deadline_ms: int):
+    context.deadline_ms = deadline_ms
+
+
 @step('{n_batch:d} as batch size')
 def step_n_batch(context, n_batch):
     context.n_batch = n_batch
@@ -523,6 +696,13 @@ def step_a_prompt_prompt(context, prompt):
     context.n_prompts = len(context.prompts)
 
 
+@step('an image {image_id:d}')
+def step_an_image(context, image_id):
+    if context.image_data is None:
+        context.image_data = []
+    context.image_data.append({'id': image_id, 'data': base64.b64encode(random_bmp(48, 48, seed=image_id)).decode()})
+
+
 @step('{num_prompts:d} prompts {prompt} with seed {seed:d}')
 def step_many_prompts(context, num_prompts, prompt, seed):
     if context.seed is None:
@@ -547,6 +727,10 @@ async def step_concurrent_completion_requests(context):
         n_predict=context.n_predict if hasattr(context, 'n_predict') else None,
         user_api_key=context.user_api_key if hasattr(context, 'user_api_key') else None,
         temperature=context.temperature,
+        image_data=context.image_data,
+        priority=context.priority,
+        deadline_ms=context.deadline_ms,
+        n_draft=context.n_draft,
     )
 
 
@@ -676,6 +860,48 @@ async def step_oai_compute_embeddings_multiple_inputs(context):
     context.prompts.clear()
 
 
+@step('an OAI compatible embeddings computation request for multiple inputs with {api_error_code:d} api error')
+@async_run_until_complete
+async def step_oai_compute_embeddings_multiple_inputs_error(context, api_error_code: int):
+    context.embeddings = await request_oai_embeddings(context.prompts, None,
+                                                      base_url=context.base_url,
+                                                      user_api_key=context.user_api_key,
+                                                      model=context.model,
+                                                      async_client=True,
+                                                      expect_api_error=True)
+    context.prompts.clear()
+    assert context.embeddings == api_error_code, f"embeddings request must return code {api_error_code}, but got {context.embeddings}"
+
+
+@step('{n_requests:d} concurrent OAI embedding requests for multiple inputs')
+@async_run_until_complete()
+async def step_concurrent_oai_embedding_requests_multiple_inputs(context, n_requests: int):
+    context.embd_inputs = list(context.prompts)
+    context.prompts.clear()
+    for _ in range(n_requests):
+        context.concurrent_tasks.append(asyncio.create_task(request_oai_embeddings(context.embd_inputs, None,
+                                                                                   base_url=context.base_url,
+                                                                                   async_client=True,
+                                                                                   model=context.model)))
+    await asyncio.sleep(0.01)
+
+
+@step('all embeddings are generated in the order of the inputs')
+@async_run_until_complete()
+async def step_all_embeddings_in_order(context):
+    n_embedding_requests = await gather_tasks_results(context)
+    assert n_embedding_requests > 0
+    # the embedding of each input alone
+    expected = [(await request_embedding(embd_input, None, base_url=context.base_url))[0] for embd_input in context.embd_inputs]
+    for _ in range(n_embedding_requests):
+        embeddings = context.tasks_result.pop()
+        assert len(embeddings) == len(expected), f"{len(embeddings)} embeddings for {len(expected)} inputs"
+        for i, embedding in enumerate(embeddings):
+            assert_embeddings(embedding)
+            similarity = np.dot(embedding, expected[i]) / (np.linalg.norm(embedding) * np.linalg.norm(expected[i]))
+            assert np.isclose(similarity, 1.0, rtol=1e-05, atol=1e-08, equal_nan=False), f"input {i}: similarity {similarity:.10f}"
+
+
 @step('concurrent embedding requests')
 @async_run_until_complete()
 async def step_concurrent_embedding_requests(context):
@@ -828,6 +1054,13 @@ def step_assert_metric_value(context, metric_name, metric_value):
     assert context.metrics[metric_name].samples[0].value == metric_value, f"metric: {context.metrics[metric_name]}"
 
 
+@step('metric {metric_name} is at most {metric_value:d}')
+def step_assert_metric_value_at_most(context, metric_name, metric_value):
+    if metric_name not in context.metrics:
+        assert False, f"no metric {metric_name} in {context.metrics.keys()}"
+    assert context.metrics[metric_name].samples[0].value <= metric_value, f"metric: {context.metrics[metric_name]}"
+
+
 @step('available models')
 def step_available_models(context):
     # openai client always expects an api_key
@@ -928,7 +1161,13 @@ async def request_completion(prompt,
                              id_slot=None,
                              expect_api_error=None,
                              user_api_key=None,
-                             temperature=None) -> int | dict[str, Any]:
+                             temperature=None,
+                             image_data=None,
+                             priority=None,
+                             deadline_ms=None,
+                             n_draft=None,
+                             stop=None,
+                             stream=None) -> int | dict[str, Any]:
     if debug:
         print(f"Sending completion request: {prompt}")
     origin = "my.super.domain"
@@ -952,16 +1191,67 @@ async def request_completion(prompt,
                                     "seed": seed if seed is not None else 42,
                                     "temperature": temperature if temperature is not None else 0.8,
                                     "n_probs": 2,
+                                    "image_data": image_data,
+                                    "priority": priority,
+                                    "deadline_ms": deadline_ms,
+                                    "n_draft": n_draft,
+                                    "stop": stop if stop is not None else [],
+                                    "stream": stream is not None and stream,
                                 },
                                 headers=headers) as response:
             if expect_api_error is None or not expect_api_error:
                 assert response.status == 200
                 assert response.headers['Access-Control-Allow-Origin'] == origin
+                if stream:
+                    return await read_completion_stream(response)
                 return await response.json()
             else:
                 return response.status
 
 
+def http_request(context, path, body) -> bytes:
+    data = json.dumps(body).encode()
+    return (f"POST {path} HTTP/1.1\r\n"
+            f"Host: {context.server_fqdn}:{context.server_port}\r\n"
+            "Content-Type: application/json\r\n"
+            f"Content-Length: {len(data)}\r\n"
+            "\r\n").encode() + data
+
+
+async def read_http_response(reader) -> tuple[int, Any]:
+    # a response with a Content-Length, as the non-streamed completions
+    headers = (await reader.readuntil(b'\r\n\r\n')).decode().split('\r\n')
+    status = int(headers[0].split(' ')[1])
+    n_body = 0
+    for header in headers[1:]:
+        key, _, value = header.partition(':')
+        if key.strip().lower() == 'content-length':
+            n_body = int(value)
+    body = await reader.readexactly(n_body)
+    return status, json.loads(body) if n_body > 0 else None
+
+
+async def read_completion_stream(response) -> dict[str, Any]:
+    # the last event has the fields of a completion, its content and probabilities are those of the events before it
+    content = ''
+    probs = []
+    completion = None
+    async for line in response.content:
+        line = line.decode('utf-8').strip()
+        if not line.startswith('data: '):
+            continue
+        event = json.loads(line[len('data: '):])
+        if event['stop']:
+            completion = event
+            break
+        content += event['content']
+        probs.extend(event.get('completion_probabilities', []))
+    assert completion is not None, "the stream ended without a final event"
+    completion['content'] = content
+    completion['completion_probabilities'] = probs
+    return completion
+
+
 async def oai_chat_completions(user_prompt,
                                seed,
                                system_prompt,
@@ -1114,7 +1404,7 @@ async def request_embedding(content, seed, base_url=None) -> list[list[float]] |
 
 async def request_oai_embeddings(input, seed,
                                  base_url=None, user_api_key=None,
-                                 model=None, async_client=False) -> list[list[float]]:
+                                 model=None, async_client=False, expect_api_error=None) -> list[list[float]] | int:
     # openai client always expects an api_key
     user_api_key = user_api_key if user_api_key is not None else 'nope'
     if async_client:
@@ -1129,6 +1419,8 @@ async def request_oai_embeddings(input, seed,
                                         "model": model,
                                     },
                                     headers=headers) as response:
+                if expect_api_error is not None and expect_api_error:
+                    return response.status
                 assert response.status == 200, f"received status code not expected: {response.status}"
                 assert response.headers['Access-Control-Allow-Origin'] == origin
                 assert response.headers['Content-Type'] == "application/json; charset=utf-8"
@@ -1206,6 +1498,18 @@ def assert_all_predictions_different(completion_responses):
             assert content_i != content_j, "contents not different"
 
 
+def pick_stop_word(completion):
+    # a whole token generated in the second half of the completion, so that content and probabilities come before it.
+    # the stop word includes the leading space of the token: the streamed content ends at the last token before it
+    content = completion['content']
+    tokens = [prob['content'] for prob in completion['completion_probabilities']]
+    for token in tokens[len(tokens) // 2:]:
+        word = token.lstrip(' ')
+        if len(word) > 1 and word.isascii() and word.isalpha() and content.find(token) > 0:
+            return token
+    assert False, f"no word to stop at in {tokens}"
+
+
 def assert_all_token_probabilities_equal(completion_responses):
     n_predict = len(completion_responses[0]['completion_probabilities'])
     if 'DEBUG' in os.environ and os.environ['DEBUG'] == 'ON':
@@ -1328,6 +1632,79 @@ def context_text(context):
     return context.text.replace('\r', '')
 
 
+def write_random_mmproj(path, n_embd, seed=42):
+    # a tiny LLaVA-1.5 style projector (CLIP vision encoder + MLP) with random weights, projecting to n_embd
+    hidden, n_head, n_ff, n_layer, image_size, patch_size, proj = 64, 4, 128, 2, 48, 8, 128
+    n_pos = (image_size // patch_size) ** 2 + 1
+
+    writer = gguf.GGUFWriter(path, 'clip')
+    writer.add_file_type(gguf.LlamaFileType.MOSTLY_F16)
+    writer.add_name('random test projector')
+    writer.add_description('random weights, for tests only')
+    writer.add_bool('clip.has_text_encoder', False)
+    writer.add_bool('clip.has_vision_encoder', True)
+    writer.add_bool('clip.has_llava_projector', True)
+    writer.add_bool('clip.use_gelu', False)
+    writer.add_string('clip.projector_type', 'mlp')
+    writer.add_uint32('clip.vision.embedding_length', hidden)
+    writer.add_uint32('clip.vision.feed_forward_length', n_ff)
+    writer.add_uint32('clip.vision.block_count', n_layer)
+    writer.add_uint32('clip.vision.attention.head_count', n_head)
+    writer.add_float32('clip.vision.attention.layer_norm_epsilon', 1e-5)
+    writer.add_uint32('clip.vision.image_size', image_size)
+    writer.add_uint32('clip.vision.patch_size', patch_size)
+    writer.add_uint32('clip.vision.projection_dim', proj)
+    writer.add_array('clip.vision.image_mean', [0.48, 0.45, 0.40])
+    writer.add_array('clip.vision.image_std', [0.26, 0.26, 0.27])
+
+    rng = np.random.default_rng(seed)
+
+    # the shapes are in numpy order, the reverse of the ggml one
+    def add(name, *shape, ones=False):
+        data = np.ones(shape) if ones else rng.normal(0.0, 0.2, shape)
+        writer.add_tensor(name, data.astype(np.float32))
+
+    writer.add_tensor('v.patch_embd.weight', rng.normal(0.0, 0.2, (hidden, 3, patch_size, patch_size)).astype(np.float16))
+    add('v.position_embd.weight', n_pos, hidden)
+    add('v.class_embd', hidden)
+    add('v.pre_ln.weight', hidden, ones=True)
+    add('v.pre_ln.bias', hidden)
+    for il in range(n_layer):
+        for name in ('attn_q', 'attn_k', 'attn_v', 'attn_out'):
+            add(f'v.blk.{il}.{name}.weight', hidden, hidden)
+            add(f'v.blk.{il}.{name}.bias', hidden)
+        for name in ('ln1', 'ln2'):
+            add(f'v.blk.{il}.{name}.weight', hidden, ones=True)
+            add(f'v.blk.{il}.{name}.bias', hidden)
+        add(f'v.blk.{il}.ffn_down.weight', n_ff, hidden)
+        add(f'v.blk.{il}.ffn_down.bias', n_ff)
+        add(f'v.blk.{il}.ffn_up.weight', hidden, n_ff)
+        add(f'v.blk.{il}.ffn_up.bias', hidden)
+    add('mm.0.weight', proj, hidden)
+    add('mm.0.bias', proj)
+    add('mm.2.weight', n_embd, proj)
+    add('mm.2.bias', n_embd)
+
+    writer.write_header_to_file()
+    writer.write_kv_data_to_file()
+    writer.write_tensors_to_file()
+    writer.close()
+
+
+def random_bmp(width, height, seed):
+    # an uncompressed 24 bits BMP image with random pixels
+    rng = np.random.default_rng(seed)
+    row_size = (width * 3 + 3) // 4 * 4
+    pixels = bytearray()
+    for _ in range(height):
+        row = rng.integers(0, 256, width * 3, dtype=np.uint8).tobytes()
+        pixels += row + bytes(row_size - len(row))
+    header = b'BM' + (54 + len(pixels)).to_bytes(4, 'little') + bytes(4) + (54).to_bytes(4, 'little')
+    info = b''.join(v.to_bytes(4, 'little') for v in (40, width, height)) + (1).to_bytes(2, 'little') + (24).to_bytes(2, 'little') \
+        + b''.join(v.to_bytes(4, 'little') for v in (0, len(pixels), 2835, 2835, 0, 0))
+    return header + info + bytes(pixels)
+
+
 def start_server_background(context):
     if os.name == 'nt':
         context.server_path = '../../../build/bin/Release/llama-server.exe'
@@ -1386,6 +1763,18 @@ def start_server_background(context):
         server_args.extend(['--lora', context.lora_file])
     if context.disable_ctx_shift:
         server_args.extend(['--no-context-shift'])
+    if context.kv_hh_budget:
+        server_args.extend(['--kv-hh-budget', context.kv_hh_budget])
+    if context.http_event_loop:
+        server_args.append('--http-event-loop')
+    if context.mmproj_file:
+        server_args.extend(['--mmproj', context.mmproj_file])
+    if context.n_prefill_budget:
+        server_args.extend(['--prefill-budget', context.n_prefill_budget])
+    if context.server_preemption:
+        server_args.append('--preemption')
+    if context.server_spec_ngram:
+        server_args.append('--spec-ngram')
 
     args = [str(arg) for arg in [context.server_path, *server_args]]
     print(f"bench: starting server with: {' '.join(args)}")
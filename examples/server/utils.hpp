@@ -16,6 +16,8 @@
 #define JSON_ASSERT GGML_ASSERT
 #include "json.hpp"
 
+#include <algorithm>
+#include <cmath>
 #include <random>
 #include <sstream>
 #include <string>
@@ -51,14 +53,83 @@ static T json_value(const json & body, const std::string & key, const T & defaul
     }
 }
 
+//
+// image marker utils
+//
+
+struct image_marker {
+    size_t pos; // position of the marker in the prompt
+    size_t len; // length of the marker
+    int    id;
+};
+
+// find the [img-<id>] markers of a prompt, in order
+// a marker escaped with a backslash (\[img-<id>]) is text, see escape_image_markers
+static std::vector<image_marker> find_image_markers(const std::string & prompt) {
+    static const std::string prefix = "[img-";
+
+    std::vector<image_marker> res;
+
+    size_t pos = 0;
+    while ((pos = prompt.find(prefix, pos)) != std::string::npos) {
+        if (pos > 0 && prompt[pos - 1] == '\\') {
+            pos += prefix.size();
+            continue;
+        }
+
+        size_t end = pos + prefix.size();
+        while (end < prompt.size() && end - pos - prefix.size() < 9 && isdigit((unsigned char) prompt[end])) {
+            end++;
+        }
+
+        if (end > pos + prefix.size() && end < prompt.size() && prompt[end] == ']') {
+            res.push_back({pos, end + 1 - pos, std::stoi(prompt.substr(pos + prefix.size(), end - pos - prefix.size()))});
+            pos = end + 1;
+        } else {
+            pos += prefix.size();
+        }
+    }
+
+    return res;
+}
+
+// escape the [img-<id>] markers of a text, so that they are not taken for images
+static std::string escape_image_markers(const std::string & text) {
+    std::string res = text;
+    string_replace_all(res, "[img-", "\\[img-");
+    return res;
+}
+
+// the text of the escaped markers of a prompt with images
+static std::string unescape_image_markers(const std::string & text) {
+    std::string res = text;
+    string_replace_all(res, "\\[img-", "[img-");
+    return res;
+}
+
 //
 // chat template utils
 //
 
 // Format given chat. If tmpl is empty, we take the template from model metadata
-inline std::string format_chat(const struct llama_model * model, const std::string & tmpl, const std::vector<json> & messages) {
+// the "image_url" content parts are replaced by [img-<id>] markers and their base64 data is appended to images,
+// where id is the index in images - the markers in the text of a chat with images are escaped
+inline std::string format_chat(const struct llama_model * model, const std::string & tmpl, const std::vector<json> & messages, std::vector<std::string> * images = nullptr) {
     std::vector<llama_chat_msg> chat;
 
+    bool has_images = false;
+    for (const auto & msg : messages) {
+        if (msg.contains("content") && msg["content"].is_array()) {
+            for (const auto & part : msg["content"]) {
+                has_images |= part.contains("image_url");
+            }
+        }
+    }
+
+    const auto text = [&](const std::string & s) {
+        return has_images ? escape_image_markers(s) : s;
+    };
+
     for (size_t i = 0; i < messages.size(); ++i) {
         const auto & curr_msg = messages[i];
 
@@ -67,11 +138,28 @@ inline std::string format_chat(const struct llama_model * model, const std::stri
         std::string content;
         if (curr_msg.contains("content")) {
             if (curr_msg["content"].is_string()) {
-                content = curr_msg["content"].get<std::string>();
+                content = text(curr_msg["content"].get<std::string>());
             } else if (curr_msg["content"].is_array()) {
                 for (const auto & part : curr_msg["content"]) {
                     if (part.contains("text")) {
-                        content += "\n" + part["text"].get<std::string>();
+                        content += "\n" + text(part["text"].get<std::string>());
+                    } else if (part.contains("image_url")) {
+                        if (images == nullptr) {
+                            throw std::runtime_error("Image content is not supported here");
+                        }
+
+                        // either {"url": "..."} or the url itself
+                        const json & image_url = part["image_url"];
+                        const std::string url = image_url.is_string() ? image_url.get<std::string>() : json_value(image_url, "url", std::string());
+
+                        // only the images embedded in the request are supported, the server does not fetch urls
+                        const size_t pos = url.find(";base64,");
+                        if (url.rfind("data:image/", 0) != 0 || pos == std::string::npos) {
+                            throw std::runtime_error("Only base64 data urls (data:image/...;base64,...) are supported for \"image_url\"");
+                        }
+
+                        content += "[img-" + std::to_string(images->size()) + "]";
+                        images->push_back(url.substr(pos + 8));
                     }
                 }
             } else {
@@ -183,8 +271,9 @@ static std::string gen_chatcmplid() {
 //
 
 static size_t common_part(const std::vector<llama_token> & a, const std::vector<llama_token> & b) {
+    // LLAMA_TOKEN_NULL stands for an image position, two images are never assumed to be the same
     size_t i;
-    for (i = 0; i < a.size() && i < b.size() && a[i] == b[i]; i++) {}
+    for (i = 0; i < a.size() && i < b.size() && a[i] == b[i] && a[i] != LLAMA_TOKEN_NULL; i++) {}
 
     return i;
 }
@@ -216,6 +305,20 @@ static size_t find_partial_stop_string(const std::string &stop, const std::strin
     return std::string::npos;
 }
 
+// nearest-rank percentile (p in [0, 100]) of a set of samples, 0 if there are none
+static float percentile(std::vector<float> samples, float p) {
+    if (samples.empty()) {
+        return 0.0f;
+    }
+
+    // the smallest sample that is greater than or equal to p% of the samples
+    const int64_t n = samples.size();
+    const size_t  k = std::min(std::max((int64_t) std::ceil(p / 100.0f * n) - 1, (int64_t) 0), n - 1);
+    std::nth_element(samples.begin(), samples.begin() + k, samples.end());
+
+    return samples[k];
+}
+
 static bool json_is_array_of_numbers(const json & data) {
     if (data.is_array()) {
         for (const auto & e : data) {
@@ -292,7 +395,7 @@ static json probs_vector_to_json(const llama_context * ctx, const std::vector<co
     return out;
 }
 
-static bool server_sent_event(httplib::DataSink & sink, const char * event, const json & data) {
+static std::string format_server_sent_event(const char * event, const json & data) {
     const std::string str =
         std::string(event) + ": " +
         data.dump(-1, ' ', false, json::error_handler_t::replace) +
@@ -300,6 +403,12 @@ static bool server_sent_event(httplib::DataSink & sink, const char * event, cons
 
     LOG_DBG("data stream, to_send: %s", str.c_str());
 
+    return str;
+}
+
+static bool server_sent_event(httplib::DataSink & sink, const char * event, const json & data) {
+    const std::string str = format_server_sent_event(event, data);
+
     return sink.write(str.c_str(), str.size());
 }
 
@@ -316,7 +425,17 @@ static json oaicompat_completion_params_parse(
     llama_params["__oaicompat"] = true;
 
     // Apply chat template to the list of messages
-    llama_params["prompt"] = format_chat(model, chat_template, body.at("messages"));
+    std::vector<std::string> images;
+    llama_params["prompt"] = format_chat(model, chat_template, body.at("messages"), &images);
+
+    // Handle the images of the messages
+    if (!images.empty()) {
+        json image_data = json::array();
+        for (size_t i = 0; i < images.size(); ++i) {
+            image_data.push_back({{"id", i}, {"data", images[i]}});
+        }
+        llama_params["image_data"] = image_data;
+    }
 
     // Handle "stop" field
     if (body.contains("stop") && body.at("stop").is_string()) {
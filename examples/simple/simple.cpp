@@ -44,6 +44,8 @@ int main(int argc, char ** argv) {
 
     // initialize the context
 
+    gpt_params_resolve_cache_types(params, model);
+
     llama_context_params ctx_params = llama_context_params_from_gpt_params(params);
 
     llama_context * ctx = llama_new_context_with_model(model, ctx_params);
@@ -78,6 +78,9 @@ int main(int argc, char ** argv) {
     }
 
     params.cpuparams_batch.n_threads = params.draft_cpuparams_batch.n_threads;
+    // the layers of the per-layer KV cache types are the ones of the target model
+    params.cache_type_k_layers.clear();
+    params.cache_type_v_layers.clear();
     llama_init_result llama_init_dft = llama_init_from_gpt_params(params);
     model_dft = llama_init_dft.model;
     ctx_dft = llama_init_dft.context;
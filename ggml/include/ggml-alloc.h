@@ -66,6 +66,16 @@ GGML_API bool ggml_gallocr_alloc_graph(ggml_gallocr_t galloc, struct ggml_cgraph
 
 GGML_API size_t ggml_gallocr_get_buffer_size(ggml_gallocr_t galloc, int buffer_id);
 
+// statistics of the memory planner for the last reserve
+struct ggml_gallocr_plan_stats {
+    size_t sum;     // sum of the sizes of all the tensors allocated in the buffer, without any reuse
+    size_t peak;    // largest amount of memory in use at the same time (lower bound of the buffer size)
+    size_t greedy;  // buffer size with the free-block allocator in graph order
+    size_t planned; // buffer size with the lifetime-aware planner
+};
+
+GGML_API void ggml_gallocr_get_plan_stats(ggml_gallocr_t galloc, int buffer_id, struct ggml_gallocr_plan_stats * stats);
+
 // Utils
 // Create a buffer and allocate all the tensors in a ggml_context
 GGML_API struct ggml_backend_buffer * ggml_backend_alloc_ctx_tensors_from_buft(struct ggml_context * ctx, ggml_backend_buffer_type_t buft);
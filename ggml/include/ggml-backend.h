@@ -116,6 +116,21 @@ extern "C" {
     GGML_API ggml_backend_buffer_type_t ggml_backend_cpu_hbm_buffer_type(void);
 #endif
 
+    //
+    // NUMA node CPU backend
+    //
+
+    // CPU backend bound to a single NUMA node, for pipeline parallelism across the nodes with ggml_backend_sched
+    // graphs are computed asynchronously in a dispatcher thread pinned to the node, and the buffers are bound to the node memory
+    // the node buffers are not host buffers, so that other backends only access them through copies synchronized with the node
+    // returns NULL if NUMA is not supported on this platform or the node does not exist
+    GGML_API ggml_backend_t ggml_backend_cpu_numa_init(int node);
+
+    GGML_API GGML_CALL bool ggml_backend_is_cpu_numa(ggml_backend_t backend);
+    GGML_API           int  ggml_backend_cpu_numa_get_node(ggml_backend_t backend_cpu_numa);
+
+    GGML_API ggml_backend_buffer_type_t ggml_backend_cpu_numa_buffer_type(int node);
+
     //
     // Backend registry
     //
@@ -195,6 +210,7 @@ extern "C" {
     GGML_API int                  ggml_backend_sched_get_n_copies(ggml_backend_sched_t sched);
 
     GGML_API size_t               ggml_backend_sched_get_buffer_size(ggml_backend_sched_t sched, ggml_backend_t backend);
+    GGML_API void                 ggml_backend_sched_get_plan_stats(ggml_backend_sched_t sched, ggml_backend_t backend, struct ggml_gallocr_plan_stats * stats);
 
     GGML_API void                 ggml_backend_sched_set_tensor_backend(ggml_backend_sched_t sched, struct ggml_tensor * node, ggml_backend_t backend);
     GGML_API ggml_backend_t       ggml_backend_sched_get_tensor_backend(ggml_backend_sched_t sched, struct ggml_tensor * node);
@@ -211,6 +227,43 @@ extern "C" {
     // Set a callback to be called for each resulting node during graph compute
     GGML_API void                 ggml_backend_sched_set_eval_callback(ggml_backend_sched_t sched, ggml_backend_sched_eval_callback callback, void * user_data);
 
+    // Profiling of the graph compute, disabled by default
+    // while profiling, the backends are synchronized before and after each split to measure it in isolation
+    enum ggml_backend_sched_profile_level {
+        GGML_BACKEND_SCHED_PROFILE_NONE   = 0,
+        GGML_BACKEND_SCHED_PROFILE_SPLITS = 1, // splits and copies of the split inputs
+        GGML_BACKEND_SCHED_PROFILE_NODES  = 2, // also every node, each one computed separately
+    };
+
+    enum ggml_backend_sched_profile_type {
+        GGML_BACKEND_SCHED_PROFILE_SPLIT,
+        GGML_BACKEND_SCHED_PROFILE_COPY,
+        GGML_BACKEND_SCHED_PROFILE_NODE,
+    };
+
+    struct ggml_backend_sched_profile_event {
+        enum ggml_backend_sched_profile_type type;
+
+        int     graph;          // index of the graph compute since the profiling was enabled
+        int     split;          // index of the split in the graph
+        int     backend_id;     // backend of the split
+        int     src_backend_id; // source backend of a copy, -1 otherwise
+        enum ggml_op op;        // op of a node
+        int     n_nodes;        // number of nodes of a split
+        size_t  n_bytes;        // bytes copied, or size of the node output
+        int64_t t_start_us;
+        int64_t t_end_us;
+        char    name[GGML_MAX_NAME]; // node or split input tensor
+    };
+
+    GGML_API void ggml_backend_sched_set_profile(ggml_backend_sched_t sched, enum ggml_backend_sched_profile_level level);
+    GGML_API enum ggml_backend_sched_profile_level ggml_backend_sched_get_profile(ggml_backend_sched_t sched);
+
+    // events recorded since the last reset, the pointer is valid until the next graph compute or reset
+    GGML_API int                                             ggml_backend_sched_get_profile_n_events(ggml_backend_sched_t sched);
+    GGML_API const struct ggml_backend_sched_profile_event * ggml_backend_sched_get_profile_events  (ggml_backend_sched_t sched);
+    GGML_API void                                            ggml_backend_sched_reset_profile       (ggml_backend_sched_t sched);
+
     //
     // Utils
     //
@@ -493,6 +493,7 @@ extern "C" {
         GGML_OP_TRANSPOSE,
         GGML_OP_GET_ROWS,
         GGML_OP_GET_ROWS_BACK,
+        GGML_OP_SET_ROWS,
         GGML_OP_DIAG,
         GGML_OP_DIAG_MASK_INF,
         GGML_OP_DIAG_MASK_ZERO,
@@ -641,17 +642,36 @@ extern "C" {
         GGML_SCHED_PRIO_REALTIME
     };
 
+    // Adaptive polling level
+    // The polling level is picked before each graph from the measured gap between graph computations:
+    //   short gaps  -> aggressive polling
+    //   medium gaps -> no polling (cond_wait)
+    //   long gaps   -> the threadpool is paused after the graph
+#define GGML_THREADPOOL_POLL_ADAPTIVE UINT32_MAX
+
     // Threadpool params
     // Use ggml_threadpool_params_default() or ggml_threadpool_params_init() to populate the defaults
     struct ggml_threadpool_params {
         bool                cpumask[GGML_MAX_N_THREADS]; // mask of cpu cores (all-zeros means use default affinity settings)
         int                 n_threads;                   // number of threads
         enum ggml_sched_priority prio;                   // thread priority
-        uint32_t            poll;                        // polling level (0 - no polling, 100 - aggressive polling)
+        uint32_t            poll;                        // polling level (0 - no polling, 100 - aggressive polling, GGML_THREADPOOL_POLL_ADAPTIVE)
         bool                strict_cpu;                  // strict cpu placement
         bool                paused;                      // start in paused state
     };
 
+    // Threadpool statistics
+    // Counters are accumulated per worker thread and are only approximate while a graph is running
+    struct ggml_threadpool_stats {
+        int64_t  n_graphs;      // number of graphs computed
+        int64_t  n_spin_hits;   // number of times new work arrived while polling
+        int64_t  n_spin_misses; // number of times polling timed out and the thread fell back to cond_wait
+        int64_t  n_pauses;      // number of times the adaptive policy paused the threadpool
+        int64_t  t_spin_us;     // total time spent polling, summed over all threads
+        int64_t  t_gap_us;      // running average of the gap between graph computations
+        uint32_t poll;          // polling level used for the last graph
+    };
+
     struct ggml_threadpool;     // forward declaration, see ggml.c
 
     typedef struct ggml_threadpool * ggml_threadpool_t;
@@ -691,6 +711,7 @@ extern "C" {
         GGML_NUMA_STRATEGY_ISOLATE    = 2,
         GGML_NUMA_STRATEGY_NUMACTL    = 3,
         GGML_NUMA_STRATEGY_MIRROR     = 4,
+        GGML_NUMA_STRATEGY_PIPELINE   = 5, // one CPU backend per node, layers split across the nodes
         GGML_NUMA_STRATEGY_COUNT
     };
 
@@ -718,6 +739,11 @@ extern "C" {
     GGML_API void    ggml_numa_init(enum ggml_numa_strategy numa); // call once for better performance on NUMA systems
     GGML_API bool    ggml_is_numa(void); // true if init detected that system has >1 NUMA node
 
+    GGML_API enum ggml_numa_strategy ggml_numa_get_strategy(void);
+    GGML_API int     ggml_numa_n_nodes(void);
+    GGML_API int     ggml_numa_node_n_cpus(int node);
+    GGML_API bool    ggml_numa_node_cpumask(int node, bool * cpumask); // cpumask[GGML_MAX_N_THREADS], returns false if the node does not exist
+
     GGML_API void    ggml_print_object (const struct ggml_object * obj);
     GGML_API void    ggml_print_objects(const struct ggml_context * ctx);
 
@@ -1424,6 +1450,17 @@ extern "C" {
             struct ggml_tensor  * b,
             struct ggml_tensor  * c);
 
+    // a[c[i]] = b[i], in-place
+    // a: destination rows (ne[0] elements each, the rows do not have to be contiguous)
+    // b: F32 source rows
+    // c: I32 row indices into a, one per row of b
+    // returns a view of a
+    GGML_API struct ggml_tensor * ggml_set_rows(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * c);
+
     GGML_API struct ggml_tensor * ggml_diag(
         struct ggml_context     * ctx,
         struct ggml_tensor      * a);
@@ -2117,6 +2154,8 @@ extern "C" {
     GGML_API int                           ggml_threadpool_get_n_threads(struct ggml_threadpool * threadpool);
     GGML_API void                          ggml_threadpool_pause        (struct ggml_threadpool * threadpool);
     GGML_API void                          ggml_threadpool_resume       (struct ggml_threadpool * threadpool);
+    GGML_API void                          ggml_threadpool_get_stats    (struct ggml_threadpool * threadpool, struct ggml_threadpool_stats * stats);
+    GGML_API void                          ggml_threadpool_reset_stats  (struct ggml_threadpool * threadpool);
 
     // ggml_graph_plan() has to be called before ggml_graph_compute()
     // when plan.work_size > 0, caller must allocate memory for plan.work_data
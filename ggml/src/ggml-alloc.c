@@ -339,6 +339,17 @@ struct hash_node {
     int buffer_id;
     size_t offset; // offset within the buffer
     bool allocated;
+    int block_id;  // 1-based index of the memory block in galloc->blocks, 0 = none
+};
+
+// a memory block handed out by the dynamic allocator and the range of graph steps during which it is in use
+// a block can be shared by several tensors when the operations are computed in place
+struct mem_block {
+    int    buffer_id;
+    size_t size;
+    size_t offset;
+    int    start;
+    int    end;
 };
 
 struct tensor_alloc {
@@ -371,6 +382,14 @@ struct ggml_gallocr {
 
     struct leaf_alloc * leaf_allocs; // [n_leafs]
     int n_leafs;
+
+    // lifetimes of the blocks in the last reserve, used by the memory planner
+    struct mem_block * blocks;
+    int n_blocks;
+    int n_blocks_max;
+    int cur_step;
+
+    struct ggml_gallocr_plan_stats * plan_stats; // [n_buffers]
 };
 
 ggml_gallocr_t ggml_gallocr_new_n(ggml_backend_buffer_type_t * bufts, int n_bufs) {
@@ -386,6 +405,9 @@ ggml_gallocr_t ggml_gallocr_new_n(ggml_backend_buffer_type_t * bufts, int n_bufs
     galloc->buf_tallocs = calloc(n_bufs, sizeof(struct ggml_dyn_tallocr *));
     GGML_ASSERT(galloc->buf_tallocs != NULL);
 
+    galloc->plan_stats = calloc(n_bufs, sizeof(struct ggml_gallocr_plan_stats));
+    GGML_ASSERT(galloc->plan_stats != NULL);
+
     for (int i = 0; i < n_bufs; i++) {
         galloc->bufts[i] = bufts[i];
         galloc->buffers[i] = NULL;
@@ -453,6 +475,8 @@ void ggml_gallocr_free(ggml_gallocr_t galloc) {
     free(galloc->buf_tallocs);
     free(galloc->node_allocs);
     free(galloc->leaf_allocs);
+    free(galloc->blocks);
+    free(galloc->plan_stats);
     free(galloc);
 }
 
@@ -478,6 +502,23 @@ static bool ggml_gallocr_is_allocated(ggml_gallocr_t galloc, struct ggml_tensor
     return t->data != NULL || ggml_gallocr_hash_get(galloc, t)->allocated;
 }
 
+static int ggml_gallocr_new_block(ggml_gallocr_t galloc, int buffer_id, size_t size) {
+    if (galloc->n_blocks == galloc->n_blocks_max) {
+        galloc->n_blocks_max = MAX(256, 2*galloc->n_blocks_max);
+        galloc->blocks = realloc(galloc->blocks, galloc->n_blocks_max * sizeof(struct mem_block));
+        GGML_ASSERT(galloc->blocks != NULL);
+    }
+
+    struct mem_block * block = &galloc->blocks[galloc->n_blocks++];
+    block->buffer_id = buffer_id;
+    block->size      = aligned_offset(NULL, size, galloc->buf_tallocs[buffer_id]->alignment);
+    block->offset    = 0;
+    block->start     = galloc->cur_step;
+    block->end       = INT_MAX; // never freed
+
+    return galloc->n_blocks;
+}
+
 static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor * node, int buffer_id) {
     struct hash_node * hn = ggml_gallocr_hash_get(galloc, node);
 
@@ -520,6 +561,7 @@ static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor
                             assert(view_src_hn->offset == p_hn->offset);
                             hn->buffer_id = p_hn->buffer_id;
                             hn->offset = p_hn->offset;
+                            hn->block_id = view_src_hn->block_id;
                             p_hn->allocated = false; // avoid freeing the parent
                             view_src_hn->allocated = false;
                             return;
@@ -528,6 +570,7 @@ static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor
                         AT_PRINTF("reusing parent %s for %s\n", parent->name, node->name);
                         hn->buffer_id = p_hn->buffer_id;
                         hn->offset = p_hn->offset;
+                        hn->block_id = p_hn->block_id;
                         p_hn->allocated = false; // avoid freeing the parent
                         return;
                     }
@@ -541,6 +584,7 @@ static void ggml_gallocr_allocate_node(ggml_gallocr_t galloc, struct ggml_tensor
         size_t offset = ggml_dyn_tallocr_alloc(alloc, size, node);
         hn->buffer_id = buffer_id;
         hn->offset = offset;
+        hn->block_id = ggml_gallocr_new_block(galloc, buffer_id, size);
         return;
     }
 }
@@ -560,6 +604,10 @@ static void ggml_gallocr_free_node(ggml_gallocr_t galloc, struct ggml_tensor * n
     size_t size = ggml_backend_buft_get_alloc_size(buft, node);
     ggml_dyn_tallocr_free_tensor(alloc, offset, size, node);
     hn->allocated = false;
+
+    if (hn->block_id > 0) {
+        galloc->blocks[hn->block_id - 1].end = galloc->cur_step;
+    }
 }
 
 static int get_node_buffer_id(const int * node_buffer_ids, int i) {
@@ -571,6 +619,10 @@ static void ggml_gallocr_alloc_graph_impl(ggml_gallocr_t galloc, struct ggml_cgr
     ggml_hash_set_reset(&galloc->hash_set);
     memset(galloc->hash_values, 0, sizeof(struct hash_node) * galloc->hash_set.size);
 
+    // leafs and inputs are allocated at step 0, node i at step i + 1
+    galloc->n_blocks = 0;
+    galloc->cur_step = 0;
+
     // allocate leafs
     // these may be tensors that the application is not using in the graph, but may still want to allocate for other purposes
     for (int i = 0; i < graph->n_leafs; i++) {
@@ -616,6 +668,8 @@ static void ggml_gallocr_alloc_graph_impl(ggml_gallocr_t galloc, struct ggml_cgr
         struct ggml_tensor * node = graph->nodes[i];
         int buffer_id = get_node_buffer_id(node_buffer_ids, i);
 
+        galloc->cur_step = i + 1;
+
         // allocate parents (only leafs need to be allocated at this point)
         for (int j = 0; j < GGML_MAX_SRC; j++) {
             struct ggml_tensor * parent = node->src[j];
@@ -673,6 +727,152 @@ static void ggml_gallocr_alloc_graph_impl(ggml_gallocr_t galloc, struct ggml_cgr
     }
 }
 
+// memory planner
+
+static int mem_block_cmp_size(const void * a, const void * b) {
+    const struct mem_block * ba = *(const struct mem_block * const *) a;
+    const struct mem_block * bb = *(const struct mem_block * const *) b;
+    if (ba->size != bb->size) {
+        return ba->size > bb->size ? -1 : 1;
+    }
+    return ba->start - bb->start;
+}
+
+static int mem_block_cmp_offset(const void * a, const void * b) {
+    const struct mem_block * ba = *(const struct mem_block * const *) a;
+    const struct mem_block * bb = *(const struct mem_block * const *) b;
+    if (ba->offset != bb->offset) {
+        return ba->offset < bb->offset ? -1 : 1;
+    }
+    return 0;
+}
+
+static bool mem_blocks_overlap(const struct mem_block * a, const struct mem_block * b) {
+    return a->start <= b->end && b->start <= a->end;
+}
+
+// assign the offsets of the blocks from their lifetimes over the whole graph
+// the blocks are placed from the largest to the smallest, each one in the smallest gap that fits between the already
+// placed blocks that are in use at the same time
+// returns the resulting buffer size
+static size_t ggml_gallocr_plan_blocks(struct mem_block ** blocks, int n_blocks, struct mem_block ** live) {
+    qsort(blocks, n_blocks, sizeof(blocks[0]), mem_block_cmp_size);
+
+    size_t max_size = 0;
+
+    for (int i = 0; i < n_blocks; i++) {
+        struct mem_block * block = blocks[i];
+
+        int n_live = 0;
+        for (int j = 0; j < i; j++) {
+            if (mem_blocks_overlap(block, blocks[j])) {
+                live[n_live++] = blocks[j];
+            }
+        }
+        qsort(live, n_live, sizeof(live[0]), mem_block_cmp_offset);
+
+        size_t best_offset = SIZE_MAX;
+        size_t best_size   = SIZE_MAX;
+        size_t offset      = 0;
+        for (int j = 0; j < n_live; j++) {
+            if (live[j]->offset >= offset + block->size && live[j]->offset - offset < best_size) {
+                best_offset = offset;
+                best_size   = live[j]->offset - offset;
+            }
+            offset = MAX(offset, live[j]->offset + live[j]->size);
+        }
+        if (best_offset == SIZE_MAX) {
+            // no gap, place after the last live block
+            best_offset = offset;
+        }
+
+        block->offset = best_offset;
+        max_size = MAX(max_size, best_offset + block->size);
+    }
+
+    return max_size;
+}
+
+// re-plan the offsets of the blocks handed out by the dynamic allocators and keep the plan when it results in smaller buffers
+static void ggml_gallocr_plan(ggml_gallocr_t galloc, int n_steps) {
+    struct mem_block ** blocks   = malloc(MAX(1, galloc->n_blocks) * sizeof(struct mem_block *));
+    struct mem_block ** live     = malloc(MAX(1, galloc->n_blocks) * sizeof(struct mem_block *));
+    int64_t          *  usage    = malloc((n_steps + 1) * sizeof(int64_t));
+    bool             *  use_plan = calloc(galloc->n_buffers, sizeof(bool));
+    GGML_ASSERT(blocks != NULL && live != NULL && usage != NULL && use_plan != NULL);
+
+    for (int i = 0; i < galloc->n_buffers; i++) {
+        struct ggml_dyn_tallocr * alloc = galloc->buf_tallocs[i];
+
+        // buffers of the same type share the allocator
+        int shared = -1;
+        for (int j = 0; j < i; j++) {
+            if (galloc->buf_tallocs[j] == alloc) {
+                shared = j;
+                break;
+            }
+        }
+        if (shared >= 0) {
+            galloc->plan_stats[i] = galloc->plan_stats[shared];
+            use_plan[i] = use_plan[shared];
+            continue;
+        }
+
+        memset(usage, 0, (n_steps + 1) * sizeof(int64_t));
+
+        int n = 0;
+        size_t sum = 0;
+        for (int b = 0; b < galloc->n_blocks; b++) {
+            struct mem_block * block = &galloc->blocks[b];
+            if (galloc->buf_tallocs[block->buffer_id] != alloc) {
+                continue;
+            }
+            blocks[n++] = block;
+            sum += block->size;
+
+            const int end = block->end < n_steps ? block->end : n_steps - 1;
+            usage[block->start] += block->size;
+            usage[end + 1]      -= block->size;
+        }
+
+        size_t peak = 0;
+        int64_t cur = 0;
+        for (int t = 0; t < n_steps; t++) {
+            cur += usage[t];
+            peak = MAX(peak, (size_t) cur);
+        }
+
+        const size_t greedy  = ggml_dyn_tallocr_max_size(alloc);
+        const size_t planned = ggml_gallocr_plan_blocks(blocks, n, live);
+
+        galloc->plan_stats[i] = (struct ggml_gallocr_plan_stats) {
+            /*.sum     = */ sum,
+            /*.peak    = */ peak,
+            /*.greedy  = */ greedy,
+            /*.planned = */ planned,
+        };
+
+        if (planned < greedy) {
+            alloc->max_size = planned;
+            use_plan[i] = true;
+        }
+
+        AT_PRINTF("%s: buffer %d: sum = %zu, peak = %zu, greedy = %zu, planned = %zu\n", __func__, i, sum, peak, greedy, planned);
+    }
+
+    for (size_t i = 0; i < galloc->hash_set.size; i++) {
+        struct hash_node * hn = &galloc->hash_values[i];
+        if (hn->block_id > 0 && use_plan[hn->buffer_id]) {
+            hn->offset = galloc->blocks[hn->block_id - 1].offset;
+        }
+    }
+
+    free(blocks);
+    free(live);
+    free(usage);
+    free(use_plan);
+}
+
 bool ggml_gallocr_reserve_n(ggml_gallocr_t galloc, struct ggml_cgraph * graph, const int * node_buffer_ids, const int * leaf_buffer_ids) {
     size_t min_hash_size = graph->n_nodes + graph->n_leafs;
     // add 25% margin to avoid hash collisions
@@ -697,6 +897,9 @@ bool ggml_gallocr_reserve_n(ggml_gallocr_t galloc, struct ggml_cgraph * graph, c
     // allocate in hash table
     ggml_gallocr_alloc_graph_impl(galloc, graph, node_buffer_ids, leaf_buffer_ids);
 
+    // lifetime-aware offsets, if they need less memory than the allocation in graph order
+    ggml_gallocr_plan(galloc, graph->n_nodes + 1);
+
     // set the node_allocs from the hash table
     if (galloc->n_nodes < graph->n_nodes) {
         free(galloc->node_allocs);
@@ -913,6 +1116,12 @@ bool ggml_gallocr_alloc_graph(ggml_gallocr_t galloc, struct ggml_cgraph * graph)
     return true;
 }
 
+void ggml_gallocr_get_plan_stats(ggml_gallocr_t galloc, int buffer_id, struct ggml_gallocr_plan_stats * stats) {
+    GGML_ASSERT(buffer_id >= 0 && buffer_id < galloc->n_buffers);
+
+    *stats = galloc->plan_stats[buffer_id];
+}
+
 size_t ggml_gallocr_get_buffer_size(ggml_gallocr_t galloc, int buffer_id) {
     GGML_ASSERT(buffer_id >= 0 && buffer_id < galloc->n_buffers);
 
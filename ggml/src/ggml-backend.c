@@ -849,12 +849,23 @@ GGML_CALL static bool ggml_backend_cpu_supports_op(ggml_backend_t backend, const
                 op->type != GGML_TYPE_IQ2_XS  &&
                 op->type != GGML_TYPE_IQ1_S   &&
                 op->type != GGML_TYPE_IQ1_M; // missing type_traits.from_float
+        case GGML_OP_SET_ROWS:
+            if (op->nb[0] != ggml_type_size(op->type)) {
+                return op->type == GGML_TYPE_F32 || op->type == GGML_TYPE_F16;
+            }
+            return
+                op->type != GGML_TYPE_IQ2_XXS &&
+                op->type != GGML_TYPE_IQ2_XS  &&
+                op->type != GGML_TYPE_IQ1_S   &&
+                op->type != GGML_TYPE_IQ1_M; // missing type_traits.from_float
         case GGML_OP_MUL_MAT:
             return op->src[1]->type == GGML_TYPE_F32 || op->src[1]->type == ggml_internal_get_type_traits(op->src[0]->type).vec_dot_type;
         case GGML_OP_ROPE_BACK:
             return op->src[2] == NULL && (op->op_params[2] & 4) == 0;
         case GGML_OP_IM2COL_BACK:
             return op->src[0]->type == GGML_TYPE_F32 && op->src[1]->type == GGML_TYPE_F32;
+        case GGML_OP_OUT_PROD:
+            return (op->src[0]->type == GGML_TYPE_F32 || ggml_is_quantized(op->src[0]->type)) && op->src[1]->type == GGML_TYPE_F32;
         default:
             return true;
     }
@@ -928,7 +939,7 @@ GGML_CALL bool ggml_backend_is_cpu(ggml_backend_t backend) {
 }
 
 void ggml_backend_cpu_set_n_threads(ggml_backend_t backend_cpu, int n_threads) {
-    GGML_ASSERT(ggml_backend_is_cpu(backend_cpu));
+    GGML_ASSERT(ggml_backend_is_cpu(backend_cpu) || ggml_backend_is_cpu_numa(backend_cpu));
 
     struct ggml_backend_cpu_context * ctx = (struct ggml_backend_cpu_context *)backend_cpu->context;
     ctx->n_threads = n_threads;
@@ -947,7 +958,7 @@ void ggml_backend_cpu_set_threadpool(ggml_backend_t backend_cpu, ggml_threadpool
 }
 
 void ggml_backend_cpu_set_abort_callback(ggml_backend_t backend_cpu, ggml_abort_callback abort_callback, void * abort_callback_data) {
-    GGML_ASSERT(ggml_backend_is_cpu(backend_cpu));
+    GGML_ASSERT(ggml_backend_is_cpu(backend_cpu) || ggml_backend_is_cpu_numa(backend_cpu));
 
     struct ggml_backend_cpu_context * ctx = (struct ggml_backend_cpu_context *)backend_cpu->context;
     ctx->abort_callback = abort_callback;
@@ -966,6 +977,671 @@ GGML_CALL static ggml_backend_t ggml_backend_reg_cpu_init(const char * params, v
     GGML_UNUSED(user_data);
 }
 
+// NUMA node CPU backend
+
+#define GGML_CPU_NUMA_MAX_NODES 8   // same as GGML_NUMA_MAX_NODES in ggml.c
+#define GGML_CPU_NUMA_MAX_TASKS 256 // maximum number of operations queued on a node
+
+static ggml_guid_t ggml_backend_cpu_numa_guid(void) {
+    static ggml_guid guid = { 0x3f, 0x1c, 0x8e, 0x52, 0xa4, 0x07, 0x4b, 0xd9, 0x91, 0x6e, 0x2d, 0xc8, 0x5b, 0x70, 0xe3, 0x14 };
+    return &guid;
+}
+
+GGML_CALL bool ggml_backend_is_cpu_numa(ggml_backend_t backend) {
+    return backend != NULL && ggml_guid_matches(backend->guid, ggml_backend_cpu_numa_guid());
+}
+
+#if defined(__gnu_linux__)
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+
+// buffer type
+
+struct ggml_backend_cpu_numa_buffer_type_context {
+    int  node;
+    char name[16];
+};
+
+GGML_CALL static const char * ggml_backend_cpu_numa_buffer_type_get_name(ggml_backend_buffer_type_t buft) {
+    struct ggml_backend_cpu_numa_buffer_type_context * ctx = (struct ggml_backend_cpu_numa_buffer_type_context *)buft->context;
+
+    return ctx->name;
+}
+
+static bool ggml_backend_buft_is_cpu_numa(ggml_backend_buffer_type_t buft) {
+    return buft->iface.get_name == ggml_backend_cpu_numa_buffer_type_get_name;
+}
+
+GGML_CALL static const char * ggml_backend_cpu_numa_buffer_get_name(ggml_backend_buffer_t buffer) {
+    return ggml_backend_buft_name(buffer->buft);
+}
+
+GGML_CALL static void ggml_backend_cpu_numa_buffer_free_buffer(ggml_backend_buffer_t buffer) {
+    munmap(buffer->context, buffer->size);
+}
+
+// the buffers may still be accessed by the queued tasks of any node, as the copies between nodes are queued on the source node
+// the synchronous accesses wait for the queues of all the NUMA backends
+static void ggml_backend_cpu_numa_drain(void);
+
+GGML_CALL static void ggml_backend_cpu_numa_buffer_memset_tensor(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor, uint8_t value, size_t offset, size_t size) {
+    ggml_backend_cpu_numa_drain();
+    ggml_backend_cpu_buffer_memset_tensor(buffer, tensor, value, offset, size);
+}
+
+GGML_CALL static void ggml_backend_cpu_numa_buffer_set_tensor(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
+    ggml_backend_cpu_numa_drain();
+    ggml_backend_cpu_buffer_set_tensor(buffer, tensor, data, offset, size);
+}
+
+GGML_CALL static void ggml_backend_cpu_numa_buffer_get_tensor(ggml_backend_buffer_t buffer, const struct ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+    ggml_backend_cpu_numa_drain();
+    ggml_backend_cpu_buffer_get_tensor(buffer, tensor, data, offset, size);
+}
+
+GGML_CALL static bool ggml_backend_cpu_numa_buffer_cpy_tensor(ggml_backend_buffer_t buffer, const struct ggml_tensor * src, struct ggml_tensor * dst) {
+    if (ggml_backend_buffer_is_host(src->buffer) || ggml_backend_buft_is_cpu_numa(src->buffer->buft)) {
+        ggml_backend_cpu_numa_drain();
+        memcpy(dst->data, src->data, ggml_nbytes(src));
+        return true;
+    }
+    return false;
+
+    GGML_UNUSED(buffer);
+}
+
+GGML_CALL static void ggml_backend_cpu_numa_buffer_clear(ggml_backend_buffer_t buffer, uint8_t value) {
+    ggml_backend_cpu_numa_drain();
+    ggml_backend_cpu_buffer_clear(buffer, value);
+}
+
+static struct ggml_backend_buffer_i cpu_numa_backend_buffer_i = {
+    /* .get_name        = */ ggml_backend_cpu_numa_buffer_get_name,
+    /* .free_buffer     = */ ggml_backend_cpu_numa_buffer_free_buffer,
+    /* .get_base        = */ ggml_backend_cpu_buffer_get_base,
+    /* .init_tensor     = */ NULL, // no initialization required
+    /* .memset_tensor   = */ ggml_backend_cpu_numa_buffer_memset_tensor,
+    /* .set_tensor      = */ ggml_backend_cpu_numa_buffer_set_tensor,
+    /* .get_tensor      = */ ggml_backend_cpu_numa_buffer_get_tensor,
+    /* .cpy_tensor      = */ ggml_backend_cpu_numa_buffer_cpy_tensor,
+    /* .clear           = */ ggml_backend_cpu_numa_buffer_clear,
+    /* .reset           = */ NULL,
+};
+
+GGML_CALL static ggml_backend_buffer_t ggml_backend_cpu_numa_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
+    struct ggml_backend_cpu_numa_buffer_type_context * ctx = (struct ggml_backend_cpu_numa_buffer_type_context *)buft->context;
+
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    size = GGML_PAD(MAX(size, 1), page_size);
+
+    void * data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "%s: failed to allocate buffer of size %zu\n", __func__, size);
+        return NULL;
+    }
+
+    // the pages are allocated on the node when they are first touched
+    unsigned long nodemask = 1ul << ctx->node;
+    if (syscall(SYS_mbind, data, size, MPOL_BIND, &nodemask, sizeof(nodemask)*8, 0) != 0) {
+        static bool warned = false;
+        if (!warned) {
+            fprintf(stderr, "%s: warning: failed to bind buffer to NUMA node %d: %s\n", __func__, ctx->node, strerror(errno));
+            warned = true;
+        }
+    }
+
+    return ggml_backend_buffer_init(buft, cpu_numa_backend_buffer_i, data, size);
+}
+
+GGML_CALL static bool ggml_backend_cpu_numa_buffer_type_is_host(ggml_backend_buffer_type_t buft) {
+    // the data is accessible from the CPU, but it is written asynchronously by the node backend
+    // other CPU backends must not use it directly, as they would not be synchronized with the node
+    return false;
+
+    GGML_UNUSED(buft);
+}
+
+ggml_backend_buffer_type_t ggml_backend_cpu_numa_buffer_type(int node) {
+    static struct ggml_backend_cpu_numa_buffer_type_context ggml_backend_cpu_numa_buffer_type_contexts[GGML_CPU_NUMA_MAX_NODES];
+    static struct ggml_backend_buffer_type ggml_backend_cpu_numa_buffer_types[GGML_CPU_NUMA_MAX_NODES];
+
+    if (node < 0 || node >= GGML_CPU_NUMA_MAX_NODES || node >= ggml_numa_n_nodes()) {
+        return NULL;
+    }
+
+    if (ggml_backend_cpu_numa_buffer_types[node].context == NULL) {
+        struct ggml_backend_cpu_numa_buffer_type_context * ctx = &ggml_backend_cpu_numa_buffer_type_contexts[node];
+        ctx->node = node;
+        snprintf(ctx->name, sizeof(ctx->name), "CPU_NUMA%d", node);
+
+        ggml_backend_cpu_numa_buffer_types[node] = (struct ggml_backend_buffer_type) {
+            /* .iface = */ {
+                /* .get_name         = */ ggml_backend_cpu_numa_buffer_type_get_name,
+                /* .alloc_buffer     = */ ggml_backend_cpu_numa_buffer_type_alloc_buffer,
+                /* .get_alignment    = */ ggml_backend_cpu_buffer_type_get_alignment,
+                /* .get_max_size     = */ NULL, // defaults to SIZE_MAX
+                /* .get_alloc_size   = */ NULL, // defaults to ggml_nbytes
+                /* .is_host          = */ ggml_backend_cpu_numa_buffer_type_is_host,
+            },
+            /* .context = */ ctx,
+        };
+    }
+
+    return &ggml_backend_cpu_numa_buffer_types[node];
+}
+
+// backend
+
+// operations are queued by the scheduler and executed in order by the dispatcher thread of the node
+enum ggml_backend_cpu_numa_op {
+    GGML_CPU_NUMA_OP_COMPUTE,
+    GGML_CPU_NUMA_OP_COPY,
+    GGML_CPU_NUMA_OP_WAIT,
+};
+
+struct ggml_backend_cpu_numa_context;
+
+struct ggml_backend_cpu_numa_task {
+    enum ggml_backend_cpu_numa_op op;
+
+    // GGML_CPU_NUMA_OP_COMPUTE, owned by the task
+    struct ggml_cgraph * graph;
+
+    // GGML_CPU_NUMA_OP_COPY
+    void       * dst;
+    const void * src;
+    size_t       size;
+
+    // GGML_CPU_NUMA_OP_WAIT, until the given number of tasks of another node are done
+    struct ggml_backend_cpu_numa_context * other;
+    uint64_t                               n_done;
+};
+
+struct ggml_backend_cpu_numa_context {
+    struct ggml_backend_cpu_context cpu; // must be first, shared with the CPU backend functions
+
+    int  node;
+    int  n_cpus;
+    char name[16];
+
+    pthread_t       thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond; // signaled when a task is queued or done
+
+    struct ggml_backend_cpu_numa_task tasks[GGML_CPU_NUMA_MAX_TASKS];
+    uint64_t n_submitted;
+    uint64_t n_done;
+    bool     stop;
+
+    enum ggml_status status; // first error of the queued graphs
+
+    struct ggml_backend_cpu_numa_context * next; // list of the live backends
+};
+
+static pthread_mutex_t ggml_backend_cpu_numa_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct ggml_backend_cpu_numa_context * ggml_backend_cpu_numa_list = NULL;
+
+struct ggml_backend_cpu_numa_event {
+    uint64_t n_submitted;
+};
+
+// the graph and its tensors belong to the scheduler and may be reused before the queued compute runs, so the task keeps a copy
+// the copies are only used for computing: the sources of the nodes are copied one level deep
+static struct ggml_cgraph * ggml_backend_cpu_numa_graph_dup(const struct ggml_cgraph * cgraph) {
+    const int n_nodes = cgraph->n_nodes;
+
+    int n_tensors = n_nodes;
+    for (int i = 0; i < n_nodes; i++) {
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            if (cgraph->nodes[i]->src[j] != NULL) {
+                n_tensors++;
+            }
+        }
+    }
+
+    const size_t size = sizeof(struct ggml_cgraph) + n_nodes*sizeof(struct ggml_tensor *) + n_tensors*sizeof(struct ggml_tensor);
+    char * mem = malloc(size);
+    GGML_ASSERT(mem != NULL);
+
+    struct ggml_cgraph  * graph   = (struct ggml_cgraph *) mem;
+    struct ggml_tensor ** nodes   = (struct ggml_tensor **)(mem + sizeof(struct ggml_cgraph));
+    struct ggml_tensor  * tensors = (struct ggml_tensor *) (mem + sizeof(struct ggml_cgraph) + n_nodes*sizeof(struct ggml_tensor *));
+
+    *graph = (struct ggml_cgraph) {
+        /*.size             =*/ n_nodes,
+        /*.n_nodes          =*/ n_nodes,
+        /*.n_leafs          =*/ 0,
+        /*.nodes            =*/ nodes,
+        /*.grads            =*/ NULL,
+        /*.leafs            =*/ NULL,
+        /*.visited_hash_set =*/ { 0, NULL, NULL },
+        /*.order            =*/ cgraph->order,
+    };
+
+    int k = 0;
+    for (int i = 0; i < n_nodes; i++) {
+        struct ggml_tensor * node = &tensors[k++];
+        *node = *cgraph->nodes[i];
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            if (node->src[j] != NULL) {
+                tensors[k] = *node->src[j];
+                node->src[j] = &tensors[k++];
+            }
+        }
+        nodes[i] = node;
+    }
+
+    return graph;
+}
+
+static uint64_t ggml_backend_cpu_numa_submit(struct ggml_backend_cpu_numa_context * ctx, const struct ggml_backend_cpu_numa_task * task) {
+    pthread_mutex_lock(&ctx->mutex);
+    while (ctx->n_submitted - ctx->n_done >= GGML_CPU_NUMA_MAX_TASKS) {
+        pthread_cond_wait(&ctx->cond, &ctx->mutex);
+    }
+    ctx->tasks[ctx->n_submitted % GGML_CPU_NUMA_MAX_TASKS] = *task;
+    const uint64_t n_submitted = ++ctx->n_submitted;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->mutex);
+
+    return n_submitted;
+}
+
+static uint64_t ggml_backend_cpu_numa_n_submitted(struct ggml_backend_cpu_numa_context * ctx) {
+    pthread_mutex_lock(&ctx->mutex);
+    const uint64_t n_submitted = ctx->n_submitted;
+    pthread_mutex_unlock(&ctx->mutex);
+
+    return n_submitted;
+}
+
+static void ggml_backend_cpu_numa_wait(struct ggml_backend_cpu_numa_context * ctx, uint64_t n_done) {
+    pthread_mutex_lock(&ctx->mutex);
+    while (ctx->n_done < n_done) {
+        pthread_cond_wait(&ctx->cond, &ctx->mutex);
+    }
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+static void ggml_backend_cpu_numa_drain(void) {
+    pthread_mutex_lock(&ggml_backend_cpu_numa_list_mutex);
+    for (struct ggml_backend_cpu_numa_context * ctx = ggml_backend_cpu_numa_list; ctx != NULL; ctx = ctx->next) {
+        ggml_backend_cpu_numa_wait(ctx, ggml_backend_cpu_numa_n_submitted(ctx));
+    }
+    pthread_mutex_unlock(&ggml_backend_cpu_numa_list_mutex);
+}
+
+static enum ggml_status ggml_backend_cpu_numa_compute(struct ggml_backend_cpu_numa_context * ctx, struct ggml_cgraph * cgraph) {
+    struct ggml_backend_cpu_context * cpu_ctx = &ctx->cpu;
+
+    const int n_threads = MIN(cpu_ctx->n_threads, ctx->n_cpus);
+
+    struct ggml_cplan cplan = ggml_graph_plan(cgraph, n_threads, cpu_ctx->threadpool);
+
+    if (cpu_ctx->work_size < cplan.work_size) {
+        free(cpu_ctx->work_data);
+        cpu_ctx->work_data = malloc(cplan.work_size);
+        if (cpu_ctx->work_data == NULL) {
+            cpu_ctx->work_size = 0;
+            return GGML_STATUS_ALLOC_FAILED;
+        }
+        cpu_ctx->work_size = cplan.work_size;
+    }
+    cplan.work_data = cpu_ctx->work_data;
+
+    cplan.abort_callback      = cpu_ctx->abort_callback;
+    cplan.abort_callback_data = cpu_ctx->abort_callback_data;
+
+    return ggml_graph_compute(cgraph, &cplan);
+}
+
+static void * ggml_backend_cpu_numa_thread(void * data) {
+    struct ggml_backend_cpu_numa_context * ctx = (struct ggml_backend_cpu_numa_context *)data;
+
+    // the dispatcher is the main thread of the threadpool of the node
+    struct ggml_threadpool_params tpp = ggml_threadpool_params_default(MIN(ctx->n_cpus, GGML_MAX_N_THREADS));
+    ggml_numa_node_cpumask(ctx->node, tpp.cpumask);
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    for (int i = 0; i < GGML_MAX_N_THREADS && i < CPU_SETSIZE; i++) {
+        if (tpp.cpumask[i]) {
+            CPU_SET(i, &cpuset);
+        }
+    }
+    int rv = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    if (rv != 0) {
+        fprintf(stderr, "%s: warning: failed to set affinity to NUMA node %d: %s\n", __func__, ctx->node, strerror(rv));
+    }
+
+    ctx->cpu.threadpool = ggml_threadpool_new(&tpp);
+
+    pthread_mutex_lock(&ctx->mutex);
+    while (true) {
+        while (ctx->n_done == ctx->n_submitted && !ctx->stop) {
+            pthread_cond_wait(&ctx->cond, &ctx->mutex);
+        }
+        if (ctx->n_done == ctx->n_submitted) {
+            break;
+        }
+        struct ggml_backend_cpu_numa_task task = ctx->tasks[ctx->n_done % GGML_CPU_NUMA_MAX_TASKS];
+        pthread_mutex_unlock(&ctx->mutex);
+
+        enum ggml_status status = GGML_STATUS_SUCCESS;
+        switch (task.op) {
+            case GGML_CPU_NUMA_OP_COMPUTE:
+                status = ggml_backend_cpu_numa_compute(ctx, task.graph);
+                free(task.graph);
+                break;
+            case GGML_CPU_NUMA_OP_COPY:
+                memcpy(task.dst, task.src, task.size);
+                break;
+            case GGML_CPU_NUMA_OP_WAIT:
+                ggml_backend_cpu_numa_wait(task.other, task.n_done);
+                break;
+        }
+
+        pthread_mutex_lock(&ctx->mutex);
+        if (status != GGML_STATUS_SUCCESS && ctx->status == GGML_STATUS_SUCCESS) {
+            ctx->status = status;
+        }
+        ctx->n_done++;
+        pthread_cond_broadcast(&ctx->cond);
+    }
+    pthread_mutex_unlock(&ctx->mutex);
+
+    ggml_threadpool_free(ctx->cpu.threadpool);
+    ctx->cpu.threadpool = NULL;
+
+    return NULL;
+}
+
+GGML_CALL static const char * ggml_backend_cpu_numa_name(ggml_backend_t backend) {
+    struct ggml_backend_cpu_numa_context * ctx = (struct ggml_backend_cpu_numa_context *)backend->context;
+
+    return ctx->name;
+}
+
+GGML_CALL static void ggml_backend_cpu_numa_free(ggml_backend_t backend) {
+    struct ggml_backend_cpu_numa_context * ctx = (struct ggml_backend_cpu_numa_context *)backend->context;
+
+    pthread_mutex_lock(&ggml_backend_cpu_numa_list_mutex);
+    for (struct ggml_backend_cpu_numa_context ** p = &ggml_backend_cpu_numa_list; *p != NULL; p = &(*p)->next) {
+        if (*p == ctx) {
+            *p = ctx->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ggml_backend_cpu_numa_list_mutex);
+
+    // the queued tasks are completed before the thread exits
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->stop = true;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->mutex);
+    pthread_join(ctx->thread, NULL);
+
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->mutex);
+    free(ctx->cpu.work_data);
+    free(ctx);
+    free(backend);
+}
+
+GGML_CALL static ggml_backend_buffer_type_t ggml_backend_cpu_numa_get_default_buffer_type(ggml_backend_t backend) {
+    struct ggml_backend_cpu_numa_context * ctx = (struct ggml_backend_cpu_numa_context *)backend->context;
+
+    return ggml_backend_cpu_numa_buffer_type(ctx->node);
+}
+
+GGML_CALL static void ggml_backend_cpu_numa_set_tensor_async(ggml_backend_t backend, struct ggml_tensor * tensor, const void * data, size_t offset, size_t size) {
+    struct ggml_backend_cpu_numa_context * ctx = (struct ggml_backend_cpu_numa_context *)backend->context;
+
+    struct ggml_backend_cpu_numa_task task = { 0 };
+    task.op   = GGML_CPU_NUMA_OP_COPY;
+    task.dst  = (char *)tensor->data + offset;
+    task.src  = data;
+    task.size = size;
+    ggml_backend_cpu_numa_submit(ctx, &task);
+}
+
+GGML_CALL static void ggml_backend_cpu_numa_get_tensor_async(ggml_backend_t backend, const struct ggml_tensor * tensor, void * data, size_t offset, size_t size) {
+    struct ggml_backend_cpu_numa_context * ctx = (struct ggml_backend_cpu_numa_context *)backend->context;
+
+    struct ggml_backend_cpu_numa_task task = { 0 };
+    task.op   = GGML_CPU_NUMA_OP_COPY;
+    task.dst  = data;
+    task.src  = (const char *)tensor->data + offset;
+    task.size = size;
+    ggml_backend_cpu_numa_submit(ctx, &task);
+}
+
+GGML_CALL static bool ggml_backend_cpu_numa_cpy_tensor_async(ggml_backend_t backend_src, ggml_backend_t backend_dst, const struct ggml_tensor * src, struct ggml_tensor * dst) {
+    if (!ggml_backend_is_cpu_numa(backend_src) || !ggml_backend_is_cpu_numa(backend_dst)) {
+        // the other backends are synchronous, the scheduler falls back to a blocking copy
+        return false;
+    }
+
+    struct ggml_backend_cpu_numa_context * ctx_src = (struct ggml_backend_cpu_numa_context *)backend_src->context;
+    struct ggml_backend_cpu_numa_context * ctx_dst = (struct ggml_backend_cpu_numa_context *)backend_dst->context;
+
+    struct ggml_backend_cpu_numa_task task = { 0 };
+    task.op   = GGML_CPU_NUMA_OP_COPY;
+    task.dst  = dst->data;
+    task.src  = src->data;
+    task.size = ggml_nbytes(src);
+
+    if (ctx_src == ctx_dst) {
+        ggml_backend_cpu_numa_submit(ctx_dst, &task);
+        return true;
+    }
+
+    // the copy is queued on the source node, so that it happens before the source is overwritten by later work of the node
+    // it starts after the work already queued on the destination node, which may still be using the previous contents of dst
+    struct ggml_backend_cpu_numa_task wait = { 0 };
+    wait.op     = GGML_CPU_NUMA_OP_WAIT;
+    wait.other  = ctx_dst;
+    wait.n_done = ggml_backend_cpu_numa_n_submitted(ctx_dst);
+    ggml_backend_cpu_numa_submit(ctx_src, &wait);
+
+    wait.other  = ctx_src;
+    wait.n_done = ggml_backend_cpu_numa_submit(ctx_src, &task);
+    ggml_backend_cpu_numa_submit(ctx_dst, &wait);
+
+    return true;
+}
+
+GGML_CALL static void ggml_backend_cpu_numa_synchronize(ggml_backend_t backend) {
+    struct ggml_backend_cpu_numa_context * ctx = (struct ggml_backend_cpu_numa_context *)backend->context;
+
+    ggml_backend_cpu_numa_wait(ctx, ggml_backend_cpu_numa_n_submitted(ctx));
+}
+
+GGML_CALL static enum ggml_status ggml_backend_cpu_numa_graph_compute(ggml_backend_t backend, struct ggml_cgraph * cgraph) {
+    struct ggml_backend_cpu_numa_context * ctx = (struct ggml_backend_cpu_numa_context *)backend->context;
+
+    // report the errors of the previous graphs, the current one is only queued
+    pthread_mutex_lock(&ctx->mutex);
+    enum ggml_status status = ctx->status;
+    ctx->status = GGML_STATUS_SUCCESS;
+    pthread_mutex_unlock(&ctx->mutex);
+
+    if (status != GGML_STATUS_SUCCESS) {
+        return status;
+    }
+
+    struct ggml_backend_cpu_numa_task task = { 0 };
+    task.op    = GGML_CPU_NUMA_OP_COMPUTE;
+    task.graph = ggml_backend_cpu_numa_graph_dup(cgraph);
+    ggml_backend_cpu_numa_submit(ctx, &task);
+
+    return GGML_STATUS_SUCCESS;
+}
+
+GGML_CALL static bool ggml_backend_cpu_numa_supports_buft(ggml_backend_t backend, ggml_backend_buffer_type_t buft) {
+    struct ggml_backend_cpu_numa_context * ctx = (struct ggml_backend_cpu_numa_context *)backend->context;
+
+    // tensors of the other nodes and of the host are copied to the node by the scheduler
+    return buft == ggml_backend_cpu_numa_buffer_type(ctx->node);
+}
+
+GGML_CALL static ggml_backend_event_t ggml_backend_cpu_numa_event_new(ggml_backend_t backend) {
+    struct ggml_backend_cpu_numa_event * ev = calloc(1, sizeof(struct ggml_backend_cpu_numa_event));
+
+    ggml_backend_event_t event = malloc(sizeof(struct ggml_backend_event));
+    event->backend = backend;
+    event->context = ev;
+
+    return event;
+}
+
+GGML_CALL static void ggml_backend_cpu_numa_event_free(ggml_backend_event_t event) {
+    free(event->context);
+    free(event);
+}
+
+GGML_CALL static void ggml_backend_cpu_numa_event_record(ggml_backend_event_t event) {
+    struct ggml_backend_cpu_numa_context * ctx = (struct ggml_backend_cpu_numa_context *)event->backend->context;
+    struct ggml_backend_cpu_numa_event   * ev  = (struct ggml_backend_cpu_numa_event *)event->context;
+
+    ev->n_submitted = ggml_backend_cpu_numa_n_submitted(ctx);
+}
+
+GGML_CALL static void ggml_backend_cpu_numa_event_wait(ggml_backend_t backend, ggml_backend_event_t event) {
+    struct ggml_backend_cpu_numa_event * ev = (struct ggml_backend_cpu_numa_event *)event->context;
+
+    if (event->backend == backend) {
+        // the tasks of a node are executed in order
+        return;
+    }
+
+    struct ggml_backend_cpu_numa_task task = { 0 };
+    task.op     = GGML_CPU_NUMA_OP_WAIT;
+    task.other  = (struct ggml_backend_cpu_numa_context *)event->backend->context;
+    task.n_done = ev->n_submitted;
+    ggml_backend_cpu_numa_submit((struct ggml_backend_cpu_numa_context *)backend->context, &task);
+}
+
+GGML_CALL static void ggml_backend_cpu_numa_event_synchronize(ggml_backend_event_t event) {
+    struct ggml_backend_cpu_numa_context * ctx = (struct ggml_backend_cpu_numa_context *)event->backend->context;
+    struct ggml_backend_cpu_numa_event   * ev  = (struct ggml_backend_cpu_numa_event *)event->context;
+
+    ggml_backend_cpu_numa_wait(ctx, ev->n_submitted);
+}
+
+static struct ggml_backend_i cpu_numa_backend_i = {
+    /* .get_name                = */ ggml_backend_cpu_numa_name,
+    /* .free                    = */ ggml_backend_cpu_numa_free,
+    /* .get_default_buffer_type = */ ggml_backend_cpu_numa_get_default_buffer_type,
+    /* .set_tensor_async        = */ ggml_backend_cpu_numa_set_tensor_async,
+    /* .get_tensor_async        = */ ggml_backend_cpu_numa_get_tensor_async,
+    /* .cpy_tensor_async        = */ ggml_backend_cpu_numa_cpy_tensor_async,
+    /* .synchronize             = */ ggml_backend_cpu_numa_synchronize,
+    /* .graph_plan_create       = */ NULL,
+    /* .graph_plan_free         = */ NULL,
+    /* .graph_plan_update       = */ NULL,
+    /* .graph_plan_compute      = */ NULL,
+    /* .graph_compute           = */ ggml_backend_cpu_numa_graph_compute,
+    /* .supports_op             = */ ggml_backend_cpu_supports_op,
+    /* .supports_buft           = */ ggml_backend_cpu_numa_supports_buft,
+    /* .offload_op              = */ NULL,
+    /* .event_new               = */ ggml_backend_cpu_numa_event_new,
+    /* .event_free              = */ ggml_backend_cpu_numa_event_free,
+    /* .event_record            = */ ggml_backend_cpu_numa_event_record,
+    /* .event_wait              = */ ggml_backend_cpu_numa_event_wait,
+    /* .event_synchronize       = */ ggml_backend_cpu_numa_event_synchronize,
+};
+
+ggml_backend_t ggml_backend_cpu_numa_init(int node) {
+    if (ggml_backend_cpu_numa_buffer_type(node) == NULL || ggml_numa_node_n_cpus(node) == 0) {
+        return NULL;
+    }
+
+    struct ggml_backend_cpu_numa_context * ctx = calloc(1, sizeof(struct ggml_backend_cpu_numa_context));
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    ctx->cpu.n_threads = ggml_numa_node_n_cpus(node);
+    ctx->node          = node;
+    ctx->n_cpus        = ggml_numa_node_n_cpus(node);
+    ctx->status        = GGML_STATUS_SUCCESS;
+    snprintf(ctx->name, sizeof(ctx->name), "CPU_NUMA%d", node);
+
+    pthread_mutex_init(&ctx->mutex, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+
+    ggml_backend_t backend = malloc(sizeof(struct ggml_backend));
+    if (backend == NULL) {
+        pthread_cond_destroy(&ctx->cond);
+        pthread_mutex_destroy(&ctx->mutex);
+        free(ctx);
+        return NULL;
+    }
+
+    *backend = (struct ggml_backend) {
+        /* .guid      = */ ggml_backend_cpu_numa_guid(),
+        /* .interface = */ cpu_numa_backend_i,
+        /* .context   = */ ctx
+    };
+
+    if (pthread_create(&ctx->thread, NULL, ggml_backend_cpu_numa_thread, ctx) != 0) {
+        fprintf(stderr, "%s: failed to create the dispatcher thread of NUMA node %d\n", __func__, node);
+        pthread_cond_destroy(&ctx->cond);
+        pthread_mutex_destroy(&ctx->mutex);
+        free(ctx);
+        free(backend);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&ggml_backend_cpu_numa_list_mutex);
+    ctx->next = ggml_backend_cpu_numa_list;
+    ggml_backend_cpu_numa_list = ctx;
+    pthread_mutex_unlock(&ggml_backend_cpu_numa_list_mutex);
+
+    return backend;
+}
+
+int ggml_backend_cpu_numa_get_node(ggml_backend_t backend_cpu_numa) {
+    GGML_ASSERT(ggml_backend_is_cpu_numa(backend_cpu_numa));
+
+    struct ggml_backend_cpu_numa_context * ctx = (struct ggml_backend_cpu_numa_context *)backend_cpu_numa->context;
+    return ctx->node;
+}
+
+#else
+
+// NUMA nodes are only detected on Linux, the other platforms use the CPU backend
+
+ggml_backend_t ggml_backend_cpu_numa_init(int node) {
+    return NULL;
+
+    GGML_UNUSED(node);
+}
+
+int ggml_backend_cpu_numa_get_node(ggml_backend_t backend_cpu_numa) {
+    GGML_ABORT("NUMA CPU backend is not supported on this platform");
+
+    GGML_UNUSED(backend_cpu_numa);
+}
+
+ggml_backend_buffer_type_t ggml_backend_cpu_numa_buffer_type(int node) {
+    return NULL;
+
+    GGML_UNUSED(node);
+}
+
+#endif
+
 // multi-buffer buffer
 
 struct ggml_backend_multi_buffer_context {
@@ -1125,6 +1801,13 @@ struct ggml_backend_sched {
     size_t context_buffer_size;
 
     bool debug;
+
+    // profiling
+    enum ggml_backend_sched_profile_level profile_level;
+    struct ggml_backend_sched_profile_event * profile_events;
+    int n_profile_events;
+    int profile_events_capacity;
+    int n_profile_graphs;
 };
 
 #define hash_id(tensor) ggml_hash_find_or_insert(&sched->hash_set, tensor)
@@ -1796,20 +2479,57 @@ static bool ggml_backend_sched_alloc_splits(ggml_backend_sched_t sched) {
     return true;
 }
 
+static struct ggml_backend_sched_profile_event * ggml_backend_sched_profile_add(
+        ggml_backend_sched_t sched, enum ggml_backend_sched_profile_type type, int split_id, const struct ggml_tensor * tensor, int64_t t_start_us) {
+    if (sched->n_profile_events == sched->profile_events_capacity) {
+        sched->profile_events_capacity = MAX(256, 2*sched->profile_events_capacity);
+        sched->profile_events = realloc(sched->profile_events, sched->profile_events_capacity*sizeof(struct ggml_backend_sched_profile_event));
+        GGML_ASSERT(sched->profile_events != NULL);
+    }
+
+    struct ggml_backend_sched_profile_event * ev = &sched->profile_events[sched->n_profile_events++];
+    memset(ev, 0, sizeof(*ev));
+
+    ev->type           = type;
+    ev->graph          = sched->n_profile_graphs;
+    ev->split          = split_id;
+    ev->backend_id     = sched->splits[split_id].backend_id;
+    ev->src_backend_id = -1;
+    ev->op             = GGML_OP_NONE;
+    ev->t_start_us     = t_start_us;
+    ev->t_end_us       = ggml_time_us();
+    if (tensor != NULL) {
+        ev->op      = tensor->op;
+        ev->n_bytes = ggml_nbytes(tensor);
+        snprintf(ev->name, sizeof(ev->name), "%s", tensor->name);
+    }
+
+    return ev;
+}
+
 static enum ggml_status ggml_backend_sched_compute_splits(ggml_backend_sched_t sched) {
     struct ggml_backend_sched_split * splits = sched->splits;
 
+    const bool profile = sched->profile_level != GGML_BACKEND_SCHED_PROFILE_NONE;
+
     for (int i = 0; i < sched->n_splits; i++) {
         struct ggml_backend_sched_split * split = &splits[i];
         int split_backend_id = split->backend_id;
         ggml_backend_t split_backend = sched->backends[split_backend_id];
 
+        if (profile) {
+            // measure the split without the work queued before it
+            ggml_backend_sched_synchronize(sched);
+        }
+
         // copy the input tensors to the split backend
         for (int j = 0; j < split->n_inputs; j++) {
             ggml_backend_t input_backend = ggml_backend_sched_get_tensor_backend(sched, split->inputs[j]);
             struct ggml_tensor * input = split->inputs[j];
             struct ggml_tensor * input_cpy = tensor_copy(input, split_backend_id, sched->cur_copy);
 
+            const int64_t t_copy_start_us = profile ? ggml_time_us() : 0;
+
             if (input->flags & GGML_TENSOR_FLAG_INPUT) {
                 // inputs from the user must be copied immediately to prevent the user overwriting the data before the copy is done
                 if (sched->events[split_backend_id][sched->cur_copy] != NULL) {
@@ -1837,9 +2557,38 @@ static enum ggml_status ggml_backend_sched_compute_splits(ggml_backend_sched_t s
                     ggml_backend_tensor_copy(input, input_cpy);
                 }
             }
+
+            if (profile) {
+                // async copies may be queued on either backend
+                ggml_backend_synchronize(input_backend);
+                ggml_backend_synchronize(split_backend);
+                struct ggml_backend_sched_profile_event * ev = ggml_backend_sched_profile_add(sched, GGML_BACKEND_SCHED_PROFILE_COPY, i, input, t_copy_start_us);
+                ev->src_backend_id = ggml_backend_sched_backend_id(sched, input_backend);
+            }
         }
 
-        if (!sched->callback_eval) {
+        const int64_t t_split_start_us = profile ? ggml_time_us() : 0;
+
+        if (!sched->callback_eval && sched->profile_level == GGML_BACKEND_SCHED_PROFILE_NODES) {
+            // compute the nodes one at a time to measure them
+            for (int j = 0; j < split->graph.n_nodes; j++) {
+                struct ggml_tensor * t = split->graph.nodes[j];
+
+                const int64_t t_node_start_us = ggml_time_us();
+
+                struct ggml_cgraph gv = ggml_graph_view(&split->graph, j, j + 1);
+
+                enum ggml_status ec = ggml_backend_graph_compute_async(split_backend, &gv);
+                if (ec != GGML_STATUS_SUCCESS) {
+                    return ec;
+                }
+                ggml_backend_synchronize(split_backend);
+
+                if (!ggml_is_view_op(t->op)) {
+                    ggml_backend_sched_profile_add(sched, GGML_BACKEND_SCHED_PROFILE_NODE, i, t, t_node_start_us);
+                }
+            }
+        } else if (!sched->callback_eval) {
             enum ggml_status ec = ggml_backend_graph_compute_async(split_backend, &split->graph);
             if (ec != GGML_STATUS_SUCCESS) {
                 return ec;
@@ -1878,6 +2627,12 @@ static enum ggml_status ggml_backend_sched_compute_splits(ggml_backend_sched_t s
             }
         }
 
+        if (profile) {
+            ggml_backend_synchronize(split_backend);
+            struct ggml_backend_sched_profile_event * ev = ggml_backend_sched_profile_add(sched, GGML_BACKEND_SCHED_PROFILE_SPLIT, i, NULL, t_split_start_us);
+            ev->n_nodes = split->graph.n_nodes;
+        }
+
         // record the event of this copy
         if (split->n_inputs > 0) {
             if (sched->events[split_backend_id][sched->cur_copy] != NULL) {
@@ -1888,6 +2643,10 @@ static enum ggml_status ggml_backend_sched_compute_splits(ggml_backend_sched_t s
 
     sched->cur_copy = (sched->cur_copy + 1) % sched->n_copies;
 
+    if (profile) {
+        sched->n_profile_graphs++;
+    }
+
     return GGML_STATUS_SUCCESS;
 }
 
@@ -1967,6 +2726,7 @@ void ggml_backend_sched_free(ggml_backend_sched_t sched) {
     free(sched->context_buffer);
     free(sched->graph.nodes);
     free(sched->graph.leafs);
+    free(sched->profile_events);
     free(sched);
 }
 
@@ -2042,6 +2802,27 @@ void ggml_backend_sched_set_eval_callback(ggml_backend_sched_t sched, ggml_backe
     sched->callback_eval_user_data = user_data;
 }
 
+void ggml_backend_sched_set_profile(ggml_backend_sched_t sched, enum ggml_backend_sched_profile_level level) {
+    sched->profile_level = level;
+}
+
+enum ggml_backend_sched_profile_level ggml_backend_sched_get_profile(ggml_backend_sched_t sched) {
+    return sched->profile_level;
+}
+
+int ggml_backend_sched_get_profile_n_events(ggml_backend_sched_t sched) {
+    return sched->n_profile_events;
+}
+
+const struct ggml_backend_sched_profile_event * ggml_backend_sched_get_profile_events(ggml_backend_sched_t sched) {
+    return sched->profile_events;
+}
+
+void ggml_backend_sched_reset_profile(ggml_backend_sched_t sched) {
+    sched->n_profile_events = 0;
+    sched->n_profile_graphs = 0;
+}
+
 int ggml_backend_sched_get_n_splits(ggml_backend_sched_t sched) {
     return sched->n_splits;
 }
@@ -2066,6 +2847,13 @@ size_t ggml_backend_sched_get_buffer_size(ggml_backend_sched_t sched, ggml_backe
     return ggml_gallocr_get_buffer_size(sched->galloc, backend_index);
 }
 
+void ggml_backend_sched_get_plan_stats(ggml_backend_sched_t sched, ggml_backend_t backend, struct ggml_gallocr_plan_stats * stats) {
+    int backend_index = ggml_backend_sched_backend_id(sched, backend);
+    GGML_ASSERT(backend_index >= 0 && backend_index < sched->n_backends);
+
+    ggml_gallocr_get_plan_stats(sched->galloc, backend_index, stats);
+}
+
 void ggml_backend_sched_set_tensor_backend(ggml_backend_sched_t sched, struct ggml_tensor * node, ggml_backend_t backend) {
     int backend_index = ggml_backend_sched_backend_id(sched, backend);
     GGML_ASSERT(backend_index >= 0 && backend_index < sched->n_backends);
@@ -2020,6 +2020,33 @@ typedef pthread_mutex_t    ggml_mutex_t;
 
 #endif
 
+// 64-bit polling stats, updated by the compute threads and read by ggml_threadpool_get_stats() from any thread
+#if defined(_WIN32) && !defined(__clang__)
+typedef volatile LONG64 ggml_poll_stat_t;
+
+static inline void ggml_poll_stat_add(ggml_poll_stat_t * stat, int64_t v) {
+    InterlockedExchangeAdd64(stat, v);
+}
+static inline int64_t ggml_poll_stat_get(ggml_poll_stat_t * stat) {
+    return InterlockedCompareExchange64(stat, 0, 0);
+}
+static inline void ggml_poll_stat_set(ggml_poll_stat_t * stat, int64_t v) {
+    InterlockedExchange64(stat, v);
+}
+#else
+typedef _Atomic int64_t ggml_poll_stat_t;
+
+static inline void ggml_poll_stat_add(ggml_poll_stat_t * stat, int64_t v) {
+    atomic_fetch_add_explicit(stat, v, memory_order_relaxed);
+}
+static inline int64_t ggml_poll_stat_get(ggml_poll_stat_t * stat) {
+    return atomic_load_explicit(stat, memory_order_relaxed);
+}
+static inline void ggml_poll_stat_set(ggml_poll_stat_t * stat, int64_t v) {
+    atomic_store_explicit(stat, v, memory_order_relaxed);
+}
+#endif
+
 // Threadpool def
 struct ggml_threadpool {
     ggml_mutex_t mutex;       // mutex for cond.var
@@ -2045,6 +2072,13 @@ struct ggml_threadpool {
 
     int32_t      prio;        // Scheduling priority
     uint32_t     poll;        // Polling level (0 - no polling)
+    atomic_int   poll_cur;    // Polling level used for the current graph (differs from poll in adaptive mode)
+
+    // adaptive polling state, t_last_end is only accessed by the main thread
+    int64_t          t_last_end; // end time of the previous graph
+    ggml_poll_stat_t t_gap;      // running average of the gap between graphs
+    ggml_poll_stat_t n_graphs;
+    ggml_poll_stat_t n_pauses;
 
     enum ggml_status ec;
 };
@@ -2056,6 +2090,11 @@ struct ggml_compute_state {
     bool cpumask[GGML_MAX_N_THREADS];
     int  last_graph;
     bool pending;
+
+    // polling stats, only incremented by the owning thread
+    ggml_poll_stat_t t_spin_us;
+    ggml_poll_stat_t n_spin_hits;
+    ggml_poll_stat_t n_spin_misses;
 #endif
     struct ggml_threadpool * threadpool;
     int ith;
@@ -2974,6 +3013,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "TRANSPOSE",
     "GET_ROWS",
     "GET_ROWS_BACK",
+    "SET_ROWS",
     "DIAG",
     "DIAG_MASK_INF",
     "DIAG_MASK_ZERO",
@@ -2992,6 +3032,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "UPSCALE",
     "PAD",
     "ARANGE",
+    "ARANGE_DROP",
     "TIMESTEP_EMBEDDING",
     "ARGSORT",
     "LEAKY_RELU",
@@ -3024,7 +3065,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "OPT_STEP_ADAMW",
 };
 
-static_assert(GGML_OP_COUNT == 81, "GGML_OP_COUNT != 81");
+static_assert(GGML_OP_COUNT == 82, "GGML_OP_COUNT != 82");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -3068,6 +3109,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "transpose(x)",
     "get_rows(x)",
     "get_rows_back(x)",
+    "set_rows(x)",
     "diag(x)",
     "diag_mask_inf(x)",
     "diag_mask_zero(x)",
@@ -3086,6 +3128,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "upscale(x)",
     "pad(x)",
     "arange(start, stop, step)",
+    "arange_drop(drop, start, stop)",
     "timestep_embedding(timesteps, dim, max_period)",
     "argsort(x)",
     "leaky_relu(x)",
@@ -3118,7 +3161,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "adamw(x)",
 };
 
-static_assert(GGML_OP_COUNT == 81, "GGML_OP_COUNT != 81");
+static_assert(GGML_OP_COUNT == 82, "GGML_OP_COUNT != 82");
 
 static_assert(GGML_OP_POOL_COUNT == 2, "GGML_OP_POOL_COUNT != 2");
 
@@ -3356,6 +3399,38 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+enum ggml_numa_strategy ggml_numa_get_strategy(void) {
+    return g_state.numa.numa_strategy;
+}
+
+int ggml_numa_n_nodes(void) {
+    return g_state.numa.n_nodes;
+}
+
+int ggml_numa_node_n_cpus(int node) {
+    if (node < 0 || node >= (int) g_state.numa.n_nodes) {
+        return 0;
+    }
+    return g_state.numa.nodes[node].n_cpus;
+}
+
+bool ggml_numa_node_cpumask(int node, bool * cpumask) {
+    if (node < 0 || node >= (int) g_state.numa.n_nodes) {
+        return false;
+    }
+
+    memset(cpumask, 0, GGML_MAX_N_THREADS);
+
+    const struct ggml_numa_node * n = &g_state.numa.nodes[node];
+    for (uint32_t i = 0; i < n->n_cpus; ++i) {
+        if (n->cpus[i] < GGML_MAX_N_THREADS) {
+            cpumask[n->cpus[i]] = true;
+        }
+    }
+
+    return true;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void ggml_print_object(const struct ggml_object * obj) {
@@ -6473,6 +6548,35 @@ struct ggml_tensor * ggml_get_rows_back(
     return result;
 }
 
+// ggml_set_rows
+
+struct ggml_tensor * ggml_set_rows(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c) {
+    GGML_ASSERT(ggml_is_matrix(a) && ggml_is_matrix(b) && ggml_is_vector(c));
+    GGML_ASSERT(a->ne[0] == b->ne[0] && b->ne[1] == c->ne[0]);
+    GGML_ASSERT(b->type == GGML_TYPE_F32 && b->nb[0] == sizeof(float));
+    GGML_ASSERT(c->type == GGML_TYPE_I32);
+
+    bool is_node = false;
+
+    if (a->grad || b->grad) {
+        GGML_ABORT("fatal error"); // TODO: implement backward
+        is_node = true;
+    }
+
+    struct ggml_tensor * result = ggml_view_tensor(ctx, a);
+
+    result->op   = GGML_OP_SET_ROWS;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src[0] = b;
+    result->src[1] = c;
+
+    return result;
+}
+
 // ggml_diag
 
 struct ggml_tensor * ggml_diag(
@@ -14047,6 +14151,80 @@ static void ggml_compute_forward_get_rows(
     // printf("[get_rows end]\n");
 }
 
+// ggml_compute_forward_set_rows
+
+static void ggml_compute_forward_set_rows(
+        const struct ggml_compute_params * params,
+              struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+    const struct ggml_tensor * src1 = dst->src[1];
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    const enum ggml_type type = dst->type;
+
+    const int64_t nc = ne00;
+    const int64_t nr = ne01;
+
+    assert(ne0  == nc);
+    assert(ne10 == nr);
+    assert(nb00 == sizeof(float));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    ggml_from_float_t const from_float = type_traits[type].from_float;
+
+    // contiguous destination rows can be converted in one go
+    const bool cont_rows = nb0 == ggml_type_size(type);
+
+    for (int64_t i = ir0; i < ir1; ++i) {
+        const int64_t i1 = *(int32_t *) ((char *) src1->data + i*nb10);
+
+        GGML_ASSERT(i1 >= 0 && i1 < ne1);
+
+        const float * src_row = (const float *) ((char *) src0->data + i*nb01);
+              char  * dst_row = (char *) dst->data + i1*nb1;
+
+        if (cont_rows) {
+            if (type == GGML_TYPE_F32) {
+                memcpy(dst_row, src_row, nc*sizeof(float));
+            } else {
+                GGML_ASSERT(from_float != NULL);
+                from_float(src_row, dst_row, nc);
+            }
+        } else {
+            // strided destination row, e.g. a column of a transposed matrix
+            switch (type) {
+                case GGML_TYPE_F32:
+                    {
+                        for (int64_t j = 0; j < nc; ++j) {
+                            *(float *) (dst_row + j*nb0) = src_row[j];
+                        }
+                    } break;
+                case GGML_TYPE_F16:
+                    {
+                        for (int64_t j = 0; j < nc; ++j) {
+                            *(ggml_fp16_t *) (dst_row + j*nb0) = GGML_FP32_TO_FP16(src_row[j]);
+                        }
+                    } break;
+                default:
+                    {
+                        GGML_ABORT("fatal error");
+                    }
+            }
+        }
+    }
+}
+
 // ggml_compute_forward_get_rows_back
 
 static void ggml_compute_forward_get_rows_back_f32_f16(
@@ -17897,6 +18075,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_get_rows_back(params, tensor);
             } break;
+        case GGML_OP_SET_ROWS:
+            {
+                ggml_compute_forward_set_rows(params, tensor);
+            } break;
         case GGML_OP_DIAG:
             {
                 ggml_compute_forward_diag(params, tensor);
@@ -18862,6 +19044,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ABORT("fatal error"); // TODO: not implemented
             }
+        case GGML_OP_SET_ROWS:
+            {
+                GGML_ABORT("fatal error"); // TODO: not implemented
+            }
         case GGML_OP_DIAG:
             {
                 GGML_ABORT("fatal error"); // TODO: not implemented
@@ -19654,7 +19840,8 @@ static void set_numa_thread_affinity(int thread_n) {
 }
 
 static void clear_numa_thread_affinity(void) {
-    if (!ggml_is_numa()) {
+    // with the pipeline strategy, the threads are pinned to their node by the NUMA CPU backends
+    if (!ggml_is_numa() || g_state.numa.numa_strategy == GGML_NUMA_STRATEGY_PIPELINE) {
         return;
     }
 
@@ -19691,6 +19878,7 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
 
     switch (node->op) {
         case GGML_OP_CPY:
+        case GGML_OP_SET_ROWS:
         case GGML_OP_DUP:
         case GGML_OP_CONT:
         case GGML_OP_ADD:
@@ -20410,14 +20598,24 @@ static inline bool ggml_graph_compute_poll_for_work(struct ggml_compute_state *
     }
 
     // This seems to make 0 ... 100 a decent range for polling level across modern processors.
-    // Perhaps, we can adjust it dynamically based on load and things.
-    const uint64_t n_rounds = 1024UL * 128 * threadpool->poll;
+    // In adaptive mode the level is picked by ggml_threadpool_adapt_poll() before each graph.
+    const uint32_t poll     = atomic_load_explicit(&threadpool->poll_cur, memory_order_relaxed);
+    const uint64_t n_rounds = 1024UL * 128 * poll;
+
+    if (n_rounds == 0) {
+        return ggml_graph_compute_thread_ready(state);
+    }
+
+    const int64_t t_start = ggml_time_us();
 
     for (uint64_t i=0; !ggml_graph_compute_thread_ready(state) && i < n_rounds; i++) {
         // No new work. Keep polling.
         ggml_thread_cpu_relax();
     }
 
+    ggml_poll_stat_add(&state->t_spin_us, ggml_time_us() - t_start);
+    ggml_poll_stat_add(state->pending ? &state->n_spin_hits : &state->n_spin_misses, 1);
+
     return state->pending;
 }
 
@@ -20510,8 +20708,88 @@ static void ggml_graph_compute_kickoff(struct ggml_threadpool * threadpool, int
     ggml_mutex_unlock(&threadpool->mutex);
 }
 
+// Gaps below this are bridged by polling, above it the workers sleep on the cond.var
+#define GGML_POLL_ADAPTIVE_SPIN_US   1000
+// Gaps above this pause the threadpool once the graph is done
+#define GGML_POLL_ADAPTIVE_PAUSE_US 50000
+
+// Pick the polling level for the next graph from the measured gap since the previous one
+static void ggml_threadpool_adapt_poll(struct ggml_threadpool * threadpool) {
+    const int64_t t_now = ggml_time_us();
+
+    if (threadpool->t_last_end == 0) {
+        // first graph, nothing measured yet
+        return;
+    }
+
+    const int64_t t_gap_new = t_now - threadpool->t_last_end;
+    const int64_t t_gap_avg = ggml_poll_stat_get(&threadpool->t_gap);
+
+    // exponential moving average, weight 1/8 for the new sample
+    const int64_t t_gap = t_gap_avg > 0 ? (7*t_gap_avg + t_gap_new)/8 : t_gap_new;
+    ggml_poll_stat_set(&threadpool->t_gap, t_gap);
+
+    if (threadpool->poll != GGML_THREADPOOL_POLL_ADAPTIVE) {
+        return;
+    }
+
+    const uint32_t poll = t_gap < GGML_POLL_ADAPTIVE_SPIN_US ? 100 : 0;
+
+    atomic_store_explicit(&threadpool->poll_cur, poll, memory_order_relaxed);
+}
+
+// Pause the threadpool after the graph if the next one is not expected soon
+static void ggml_threadpool_adapt_pause(struct ggml_threadpool * threadpool) {
+    threadpool->t_last_end = ggml_time_us();
+
+    if (threadpool->poll != GGML_THREADPOOL_POLL_ADAPTIVE || ggml_poll_stat_get(&threadpool->t_gap) < GGML_POLL_ADAPTIVE_PAUSE_US) {
+        return;
+    }
+
+    ggml_mutex_lock(&threadpool->mutex);
+    if (!threadpool->pause) {
+        ggml_threadpool_pause_locked(threadpool);
+        ggml_poll_stat_add(&threadpool->n_pauses, 1);
+    }
+    ggml_mutex_unlock(&threadpool->mutex);
+}
+
 #endif // GGML_USE_OPENMP
 
+void ggml_threadpool_get_stats(struct ggml_threadpool * threadpool, struct ggml_threadpool_stats * stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    stats->n_graphs = ggml_poll_stat_get(&threadpool->n_graphs);
+    stats->n_pauses = ggml_poll_stat_get(&threadpool->n_pauses);
+    stats->t_gap_us = ggml_poll_stat_get(&threadpool->t_gap);
+    stats->poll     = atomic_load_explicit(&threadpool->poll_cur, memory_order_relaxed);
+
+#ifndef GGML_USE_OPENMP
+    for (int j = 0; j < threadpool->n_threads_max; j++) {
+        struct ggml_compute_state * state = &threadpool->workers[j];
+
+        stats->t_spin_us     += ggml_poll_stat_get(&state->t_spin_us);
+        stats->n_spin_hits   += ggml_poll_stat_get(&state->n_spin_hits);
+        stats->n_spin_misses += ggml_poll_stat_get(&state->n_spin_misses);
+    }
+#endif
+}
+
+void ggml_threadpool_reset_stats(struct ggml_threadpool * threadpool) {
+    ggml_poll_stat_set(&threadpool->n_graphs, 0);
+    ggml_poll_stat_set(&threadpool->n_pauses, 0);
+
+#ifndef GGML_USE_OPENMP
+    for (int j = 0; j < threadpool->n_threads_max; j++) {
+        struct ggml_compute_state * state = &threadpool->workers[j];
+
+        ggml_poll_stat_set(&state->t_spin_us,     0);
+        ggml_poll_stat_set(&state->n_spin_hits,   0);
+        ggml_poll_stat_set(&state->n_spin_misses, 0);
+    }
+#endif
+}
+
 void ggml_threadpool_params_init(struct ggml_threadpool_params * p, int n_threads) {
     p->n_threads  = n_threads;
     p->prio       = 0;     // default priority (usually means normal or inherited)
@@ -20556,6 +20834,11 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
         threadpool->n_threads_max    = tpp->n_threads;
         threadpool->n_threads_cur    = tpp->n_threads;
         threadpool->poll             = tpp->poll;
+        threadpool->poll_cur         = tpp->poll == GGML_THREADPOOL_POLL_ADAPTIVE ? 0 : tpp->poll;
+        threadpool->t_last_end       = 0;
+        threadpool->t_gap            = 0;
+        threadpool->n_graphs         = 0;
+        threadpool->n_pauses         = 0;
         threadpool->prio             = tpp->prio;
         threadpool->ec               = GGML_STATUS_SUCCESS;
     }
@@ -20632,6 +20915,8 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         threadpool->ec               = GGML_STATUS_SUCCESS;
     }
 
+    ggml_poll_stat_add(&threadpool->n_graphs, 1);
+
 #ifdef GGML_USE_OPENMP
     if (n_threads > 1) {
         #pragma omp parallel num_threads(n_threads)
@@ -20655,11 +20940,17 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         n_threads = threadpool->n_threads_max;
     }
 
+    ggml_threadpool_adapt_poll(threadpool);
+
     // Kick all threads to start the new graph
     ggml_graph_compute_kickoff(threadpool, n_threads);
 
     // This is a work thread too
     ggml_graph_compute_thread(&threadpool->workers[0]);
+
+    if (!disposable_threadpool) {
+        ggml_threadpool_adapt_pause(threadpool);
+    }
 #endif
 
     // don't leave affinity set on the main thread
@@ -333,6 +333,12 @@ extern "C" {
         float    yarn_beta_slow;   // YaRN high correction dim
         uint32_t yarn_orig_ctx;    // YaRN original context size
         float    defrag_thold;     // defragment the KV cache if holes/size > thold, < 0 disabled (default)
+        uint32_t defrag_budget;    // max KV cells moved by the defragmentation in each llama_decode, 0 = no limit (default)
+        uint32_t kv_block_size;    // KV cache block size in cells for the paged layout, power of 2, 0 = contiguous (default)
+        uint32_t kv_sink;          // sliding window eviction: first tokens of each sequence kept in the KV cache, 0 = disabled (default)
+        uint32_t kv_window;        // sliding window eviction: max tokens of each sequence in the KV cache, 0 = n_ctx / n_seq_max
+        uint32_t kv_hh_budget;     // heavy-hitter eviction: max tokens of each sequence in the KV cache, 0 = disabled (default)
+        uint32_t kv_hh_recent;     // heavy-hitter eviction: last tokens of each sequence that are never evicted
 
         ggml_backend_sched_eval_callback cb_eval;
         void * cb_eval_user_data;
@@ -340,6 +346,10 @@ extern "C" {
         enum ggml_type type_k; // data type for K cache [EXPERIMENTAL]
         enum ggml_type type_v; // data type for V cache [EXPERIMENTAL]
 
+        // per-layer data types for the K and V cache [n_layer], GGML_TYPE_COUNT = type_k/type_v, NULL = all layers [EXPERIMENTAL]
+        const enum ggml_type * type_k_layer;
+        const enum ggml_type * type_v_layer;
+
         // Keep the booleans together and at the end of the struct to avoid misalignment during copy-by-value.
         // TODO: move at the end of the struct
         bool logits_all;  // the llama_decode() call computes all logits, not just the last one (DEPRECATED - set llama_batch.logits instead)
@@ -347,6 +357,7 @@ extern "C" {
         bool offload_kqv; // whether to offload the KQV ops (including the KV cache) to GPU
         bool flash_attn;  // whether to use flash attention [EXPERIMENTAL]
         bool no_perf;     // whether to measure performance timings
+        bool kv_mixed;    // keep the first two and the last layer of a quantized K/V cache in F16 [EXPERIMENTAL]
 
         // Abort callback
         // if it returns true, execution of llama_decode() will be aborted
@@ -1187,9 +1198,15 @@ extern "C" {
         double t_load_ms;
         double t_p_eval_ms;
         double t_eval_ms;
+        double t_inputs_ms; // time spent setting the graph inputs (KQ mask, positions, ...)
+        double t_defrag_ms; // time spent defragmenting the KV cache
 
         int32_t n_p_eval;
         int32_t n_eval;
+        int32_t n_reused;       // number of graphs reused
+        int32_t n_evicted;      // number of KV cells evicted (sliding window or heavy-hitter eviction)
+        int32_t n_defrag;       // number of KV cache defragmentation steps
+        int32_t n_defrag_cells; // number of KV cells moved by the defragmentation
     };
 
     struct llama_perf_sampler_data {
@@ -1209,6 +1226,15 @@ extern "C" {
 
     LLAMA_API void llama_perf_dump_yaml(FILE * stream, const struct llama_context * ctx);
 
+    // Profiling of the graph compute: time of each split of the graph between the backends and of the copies of their inputs
+    // level 0: disabled, 1: splits and copies, 2: also every node (each node is computed and synchronized separately)
+    // the backends are synchronized around each split while profiling, so the total time is higher than without profiling
+    LLAMA_API void llama_perf_profile_set(struct llama_context * ctx, int32_t level);
+
+    // Write the events recorded since the last call as a Chrome trace (chrome://tracing or https://ui.perfetto.dev) and clear them
+    // Returns false if the file could not be written
+    LLAMA_API bool llama_perf_profile_dump_trace(struct llama_context * ctx, const char * fname);
+
 #ifdef __cplusplus
 }
 #endif
@@ -68,6 +68,7 @@
 
 #include <algorithm>
 #include <array>
+#include <bitset>
 #include <cassert>
 #include <cctype>
 #include <cfloat>
@@ -2582,6 +2583,13 @@ struct llama_cparams {
     float yarn_beta_fast;
     float yarn_beta_slow;
     float defrag_thold;
+    uint32_t defrag_budget;
+
+    uint32_t kv_block_size;
+    uint32_t kv_sink;
+    uint32_t kv_window;
+    uint32_t kv_hh_budget;
+    uint32_t kv_hh_recent;
 
     bool embeddings;
     bool causal_attn;
@@ -2763,16 +2771,112 @@ struct llama_ubatch {
     int32_t         img_token_step;
 };
 
+// set of the sequences of a KV cell
+// the ids in [0, 64) are stored in a bitmask, so the common queries do not touch the heap
+// the other ids are kept in a sorted vector
+struct llama_seq_id_set {
+    static constexpr llama_seq_id n_bits = 64;
+
+    uint64_t bits = 0;
+
+    std::vector<llama_seq_id> ext;
+
+    // iterates the ids of the bitmask (0 to n_bits - 1) in increasing order, then the other ids in increasing order, so
+    // the order is increasing only for non-negative ids (the ids of the cells are never negative)
+    struct const_iterator {
+        const llama_seq_id_set * set;
+        size_t i; // bit index, or n_bits + index in ext
+
+        const_iterator(const llama_seq_id_set * set, size_t i) : set(set), i(i) {
+            skip();
+        }
+
+        void skip() {
+            while (i < n_bits && !((set->bits >> i) & 1)) {
+                i++;
+            }
+        }
+
+        llama_seq_id operator*() const {
+            return i < n_bits ? (llama_seq_id) i : set->ext[i - n_bits];
+        }
+
+        const_iterator & operator++() {
+            i++;
+            skip();
+            return *this;
+        }
+
+        bool operator==(const const_iterator & other) const { return i == other.i; }
+        bool operator!=(const const_iterator & other) const { return i != other.i; }
+    };
+
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end()   const { return const_iterator(this, n_bits + ext.size()); }
+
+    static bool in_bits(llama_seq_id id) {
+        return 0 <= id && id < n_bits;
+    }
+
+    bool contains(llama_seq_id id) const {
+        if (in_bits(id)) {
+            return (bits >> id) & 1;
+        }
+        return std::binary_search(ext.begin(), ext.end(), id);
+    }
+
+    void insert(llama_seq_id id) {
+        if (in_bits(id)) {
+            bits |= uint64_t(1) << id;
+            return;
+        }
+        auto it = std::lower_bound(ext.begin(), ext.end(), id);
+        if (it == ext.end() || *it != id) {
+            ext.insert(it, id);
+        }
+    }
+
+    void erase(llama_seq_id id) {
+        if (in_bits(id)) {
+            bits &= ~(uint64_t(1) << id);
+            return;
+        }
+        auto it = std::lower_bound(ext.begin(), ext.end(), id);
+        if (it != ext.end() && *it == id) {
+            ext.erase(it);
+        }
+    }
+
+    void clear() {
+        bits = 0;
+        ext.clear();
+    }
+
+    bool empty() const {
+        return bits == 0 && ext.empty();
+    }
+
+    size_t size() const {
+        return std::bitset<n_bits>(bits).count() + ext.size();
+    }
+
+    bool operator==(const llama_seq_id_set & other) const {
+        return bits == other.bits && ext == other.ext;
+    }
+};
+
 struct llama_kv_cell {
     llama_pos pos   = -1;
     llama_pos delta = 0;
     int32_t   src   = -1; // used by recurrent state models to copy states
     int32_t   tail  = -1;
 
-    std::set<llama_seq_id> seq_id;
+    float score = 0.0f; // attention mass received by the cell, used by the heavy-hitter eviction
+
+    llama_seq_id_set seq_id;
 
     bool has_seq_id(const llama_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
+        return seq_id.contains(id);
     }
 
     bool is_empty() const {
@@ -2784,12 +2888,23 @@ struct llama_kv_cell {
     }
 };
 
+// a fixed-size range of KV cells, shared by the sequences that reference it
+struct llama_kv_block {
+    uint32_t n_ref = 0; // number of sequences with cells in the block
+    uint32_t used  = 0; // number of used cells in the block
+};
+
 // ring-buffer of cached KV data
+//
+// with block_size > 0 the cells are grouped in blocks and each sequence appends its tokens to the blocks
+// in its block table, so the tokens of a ubatch do not need a contiguous slot
+// the new KV data is scattered to the cells in slot_idxs and the KQ mask selects the cells of each sequence
 struct llama_kv_cache {
     bool has_shift = false;
     bool do_defrag = false;
     bool recurrent = false; // with recurrent state models, a cell can hold the state for more than one past token
     bool v_trans   = true;  // the value tensor is transposed
+    bool paged     = false; // the cells are allocated in blocks of block_size
 
     // Note: The value of head isn't only used to optimize searching
     // for a free KV slot. llama_decode_internal also uses it, so it
@@ -2806,6 +2921,50 @@ struct llama_kv_cache {
 
     std::vector<llama_kv_cell> cells;
 
+    // paged layout
+    uint32_t block_size = 0;
+
+    std::vector<llama_kv_block> blocks;
+    std::map<llama_seq_id, std::vector<uint32_t>> block_tables; // blocks of each sequence, in allocation order
+
+    std::vector<int32_t> slot_idxs; // cells of the tokens in the current ubatch
+
+    std::vector<std::pair<uint32_t, uint32_t>> cow_copies; // pending (src, dst) cell copies of detached shared cells
+
+    // sliding window with attention sinks (see llama_kv_cache_evict)
+    uint32_t n_sink      = 0; // first cells of each sequence that are never evicted, 0 = disabled
+    uint32_t n_window    = 0; // max cells of each sequence
+    uint32_t evict_block = 0; // cells evicted at a time
+
+    // heavy-hitter eviction (see llama_kv_cache_evict_hh)
+    uint32_t hh_budget = 0; // max cells of each sequence, 0 = disabled
+    uint32_t hh_recent = 0; // last cells of each sequence that are never evicted
+
+    uint64_t n_evicted = 0;
+
+    // incremental defragmentation (see llama_kv_cache_update_internal)
+    bool defrag_full = false; // move all the cells in the next update, regardless of the budget
+
+    uint64_t n_defrag_cells = 0; // cells moved
+    uint64_t n_defrag_steps = 0;
+
+    // range of the cells with a pending K-shift, computed before the K-shift graph is built
+    uint32_t shift_head = 0;
+    uint32_t shift_n    = 0;
+
+    // KQ mask state, maintained incrementally across the decode calls (see llama_kv_cache_mask_update)
+    bool mask_valid = false;
+
+    std::vector<llama_pos> mask_pos;   // position of each cell, -1 if empty
+    std::vector<uint32_t>  mask_dirty; // cells written since the last update
+
+    struct mask_row {
+        std::vector<float> data; // 0.0f for the cells of the sequence, -INFINITY for the others
+        llama_pos pos_max = -1;  // max position of the cells of the sequence
+    };
+
+    std::map<llama_seq_id, mask_row> mask_rows;
+
     std::vector<struct ggml_tensor *> k_l; // per layer
     std::vector<struct ggml_tensor *> v_l;
 
@@ -3280,6 +3439,36 @@ struct llama_sbatch {
     }
 };
 
+// the last decode graph, kept allocated so that the next ubatch with the same shape can skip
+// llama_build_graph, ggml_backend_sched_split_graph and the allocation of the compute buffers
+struct llama_graph_cache {
+    bool valid = false;
+
+    // shape of the cached graph
+    uint32_t n_tokens    = 0;
+    int32_t  n_outputs   = 0;
+    uint32_t n_kv        = 0;
+    bool     embd_inp    = false;
+    bool     embeddings  = false;
+    bool     causal_attn = false;
+
+    ggml_cgraph * gf = nullptr;
+
+    // the KV store views depend on kv_head - on reuse they are moved from the kv_head the graph was built for
+    struct kv_view {
+        ggml_tensor * tensor;
+        size_t        offs;   // view offset at build time
+        size_t        stride; // bytes per KV cell
+    };
+
+    uint32_t kv_head = 0;
+    std::vector<kv_view> kv_views;
+
+    bool disabled = false; // LLAMA_GRAPH_REUSE_DISABLE
+
+    int32_t n_reused = 0; // number of ubatches that reused the cached graph
+};
+
 struct llama_context {
     llama_context(const llama_model & model)
         : model(model)
@@ -3313,6 +3502,7 @@ struct llama_context {
     ggml_backend_t backend_blas = nullptr;
 #endif
     ggml_backend_t backend_cpu = nullptr;
+    std::vector<ggml_backend_t> backends_numa; // one per NUMA node with the pipeline strategy
 
     ggml_threadpool_t threadpool       = nullptr;
     ggml_threadpool_t threadpool_batch = nullptr;
@@ -3323,6 +3513,8 @@ struct llama_context {
     mutable int64_t t_load_us;
     mutable int64_t t_p_eval_us = 0;
     mutable int64_t t_eval_us   = 0;
+    mutable int64_t t_inputs_us = 0; // time spent in llama_set_inputs
+    mutable int64_t t_defrag_us = 0; // time spent in the KV cache defragmentation
 
     mutable int64_t t_compute_start_us = 0;
     mutable int64_t n_queued_tokens = 0;
@@ -3363,6 +3555,8 @@ struct llama_context {
     std::vector<uint8_t> buf_compute_meta;
     ggml_backend_sched_t sched = nullptr;
 
+    struct llama_graph_cache graph_cache;
+
     ggml_abort_callback abort_callback      = nullptr;
     void *              abort_callback_data = nullptr;
 
@@ -3382,6 +3576,10 @@ struct llama_context {
     struct ggml_tensor * inp_pos_bucket;    // I32 [n_batch|n_kv, n_batch]
     struct ggml_tensor * inp_embd_enc;      // F32 [n_embd, n_outputs_enc]
     struct ggml_tensor * inp_KQ_mask_cross; // F32 [n_outputs_enc, n_batch]
+    struct ggml_tensor * inp_kv_idxs;       // I32 [n_batch]
+
+    // outputs of the heavy-hitter eviction
+    std::vector<struct ggml_tensor *> kq_scores; // F32 [n_kv] per layer
 };
 
 struct llama_lora_weight {
@@ -3555,11 +3753,30 @@ static size_t llama_get_device_memory(const llama_model & model, int device) {
 // kv cache helpers
 //
 
+// the data types of the layers of the KV cache, e.g. "q4_0" or "f16 x3, q4_0 x29"
+static std::string llama_kv_types_str(const std::vector<ggml_type> & types) {
+    std::map<ggml_type, int> count;
+    for (const ggml_type type : types) {
+        count[type]++;
+    }
+
+    if (count.size() == 1) {
+        return ggml_type_name(types[0]);
+    }
+
+    std::string res;
+    for (const auto & it : count) {
+        res += format("%s%s x%d", res.empty() ? "" : ", ", ggml_type_name(it.first), it.second);
+    }
+
+    return res;
+}
+
 static bool llama_kv_cache_init(
              struct llama_kv_cache & cache,
                const llama_context * ctx,
-                         ggml_type   type_k,
-                         ggml_type   type_v,
+    const std::vector<ggml_type> & types_k, // per layer
+    const std::vector<ggml_type> & types_v,
                           uint32_t   kv_size,
                               bool   offload) {
     const llama_model & model = ctx->model;
@@ -3578,12 +3795,29 @@ static bool llama_kv_cache_init(
     cache.size = kv_size;
     cache.used = 0;
 
-    cache.type_k = type_k;
-    cache.type_v = type_v;
+    cache.type_k = types_k[0];
+    cache.type_v = types_v[0];
 
     cache.cells.clear();
     cache.cells.resize(kv_size);
 
+    cache.paged      = !cache.recurrent && cparams.kv_block_size > 0;
+    cache.block_size = cache.paged ? cparams.kv_block_size : 0;
+
+    cache.blocks.clear();
+    cache.block_tables.clear();
+    if (cache.paged) {
+        GGML_ASSERT(kv_size % cache.block_size == 0);
+        cache.blocks.resize(kv_size / cache.block_size);
+    }
+
+    cache.n_sink      = cache.recurrent ? 0 : cparams.kv_sink;
+    cache.n_window    = cparams.kv_window;
+    cache.evict_block = cache.paged ? cache.block_size : 32;
+    cache.hh_budget   = cache.recurrent ? 0 : cparams.kv_hh_budget;
+    cache.hh_recent   = cparams.kv_hh_recent;
+    cache.n_evicted   = 0;
+
     // count used buffer types
     std::map<ggml_backend_buffer_type_t, int> buft_layer_count;
     if (offload) {
@@ -3620,8 +3854,8 @@ static bool llama_kv_cache_init(
         const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(i) + hparams.n_embd_v_s();
 
         struct ggml_context * ctx = offload ? ctx_map.at(model.buft_layer[i].buft) : cache.ctxs.front();
-        ggml_tensor * k = ggml_new_tensor_1d(ctx, type_k, n_embd_k_gqa*kv_size);
-        ggml_tensor * v = ggml_new_tensor_1d(ctx, type_v, n_embd_v_gqa*kv_size);
+        ggml_tensor * k = ggml_new_tensor_1d(ctx, types_k[i], n_embd_k_gqa*kv_size);
+        ggml_tensor * v = ggml_new_tensor_1d(ctx, types_v[i], n_embd_v_gqa*kv_size);
         ggml_format_name(k, "cache_k_l%d", i);
         ggml_format_name(v, "cache_v_l%d", i);
         cache.k_l.push_back(k);
@@ -3645,6 +3879,127 @@ static bool llama_kv_cache_init(
     return true;
 }
 
+// the paged KV cache scatters the new KV data with ggml_set_rows - check that every backend which can use
+// the KV cache buffers supports it
+static bool llama_kv_cache_paged_supported(const llama_context & ctx) {
+    const auto & cache = ctx.kv_self;
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ 8*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+
+    bool ok = true;
+
+    for (size_t il = 0; il < cache.k_l.size() && ok; ++il) {
+        for (ggml_tensor * t : { cache.k_l[il], cache.v_l[il] }) {
+            ggml_context * ctx_tmp = ggml_init(params);
+            if (!ctx_tmp) {
+                return false;
+            }
+
+            const bool trans = t == cache.v_l[il] && cache.v_trans;
+
+            // a single block with the same row type and layout as in llm_build_kv_store
+            const int64_t n_embd = 256;
+            ggml_tensor * dst = ggml_new_tensor_2d(ctx_tmp, t->type, trans ? cache.block_size : n_embd, trans ? n_embd : cache.block_size);
+            if (trans) {
+                dst = ggml_transpose(ctx_tmp, dst);
+            }
+            ggml_tensor * src  = ggml_new_tensor_2d(ctx_tmp, GGML_TYPE_F32, n_embd, 1);
+            ggml_tensor * idxs = ggml_new_tensor_1d(ctx_tmp, GGML_TYPE_I32, 1);
+            ggml_tensor * op   = ggml_set_rows(ctx_tmp, dst, src, idxs);
+
+            ggml_backend_buffer_type_t buft = ggml_backend_buffer_get_type(t->buffer);
+
+            for (ggml_backend_t backend : ctx.backends) {
+                if (ggml_backend_supports_buft(backend, buft) && !ggml_backend_supports_op(backend, op)) {
+                    ok = false;
+                }
+            }
+
+            ggml_free(ctx_tmp);
+        }
+    }
+
+    return ok;
+}
+
+// the KQ mask rows are derived from the cells: every change of the cells other than new tokens in
+// llama_kv_cache_find_slot must invalidate them
+static void llama_kv_cache_mask_invalidate(struct llama_kv_cache & cache) {
+    cache.mask_valid = false;
+    cache.mask_dirty.clear();
+}
+
+// record a cell written by llama_kv_cache_find_slot for the next llama_kv_cache_mask_update. the updates are only
+// applied by the causal mask, so without it (e.g. non-causal embeddings) the list is capped at the size of the cache
+// and the mask is rebuilt instead, which costs the same as applying that many updates
+static void llama_kv_cache_mask_dirty(struct llama_kv_cache & cache, uint32_t cell_id) {
+    if (!cache.mask_valid) {
+        return;
+    }
+
+    if (cache.mask_dirty.size() >= cache.size) {
+        llama_kv_cache_mask_invalidate(cache);
+        return;
+    }
+
+    cache.mask_dirty.push_back(cell_id);
+}
+
+// bring the mask state up to date with the cells and make sure that the sequences of the ubatch have a row
+static void llama_kv_cache_mask_update(struct llama_kv_cache & cache, const llama_ubatch & batch) {
+    const uint32_t size = cache.size;
+
+    auto build_row = [&](llama_seq_id seq_id, llama_kv_cache::mask_row & row) {
+        row.data.resize(size);
+        row.pos_max = -1;
+        for (uint32_t i = 0; i < size; ++i) {
+            const llama_kv_cell & cell = cache.cells[i];
+            if (cell.has_seq_id(seq_id)) {
+                row.data[i] = 0.0f;
+                row.pos_max = std::max(row.pos_max, cell.pos);
+            } else {
+                row.data[i] = -INFINITY;
+            }
+        }
+    };
+
+    if (!cache.mask_valid) {
+        cache.mask_pos.resize(size);
+        for (uint32_t i = 0; i < size; ++i) {
+            cache.mask_pos[i] = cache.cells[i].pos;
+        }
+
+        cache.mask_rows.clear();
+        cache.mask_valid = true;
+    }
+
+    // the new cells only gain sequences, so the rows can be updated in place
+    for (const uint32_t i : cache.mask_dirty) {
+        const llama_kv_cell & cell = cache.cells[i];
+
+        cache.mask_pos[i] = cell.pos;
+
+        for (auto & it : cache.mask_rows) {
+            if (cell.has_seq_id(it.first)) {
+                it.second.data[i] = 0.0f;
+                it.second.pos_max = std::max(it.second.pos_max, cell.pos);
+            }
+        }
+    }
+    cache.mask_dirty.clear();
+
+    for (uint32_t s = 0; s < batch.n_seqs; ++s) {
+        const llama_seq_id seq_id = batch.seq_id[s][0];
+        if (cache.mask_rows.find(seq_id) == cache.mask_rows.end()) {
+            build_row(seq_id, cache.mask_rows[seq_id]);
+        }
+    }
+}
+
 // find an empty slot of size "n_tokens" in the cache
 // updates the cache head
 // Note: On success, it's important that cache.head points
@@ -3809,6 +4164,8 @@ static bool llama_kv_cache_find_slot(
             }
         }
 
+        llama_kv_cache_mask_invalidate(cache);
+
         // allow getting the range of used cells, from head to head + n
         cache.head = min;
         cache.n    = max - min + 1;
@@ -3855,19 +4212,253 @@ static bool llama_kv_cache_find_slot(
     for (uint32_t s = 0; s < n_seqs; s++) {
         for (uint32_t i = 0; i < n_seq_tokens; ++i) {
             uint32_t k = s*n_seq_tokens + i;
-            cache.cells[cache.head + k].pos = batch.pos[k];
+            cache.cells[cache.head + k].pos   = batch.pos[k];
+            cache.cells[cache.head + k].score = 0.0f;
 
             for (int32_t j = 0; j < batch.n_seq_id[s]; j++) {
                 cache.cells[cache.head + k].seq_id.insert(batch.seq_id[s][j]);
             }
+
+            llama_kv_cache_mask_dirty(cache, cache.head + k);
+        }
+    }
+
+    cache.used += n_tokens;
+
+    return true;
+}
+
+// recount the used cells and the referencing sequences of each block and update the block tables
+// a block is referenced by every sequence with at least one cell in it, so the blocks of a prefix shared
+// with llama_kv_cache_seq_cp end up in the tables of all the sequences that share it
+static void llama_kv_cache_blocks_update(struct llama_kv_cache & cache) {
+    const uint32_t n_blocks = cache.blocks.size();
+
+    // sequences with cells in each block
+    std::vector<std::vector<llama_seq_id>> block_seqs(n_blocks);
+
+    for (uint32_t ib = 0; ib < n_blocks; ++ib) {
+        llama_kv_block & block = cache.blocks[ib];
+
+        block.used = 0;
+
+        for (uint32_t i = ib*cache.block_size; i < (ib + 1)*cache.block_size; ++i) {
+            const llama_kv_cell & cell = cache.cells[i];
+            if (cell.pos < 0) {
+                continue;
+            }
+
+            block.used++;
+
+            for (const llama_seq_id seq_id : cell.seq_id) {
+                if (std::find(block_seqs[ib].begin(), block_seqs[ib].end(), seq_id) == block_seqs[ib].end()) {
+                    block_seqs[ib].push_back(seq_id);
+                }
+            }
+        }
+
+        block.n_ref = block_seqs[ib].size();
+    }
+
+    // drop the blocks that a sequence does not reference anymore, keeping the order of the others
+    for (auto it = cache.block_tables.begin(); it != cache.block_tables.end(); ) {
+        const llama_seq_id seq_id = it->first;
+        auto & table = it->second;
+
+        table.erase(std::remove_if(table.begin(), table.end(), [&](uint32_t ib) {
+            auto & seqs = block_seqs[ib];
+            auto   pos  = std::find(seqs.begin(), seqs.end(), seq_id);
+            if (pos == seqs.end()) {
+                return true;
+            }
+            // already in the table
+            seqs.erase(pos);
+            return false;
+        }), table.end());
+
+        it = table.empty() ? cache.block_tables.erase(it) : std::next(it);
+    }
+
+    // append the newly referenced blocks (e.g. after llama_kv_cache_seq_cp)
+    for (uint32_t ib = 0; ib < n_blocks; ++ib) {
+        for (const llama_seq_id seq_id : block_seqs[ib]) {
+            cache.block_tables[seq_id].push_back(ib);
+        }
+    }
+}
+
+// find an empty cell for a new token of seq_id
+// the tokens are appended to the last block of the sequence as long as no other sequence references it - shared
+// blocks are never written, the first divergent token of each sequence starts a new block
+// call llama_kv_cache_blocks_update before, returns -1 if the cache is full
+static int32_t llama_kv_cache_alloc_cell(struct llama_kv_cache & cache, llama_seq_id seq_id) {
+    const uint32_t n_blocks = cache.blocks.size();
+
+    // first empty cell of block ib, or -1 if the block is full
+    auto find_cell = [&](uint32_t ib) -> int32_t {
+        for (uint32_t i = ib*cache.block_size; i < (ib + 1)*cache.block_size; ++i) {
+            if (cache.cells[i].pos < 0) {
+                return i;
+            }
+        }
+        return -1;
+    };
+
+    auto & table = cache.block_tables[seq_id];
+
+    int32_t cell_id = -1;
+
+    if (!table.empty() && cache.blocks[table.back()].n_ref <= 1) {
+        cell_id = find_cell(table.back());
+    }
+
+    if (cell_id < 0) {
+        // allocate the first free block, keeping the used part of the cache compact
+        for (uint32_t ib = 0; ib < n_blocks; ++ib) {
+            if (cache.blocks[ib].used == 0 && cache.blocks[ib].n_ref == 0) {
+                cache.blocks[ib].n_ref = 1;
+                table.push_back(ib);
+                cell_id = ib*cache.block_size;
+                break;
+            }
+        }
+    }
+
+    if (cell_id < 0) {
+        // no free blocks left - use the empty cells in the blocks of the other sequences
+        for (uint32_t ib = 0; ib < n_blocks && cell_id < 0; ++ib) {
+            cell_id = find_cell(ib);
+        }
+    }
+
+    if (cell_id >= 0) {
+        cache.blocks[cell_id / cache.block_size].used++;
+    }
+
+    return cell_id;
+}
+
+// find a cell for each token of the ubatch in the blocks of its sequence
+// unlike llama_kv_cache_find_slot, the cells do not have to be contiguous, they are returned in cache.slot_idxs
+static bool llama_kv_cache_find_slot_paged(
+           struct llama_kv_cache & cache,
+       const struct llama_ubatch & batch) {
+    GGML_ASSERT(cache.paged);
+
+    const uint32_t n_tokens     = batch.n_tokens;
+    const uint32_t n_seqs       = batch.n_seqs;
+    const uint32_t n_seq_tokens = batch.n_seq_tokens;
+
+    cache.slot_idxs.resize(n_tokens);
+
+    // the visual token dropping writes each layer at a different offset from kv_head
+    if (batch.img_token_len != 0 || batch.img_token_step != 0) {
+        if (!llama_kv_cache_find_slot(cache, batch)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < n_tokens; ++i) {
+            cache.slot_idxs[i] = cache.head + i;
+        }
+        return true;
+    }
+
+    if (cache.used + n_tokens > cache.size) {
+        return false;
+    }
+
+    llama_kv_cache_blocks_update(cache);
+
+    uint32_t head = cache.size;
+
+    for (uint32_t s = 0; s < n_seqs; s++) {
+        for (uint32_t i = 0; i < n_seq_tokens; ++i) {
+            const uint32_t k = s*n_seq_tokens + i;
+
+            const int32_t cell_id = llama_kv_cache_alloc_cell(cache, batch.seq_id[s][0]);
+
+            // there are at least n_tokens empty cells
+            GGML_ASSERT(cell_id >= 0);
+
+            llama_kv_cell & cell = cache.cells[cell_id];
+
+            cell.pos   = batch.pos[k];
+            cell.score = 0.0f;
+            for (int32_t j = 0; j < batch.n_seq_id[s]; j++) {
+                cell.seq_id.insert(batch.seq_id[s][j]);
+            }
+
+            cache.slot_idxs[k] = cell_id;
+            llama_kv_cache_mask_dirty(cache, cell_id);
+
+            head = std::min(head, (uint32_t) cell_id);
         }
     }
 
     cache.used += n_tokens;
+    cache.head  = head;
 
     return true;
 }
 
+// copy-on-write: before the position of the cells of seq_id in [p0, p1) is changed, move seq_id out of the
+// cells that it shares with other sequences into cells of its own
+// the KV data of the new cells is copied from the shared ones in llama_kv_cache_update
+static void llama_kv_cache_seq_detach(
+        struct llama_kv_cache & cache,
+                 llama_seq_id   seq_id,
+                    llama_pos   p0,
+                    llama_pos   p1) {
+    std::vector<uint32_t> shared;
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        const llama_kv_cell & cell = cache.cells[i];
+        if (cell.pos >= p0 && cell.pos < p1 && cell.seq_id.size() > 1 && cell.has_seq_id(seq_id)) {
+            shared.push_back(i);
+        }
+    }
+
+    if (shared.empty()) {
+        return;
+    }
+
+    if (cache.paged) {
+        llama_kv_cache_blocks_update(cache);
+    }
+
+    uint32_t next_empty = 0;
+
+    for (const uint32_t i : shared) {
+        int32_t cell_id = -1;
+        if (cache.paged) {
+            cell_id = llama_kv_cache_alloc_cell(cache, seq_id);
+        } else {
+            for (; next_empty < cache.size; ++next_empty) {
+                if (cache.cells[next_empty].is_empty()) {
+                    cell_id = next_empty++;
+                    break;
+                }
+            }
+        }
+        if (cell_id < 0) {
+            LLAMA_LOG_WARN("%s: no free KV cells, the cells of seq_id %d shared with other sequences are modified in place\n", __func__, seq_id);
+            return;
+        }
+
+        llama_kv_cell & src = cache.cells[i];
+        llama_kv_cell & dst = cache.cells[cell_id];
+
+        dst.pos   = src.pos;
+        dst.delta = src.delta;
+        dst.score = src.score;
+        dst.seq_id.insert(seq_id);
+
+        src.seq_id.erase(seq_id);
+
+        cache.used++;
+        cache.cow_copies.emplace_back(i, cell_id);
+    }
+}
+
 // find how many cells are currently in use
 static uint32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
     for (uint32_t i = cache.size; i > 0; --i) {
@@ -3882,6 +4473,8 @@ static uint32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
 }
 
 static void llama_kv_cache_clear(struct llama_kv_cache & cache) {
+    llama_kv_cache_mask_invalidate(cache);
+
     for (int32_t i = 0; i < (int32_t) cache.size; ++i) {
         cache.cells[i].pos = -1;
         cache.cells[i].seq_id.clear();
@@ -3891,6 +4484,12 @@ static void llama_kv_cache_clear(struct llama_kv_cache & cache) {
     cache.head = 0;
     cache.used = 0;
 
+    for (auto & block : cache.blocks) {
+        block = {};
+    }
+    cache.block_tables.clear();
+    cache.cow_copies.clear();
+
     for (auto & buf : cache.bufs) {
         ggml_backend_buffer_clear(buf, 0);
     }
@@ -3901,6 +4500,8 @@ static bool llama_kv_cache_seq_rm(
                  llama_seq_id   seq_id,
                     llama_pos   p0,
                     llama_pos   p1) {
+    llama_kv_cache_mask_invalidate(cache);
+
     uint32_t new_head = cache.size;
 
     if (p0 < 0) p0 = 0;
@@ -3965,6 +4566,8 @@ static void llama_kv_cache_seq_cp(
                  llama_seq_id   seq_id_dst,
                     llama_pos   p0,
                     llama_pos   p1) {
+    llama_kv_cache_mask_invalidate(cache);
+
     if (p0 < 0) p0 = 0;
     if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
 
@@ -4007,6 +4610,8 @@ static void llama_kv_cache_seq_cp(
 }
 
 static void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id seq_id) {
+    llama_kv_cache_mask_invalidate(cache);
+
     uint32_t new_head = cache.size;
 
     for (uint32_t i = 0; i < cache.size; ++i) {
@@ -4035,6 +4640,8 @@ static void llama_kv_cache_seq_add(
                     llama_pos   p0,
                     llama_pos   p1,
                     llama_pos   delta) {
+    llama_kv_cache_mask_invalidate(cache);
+
     uint32_t new_head = cache.size;
 
     if (p0 < 0) p0 = 0;
@@ -4056,6 +4663,10 @@ static void llama_kv_cache_seq_add(
         return;
     }
 
+    if (cache.paged) {
+        llama_kv_cache_seq_detach(cache, seq_id, p0, p1);
+    }
+
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
             cache.has_shift = true;
@@ -4086,6 +4697,8 @@ static void llama_kv_cache_seq_div(
                     llama_pos   p0,
                     llama_pos   p1,
                           int   d) {
+    llama_kv_cache_mask_invalidate(cache);
+
     if (p0 < 0) p0 = 0;
     if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
     // If there is no range then return early to avoid looping over the cache.
@@ -4105,6 +4718,10 @@ static void llama_kv_cache_seq_div(
         return;
     }
 
+    if (cache.paged) {
+        llama_kv_cache_seq_detach(cache, seq_id, p0, p1);
+    }
+
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
             cache.has_shift = true;
@@ -4130,6 +4747,146 @@ static llama_pos llama_kv_cache_seq_pos_max(struct llama_kv_cache & cache, llama
     return result;
 }
 
+// number of new cells of each sequence of the ubatch
+static std::map<llama_seq_id, uint32_t> llama_ubatch_seq_n_tokens(const llama_ubatch & ubatch) {
+    std::map<llama_seq_id, uint32_t> n_new;
+
+    for (uint32_t s = 0; s < ubatch.n_seqs; ++s) {
+        for (int32_t j = 0; j < ubatch.n_seq_id[s]; ++j) {
+            n_new[ubatch.seq_id[s][j]] += ubatch.n_seq_tokens;
+        }
+    }
+
+    return n_new;
+}
+
+// sliding window with attention sinks (StreamingLLM): make room for the tokens of the ubatch in the sequences that
+// would exceed n_window cells, by evicting the oldest cells after the first n_sink ones, evict_block cells at a time
+// instead of shifting the whole window back, the sink cells are moved up next to the remaining cells - their K-shift is
+// applied lazily by the next cache update and only touches the sink cells
+static void llama_kv_cache_evict(struct llama_kv_cache & cache, const llama_ubatch & ubatch) {
+    const auto n_new = llama_ubatch_seq_n_tokens(ubatch);
+
+    std::vector<llama_pos> pos;
+
+    for (const auto & it : n_new) {
+        const llama_seq_id seq_id = it.first;
+
+        uint32_t n_cells = 0;
+        for (uint32_t i = 0; i < cache.size; ++i) {
+            if (cache.cells[i].has_seq_id(seq_id)) {
+                n_cells++;
+            }
+        }
+
+        if (n_cells + it.second <= cache.n_window || n_cells <= cache.n_sink) {
+            continue;
+        }
+
+        pos.clear();
+        for (uint32_t i = 0; i < cache.size; ++i) {
+            if (cache.cells[i].has_seq_id(seq_id)) {
+                pos.push_back(cache.cells[i].pos);
+            }
+        }
+        std::sort(pos.begin(), pos.end());
+
+        const uint32_t n_need  = n_cells + it.second - cache.n_window;
+        const uint32_t n_evict = std::min(GGML_PAD(n_need, cache.evict_block), n_cells - cache.n_sink);
+
+        if (n_evict < n_need) {
+            LLAMA_LOG_WARN("%s: the ubatch has more tokens of seq_id %d than the window of %u cells\n", __func__, seq_id, cache.n_window);
+        }
+
+        // evicted: [p0, p1)
+        const llama_pos p0 = pos[cache.n_sink];
+        const llama_pos p1 = cache.n_sink + n_evict < n_cells ? pos[cache.n_sink + n_evict] : pos.back() + 1;
+
+        llama_kv_cache_seq_rm(cache, seq_id, p0, p1);
+
+        // the sink cells may be shared with other sequences (e.g. a common system prompt)
+        llama_kv_cache_seq_detach(cache, seq_id, pos[0], p0);
+        llama_kv_cache_seq_add   (cache, seq_id, pos[0], p0, p1 - p0);
+
+        cache.n_evicted += n_evict;
+    }
+}
+
+// heavy-hitter eviction (H2O): make room for the tokens of the ubatch in the sequences that would exceed hh_budget
+// cells, by evicting the cells that received the least attention so far, except for the last hh_recent ones
+// the positions of the remaining cells are not changed, the evicted cells just drop out of the KQ mask
+static void llama_kv_cache_evict_hh(struct llama_kv_cache & cache, const llama_ubatch & ubatch) {
+    const auto n_new = llama_ubatch_seq_n_tokens(ubatch);
+
+    std::vector<std::pair<llama_pos, uint32_t>> cells; // (pos, cell) of the sequence
+
+    bool evicted = false;
+
+    for (const auto & it : n_new) {
+        const llama_seq_id seq_id = it.first;
+
+        cells.clear();
+        for (uint32_t i = 0; i < cache.size; ++i) {
+            if (cache.cells[i].has_seq_id(seq_id)) {
+                cells.emplace_back(cache.cells[i].pos, i);
+            }
+        }
+
+        const uint32_t n_cells = cells.size();
+
+        if (n_cells + it.second <= cache.hh_budget || n_cells <= cache.hh_recent) {
+            continue;
+        }
+
+        const uint32_t n_need  = n_cells + it.second - cache.hh_budget;
+        const uint32_t n_evict = std::min(GGML_PAD(n_need, cache.evict_block), n_cells - cache.hh_recent);
+
+        if (n_evict < n_need) {
+            LLAMA_LOG_WARN("%s: the ubatch has more tokens of seq_id %d than the budget of %u cells\n", __func__, seq_id, cache.hh_budget);
+        }
+
+        // most recent first, then the candidates by increasing score
+        std::sort(cells.begin(), cells.end(), [](const std::pair<llama_pos, uint32_t> & a, const std::pair<llama_pos, uint32_t> & b) {
+            return a.first > b.first;
+        });
+        std::partial_sort(cells.begin() + cache.hh_recent, cells.begin() + cache.hh_recent + n_evict, cells.end(),
+                [&](const std::pair<llama_pos, uint32_t> & a, const std::pair<llama_pos, uint32_t> & b) {
+            return cache.cells[a.second].score < cache.cells[b.second].score;
+        });
+
+        for (uint32_t k = cache.hh_recent; k < cache.hh_recent + n_evict; ++k) {
+            const uint32_t i = cells[k].second;
+
+            llama_kv_cell & cell = cache.cells[i];
+
+            cell.seq_id.erase(seq_id);
+            if (cell.is_empty()) {
+                cache.used--;
+
+                cell.pos   = -1;
+                cell.src   = -1;
+                cell.score = 0.0f;
+
+                cache.head = std::min(cache.head, i);
+            }
+        }
+
+        cache.n_evicted += n_evict;
+
+        evicted = true;
+    }
+
+    if (evicted) {
+        llama_kv_cache_mask_invalidate(cache);
+
+        // the contiguous layout needs the ubatch in consecutive cells, compact the holes left by the eviction
+        if (!cache.paged && ubatch.n_tokens > 1) {
+            cache.do_defrag   = true;
+            cache.defrag_full = true;
+        }
+    }
+}
+
 static void llama_kv_cache_defrag(struct llama_kv_cache & cache) {
     if (!cache.recurrent) {
         cache.do_defrag = true;
@@ -6938,6 +7695,15 @@ static bool llm_load_tensors(
         }
     }
 
+    // with the NUMA pipeline strategy, the layers are split evenly across the NUMA nodes, each node reads only local weights
+    const int n_numa = ggml_numa_get_strategy() == GGML_NUMA_STRATEGY_PIPELINE ? ggml_numa_n_nodes() : 0;
+    if (n_numa > 1 && i_gpu_start == n_layer) {
+        for (int i = 0; i < n_layer; ++i) {
+            model.buft_layer[i] = ggml_backend_cpu_numa_buffer_type(i*n_numa/n_layer);
+        }
+        model.buft_output = ggml_backend_cpu_numa_buffer_type(n_numa - 1);
+    }
+
     // count used buffer types
     std::map<ggml_backend_buffer_type_t, int> buft_layer_count;
     buft_layer_count[model.buft_input.buft]++;
@@ -9004,6 +9770,25 @@ static struct ggml_tensor * llm_build_inp_embd(
     return inpL;
 }
 
+// cells of the ubatch tokens in the paged KV cache, nullptr with the contiguous layout
+static struct ggml_tensor * llm_build_inp_kv_idxs(
+        struct ggml_context * ctx,
+       struct llama_context & lctx,
+                    int32_t   n_tokens,
+         const llm_build_cb & cb) {
+    if (!lctx.kv_self.paged) {
+        return nullptr;
+    }
+
+    if (lctx.inp_kv_idxs == nullptr) {
+        lctx.inp_kv_idxs = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, n_tokens);
+        cb(lctx.inp_kv_idxs, "inp_kv_idxs", -1);
+        ggml_set_input(lctx.inp_kv_idxs);
+    }
+
+    return lctx.inp_kv_idxs;
+}
+
 static void llm_build_kv_store(
         struct ggml_context * ctx,
         const llama_hparams & hparams,
@@ -9012,6 +9797,7 @@ static void llm_build_kv_store(
          struct ggml_cgraph * graph,
          struct ggml_tensor * k_cur,
          struct ggml_tensor * v_cur,
+         struct ggml_tensor * kv_idxs,
                     int32_t   n_tokens,
                     int32_t   kv_head,
          const llm_build_cb & cb,
@@ -9023,6 +9809,45 @@ static void llm_build_kv_store(
 
     GGML_ASSERT(kv.size == n_ctx);
 
+    if (kv_idxs) {
+        // paged KV cache: scatter the rows of the ubatch to the cells in kv_idxs
+        GGML_ASSERT(kv_idxs->ne[0] == n_tokens);
+
+        struct ggml_tensor * k_cache_rows = ggml_view_2d(ctx, kv.k_l[il], n_embd_k_gqa, n_ctx,
+                ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa), 0);
+
+        if (!ggml_is_contiguous(k_cur)) {
+            k_cur = ggml_cont(ctx, k_cur);
+        }
+        k_cache_rows = ggml_set_rows(ctx, k_cache_rows, ggml_reshape_2d(ctx, k_cur, n_embd_k_gqa, n_tokens), kv_idxs);
+        cb(k_cache_rows, "k_cache_rows", il);
+
+        ggml_build_forward_expand(graph, k_cache_rows);
+
+        assert(v_cur->ne[0] == n_embd_v_gqa && v_cur->ne[1] == n_tokens);
+
+        struct ggml_tensor * v_cache_rows = nullptr;
+
+        if (cparams.flash_attn) {
+            v_cache_rows = ggml_view_2d(ctx, kv.v_l[il], n_embd_v_gqa, n_ctx,
+                    ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa), 0);
+        } else {
+            // the V cache is transposed - each token is a column
+            v_cache_rows = ggml_transpose(ctx, ggml_view_2d(ctx, kv.v_l[il], n_ctx, n_embd_v_gqa,
+                    ggml_row_size(kv.v_l[il]->type, n_ctx), 0));
+        }
+
+        if (v_cur->nb[0] != sizeof(float)) {
+            v_cur = ggml_cont(ctx, v_cur);
+        }
+        v_cache_rows = ggml_set_rows(ctx, v_cache_rows, v_cur, kv_idxs);
+        cb(v_cache_rows, "v_cache_rows", il);
+
+        ggml_build_forward_expand(graph, v_cache_rows);
+
+        return;
+    }
+
     struct ggml_tensor * k_cache_view = ggml_view_1d(ctx, kv.k_l[il], n_tokens*n_embd_k_gqa, ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa)*kv_head);
     cb(k_cache_view, "k_cache_view", il);
 
@@ -9360,6 +10185,38 @@ static struct ggml_tensor * llm_build_moe_ffn(
     return moe_out;
 }
 
+// heavy-hitter eviction: attention mass received by each KV cell in this layer, summed over the heads and over the
+// last tokens of the ubatch (the SnapKV observation window) - read back by llama_kv_cache_hh_update
+static void llm_build_kq_score(
+        struct ggml_context * ctx,
+       struct llama_context & lctx,
+         struct ggml_cgraph * graph,
+         struct ggml_tensor * kq,
+         const llm_build_cb & cb,
+                    int       il) {
+    if (lctx.kv_self.hh_budget == 0) {
+        return;
+    }
+
+    // kq: [n_kv, n_tokens, n_head]
+    const int64_t n_kv     = kq->ne[0];
+    const int64_t n_tokens = kq->ne[1];
+    const int64_t n_head   = kq->ne[2];
+    const int64_t n_obs    = std::min<int64_t>(n_tokens, 32);
+
+    struct ggml_tensor * score = ggml_view_3d(ctx, kq, n_kv, n_obs, n_head, kq->nb[1], kq->nb[2], (n_tokens - n_obs)*kq->nb[1]);
+
+    // [n_obs*n_head, n_kv] -> [1, n_kv]
+    score = ggml_cont(ctx, ggml_permute(ctx, score, 2, 0, 1, 3));
+    score = ggml_sum_rows(ctx, ggml_reshape_2d(ctx, score, n_obs*n_head, n_kv));
+    cb(score, "kq_score", il);
+
+    ggml_set_output(score);
+    ggml_build_forward_expand(graph, score);
+
+    lctx.kq_scores.push_back(score);
+}
+
 static struct ggml_tensor * llm_build_kqv(
         struct ggml_context * ctx,
        struct llama_context & lctx,
@@ -9453,6 +10310,8 @@ static struct ggml_tensor * llm_build_kqv(
         kq = ggml_soft_max_ext(ctx, kq, kq_mask, kq_scale, hparams.f_max_alibi_bias);
         cb(kq, "kq_soft_max_ext", il);
 
+        llm_build_kq_score(ctx, lctx, graph, kq, cb, il);
+
         GGML_ASSERT(kv.size == n_ctx);
 
         // split cached v into n_head heads
@@ -9517,7 +10376,9 @@ static struct ggml_tensor * llm_build_kv(
     ggml_build_forward_expand(graph, k_cur);
     ggml_build_forward_expand(graph, v_cur);
 
-    llm_build_kv_store(ctx, hparams, cparams, kv, graph, k_cur, v_cur, n_tokens, kv_head, cb, il);
+    struct ggml_tensor * kv_idxs = llm_build_inp_kv_idxs(ctx, lctx, n_tokens, cb);
+
+    llm_build_kv_store(ctx, hparams, cparams, kv, graph, k_cur, v_cur, kv_idxs, n_tokens, kv_head, cb, il);
 
     struct ggml_tensor * cur;
 
@@ -9641,6 +10502,8 @@ static struct ggml_tensor * llm_build_kqv_drop(
         kq = ggml_soft_max_ext(ctx, kq, kq_mask, kq_scale, hparams.f_max_alibi_bias);
         cb(kq, "kq_soft_max_ext", il);
 
+        llm_build_kq_score(ctx, lctx, graph, kq, cb, il);
+
         GGML_ASSERT(kv.size == n_ctx);
 
         // split cached v into n_head heads
@@ -9759,7 +10622,10 @@ static struct ggml_tensor * llm_build_kv_drop(
     ggml_build_forward_expand(graph, k_cur);
     ggml_build_forward_expand(graph, v_cur);
 
-    llm_build_kv_store(ctx, hparams, cparams, kv, graph, k_cur, v_cur, n_tokens, kv_head, cb, il);
+    // with visual token dropping, each layer is stored at its own offset from kv_head in a contiguous slot
+    struct ggml_tensor * kv_idxs = img_token_step == 0 ? llm_build_inp_kv_idxs(ctx, lctx, n_tokens, cb) : nullptr;
+
+    llm_build_kv_store(ctx, hparams, cparams, kv, graph, k_cur, v_cur, kv_idxs, n_tokens, kv_head, cb, il);
 
     // n_embd = n_head * n_head_dim
     // q_cur: (n_tokens, n_head, n_head_dim)
@@ -10225,6 +11091,9 @@ struct llm_build_context {
         lctx.inp_pos_bucket    = nullptr;
         lctx.inp_embd_enc      = nullptr;
         lctx.inp_KQ_mask_cross = nullptr;
+        lctx.inp_kv_idxs       = nullptr;
+
+        lctx.kq_scores.clear();
     }
 
     void free() {
@@ -10239,7 +11108,10 @@ struct llm_build_context {
 
         GGML_ASSERT(kv_self.size == n_ctx);
 
-        lctx.inp_K_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_ctx);
+        // only the cells [shift_head, shift_head + shift_n) have a non-zero delta
+        const int64_t n_shift = kv_self.shift_n;
+
+        lctx.inp_K_shift = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_shift);
         cb(lctx.inp_K_shift, "K_shift", -1);
         ggml_set_input(lctx.inp_K_shift);
 
@@ -10249,10 +11121,10 @@ struct llm_build_context {
             struct ggml_tensor * rope_factors = build_rope_factors(il);
             struct ggml_tensor * k =
                 ggml_view_3d(ctx0, kv_self.k_l[il],
-                    n_embd_head_k, n_head_kv, n_ctx,
+                    n_embd_head_k, n_head_kv, n_shift,
                     ggml_row_size(kv_self.k_l[il]->type, n_embd_head_k),
                     ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
-                    0);
+                    ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa)*kv_self.shift_head);
 
             struct ggml_tensor * tmp;
             if (ggml_is_quantized(k->type)) {
@@ -10284,66 +11156,92 @@ struct llm_build_context {
         return gf;
     }
 
-    struct ggml_cgraph * build_defrag(const std::vector<uint32_t> & ids) {
-        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+    // copy the KV data of the cells [i, i + nm) to the cells [id, id + nm) in all layers
+    void build_kv_copy(struct ggml_cgraph * gf, uint32_t i, uint32_t id, uint32_t nm) {
+        for (int il = 0; il < n_layer; ++il) {
+            const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
+            const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
 
-        for (uint32_t i = 0; i < ids.size(); ++i) {
-            const uint32_t id = ids[i];
+            ggml_tensor * view_k_src = ggml_view_2d(ctx0, kv_self.k_l[il],
+                    n_embd_k_gqa, nm,
+                    ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
+                    ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa*i));
 
-            if (i == id || id == ids.size()) {
-                continue;
+            ggml_tensor * view_k_dst = ggml_view_2d(ctx0, kv_self.k_l[il],
+                    n_embd_k_gqa, nm,
+                    ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
+                    ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa*id));
+
+            ggml_tensor * view_v_src;
+            ggml_tensor * view_v_dst;
+
+            if (flash_attn) {
+                // NOTE: the V cache is not transposed when using flash attention
+                view_v_src = ggml_view_2d(ctx0, kv_self.v_l[il],
+                        n_embd_v_gqa, nm,
+                        ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa),
+                        ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa*i));
+
+                view_v_dst = ggml_view_2d(ctx0, kv_self.v_l[il],
+                        n_embd_v_gqa, nm,
+                        ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa),
+                        ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa*id));
+            } else {
+                view_v_src = ggml_view_2d(ctx0, kv_self.v_l[il],
+                        nm, n_embd_v_gqa,
+                        ggml_row_size(kv_self.v_l[il]->type, kv_self.size),
+                        ggml_row_size(kv_self.v_l[il]->type, i));
+
+                view_v_dst = ggml_view_2d(ctx0, kv_self.v_l[il],
+                        nm, n_embd_v_gqa,
+                        ggml_row_size(kv_self.v_l[il]->type, kv_self.size),
+                        ggml_row_size(kv_self.v_l[il]->type, id));
             }
 
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, view_k_src, view_k_dst));
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, view_v_src, view_v_dst));
+        }
+    }
+
+    struct ggml_cgraph * build_kv_cow(const std::vector<std::pair<uint32_t, uint32_t>> & copies) {
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
+
+        for (size_t i = 0; i < copies.size(); ++i) {
+            const uint32_t src = copies[i].first;
+            const uint32_t dst = copies[i].second;
+
             uint32_t nm = 1;
 
-            while (i + nm < ids.size() && ids[i + nm] == id + nm) {
+            while (i + nm < copies.size() && copies[i + nm].first == src + nm && copies[i + nm].second == dst + nm) {
                 nm++;
             }
 
-            for (int il = 0; il < n_layer; ++il) {
-                const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
-                const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
+            build_kv_copy(gf, src, dst, nm);
 
-                ggml_tensor * view_k_src = ggml_view_2d(ctx0, kv_self.k_l[il],
-                        n_embd_k_gqa, nm,
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa*i));
+            i += nm - 1;
+        }
 
-                ggml_tensor * view_k_dst = ggml_view_2d(ctx0, kv_self.k_l[il],
-                        n_embd_k_gqa, nm,
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa*id));
+        return gf;
+    }
 
-                ggml_tensor * view_v_src;
-                ggml_tensor * view_v_dst;
+    struct ggml_cgraph * build_defrag(const std::vector<uint32_t> & ids) {
+        struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
 
-                if (flash_attn) {
-                    // NOTE: the V cache is not transposed when using flash attention
-                    view_v_src = ggml_view_2d(ctx0, kv_self.v_l[il],
-                            n_embd_v_gqa, nm,
-                            ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa),
-                            ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa*i));
+        for (uint32_t i = 0; i < ids.size(); ++i) {
+            const uint32_t id = ids[i];
 
-                    view_v_dst = ggml_view_2d(ctx0, kv_self.v_l[il],
-                            n_embd_v_gqa, nm,
-                            ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa),
-                            ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa*id));
-                } else {
-                    view_v_src = ggml_view_2d(ctx0, kv_self.v_l[il],
-                            nm, n_embd_v_gqa,
-                            ggml_row_size(kv_self.v_l[il]->type, kv_self.size),
-                            ggml_row_size(kv_self.v_l[il]->type, i));
-
-                    view_v_dst = ggml_view_2d(ctx0, kv_self.v_l[il],
-                            nm, n_embd_v_gqa,
-                            ggml_row_size(kv_self.v_l[il]->type, kv_self.size),
-                            ggml_row_size(kv_self.v_l[il]->type, id));
-                }
+            if (i == id || id == ids.size()) {
+                continue;
+            }
+
+            uint32_t nm = 1;
 
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, view_k_src, view_k_dst));
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, view_v_src, view_v_dst));
+            while (i + nm < ids.size() && ids[i + nm] == id + nm) {
+                nm++;
             }
 
+            build_kv_copy(gf, i, id, nm);
+
             i += nm - 1;
         }
 
@@ -15420,7 +16318,7 @@ struct llm_build_context {
                 struct ggml_tensor * Vcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
 
-                llm_build_kv_store(ctx0, hparams, cparams, kv_self, gf, Kcur, Vcur, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, cparams, kv_self, gf, Kcur, Vcur, llm_build_inp_kv_idxs(ctx0, lctx, n_tokens, cb), n_tokens, kv_head, cb, il);
 
                 struct ggml_tensor * k =
                     ggml_view_3d(ctx0, kv_self.k_l[il],
@@ -16164,6 +17062,23 @@ static struct ggml_cgraph * llama_build_graph_defrag(llama_context & lctx, const
     return result;
 }
 
+static struct ggml_cgraph * llama_build_graph_kv_cow(llama_context & lctx, const std::vector<std::pair<uint32_t, uint32_t>> & copies) {
+    llama_ubatch dummy = {};
+    dummy.equal_seqs = true;
+
+    llm_build_cb cb = [&](struct ggml_tensor * , const char * , int ) { };
+
+    struct llm_build_context llm(lctx, dummy, cb, false);
+
+    llm.init();
+
+    struct ggml_cgraph * result = llm.build_kv_cow(copies);
+
+    llm.free();
+
+    return result;
+}
+
 static struct ggml_cgraph * llama_build_graph_k_shift(llama_context & lctx) {
     llama_ubatch dummy = {};
     dummy.equal_seqs = true;
@@ -16421,14 +17336,14 @@ static struct ggml_cgraph * llama_build_graph(
 }
 
 static void llama_set_k_shift(llama_context & lctx) {
-    const int64_t kv_size = lctx.kv_self.size;
+    const auto & kv_self = lctx.kv_self;
 
     assert(ggml_backend_buffer_is_host(lctx.inp_K_shift->buffer));
 
     int32_t * data = (int32_t *) lctx.inp_K_shift->data;
 
-    for (int i = 0; i < kv_size; ++i) {
-        data[i] = lctx.kv_self.cells[i].delta;
+    for (uint32_t i = 0; i < kv_self.shift_n; ++i) {
+        data[i] = kv_self.cells[kv_self.shift_head + i].delta;
     }
 }
 
@@ -16495,7 +17410,15 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & batch) {
     if (batch.pos && lctx.inp_pos) {
         const int64_t n_tokens = batch.n_tokens;
 
-        ggml_backend_tensor_set(lctx.inp_pos, batch.pos, 0, n_tokens*ggml_element_size(lctx.inp_pos));
+        ggml_backend_tensor_set(lctx.inp_pos, batch.pos, 0, n_tokens*ggml_element_size(lctx.inp_pos));
+    }
+
+    if (lctx.inp_kv_idxs) {
+        const int64_t n_tokens = batch.n_tokens;
+
+        GGML_ASSERT((int64_t) kv_self.slot_idxs.size() == n_tokens);
+
+        ggml_backend_tensor_set(lctx.inp_kv_idxs, kv_self.slot_idxs.data(), 0, n_tokens*ggml_element_size(lctx.inp_kv_idxs));
     }
 
     // TODO
@@ -16506,6 +17429,10 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & batch) {
         GGML_ASSERT(ggml_backend_buffer_is_host(lctx.inp_out_ids->buffer));
         int32_t * data = (int32_t *) lctx.inp_out_ids->data;
 
+        // the visual token dropping removes img_token_step image tokens in each layer, so the rows of the outputs
+        // are shifted by the number of dropped tokens in the last layer
+        const int32_t n_dropped = n_tokens > 1 && batch.img_token_len > 0 ? (int32_t) hparams.n_layer*batch.img_token_step : 0;
+
         // printf("lctx.n_outputs: %d\n", lctx.n_outputs);
 
         if (lctx.n_outputs == n_tokens) {
@@ -16518,9 +17445,7 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & batch) {
             int32_t n_outputs = 0;
             for (int i = 0; i < n_tokens; ++i) {
                 if (batch.output[i]) {
-                    // TODO: change it back!!!!!
-                    // data[n_outputs++] = std::max(0, 0);
-                    data[n_outputs++] = i - batch.img_token_len;
+                    data[n_outputs++] = i - n_dropped;
                 }
             }
             // the graph needs to have been passed the correct number of outputs
@@ -16528,7 +17453,7 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & batch) {
         } else if (lctx.n_outputs == 1) {
             // printf("lctx.n_putput == 1\n");
             // only keep last output
-            data[0] = n_tokens - 1;
+            data[0] = n_tokens - 1 - n_dropped;
         } else {
             GGML_ASSERT(lctx.n_outputs == 0);
         }
@@ -16567,39 +17492,51 @@ static void llama_set_inputs(llama_context & lctx, const llama_ubatch & batch) {
             // For causal attention, use only the previous KV cells
             // of the correct sequence for each token of the batch.
             // It's assumed that if a token in the batch has multiple sequences, they are equivalent.
+            //
+            // the row of each sequence (0.0f for its cells, -INFINITY for the others) and the positions of the cells
+            // are kept up to date across the decode calls by llama_kv_cache_mask_update, so during generation the
+            // row of a token that comes after all the cells of its sequence is a plain copy of the sequence row
+            llama_kv_cache_mask_update(lctx.kv_self, batch);
+
+            const llama_pos * cell_pos = kv_self.mask_pos.data();
+
             for (int h = 0; h < 1; ++h) {
                 for (int s = 0; s < n_seqs; ++s) {
                     const llama_seq_id seq_id = batch.seq_id[s][0];
 
+                    const auto & seq_row = kv_self.mask_rows.at(seq_id);
+
+                    const float * seq_mask = seq_row.data.data();
+
                     for (int j = 0; j < n_seq_tokens; ++j) {
                         const llama_pos pos = batch.pos[s*n_seq_tokens + j];
 
-                        for (int i = 0; i < n_kv; ++i) {
-                            float f;
-                            // 改变了mask，但没有减少计算量，因为mask是在计算完attention之后叠加的
-                            // if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos || pos - kv_self.cells[i].pos >= 10) {
-                            if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
-                                f = -INFINITY;
+                        // data: (n_batch, n_seqs, n_seq_tokens, n_kv)
+                        // data[h][s][j][i] = f
+                        const int64_t offs = h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv;
+
+                        if (data) {
+                            float * row = data + offs;
+                            if (hparams.use_alibi) {
+                                for (int i = 0; i < n_kv; ++i) {
+                                    row[i] = seq_mask[i] != 0.0f || cell_pos[i] > pos ? -INFINITY : -(float) (pos - cell_pos[i]);
+                                }
+                            } else if (pos >= seq_row.pos_max) {
+                                memcpy(row, seq_mask, n_kv*sizeof(float));
                             } else {
-                                if (hparams.use_alibi) {
-                                    f = -std::abs(kv_self.cells[i].pos - pos);
-                                } else {
-                                    f = 0.0f;
+                                for (int i = 0; i < n_kv; ++i) {
+                                    row[i] = cell_pos[i] > pos ? -INFINITY : seq_mask[i];
                                 }
                             }
+                        }
 
-                            if (data) {
-                                // data: (n_batch, n_seqs, n_seq_tokens, n_kv)
-                                // data[h][s][j][i] = f
-                                data[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
-                            }
-
-                            // may need to cut off old tokens for sliding window
-                            if (data_swa) {
-                                if (pos - kv_self.cells[i].pos >= (int32_t)hparams.n_swa) {
-                                    f = -INFINITY;
-                                }
-                                data_swa[h*(n_kv*n_tokens) + s*(n_kv*n_seq_tokens) + j*n_kv + i] = f;
+                        // may need to cut off old tokens for sliding window
+                        if (data_swa) {
+                            float * row = data_swa + offs;
+                            const llama_pos n_swa = hparams.n_swa;
+                            for (int i = 0; i < n_kv; ++i) {
+                                const bool masked = seq_mask[i] != 0.0f || cell_pos[i] > pos || pos - cell_pos[i] >= n_swa;
+                                row[i] = masked ? -INFINITY : (hparams.use_alibi ? -(float) (pos - cell_pos[i]) : 0.0f);
                             }
                         }
                     }
@@ -17004,6 +17941,11 @@ static void llama_graph_compute(
         ggml_backend_cpu_set_threadpool(lctx.backend_cpu, threadpool);
         ggml_backend_cpu_set_abort_callback(lctx.backend_cpu, lctx.abort_callback, lctx.abort_callback_data);
     }
+    for (auto * backend : lctx.backends_numa) {
+        // the nodes run concurrently, each one with its share of the threads
+        ggml_backend_cpu_set_n_threads(backend, std::max(1, n_threads / (int) lctx.backends_numa.size()));
+        ggml_backend_cpu_set_abort_callback(backend, lctx.abort_callback, lctx.abort_callback_data);
+    }
 #ifdef GGML_USE_BLAS
     if (lctx.backend_blas != nullptr) {
         ggml_backend_blas_set_n_threads(lctx.backend_blas, n_threads);
@@ -17015,6 +17957,120 @@ static void llama_graph_compute(
     // fprintf(stderr, "splits: %d\n", ggml_backend_sched_get_n_splits(lctx.sched));
 }
 
+// check if the ubatch has the same shape as the cached graph
+static bool llama_graph_cache_match(const llama_context & lctx, const llama_ubatch & ubatch) {
+    const auto & cache = lctx.graph_cache;
+
+    return cache.valid &&
+        cache.n_tokens    == ubatch.n_tokens &&
+        cache.n_outputs   == lctx.n_outputs &&
+        cache.n_kv        == lctx.kv_self.n &&
+        cache.embd_inp    == (ubatch.embd != nullptr) &&
+        cache.embeddings  == lctx.cparams.embeddings &&
+        cache.causal_attn == lctx.cparams.causal_attn;
+}
+
+// keep the allocated graph for the next ubatch, if everything it depends on is part of the cache key
+static void llama_graph_cache_store(llama_context & lctx, const llama_ubatch & ubatch, ggml_cgraph * gf) {
+    const auto & hparams = lctx.model.hparams;
+    const auto & cparams = lctx.cparams;
+    const auto & kv_self = lctx.kv_self;
+
+    auto & cache = lctx.graph_cache;
+
+    cache.valid = false;
+    cache.kv_views.clear();
+
+    if (cache.disabled || !hparams.causal_attn || kv_self.recurrent || llama_model_has_encoder(&lctx.model)) {
+        return;
+    }
+
+    // the pipeline parallel copies of the inputs are rotated on every compute
+    if (ggml_backend_sched_get_n_copies(lctx.sched) > 1) {
+        return;
+    }
+
+    // the visual token dropping changes the per-layer graph with the KV cache usage
+    if (ubatch.img_token_len != 0 || ubatch.img_token_step != 0) {
+        return;
+    }
+
+    // bytes per KV cell, as used for the views in llm_build_kv_store
+    std::unordered_map<const ggml_tensor *, size_t> strides;
+    for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+        strides[kv_self.k_l[il]] = ggml_row_size(kv_self.k_l[il]->type, hparams.n_embd_k_gqa(il));
+        strides[kv_self.v_l[il]] = cparams.flash_attn
+            ? ggml_row_size(kv_self.v_l[il]->type, hparams.n_embd_v_gqa(il))
+            : ggml_element_size(kv_self.v_l[il]); // the V cache is transposed
+    }
+
+    for (int i = 0; i < ggml_graph_n_nodes(gf); ++i) {
+        ggml_tensor * t = ggml_graph_node(gf, i);
+
+        if (t->view_src == nullptr ||
+            (strncmp(t->name, "k_cache_view-", 13) != 0 && strncmp(t->name, "v_cache_view-", 13) != 0)) {
+            continue;
+        }
+
+        const auto it = strides.find(t->view_src);
+        if (it == strides.end()) {
+            return;
+        }
+
+        cache.kv_views.push_back({ t, t->view_offs, it->second });
+    }
+
+    // the paged KV store does not depend on kv_head, the cells are a graph input
+    if (cache.kv_views.empty() && !kv_self.paged) {
+        return;
+    }
+
+    cache.valid       = true;
+    cache.n_tokens    = ubatch.n_tokens;
+    cache.n_outputs   = lctx.n_outputs;
+    cache.n_kv        = kv_self.n;
+    cache.embd_inp    = ubatch.embd != nullptr;
+    cache.embeddings  = cparams.embeddings;
+    cache.causal_attn = cparams.causal_attn;
+    cache.kv_head     = kv_self.head;
+    cache.gf          = gf;
+}
+
+// move the KV store views of the cached graph to the current kv_head
+static void llama_graph_cache_update(llama_context & lctx) {
+    auto & cache = lctx.graph_cache;
+
+    const int64_t delta = (int64_t) lctx.kv_self.head - (int64_t) cache.kv_head;
+
+    for (auto & view : cache.kv_views) {
+        ggml_tensor * t = view.tensor;
+
+        t->view_offs = (size_t) ((int64_t) view.offs + delta*(int64_t) view.stride);
+        t->data      = (char *) t->view_src->data + t->view_offs;
+    }
+}
+
+// heavy-hitter eviction: accumulate the attention mass received by the KV cells in the last ubatch
+static void llama_kv_cache_hh_update(llama_context & lctx) {
+    auto & kv_self = lctx.kv_self;
+
+    ggml_backend_sched_synchronize(lctx.sched);
+
+    std::vector<float> score;
+
+    for (struct ggml_tensor * t : lctx.kq_scores) {
+        // [1, n_kv]
+        const int64_t n_kv = t->ne[1];
+
+        score.resize(n_kv);
+        ggml_backend_tensor_get(t, score.data(), 0, n_kv*sizeof(float));
+
+        for (int64_t i = 0; i < n_kv; ++i) {
+            kv_self.cells[i].score += score[i];
+        }
+    }
+}
+
 // decode a batch of tokens by evaluating the transformer
 //
 //   - lctx:      llama context
@@ -17137,8 +18193,21 @@ static int llama_decode_internal(
 
         GGML_ASSERT(n_threads > 0);
 
+        // TODO: 检查ubatch
+        ubatch.img_start_pos = batch_all.img_start_pos;
+        ubatch.img_token_len = batch_all.img_token_len;
+        ubatch.img_token_step = batch_all.img_token_step;
+
         // non-causal masks do not use the KV cache
         if (hparams.causal_attn) {
+            if (kv_self.n_sink > 0) {
+                llama_kv_cache_evict(kv_self, ubatch);
+            }
+
+            if (kv_self.hh_budget > 0) {
+                llama_kv_cache_evict_hh(kv_self, ubatch);
+            }
+
             llama_kv_cache_update(&lctx);
 
             // if we have enough unused cells before the current head ->
@@ -17147,7 +18216,8 @@ static int llama_decode_internal(
                 kv_self.head = 0;
             }
 
-            if (!llama_kv_cache_find_slot(kv_self, ubatch)) {
+            const bool found = kv_self.paged ? llama_kv_cache_find_slot_paged(kv_self, ubatch) : llama_kv_cache_find_slot(kv_self, ubatch);
+            if (!found) {
                 return 1;
             }
 
@@ -17163,14 +18233,23 @@ static int llama_decode_internal(
 
         //printf("kv_self.n = %5d, kv_self.used = %5d, kv_self.head = %5d\n", kv_self.n, kv_self.used, kv_self.head);
 
-        ggml_backend_sched_reset(lctx.sched);
-        ggml_backend_sched_set_eval_callback(lctx.sched, lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
+        const bool reuse_graph = llama_graph_cache_match(lctx, ubatch);
 
-        // TODO: 检查ubatch
-        ubatch.img_start_pos = batch_all.img_start_pos;
-        ubatch.img_token_len = batch_all.img_token_len;
-        ubatch.img_token_step = batch_all.img_token_step;
-        ggml_cgraph * gf = llama_build_graph(lctx, ubatch, false);
+        ggml_cgraph * gf = nullptr;
+
+        if (reuse_graph) {
+            // same shape as the previous ubatch - the graph is still allocated, only the inputs change
+            gf = lctx.graph_cache.gf;
+            llama_graph_cache_update(lctx);
+            lctx.graph_cache.n_reused++;
+        } else {
+            lctx.graph_cache.valid = false;
+
+            ggml_backend_sched_reset(lctx.sched);
+            ggml_backend_sched_set_eval_callback(lctx.sched, lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
+
+            gf = llama_build_graph(lctx, ubatch, false);
+        }
 
         // the output is always the last tensor in the graph
         struct ggml_tensor * res  = ggml_graph_node(gf, -1);
@@ -17196,13 +18275,27 @@ static int llama_decode_internal(
         }
         // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
 
-        ggml_backend_sched_alloc_graph(lctx.sched, gf);
+        if (!reuse_graph) {
+            ggml_backend_sched_alloc_graph(lctx.sched, gf);
+
+            llama_graph_cache_store(lctx, ubatch, gf);
+        }
 
-        llama_set_inputs(lctx, ubatch);
+        {
+            const int64_t t_inputs_start_us = ggml_time_us();
+
+            llama_set_inputs(lctx, ubatch);
+
+            lctx.t_inputs_us += ggml_time_us() - t_inputs_start_us;
+        }
 
         // 实际计算
         llama_graph_compute(lctx, gf, n_threads, threadpool);
 
+        if (!lctx.kq_scores.empty()) {
+            llama_kv_cache_hh_update(lctx);
+        }
+
         // update the kv ring buffer
         {
             kv_self.head += n_tokens;
@@ -17317,7 +18410,10 @@ static int llama_decode_internal(
 
     // Reset state for the next token before backend sync, to allow the CPU activities in the reset to
     // overlap with device computation.
-    ggml_backend_sched_reset(lctx.sched);
+    // The cached graph keeps the scheduler state, it is reset when the next ubatch does not match.
+    if (!lctx.graph_cache.valid) {
+        ggml_backend_sched_reset(lctx.sched);
+    }
 
     return 0;
 }
@@ -17392,6 +18488,8 @@ static int llama_encode_internal(
 
     GGML_ASSERT(n_threads > 0);
 
+    lctx.graph_cache.valid = false;
+
     ggml_backend_sched_reset(lctx.sched);
     ggml_backend_sched_set_eval_callback(lctx.sched, lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
 
@@ -17419,7 +18517,13 @@ static int llama_encode_internal(
 
     ggml_backend_sched_alloc_graph(lctx.sched, gf);
 
-    llama_set_inputs(lctx, ubatch);
+    {
+        const int64_t t_inputs_start_us = ggml_time_us();
+
+        llama_set_inputs(lctx, ubatch);
+
+        lctx.t_inputs_us += ggml_time_us() - t_inputs_start_us;
+    }
 
     llama_graph_compute(lctx, gf, n_threads, threadpool);
 
@@ -17491,9 +18595,13 @@ static int llama_encode_internal(
 }
 
 // find holes from the beginning of the KV cache and fill them by moving data from the end of the cache
-static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
+// move up to max_cells cells from the end of the cache to the holes before them
+// returns true if the cache is compact, false if there are holes left for a later call
+static bool llama_kv_cache_defrag_internal(struct llama_context & lctx, uint32_t max_cells) {
     auto & kv_self = lctx.kv_self;
 
+    llama_kv_cache_mask_invalidate(kv_self);
+
     const auto & hparams = lctx.model.hparams;
 
     const uint32_t n_layer = hparams.n_layer;
@@ -17505,9 +18613,12 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
 
     //const int64_t t_start = ggml_time_us();
 
-    // number of cells moved
+    // number of cell ranges moved
     uint32_t n_moves = 0;
 
+    // number of cells moved
+    uint32_t n_cells = 0;
+
     // each move requires 6*n_layer tensors (see build_defrag)
     //   - source view, destination view, copy operation
     //   - x2 for keys and values
@@ -17587,8 +18698,14 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
                 continue;
             }
 
+            if (n_cells == max_cells) {
+                stop = true;
+                break;
+            }
+
             // this cell goes to (i0 + nf)
             ids[i1] = i0 + nf;
+            n_cells++;
 
             // move the cell meta data
             kv_self.cells[i0 + nf] = cell1;
@@ -17619,9 +18736,11 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
     }
 
     if (n_moves == 0) {
-        return;
+        return true;
     }
 
+    kv_self.n_defrag_cells += n_cells;
+
     //LLAMA_LOG_INFO("(tmp log) KV defrag cell moves: %u\n", n_moves);
 
     //LLAMA_LOG_INFO("expected gf nodes: %u\n", 6*n_moves*n_layer);
@@ -17699,6 +18818,8 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
 #else
     // ggml_graph defrag
 
+    lctx.graph_cache.valid = false;
+
     ggml_backend_sched_reset(lctx.sched);
 
     ggml_cgraph * gf = llama_build_graph_defrag(lctx, ids);
@@ -17709,18 +18830,75 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
     //const int64_t t_end = ggml_time_us();
 
     //LLAMA_LOG_INFO("(tmp log) KV defrag time: %.3f ms\n", (t_end - t_start)/1000.0);
+
+    // the moves fill the holes in order, the cache is compact if all the used cells are before n_used
+    return llama_kv_cache_cell_max(kv_self) == kv_self.used;
+}
+
+// copy the KV data of the shared cells detached by llama_kv_cache_seq_detach
+static void llama_kv_cache_cow_internal(struct llama_context & lctx) {
+    auto & kv_self = lctx.kv_self;
+
+    const uint32_t n_layer = lctx.model.hparams.n_layer;
+
+    // each copy requires 6*n_layer tensors (see build_defrag)
+    const uint32_t max_copies = (llama_model_max_nodes(lctx.model) - 2*n_layer)/(6*n_layer);
+
+    for (size_t i = 0; i < kv_self.cow_copies.size(); i += max_copies) {
+        const size_t n = std::min<size_t>(max_copies, kv_self.cow_copies.size() - i);
+
+        std::vector<std::pair<uint32_t, uint32_t>> copies(kv_self.cow_copies.begin() + i, kv_self.cow_copies.begin() + i + n);
+
+        lctx.graph_cache.valid = false;
+
+        ggml_backend_sched_reset(lctx.sched);
+
+        ggml_cgraph * gf = llama_build_graph_kv_cow(lctx, copies);
+
+        llama_graph_compute(lctx, gf, lctx.cparams.n_threads, lctx.threadpool);
+    }
+
+    LLAMA_LOG_DEBUG("%s: copied %zu shared KV cells\n", __func__, kv_self.cow_copies.size());
+
+    kv_self.cow_copies.clear();
 }
 
 static void llama_kv_cache_update_internal(struct llama_context & lctx) {
     bool need_reserve = false;
 
+    // copy the detached shared cells before they are shifted
+    if (!lctx.kv_self.cow_copies.empty()) {
+        llama_kv_cache_cow_internal(lctx);
+
+        need_reserve = true;
+    }
+
     // apply K-shift if needed
     if (lctx.model.hparams.rope_type != LLAMA_ROPE_TYPE_NONE && lctx.kv_self.has_shift) {
         if (lctx.model.arch == LLM_ARCH_DEEPSEEK2) { // not supported due to MLA
             GGML_ABORT("Deepseek2 does not support K-shift");
         }
 
+        auto & kv_self = lctx.kv_self;
+
+        // rotate only the range of the cells that were shifted
         {
+            uint32_t i0 = kv_self.size;
+            uint32_t i1 = 0;
+            for (uint32_t i = 0; i < kv_self.size; ++i) {
+                if (kv_self.cells[i].delta != 0) {
+                    i0 = std::min(i0, i);
+                    i1 = i + 1;
+                }
+            }
+
+            kv_self.shift_head = i0 < i1 ? i0 : 0;
+            kv_self.shift_n    = i0 < i1 ? i1 - i0 : 0;
+        }
+
+        if (kv_self.shift_n > 0) {
+            lctx.graph_cache.valid = false;
+
             ggml_backend_sched_reset(lctx.sched);
 
             ggml_cgraph * gf = llama_build_graph_k_shift(lctx);
@@ -17735,8 +18913,6 @@ static void llama_kv_cache_update_internal(struct llama_context & lctx) {
         }
 
         {
-            auto & kv_self = lctx.kv_self;
-
             kv_self.has_shift = false;
 
             for (uint32_t i = 0; i < kv_self.size; ++i) {
@@ -17746,12 +18922,21 @@ static void llama_kv_cache_update_internal(struct llama_context & lctx) {
     }
 
     // defragment the KV cache if needed
+    // with a move budget, each update moves a bounded number of cells and the rest is left for the next updates
     if (lctx.kv_self.do_defrag) {
-        llama_kv_cache_defrag_internal(lctx);
+        auto & kv_self = lctx.kv_self;
 
-        need_reserve = true;
+        const uint32_t max_cells = kv_self.defrag_full || lctx.cparams.defrag_budget == 0 ? kv_self.size : lctx.cparams.defrag_budget;
+
+        const int64_t t_start_us = ggml_time_us();
 
-        lctx.kv_self.do_defrag = false;
+        kv_self.do_defrag   = !llama_kv_cache_defrag_internal(lctx, max_cells);
+        kv_self.defrag_full = false;
+
+        lctx.t_defrag_us += ggml_time_us() - t_start_us;
+        kv_self.n_defrag_steps++;
+
+        // the copies of the defrag graph do not need compute buffers, no need to reserve again
     }
 
     // reserve a worst case graph again
@@ -17762,6 +18947,9 @@ static void llama_kv_cache_update_internal(struct llama_context & lctx) {
         uint32_t n_tokens = std::min(lctx.cparams.n_ctx, lctx.cparams.n_ubatch);
         llama_token token = llama_token_bos(&lctx.model); // not actually used by llama_build_graph, but required to choose between token and embedding inputs graph
         llama_ubatch ubatch = { true, n_tokens, n_tokens / n_seqs, n_seqs, &token, nullptr, nullptr, nullptr, nullptr, nullptr};
+
+        lctx.graph_cache.valid = false;
+
         ggml_cgraph * gf = llama_build_graph(lctx, ubatch, true);
 
         // initialize scheduler with the worst-case graph
@@ -18836,6 +20024,7 @@ int32_t llama_lora_adapter_set(
         return -1;
     }
     ctx->lora_adapters[adapter] = scale;
+    ctx->graph_cache.valid = false;
     return 0;
 }
 
@@ -18845,6 +20034,7 @@ int32_t llama_lora_adapter_remove(
     auto pos = ctx->lora_adapters.find(adapter);
     if (pos != ctx->lora_adapters.end()) {
         ctx->lora_adapters.erase(pos);
+        ctx->graph_cache.valid = false;
         return 0;
     }
     return -1;
@@ -18852,6 +20042,7 @@ int32_t llama_lora_adapter_remove(
 
 void llama_lora_adapter_clear(struct llama_context * ctx) {
     ctx->lora_adapters.clear();
+    ctx->graph_cache.valid = false;
 }
 
 void llama_lora_adapter_free(struct llama_lora_adapter * adapter) {
@@ -18904,15 +20095,24 @@ struct llama_context_params llama_context_default_params() {
         /*.yarn_beta_slow              =*/ 1.0f,
         /*.yarn_orig_ctx               =*/ 0,
         /*.defrag_thold                =*/ -1.0f,
+        /*.defrag_budget               =*/ 0,
+        /*.kv_block_size               =*/ 0,
+        /*.kv_sink                     =*/ 0,
+        /*.kv_window                   =*/ 0,
+        /*.kv_hh_budget                =*/ 0,
+        /*.kv_hh_recent                =*/ 0,
         /*.cb_eval                     =*/ nullptr,
         /*.cb_eval_user_data           =*/ nullptr,
         /*.type_k                      =*/ GGML_TYPE_F16,
         /*.type_v                      =*/ GGML_TYPE_F16,
+        /*.type_k_layer                =*/ nullptr,
+        /*.type_v_layer                =*/ nullptr,
         /*.logits_all                  =*/ false,
         /*.embeddings                  =*/ false,
         /*.offload_kqv                 =*/ true,
         /*.flash_attn                  =*/ false,
         /*.no_perf                     =*/ true,
+        /*.kv_mixed                    =*/ false,
         /*.abort_callback              =*/ nullptr,
         /*.abort_callback_data         =*/ nullptr,
     };
@@ -19102,9 +20302,18 @@ struct llama_context * llama_new_context_with_model(
         params.flash_attn = false;
     }
 
-    if (params.type_v != GGML_TYPE_F16 && !params.flash_attn) {
-        LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn\n", __func__);
-        return nullptr;
+    if (!params.flash_attn) {
+        bool v_quant = params.type_v != GGML_TYPE_F16;
+        if (params.type_v_layer) {
+            for (uint32_t il = 0; il < model->hparams.n_layer; ++il) {
+                const ggml_type type = params.type_v_layer[il];
+                v_quant = v_quant || (type != GGML_TYPE_COUNT && type != GGML_TYPE_F16);
+            }
+        }
+        if (v_quant) {
+            LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn\n", __func__);
+            return nullptr;
+        }
     }
 
     llama_context * ctx = new llama_context(*model);
@@ -19120,6 +20329,12 @@ struct llama_context * llama_new_context_with_model(
     cparams.yarn_beta_fast   = params.yarn_beta_fast;
     cparams.yarn_beta_slow   = params.yarn_beta_slow;
     cparams.defrag_thold     = params.defrag_thold;
+    cparams.defrag_budget    = params.defrag_budget;
+    cparams.kv_block_size    = params.kv_block_size;
+    cparams.kv_sink          = params.kv_sink;
+    cparams.kv_window        = params.kv_window;
+    cparams.kv_hh_budget     = params.kv_hh_budget;
+    cparams.kv_hh_recent     = params.kv_hh_recent;
     cparams.embeddings       = params.embeddings;
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
@@ -19130,8 +20345,45 @@ struct llama_context * llama_new_context_with_model(
     cparams.rope_freq_base   = params.rope_freq_base  == 0.0f ? hparams.rope_freq_base_train  : params.rope_freq_base;
     cparams.rope_freq_scale  = params.rope_freq_scale == 0.0f ? hparams.rope_freq_scale_train : params.rope_freq_scale;
 
+    if (cparams.kv_block_size & (cparams.kv_block_size - 1)) {
+        LLAMA_LOG_WARN("%s: kv_block_size = %u is not a power of 2 - using the contiguous KV cache\n", __func__, cparams.kv_block_size);
+        cparams.kv_block_size = 0;
+    }
+
     // this is necessary due to kv_self.n being padded later during inference
-    cparams.n_ctx            = GGML_PAD(cparams.n_ctx, llama_kv_cache_get_padding(cparams));
+    cparams.n_ctx            = GGML_PAD(cparams.n_ctx, std::max(llama_kv_cache_get_padding(cparams), cparams.kv_block_size));
+
+    if (cparams.kv_sink > 0) {
+        const uint32_t n_ctx_seq = cparams.n_ctx / cparams.n_seq_max;
+
+        if (cparams.kv_window == 0 || cparams.kv_window > n_ctx_seq) {
+            cparams.kv_window = n_ctx_seq;
+        }
+
+        const uint32_t evict_block = cparams.kv_block_size > 0 ? cparams.kv_block_size : 32;
+
+        if (cparams.kv_sink + evict_block > cparams.kv_window) {
+            LLAMA_LOG_WARN("%s: kv_sink = %u does not leave room for a window of %u cells - disabling the sliding window eviction\n",
+                    __func__, cparams.kv_sink, cparams.kv_window);
+            cparams.kv_sink = 0;
+        }
+    }
+
+    if (cparams.kv_hh_budget > 0) {
+        const uint32_t evict_block = cparams.kv_block_size > 0 ? cparams.kv_block_size : 32;
+
+        if (cparams.flash_attn) {
+            LLAMA_LOG_WARN("%s: the heavy-hitter eviction needs the attention scores - not supported with flash_attn, disabling it\n", __func__);
+            cparams.kv_hh_budget = 0;
+        } else if (cparams.kv_sink > 0) {
+            LLAMA_LOG_WARN("%s: the heavy-hitter eviction cannot be combined with kv_sink - disabling it\n", __func__);
+            cparams.kv_hh_budget = 0;
+        } else if (cparams.kv_hh_recent + evict_block > cparams.kv_hh_budget) {
+            LLAMA_LOG_WARN("%s: kv_hh_recent = %u does not leave room for evictions in a budget of %u cells - disabling the heavy-hitter eviction\n",
+                    __func__, cparams.kv_hh_recent, cparams.kv_hh_budget);
+            cparams.kv_hh_budget = 0;
+        }
+    }
 
     // with causal attention, the batch size is limited by the context size
     cparams.n_batch          = hparams.causal_attn ? std::min(cparams.n_ctx, params.n_batch) : params.n_batch;
@@ -19186,6 +20438,16 @@ struct llama_context * llama_new_context_with_model(
     LLAMA_LOG_INFO("%s: n_batch    = %u\n",     __func__, cparams.n_batch);
     LLAMA_LOG_INFO("%s: n_ubatch   = %u\n",     __func__, cparams.n_ubatch);
     LLAMA_LOG_INFO("%s: flash_attn = %d\n",     __func__, cparams.flash_attn);
+    if (cparams.kv_block_size > 0) {
+        LLAMA_LOG_INFO("%s: kv_block   = %u\n",     __func__, cparams.kv_block_size);
+    }
+    if (cparams.kv_sink > 0) {
+        LLAMA_LOG_INFO("%s: kv_sink    = %u\n",     __func__, cparams.kv_sink);
+        LLAMA_LOG_INFO("%s: kv_window  = %u\n",     __func__, cparams.kv_window);
+    }
+    if (cparams.kv_hh_budget > 0) {
+        LLAMA_LOG_INFO("%s: kv_hh      = %u (recent %u)\n", __func__, cparams.kv_hh_budget, cparams.kv_hh_recent);
+    }
     LLAMA_LOG_INFO("%s: freq_base  = %.1f\n",   __func__, cparams.rope_freq_base);
     LLAMA_LOG_INFO("%s: freq_scale = %g\n",     __func__, cparams.rope_freq_scale);
 
@@ -19210,8 +20472,34 @@ struct llama_context * llama_new_context_with_model(
         type_v = GGML_TYPE_F32; // required by ggml_ssm_scan for Mamba's ssm_states
     }
 
-    GGML_ASSERT(hparams.n_embd_head_k % ggml_blck_size(type_k) == 0);
-    GGML_ASSERT(hparams.n_embd_head_v % ggml_blck_size(type_v) == 0);
+    std::vector<ggml_type> types_k(hparams.n_layer, type_k);
+    std::vector<ggml_type> types_v(hparams.n_layer, type_v);
+
+    if (!llama_model_is_recurrent(model)) {
+        for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+            // the first and the last layers are the most sensitive to the KV cache quantization
+            if (params.kv_mixed && (il < 2 || il == hparams.n_layer - 1)) {
+                if (ggml_is_quantized(type_k)) {
+                    types_k[il] = GGML_TYPE_F16;
+                }
+                if (ggml_is_quantized(type_v)) {
+                    types_v[il] = GGML_TYPE_F16;
+                }
+            }
+
+            if (params.type_k_layer && params.type_k_layer[il] != GGML_TYPE_COUNT) {
+                types_k[il] = params.type_k_layer[il];
+            }
+            if (params.type_v_layer && params.type_v_layer[il] != GGML_TYPE_COUNT) {
+                types_v[il] = params.type_v_layer[il];
+            }
+        }
+    }
+
+    for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+        GGML_ASSERT(hparams.n_embd_head_k % ggml_blck_size(types_k[il]) == 0);
+        GGML_ASSERT(hparams.n_embd_head_v % ggml_blck_size(types_v[il]) == 0);
+    }
 
     if (!hparams.vocab_only) {
         // initialize backends
@@ -19353,6 +20641,26 @@ struct llama_context * llama_new_context_with_model(
         }
 #endif
 
+        // a backend for each NUMA node that has layers of the model
+        for (int node = 0; node < ggml_numa_n_nodes(); ++node) {
+            ggml_backend_buffer_type_t buft = ggml_backend_cpu_numa_buffer_type(node);
+            bool used = false;
+            for (const auto & layer : model->buft_layer) {
+                used = used || layer.buft == buft;
+            }
+            if (buft == nullptr || !used) {
+                continue;
+            }
+            ggml_backend_t backend = ggml_backend_cpu_numa_init(node);
+            if (backend == nullptr) {
+                LLAMA_LOG_ERROR("%s: failed to initialize CPU backend for NUMA node %d\n", __func__, node);
+                llama_free(ctx);
+                return nullptr;
+            }
+            ctx->backends_numa.push_back(backend);
+            ctx->backends.push_back(backend);
+        }
+
         ctx->backend_cpu = ggml_backend_cpu_init();
         if (ctx->backend_cpu == nullptr) {
             LLAMA_LOG_ERROR("%s: failed to initialize CPU backend\n", __func__);
@@ -19361,12 +20669,19 @@ struct llama_context * llama_new_context_with_model(
         }
         ctx->backends.push_back(ctx->backend_cpu);
 
-        if (!llama_kv_cache_init(ctx->kv_self, ctx, type_k, type_v, kv_size, cparams.offload_kqv)) {
+        if (!llama_kv_cache_init(ctx->kv_self, ctx, types_k, types_v, kv_size, cparams.offload_kqv)) {
             LLAMA_LOG_ERROR("%s: llama_kv_cache_init() failed for self-attention cache\n", __func__);
             llama_free(ctx);
             return nullptr;
         }
 
+        if (ctx->kv_self.paged && !llama_kv_cache_paged_supported(*ctx)) {
+            LLAMA_LOG_WARN("%s: the backends of the KV cache do not support GGML_OP_SET_ROWS - using the contiguous KV cache\n", __func__);
+            ctx->kv_self.paged      = false;
+            ctx->kv_self.block_size = 0;
+            ctx->kv_self.blocks.clear();
+        }
+
         {
             size_t memory_size_k = 0;
             size_t memory_size_v = 0;
@@ -19381,8 +20696,8 @@ struct llama_context * llama_new_context_with_model(
 
             LLAMA_LOG_INFO("%s: KV self size  = %7.2f MiB, K (%s): %7.2f MiB, V (%s): %7.2f MiB\n", __func__,
                 (float)(memory_size_k + memory_size_v) / (1024.0f * 1024.0f),
-                ggml_type_name(type_k), (float)memory_size_k / (1024.0f * 1024.0f),
-                ggml_type_name(type_v), (float)memory_size_v / (1024.0f * 1024.0f));
+                llama_kv_types_str(types_k).c_str(), (float)memory_size_k / (1024.0f * 1024.0f),
+                llama_kv_types_str(types_v).c_str(), (float)memory_size_v / (1024.0f * 1024.0f));
         }
 
         // graph outputs buffer
@@ -19428,12 +20743,19 @@ struct llama_context * llama_new_context_with_model(
             // currently this is only implemented in the CUDA backend
             pipeline_parallel = false;
 #endif
+            // the NUMA node backends compute asynchronously and support events
+            if (ctx->backends_numa.size() > 1) {
+                pipeline_parallel = true;
+            }
             ctx->sched = ggml_backend_sched_new(ctx->backends.data(), backend_buft.data(), ctx->backends.size(), max_nodes, pipeline_parallel);
 
             if (pipeline_parallel) {
                 LLAMA_LOG_INFO("%s: pipeline parallelism enabled (n_copies=%d)\n", __func__, ggml_backend_sched_get_n_copies(ctx->sched));
             }
 
+            // reuse of the decode graph between ubatches of the same shape, can be disabled for debugging
+            ctx->graph_cache.disabled = getenv("LLAMA_GRAPH_REUSE_DISABLE") != nullptr;
+
             // build worst-case graph
             uint32_t n_seqs = 1; // TODO: worst-case number of sequences
             uint32_t n_tokens = std::min(cparams.n_ctx, cparams.n_ubatch);
@@ -19456,6 +20778,16 @@ struct llama_context * llama_new_context_with_model(
                     LLAMA_LOG_INFO("%s: %10s compute buffer size = %8.2f MiB\n", __func__,
                             ggml_backend_buft_name(buft),
                             size / 1024.0 / 1024.0);
+
+                    struct ggml_gallocr_plan_stats stats;
+                    ggml_backend_sched_get_plan_stats(ctx->sched, backend, &stats);
+                    LLAMA_LOG_INFO("%s: %10s compute buffer plan: peak = %.2f MiB, sum = %.2f MiB (peak/sum = %.3f), greedy = %.2f MiB, planned = %.2f MiB\n", __func__,
+                            ggml_backend_buft_name(buft),
+                            stats.peak / 1024.0 / 1024.0,
+                            stats.sum / 1024.0 / 1024.0,
+                            stats.sum > 0 ? (double) stats.peak / stats.sum : 0.0,
+                            stats.greedy / 1024.0 / 1024.0,
+                            stats.planned / 1024.0 / 1024.0);
                 }
             }
 
@@ -19776,6 +21108,8 @@ int32_t llama_control_vector_apply(struct llama_context * lctx, const float * da
     const llama_model & model = lctx->model;
     llama_control_vector & cvec = lctx->cvec;
 
+    lctx->graph_cache.valid = false;
+
     if (data == nullptr) {
         // disable the current control vector (but leave allocated for later)
         cvec.layer_start = -1;
@@ -20355,7 +21689,8 @@ struct llama_data_read {
                 read_to(&pos,      sizeof(pos));
                 read_to(&n_seq_id, sizeof(n_seq_id));
 
-                cell.pos = pos;
+                cell.pos   = pos;
+                cell.score = 0.0f;
 
                 for (uint32_t j = 0; j < n_seq_id; ++j) {
                     llama_seq_id seq_id;
@@ -20519,6 +21854,8 @@ struct llama_data_read {
 
         bool res = read_kv_cache_meta(ctx, cell_count, seq_id) && read_kv_cache_data(ctx, cell_count);
 
+        llama_kv_cache_mask_invalidate(ctx->kv_self);
+
         if (!res) {
             if (seq_id == -1) {
                 llama_kv_cache_clear(ctx);
@@ -20620,6 +21957,11 @@ struct llama_data_write_file : llama_data_write {
     }
 
     void write_tensor_data(const struct ggml_tensor * tensor, size_t offset, size_t size) override {
+        // write host buffers directly, without a staging copy
+        if (tensor->buffer && ggml_backend_buffer_is_host(tensor->buffer)) {
+            write((const uint8_t *) tensor->data + offset, size);
+            return;
+        }
         temp_buffer.resize(size);
         ggml_backend_tensor_get(tensor, temp_buffer.data(), offset, size);
         write(temp_buffer.data(), temp_buffer.size());
@@ -20669,6 +22011,11 @@ struct llama_data_read_file : llama_data_read {
 static size_t llama_state_get_data_internal(struct llama_context * ctx, llama_data_write & data_ctx) {
     llama_synchronize(ctx);
 
+    // the data of the detached shared cells is copied lazily
+    if (!ctx->kv_self.cow_copies.empty()) {
+        llama_kv_cache_cow_internal(*ctx);
+    }
+
     data_ctx.write_model_info(ctx);
 
     // copy outputs
@@ -20706,6 +22053,11 @@ size_t llama_state_get_size(struct llama_context * ctx) {
 static size_t llama_state_set_data_internal(struct llama_context * ctx, llama_data_read & data_ctx) {
     llama_synchronize(ctx);
 
+    // the data of the detached shared cells is copied lazily
+    if (!ctx->kv_self.cow_copies.empty()) {
+        llama_kv_cache_cow_internal(*ctx);
+    }
+
     data_ctx.read_model_info(ctx);
 
     // set outputs
@@ -20760,8 +22112,16 @@ static bool llama_state_load_file_internal(struct llama_context * ctx, const cha
     {
         const size_t n_state_size_cur = file.size - file.tell();
 
-        llama_data_read_file data_ctx(&file);
-        const size_t n_read = llama_state_set_data_internal(ctx, data_ctx);
+        size_t n_read;
+        if (llama_mmap::SUPPORTED && n_state_size_cur > 0) {
+            // the tensor data is copied straight from the mapped file
+            llama_mmap mapping(&file, 0);
+            llama_data_read_buffer data_ctx((const uint8_t *) mapping.addr + file.tell(), n_state_size_cur);
+            n_read = llama_state_set_data_internal(ctx, data_ctx);
+        } else {
+            llama_data_read_file data_ctx(&file);
+            n_read = llama_state_set_data_internal(ctx, data_ctx);
+        }
 
         if (n_read != n_state_size_cur) {
             LLAMA_LOG_ERROR("%s: did not read all of the session file data! size %zu, got %zu\n", __func__, n_state_size_cur, n_read);
@@ -20809,6 +22169,11 @@ bool llama_state_save_file(struct llama_context * ctx, const char * path_session
 static size_t llama_state_seq_get_data_internal(struct llama_context * ctx, llama_data_write & data_ctx, llama_seq_id seq_id) {
     llama_synchronize(ctx);
 
+    // the data of the detached shared cells is copied lazily
+    if (!ctx->kv_self.cow_copies.empty()) {
+        llama_kv_cache_cow_internal(*ctx);
+    }
+
     data_ctx.write_kv_cache(ctx, seq_id);
 
     return data_ctx.get_size_written();
@@ -20832,6 +22197,11 @@ size_t llama_state_seq_get_data(struct llama_context * ctx, uint8_t * dst, size_
 static size_t llama_state_seq_set_data_internal(struct llama_context * ctx, llama_data_read & data_ctx, llama_seq_id dest_seq_id) {
     llama_synchronize(ctx);
 
+    // the data of the detached shared cells is copied lazily
+    if (!ctx->kv_self.cow_copies.empty()) {
+        llama_kv_cache_cow_internal(*ctx);
+    }
+
     data_ctx.read_kv_cache(ctx, dest_seq_id);
 
     return data_ctx.get_size_read();
@@ -20895,18 +22265,28 @@ static size_t llama_state_seq_load_file_internal(struct llama_context * ctx, con
 
     // restore the context state
     {
-        const size_t state_size = file.size - file.tell();
-        llama_data_read_file data_ctx(&file);
-        const size_t nread = llama_state_seq_set_data_internal(ctx, data_ctx, dest_seq_id);
+        const size_t state_offs = file.tell();
+        const size_t state_size = file.size - state_offs;
+
+        size_t nread;
+        if (llama_mmap::SUPPORTED && state_size > 0) {
+            // the tensor data is copied straight from the mapped file
+            llama_mmap mapping(&file, 0);
+            llama_data_read_buffer data_ctx((const uint8_t *) mapping.addr + state_offs, state_size);
+            nread = llama_state_seq_set_data_internal(ctx, data_ctx, dest_seq_id);
+        } else {
+            llama_data_read_file data_ctx(&file);
+            nread = llama_state_seq_set_data_internal(ctx, data_ctx, dest_seq_id);
+        }
         if (!nread) {
             LLAMA_LOG_ERROR("%s: failed to restore sequence state\n", __func__);
             return 0;
         }
         GGML_ASSERT(nread <= state_size);
-        GGML_ASSERT(nread + sizeof(uint32_t) * 3 + sizeof(llama_token) * *n_token_count_out == file.tell());
-    }
+        GGML_ASSERT(state_offs == sizeof(uint32_t) * 3 + sizeof(llama_token) * *n_token_count_out);
 
-    return file.tell();
+        return state_offs + nread;
+    }
 }
 
 size_t llama_state_seq_save_file(struct llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count) {
@@ -21676,8 +23056,14 @@ struct llama_perf_context_data llama_perf_context(const struct llama_context * c
     data.t_load_ms   = 1e-3 * ctx->t_load_us;
     data.t_p_eval_ms = 1e-3 * ctx->t_p_eval_us;
     data.t_eval_ms   = 1e-3 * ctx->t_eval_us;
+    data.t_inputs_ms = 1e-3 * ctx->t_inputs_us;
+    data.t_defrag_ms = 1e-3 * ctx->t_defrag_us;
     data.n_p_eval    = std::max(1, ctx->n_p_eval);
     data.n_eval      = std::max(1, ctx->n_eval);
+    data.n_reused    = ctx->graph_cache.n_reused;
+    data.n_evicted   = (int32_t) ctx->kv_self.n_evicted;
+    data.n_defrag    = (int32_t) ctx->kv_self.n_defrag_steps;
+    data.n_defrag_cells = (int32_t) ctx->kv_self.n_defrag_cells;
 
     return data;
 }
@@ -21693,12 +23079,26 @@ void llama_perf_context_print(const struct llama_context * ctx) {
     LLAMA_LOG_INFO("%s:        eval time = %10.2f ms / %5d runs   (%8.2f ms per token, %8.2f tokens per second)\n",
             __func__, data.t_eval_ms, data.n_eval, data.t_eval_ms / data.n_eval, 1e3 / data.t_eval_ms * data.n_eval);
     LLAMA_LOG_INFO("%s:       total time = %10.2f ms / %5d tokens\n", __func__, (t_end_ms - data.t_start_ms), (data.n_p_eval + data.n_eval));
+    LLAMA_LOG_INFO("%s:      inputs time = %10.2f ms\n", __func__, data.t_inputs_ms);
+    LLAMA_LOG_INFO("%s:    graphs reused = %10d\n", __func__, data.n_reused);
+    if (data.n_defrag > 0) {
+        LLAMA_LOG_INFO("%s:      defrag time = %10.2f ms / %5d steps (%8d cells moved)\n", __func__, data.t_defrag_ms, data.n_defrag, data.n_defrag_cells);
+    }
+    if (ctx->kv_self.n_sink > 0 || ctx->kv_self.hh_budget > 0) {
+        LLAMA_LOG_INFO("%s:    cells evicted = %10d\n", __func__, data.n_evicted);
+    }
 }
 
 void llama_perf_context_reset(struct llama_context * ctx) {
     ctx->t_start_us  = ggml_time_us();
     ctx->t_eval_us   = ctx->n_eval = 0;
     ctx->t_p_eval_us = ctx->n_p_eval = 0;
+    ctx->t_inputs_us = 0;
+    ctx->t_defrag_us = 0;
+    ctx->graph_cache.n_reused = 0;
+    ctx->kv_self.n_evicted    = 0;
+    ctx->kv_self.n_defrag_steps = 0;
+    ctx->kv_self.n_defrag_cells = 0;
 }
 
 void llama_perf_dump_yaml(FILE * stream, const llama_context * ctx) {
@@ -21723,6 +23123,107 @@ void llama_perf_dump_yaml(FILE * stream, const llama_context * ctx) {
             1.0e6 * ctx->n_p_eval / ctx->t_p_eval_us);
 }
 
+void llama_perf_profile_set(struct llama_context * ctx, int32_t level) {
+    ggml_backend_sched_set_profile(ctx->sched, (enum ggml_backend_sched_profile_level) level);
+}
+
+static std::string llama_json_escape(const char * str) {
+    std::string res;
+    for (const char * p = str; *p; ++p) {
+        const unsigned char c = *p;
+        if (c == '"' || c == '\\') {
+            res += '\\';
+            res += c;
+        } else if (c < 0x20) {
+            res += format("\\u%04x", c);
+        } else {
+            res += c;
+        }
+    }
+    return res;
+}
+
+bool llama_perf_profile_dump_trace(struct llama_context * ctx, const char * fname) {
+    llama_synchronize(ctx);
+
+    ggml_backend_sched_t sched = ctx->sched;
+
+    FILE * f = ggml_fopen(fname, "wb");
+    if (!f) {
+        LLAMA_LOG_ERROR("%s: failed to open %s\n", __func__, fname);
+        return false;
+    }
+
+    const int n_events = ggml_backend_sched_get_profile_n_events(sched);
+    const ggml_backend_sched_profile_event * events = ggml_backend_sched_get_profile_events(sched);
+
+    // the events are recorded when they end, so a split is stored after the nodes and copies it contains
+    int64_t t_start_us = n_events > 0 ? events[0].t_start_us : 0;
+    for (int i = 1; i < n_events; ++i) {
+        t_start_us = std::min(t_start_us, events[i].t_start_us);
+    }
+
+    std::vector<std::string> trace;
+
+    // one track per backend
+    const int n_backends = ggml_backend_sched_get_n_backends(sched);
+    for (int i = 0; i < n_backends; ++i) {
+        trace.push_back(format("{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                i, llama_json_escape(ggml_backend_name(ggml_backend_sched_get_backend(sched, i))).c_str()));
+    }
+
+    for (int i = 0; i < n_events; ++i) {
+        const auto & ev = events[i];
+
+        const int64_t dur_us = std::max<int64_t>(ev.t_end_us - ev.t_start_us, 0);
+
+        std::string name;
+        std::string cat;
+        std::string args = format("\"graph\": %d, \"split\": %d", ev.graph, ev.split);
+
+        switch (ev.type) {
+            case GGML_BACKEND_SCHED_PROFILE_SPLIT:
+                name = format("split %d", ev.split);
+                cat  = "split";
+                args += format(", \"n_nodes\": %d", ev.n_nodes);
+                break;
+            case GGML_BACKEND_SCHED_PROFILE_COPY:
+                name = "copy " + llama_json_escape(ev.name);
+                cat  = "copy";
+                args += format(", \"from\": \"%s\", \"bytes\": %zu, \"GB/s\": %.3f",
+                        ev.src_backend_id >= 0 ? llama_json_escape(ggml_backend_name(ggml_backend_sched_get_backend(sched, ev.src_backend_id))).c_str() : "",
+                        ev.n_bytes, dur_us > 0 ? 1e-3 * ev.n_bytes / dur_us : 0.0);
+                break;
+            case GGML_BACKEND_SCHED_PROFILE_NODE:
+                name = llama_json_escape(ev.name);
+                cat  = "node";
+                args += format(", \"op\": \"%s\", \"bytes\": %zu", ggml_op_name(ev.op), ev.n_bytes);
+                break;
+        }
+
+        trace.push_back(format("{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, \"ts\": %" PRId64 ", \"dur\": %" PRId64 ", \"args\": {%s}}",
+                name.c_str(), cat.c_str(), ev.backend_id, ev.t_start_us - t_start_us, dur_us, args.c_str()));
+    }
+
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (size_t i = 0; i < trace.size(); ++i) {
+        fprintf(f, "  %s%s\n", trace[i].c_str(), i + 1 < trace.size() ? "," : "");
+    }
+    fprintf(f, "]}\n");
+
+    const bool ok = ferror(f) == 0;
+    fclose(f);
+
+    if (!ok) {
+        LLAMA_LOG_ERROR("%s: failed to write %s\n", __func__, fname);
+        return false;
+    }
+
+    ggml_backend_sched_reset_profile(sched);
+
+    return true;
+}
+
 // For internal test use
 const std::vector<std::pair<std::string, struct ggml_tensor *>> & llama_internal_get_tensor_map(
     struct llama_context * ctx
@@ -0,0 +1,206 @@
+// tests of the graph allocator: tensors that are in use at the same time must never share memory,
+// with the offsets of the allocation in graph order as well as with the lifetime-aware plan
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+// build a random graph of 1D tensors with varied sizes and lifetimes
+static ggml_tensor * build_random_graph(ggml_context * ctx, std::mt19937 & rng, int n_inputs, int n_ops) {
+    std::vector<ggml_tensor *> tensors;
+
+    for (int i = 0; i < n_inputs; i++) {
+        ggml_tensor * t = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 16 + rng() % 1024);
+        ggml_set_name(t, ("input_" + std::to_string(i)).c_str());
+        tensors.push_back(t);
+    }
+
+    // the operands are picked among the most recent tensors, so that the older ones die at different steps
+    auto pick = [&]() {
+        const size_t n = std::min<size_t>(tensors.size(), 6);
+        return tensors[tensors.size() - 1 - rng() % n];
+    };
+
+    for (int i = 0; i < n_ops; i++) {
+        ggml_tensor * x = pick();
+        ggml_tensor * t = nullptr;
+
+        switch (rng() % 5) {
+            case 0:
+                t = ggml_scale(ctx, x, 0.5f);
+                break;
+            case 1:
+                t = ggml_relu(ctx, x);
+                break;
+            case 2:
+                {
+                    ggml_tensor * y = pick();
+                    t = x->ne[0] == y->ne[0] ? ggml_add(ctx, x, y) : ggml_concat(ctx, x, y, 0);
+                } break;
+            case 3:
+                t = ggml_concat(ctx, x, pick(), 0);
+                break;
+            case 4:
+                t = ggml_cont(ctx, ggml_view_1d(ctx, x, std::max<int64_t>(1, x->ne[0]/4), 0));
+                break;
+        }
+
+        // keep the sizes bounded
+        if (t->ne[0] > 8192) {
+            t = ggml_cont(ctx, ggml_view_1d(ctx, t, 1024, 0));
+        }
+
+        ggml_format_name(t, "node_%d", i);
+        tensors.push_back(t);
+    }
+
+    // join the recent tensors so that they are part of the graph
+    ggml_tensor * out = tensors.back();
+    for (int i = 0; i < 3; i++) {
+        out = ggml_concat(ctx, out, pick(), 0);
+    }
+
+    return out;
+}
+
+static ggml_tensor * storage(ggml_tensor * t) {
+    while (t->view_src != nullptr) {
+        t = t->view_src;
+    }
+    return t;
+}
+
+// check that no two tensors in use at the same time overlap in memory
+// a tensor is in use from the step it is computed (leafs before the first node) until its last use by a node, or
+// until the end of the graph if nothing uses it; the views keep their source in use
+// the result of a node may reuse the memory of a source that is last used by this node, in place
+static int check_overlaps(ggml_cgraph * gf) {
+    const int n_nodes = ggml_graph_n_nodes(gf);
+
+    std::map<ggml_tensor *, int> start;
+    std::map<ggml_tensor *, int> end;
+    std::map<ggml_tensor *, int> n_uses;
+
+    for (int i = 0; i < n_nodes; i++) {
+        ggml_tensor * node = ggml_graph_node(gf, i);
+        if (node->view_src == nullptr) {
+            start[node] = i;
+        }
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            ggml_tensor * src = node->src[j];
+            if (src == nullptr) {
+                continue;
+            }
+            if (src->op == GGML_OP_NONE) {
+                start[src] = -1; // leaf
+            }
+            n_uses[src]++;
+            end[storage(src)] = std::max(end[storage(src)], i);
+        }
+    }
+    for (int i = 0; i < n_nodes; i++) {
+        ggml_tensor * node = ggml_graph_node(gf, i);
+        if (n_uses[node] == 0) {
+            end[storage(node)] = n_nodes;
+        }
+    }
+
+    std::vector<ggml_tensor *> tensors;
+    for (const auto & it : start) {
+        tensors.push_back(it.first);
+    }
+    std::sort(tensors.begin(), tensors.end(), [&](ggml_tensor * a, ggml_tensor * b) { return start[a] < start[b]; });
+
+    int n_errors = 0;
+
+    for (size_t a = 0; a < tensors.size(); a++) {
+        for (size_t b = a + 1; b < tensors.size(); b++) {
+            ggml_tensor * ta = tensors[a];
+            ggml_tensor * tb = tensors[b];
+
+            const char * a0 = (const char *) ta->data;
+            const char * a1 = a0 + ggml_nbytes(ta);
+            const char * b0 = (const char *) tb->data;
+            const char * b1 = b0 + ggml_nbytes(tb);
+
+            if (a1 <= b0 || b1 <= a0) {
+                continue;
+            }
+
+            // tb is computed after ta is no longer used, or in place of ta by its last user
+            if (start[tb] > end[ta] || (start[tb] == end[ta] && a0 == b0)) {
+                continue;
+            }
+
+            printf("%s: %s [%d, %d] and %s [%d, %d] overlap in memory\n", __func__,
+                    ta->name, start[ta], end[ta], tb->name, start[tb], end[tb]);
+            n_errors++;
+        }
+    }
+
+    return n_errors;
+}
+
+int main(void) {
+    ggml_backend_buffer_type_t buft = ggml_backend_cpu_buffer_type();
+
+    int n_planned = 0;
+
+    for (int seed = 0; seed < 200; seed++) {
+        std::mt19937 rng(seed);
+
+        struct ggml_init_params params = {
+            /* .mem_size   = */ 4*1024*1024,
+            /* .mem_buffer = */ NULL,
+            /* .no_alloc   = */ true,
+        };
+        ggml_context * ctx = ggml_init(params);
+
+        ggml_cgraph * gf = ggml_new_graph(ctx);
+        ggml_build_forward_expand(gf, build_random_graph(ctx, rng, 1 + seed % 4, 20 + seed % 40));
+
+        ggml_gallocr_t galloc = ggml_gallocr_new(buft);
+        assert(ggml_gallocr_alloc_graph(galloc, gf));
+
+        ggml_gallocr_plan_stats stats;
+        ggml_gallocr_get_plan_stats(galloc, 0, &stats);
+
+        assert(stats.peak <= stats.planned && stats.peak <= stats.greedy);
+        assert(ggml_gallocr_get_buffer_size(galloc, 0) >= std::min(stats.planned, stats.greedy));
+
+        if (stats.planned < stats.greedy) {
+            n_planned++;
+        }
+
+        const int n_errors = check_overlaps(gf);
+        if (n_errors > 0) {
+            printf("seed %d: %d overlaps, sum = %zu, peak = %zu, greedy = %zu, planned = %zu\n",
+                    seed, n_errors, stats.sum, stats.peak, stats.greedy, stats.planned);
+        }
+        assert(n_errors == 0);
+
+        ggml_gallocr_free(galloc);
+        ggml_free(ctx);
+    }
+
+    printf("%d/200 graphs used the lifetime-aware plan\n", n_planned);
+
+    // the planner must have been exercised
+    assert(n_planned > 0);
+
+    printf("OK\n");
+
+    return 0;
+}
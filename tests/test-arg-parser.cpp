@@ -68,8 +68,8 @@ int main(void) {
     argv = {"binary_name", "-sm", "hello"};
     assert(false == gpt_params_parse(argv.size(), list_str_to_char(argv).data(), params, LLAMA_EXAMPLE_COMMON));
 
-    // non-existence arg in specific example (--draft cannot be used outside llama-speculative)
-    argv = {"binary_name", "--draft", "123"};
+    // non-existence arg in specific example (--p-split cannot be used outside llama-speculative)
+    argv = {"binary_name", "--p-split", "0.5"};
     assert(false == gpt_params_parse(argv.size(), list_str_to_char(argv).data(), params, LLAMA_EXAMPLE_SERVER));
 
 
@@ -98,6 +98,49 @@ int main(void) {
     assert(true == gpt_params_parse(argv.size(), list_str_to_char(argv).data(), params, LLAMA_EXAMPLE_SPECULATIVE));
     assert(params.n_draft == 123);
 
+    printf("test-arg-parser: test the per-layer KV cache types\n\n");
+
+    argv = {"binary_name", "-ctkl", "0..1=f16,-1=q8_0", "-ctvl", "2=q4_0"};
+    assert(true == gpt_params_parse(argv.size(), list_str_to_char(argv).data(), params, LLAMA_EXAMPLE_COMMON));
+    assert(params.cache_type_k_layers == "0..1=f16,-1=q8_0");
+    assert(params.cache_type_v_layers == "2=q4_0");
+
+    {
+        const std::vector<ggml_type> types = kv_cache_types_from_str(params.cache_type_k_layers, 4);
+        assert(types.size() == 4);
+        assert(types[0] == GGML_TYPE_F16);
+        assert(types[1] == GGML_TYPE_F16);
+        assert(types[2] == GGML_TYPE_COUNT);
+        assert(types[3] == GGML_TYPE_Q8_0);
+    }
+    {
+        const std::vector<ggml_type> types = kv_cache_types_from_str("-3..-2=q4_1,0=f32", 4);
+        assert(types[0] == GGML_TYPE_F32);
+        assert(types[1] == GGML_TYPE_Q4_1);
+        assert(types[2] == GGML_TYPE_Q4_1);
+        assert(types[3] == GGML_TYPE_COUNT);
+    }
+
+    auto kv_cache_types_throws = [](const std::string & spec, int n_layer) {
+        try {
+            kv_cache_types_from_str(spec, n_layer);
+        } catch (const std::runtime_error &) {
+            return true;
+        }
+        return false;
+    };
+
+    assert(kv_cache_types_throws("0",         4)); // no type
+    assert(kv_cache_types_throws("0=f15",     4)); // unknown type
+    assert(kv_cache_types_throws("4=f16",     4)); // past the last layer
+    assert(kv_cache_types_throws("-5=f16",    4)); // before the first layer
+    assert(kv_cache_types_throws("a=f16",     4)); // not a layer
+    assert(kv_cache_types_throws("1x=f16",    4)); // trailing characters
+    assert(kv_cache_types_throws("=f16",      4)); // empty layer
+    assert(kv_cache_types_throws("2..1=f16",  4)); // reversed range
+    assert(kv_cache_types_throws("0..=f16",   4)); // open range
+    assert(kv_cache_types_throws("0=f16,3=f16", 3)); // valid for more layers, e.g. the target of a draft model
+
 // skip this part on windows, because setenv is not supported
 #ifdef _WIN32
     printf("test-arg-parser: skip on windows build\n");
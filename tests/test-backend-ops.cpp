@@ -1118,6 +1118,58 @@ struct test_get_rows : public test_case {
     }
 };
 
+// GGML_OP_SET_ROWS
+struct test_set_rows : public test_case {
+    const ggml_type type;
+    const int n; // cols
+    const int m; // rows of the destination
+    const int r; // rows to set
+    const bool t; // transposed destination (non-contiguous rows)
+
+    std::string vars() override {
+        return VARS_TO_STR5(type, n, m, r, t);
+    }
+
+    test_set_rows(ggml_type type = GGML_TYPE_F32, int n = 10, int m = 5, int r = 3, bool t = false)
+        : type(type), n(n), m(m), r(r), t(t) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * dst = ggml_new_tensor_2d(ctx, type, t ? m : n, t ? n : m);
+        ggml_set_name(dst, "dst");
+        if (t) {
+            dst = ggml_transpose(ctx, dst);
+            ggml_set_name(dst, "dst_transposed");
+        }
+
+        ggml_tensor * src = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n, r);
+        ggml_set_name(src, "src");
+
+        ggml_tensor * rows = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, r);
+        ggml_set_name(rows, "rows");
+
+        ggml_tensor * out = ggml_set_rows(ctx, dst, src, rows);
+        ggml_set_name(out, "out");
+
+        return out;
+    }
+
+    void initialize_tensors(ggml_context * ctx) override {
+        for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != NULL; t = ggml_get_next_tensor(ctx, t)) {
+            if (t->type == GGML_TYPE_I32) {
+                // distinct rows, the order of the writes to the same row is not defined
+                std::vector<int> data(m);
+                for (int i = 0; i < m; i++) {
+                    data[i] = i;
+                }
+                std::shuffle(data.begin(), data.end(), std::default_random_engine(rand()));
+                ggml_backend_tensor_set(t, data.data(), 0, r * sizeof(int));
+            } else if (!ggml_is_view_op(t->op)) {
+                init_tensor_uniform(t);
+            }
+        }
+    }
+};
+
 // GGML_OP_REPEAT
 struct test_repeat : public test_case {
     const ggml_type type;
@@ -3226,6 +3278,13 @@ static bool test_backend(ggml_backend_t backend, test_mode mode, const char * op
         }
     }
 
+    for (ggml_type type : {GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_Q8_0, GGML_TYPE_Q4_0}) {
+        test_cases.emplace_back(new test_set_rows(type, 256, 16, 5, false));
+    }
+    for (ggml_type type : {GGML_TYPE_F32, GGML_TYPE_F16}) {
+        test_cases.emplace_back(new test_set_rows(type, 64, 16, 5, true));
+    }
+
     for (ggml_type type_input : {GGML_TYPE_F32}) {
         for (ggml_op_pool pool_type : {GGML_OP_POOL_AVG, GGML_OP_POOL_MAX}) {
             for (int k0 : {1, 3}) {
@@ -3745,9 +3804,52 @@ int main(int argc, char ** argv) {
         ggml_backend_free(backend);
     }
 
-    printf("%zu/%zu backends passed\n", n_ok, ggml_backend_reg_get_count());
+    // the NUMA backends are not registered, as they need a node: test the backend of each node against the CPU backend
+    size_t n_numa = 0;
+
+    if (mode != MODE_GRAD) {
+        // the first ggml_init resets the NUMA state, so it is done before the nodes are detected
+        {
+            struct ggml_init_params params = { 0, NULL, false };
+            ggml_free(ggml_init(params));
+        }
+        ggml_numa_init(GGML_NUMA_STRATEGY_PIPELINE);
+
+        for (int node = 0; node < ggml_numa_n_nodes(); node++) {
+            ggml_backend_t backend = ggml_backend_cpu_numa_init(node);
+            if (backend == NULL) {
+                continue;
+            }
+            n_numa++;
+
+            printf("Backend %s\n", ggml_backend_name(backend));
+
+            if (backend_filter != NULL && strcmp(backend_filter, ggml_backend_name(backend)) != 0) {
+                printf("  Skipping\n");
+                ggml_backend_free(backend);
+                n_ok++;
+                continue;
+            }
+
+            bool ok = test_backend(backend, mode, op_name_filter);
+
+            printf("  Backend %s: ", ggml_backend_name(backend));
+            if (ok) {
+                printf("\033[1;32mOK\033[0m\n");
+                n_ok++;
+            } else {
+                printf("\033[1;31mFAIL\033[0m\n");
+            }
+
+            printf("\n");
+
+            ggml_backend_free(backend);
+        }
+    }
+
+    printf("%zu/%zu backends passed\n", n_ok, ggml_backend_reg_get_count() + n_numa);
 
-    if (n_ok != ggml_backend_reg_get_count()) {
+    if (n_ok != ggml_backend_reg_get_count() + n_numa) {
         printf("\033[1;31mFAIL\033[0m\n");
         return 1;
     }
@@ -0,0 +1,141 @@
+// tests of the eviction order of the KV tier, with sequence states made up by the test
+
+#include "kv-tier.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <cassert>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+static std::vector<uint8_t> make_data(size_t size, uint8_t value) {
+    return std::vector<uint8_t>(size, value);
+}
+
+// ids of the entries, most recently used first
+static std::vector<uint64_t> entry_ids(const llama_kv_tier & tier) {
+    std::vector<uint64_t> ids;
+    for (const auto & entry : tier.entries) {
+        ids.push_back(entry.id);
+    }
+    return ids;
+}
+
+static llama_kv_tier_entry & get_entry(llama_kv_tier & tier, uint64_t id) {
+    for (auto & entry : tier.entries) {
+        if (entry.id == id) {
+            return entry;
+        }
+    }
+    assert(false);
+    return tier.entries.front();
+}
+
+// without a directory, the least recently used entries are dropped to meet the budget
+static void test_drop_lru() {
+    llama_kv_tier tier;
+    tier.params.host_budget = 100;
+
+    llama_kv_tier_add(tier, { 1, 2, 3 }, make_data(40, 'a'));
+    const int64_t b = llama_kv_tier_add(tier, { 1, 2, 4 }, make_data(40, 'b'));
+    assert(tier.host_size == 80);
+    assert(tier.n_dropped == 0);
+
+    const int64_t c = llama_kv_tier_add(tier, { 5, 6 }, make_data(40, 'c'));
+    assert((entry_ids(tier) == std::vector<uint64_t>{ (uint64_t) c, (uint64_t) b }));
+    assert(tier.host_size == 80);
+    assert(tier.n_dropped == 1);
+
+    // an entry larger than the budget evicts the older ones first, then itself
+    llama_kv_tier_add(tier, { 7 }, make_data(120, 'd'));
+    assert(tier.entries.empty());
+    assert(tier.host_size == 0);
+    assert(tier.n_dropped == 4);
+    assert(tier.n_stored == 4);
+}
+
+// the entry with the longest common prefix is found, unknown positions never match
+static void test_find() {
+    llama_kv_tier tier;
+    tier.params.host_budget = 1000;
+
+    const int64_t a = llama_kv_tier_add(tier, { 1, 2, 3, 4 }, make_data(10, 'a'));
+    const int64_t b = llama_kv_tier_add(tier, { 1, 2, 5 },    make_data(10, 'b'));
+    llama_kv_tier_add(tier, { 1, LLAMA_TOKEN_NULL, 3, 4, 5 }, make_data(10, 'c'));
+
+    size_t n_match = 0;
+    assert(llama_kv_tier_find(tier, { 1, 2, 3, 9 }, n_match) == a && n_match == 3);
+    assert(llama_kv_tier_find(tier, { 1, 2, 5, 9 }, n_match) == b && n_match == 3);
+    assert(llama_kv_tier_find(tier, { 9 }, n_match) == -1 && n_match == 0);
+
+    // c only matches the first token, as a and b
+    const int64_t id = llama_kv_tier_find(tier, { 1, LLAMA_TOKEN_NULL, 3 }, n_match);
+    assert(id != -1 && n_match == 1);
+}
+
+// with a directory, the least recently used entries are moved to files and can be loaded back
+static void test_spill_lru() {
+    llama_kv_tier tier;
+    tier.params.host_budget = 100;
+    tier.params.path        = "./";
+
+    const int64_t a = llama_kv_tier_add(tier, { 1 }, make_data(40, 'a'));
+    const int64_t b = llama_kv_tier_add(tier, { 2 }, make_data(40, 'b'));
+    const int64_t c = llama_kv_tier_add(tier, { 3 }, make_data(40, 'c'));
+
+    assert((entry_ids(tier) == std::vector<uint64_t>{ (uint64_t) c, (uint64_t) b, (uint64_t) a }));
+    assert(tier.host_size == 80);
+    assert(tier.n_spilled == 1);
+    assert(tier.n_dropped == 0);
+
+    // only the least recently used entry is on disk
+    assert( get_entry(tier, a).data.empty() && !get_entry(tier, a).fname.empty());
+    assert(!get_entry(tier, b).data.empty() &&  get_entry(tier, b).fname.empty());
+    assert(!get_entry(tier, c).data.empty() &&  get_entry(tier, c).fname.empty());
+
+    // the file is complete once the write is done
+    {
+        const llama_kv_tier_entry & entry = get_entry(tier, a);
+        assert(entry.writing.valid() && entry.writing.get());
+
+        std::ifstream file(entry.fname, std::ios::binary);
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        assert(data == make_data(40, 'a'));
+    }
+
+    // the next entries go to disk in the order they were stored
+    llama_kv_tier_add(tier, { 4 }, make_data(61, 'd'));
+    assert(tier.n_spilled == 3);
+    assert(tier.host_size == 61);
+    assert( get_entry(tier, b).data.empty());
+    assert( get_entry(tier, c).data.empty());
+
+    // a prefetch waits for the write of the file
+    llama_kv_tier_prefetch(tier, c);
+    {
+        llama_kv_tier_entry & entry = get_entry(tier, c);
+        assert(entry.pending.valid());
+        assert(entry.pending.get() == make_data(40, 'c'));
+    }
+
+    // the files are removed with the entries
+    const std::string fname = get_entry(tier, a).fname;
+    llama_kv_tier_clear(tier);
+    assert(tier.entries.empty());
+    assert(!std::ifstream(fname).good());
+}
+
+int main(void) {
+    test_drop_lru();
+    test_find();
+    test_spill_lru();
+
+    printf("OK\n");
+
+    return 0;
+}
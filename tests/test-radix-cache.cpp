@@ -0,0 +1,331 @@
+// tests of the radix cache of token prefixes, on a tiny random model written by the test itself
+
+#include "ggml.h"
+#include "llama.h"
+#include "radix-cache.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+static void write_random_model(const char * fname) {
+    const int n_vocab = 64, n_embd = 32, n_layer = 1, n_head = 2, n_ff = 64;
+
+    struct gguf_context * gctx = gguf_init_empty();
+    gguf_set_val_str(gctx, "general.architecture", "llama");
+    gguf_set_val_u32(gctx, "llama.vocab_size", n_vocab);
+    gguf_set_val_u32(gctx, "llama.context_length", 256);
+    gguf_set_val_u32(gctx, "llama.embedding_length", n_embd);
+    gguf_set_val_u32(gctx, "llama.block_count", n_layer);
+    gguf_set_val_u32(gctx, "llama.feed_forward_length", n_ff);
+    gguf_set_val_u32(gctx, "llama.attention.head_count", n_head);
+    gguf_set_val_f32(gctx, "llama.attention.layer_norm_rms_epsilon", 1e-5f);
+    gguf_set_val_u32(gctx, "llama.rope.dimension_count", n_embd/n_head);
+    gguf_set_val_str(gctx, "tokenizer.ggml.model", "no_vocab");
+
+    struct ggml_init_params params = { 16*1024*1024, NULL, false };
+    struct ggml_context * ctx = ggml_init(params);
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist(0.0f, 0.5f);
+
+    auto add = [&](const std::string & name, int64_t ne0, int64_t ne1) {
+        struct ggml_tensor * t = ne1 > 0 ? ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1) : ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+        ggml_set_name(t, name.c_str());
+        float * data = (float *) t->data;
+        for (int64_t i = 0; i < ggml_nelements(t); i++) {
+            data[i] = ne1 > 0 ? dist(rng) : 1.0f;
+        }
+        gguf_add_tensor(gctx, t);
+    };
+
+    add("token_embd.weight",  n_embd, n_vocab);
+    add("output_norm.weight", n_embd, 0);
+    add("output.weight",      n_embd, n_vocab);
+    for (int il = 0; il < n_layer; il++) {
+        const std::string prefix = "blk." + std::to_string(il) + ".";
+        add(prefix + "attn_norm.weight",   n_embd, 0);
+        add(prefix + "attn_q.weight",      n_embd, n_embd);
+        add(prefix + "attn_k.weight",      n_embd, n_embd);
+        add(prefix + "attn_v.weight",      n_embd, n_embd);
+        add(prefix + "attn_output.weight", n_embd, n_embd);
+        add(prefix + "ffn_norm.weight",    n_embd, 0);
+        add(prefix + "ffn_gate.weight",    n_embd, n_ff);
+        add(prefix + "ffn_up.weight",      n_embd, n_ff);
+        add(prefix + "ffn_down.weight",    n_ff,   n_embd);
+    }
+
+    gguf_write_to_file(gctx, fname, false);
+
+    gguf_free(gctx);
+    ggml_free(ctx);
+}
+
+// decode tokens[p0:] into seq_id at their positions
+static void decode(llama_context * ctx, llama_seq_id seq_id, const std::vector<llama_token> & tokens, size_t p0) {
+    llama_batch batch = llama_batch_init(tokens.size(), 0, 1);
+    for (size_t i = p0; i < tokens.size(); ++i) {
+        batch.token   [batch.n_tokens]    = tokens[i];
+        batch.pos     [batch.n_tokens]    = i;
+        batch.n_seq_id[batch.n_tokens]    = 1;
+        batch.seq_id  [batch.n_tokens][0] = seq_id;
+        batch.logits  [batch.n_tokens]    = i == tokens.size() - 1;
+        batch.n_tokens++;
+    }
+    assert(llama_decode(ctx, batch) == 0);
+    llama_batch_free(batch);
+}
+
+// positions of the cells of the KV cache that hold seq_id
+static std::vector<llama_pos> seq_pos(llama_context * ctx, llama_seq_id seq_id) {
+    llama_kv_cache_view view = llama_kv_cache_view_init(ctx, 8);
+    llama_kv_cache_view_update(ctx, &view);
+
+    std::vector<llama_pos> res;
+    for (int32_t i = 0; i < view.n_cells; ++i) {
+        for (int32_t j = 0; j < view.n_seq_max; ++j) {
+            if (view.cells_sequences[i*view.n_seq_max + j] == seq_id) {
+                res.push_back(view.cells[i].pos);
+            }
+        }
+    }
+    llama_kv_cache_view_free(&view);
+
+    std::sort(res.begin(), res.end());
+    return res;
+}
+
+static std::vector<llama_pos> range(llama_pos p0, llama_pos p1) {
+    std::vector<llama_pos> res;
+    for (llama_pos p = p0; p < p1; ++p) {
+        res.push_back(p);
+    }
+    return res;
+}
+
+static const llama_radix_node * child(const llama_radix_node & node, llama_token token) {
+    auto it = node.children.find(token);
+    assert(it != node.children.end());
+    return it->second.get();
+}
+
+static void test_insert_split_match(llama_context * ctx) {
+    llama_kv_cache_clear(ctx);
+
+    llama_radix_cache_params params;
+    params.n_tokens_max = 256;
+    params.seq_id_base  = 10;
+    params.n_seq        = 4;
+
+    llama_radix_cache cache;
+    llama_radix_cache_init(cache, params);
+
+    // insert: a single leaf holding the whole prompt
+    const std::vector<llama_token> a = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    decode(ctx, 0, a, 0);
+
+    assert(llama_radix_cache_insert(cache, ctx, 0, a) == 8);
+    assert(cache.n_tokens == 8);
+    assert(cache.root.children.size() == 1);
+
+    const llama_radix_node * leaf_a = child(cache.root, 1);
+    assert(leaf_a->tokens == a);
+    assert(leaf_a->pos == 0 && leaf_a->seq_id == 10);
+    assert(seq_pos(ctx, 10) == range(0, 8));
+
+    // inserting the same prompt again adds nothing
+    assert(llama_radix_cache_insert(cache, ctx, 0, a) == 0);
+    assert(cache.n_tokens == 8);
+
+    // match
+    assert(llama_radix_cache_find(cache, a) == 8);
+    assert(llama_radix_cache_find(cache, { 1, 2, 3, 9 }) == 3);
+    assert(llama_radix_cache_find(cache, { 1, 2, 3, 4, 5, 6, 7, 8, 9 }) == 8);
+    assert(llama_radix_cache_find(cache, { 5, 6 }) == 0);
+    assert(llama_radix_cache_find(cache, { 1, 2, LLAMA_TOKEN_NULL, 4 }) == 2);
+
+    // split: b diverges from a after 4 tokens
+    const std::vector<llama_token> b = { 1, 2, 3, 4, 20, 21 };
+    llama_kv_cache_seq_rm(ctx, 0, 4, -1);
+    decode(ctx, 0, b, 4);
+
+    assert(llama_radix_cache_insert(cache, ctx, 0, b) == 2);
+    assert(cache.n_tokens == 10);
+    assert(cache.root.children.size() == 1);
+
+    const llama_radix_node * mid = child(cache.root, 1);
+    assert((mid->tokens == std::vector<llama_token>{ 1, 2, 3, 4 }));
+    assert(mid->pos == 0 && mid->seq_id == 11);
+    assert(mid->children.size() == 2);
+
+    const llama_radix_node * tail_a = child(*mid, 5);
+    assert((tail_a->tokens == std::vector<llama_token>{ 5, 6, 7, 8 }));
+    assert(tail_a->pos == 4 && tail_a->seq_id == 10 && tail_a->parent == mid);
+
+    const llama_radix_node * tail_b = child(*mid, 20);
+    assert((tail_b->tokens == std::vector<llama_token>{ 20, 21 }));
+    assert(tail_b->pos == 4 && tail_b->seq_id == 12 && tail_b->parent == mid);
+
+    // each node holds the cells of its own tokens only
+    assert(seq_pos(ctx, 11) == range(0, 4));
+    assert(seq_pos(ctx, 10) == range(4, 8));
+    assert(seq_pos(ctx, 12) == range(4, 6));
+
+    assert(llama_radix_cache_find(cache, a) == 8);
+    assert(llama_radix_cache_find(cache, b) == 6);
+    assert(llama_radix_cache_find(cache, { 1, 2, 3, 4, 30 }) == 4);
+
+    // attach: the matched prefix is copied into the sequence, across the split
+    llama_kv_cache_seq_rm(ctx, 1, -1, -1);
+    assert(llama_radix_cache_attach(cache, ctx, 1, { 1, 2, 3, 4, 5, 6, 99 }) == 6);
+    assert(seq_pos(ctx, 1) == range(0, 6));
+    assert(cache.n_lookups == 1 && cache.n_hits == 1 && cache.n_tokens_hit == 6);
+
+    llama_kv_cache_seq_rm(ctx, 2, -1, -1);
+    assert(llama_radix_cache_attach(cache, ctx, 2, { 40, 41 }) == 0);
+    assert(seq_pos(ctx, 2).empty());
+    assert(cache.n_lookups == 2 && cache.n_hits == 1);
+
+    // the tokens after an image are not added
+    const std::vector<llama_token> c = { 30, 31, LLAMA_TOKEN_NULL, 33 };
+    llama_kv_cache_seq_rm(ctx, 0, -1, -1);
+    decode(ctx, 0, { 30, 31 }, 0);
+
+    assert(llama_radix_cache_insert(cache, ctx, 0, c) == 2);
+    assert(llama_radix_cache_find(cache, c) == 2);
+    assert((child(cache.root, 30)->tokens == std::vector<llama_token>{ 30, 31 }));
+
+    llama_radix_cache_clear(cache, ctx);
+    assert(cache.root.children.empty() && cache.n_tokens == 0);
+    for (llama_seq_id s = 10; s < 14; ++s) {
+        assert(seq_pos(ctx, s).empty());
+    }
+}
+
+static void test_evict_lru(llama_context * ctx) {
+    llama_kv_cache_clear(ctx);
+
+    llama_radix_cache_params params;
+    params.n_tokens_max = 256;
+    params.seq_id_base  = 10;
+    params.n_seq        = 3;
+
+    llama_radix_cache cache;
+    llama_radix_cache_init(cache, params);
+
+    const std::vector<llama_token> a = { 1, 2, 3, 4, 5, 6 };
+    const std::vector<llama_token> b = { 1, 2, 3, 4, 20, 21 };
+
+    decode(ctx, 0, a, 0);
+    llama_radix_cache_insert(cache, ctx, 0, a);
+    llama_kv_cache_seq_rm(ctx, 0, 4, -1);
+    decode(ctx, 0, b, 4);
+    llama_radix_cache_insert(cache, ctx, 0, b);
+
+    // using a makes the tail of b the least recently used leaf
+    llama_kv_cache_seq_rm(ctx, 1, -1, -1);
+    assert(llama_radix_cache_attach(cache, ctx, 1, a) == 6);
+
+    const llama_seq_id seq_id_b = child(*child(cache.root, 1), 20)->seq_id;
+
+    assert(llama_radix_cache_evict(cache, ctx, 1) == 2);
+    assert(cache.n_tokens == 6 && cache.n_evicted == 1);
+    assert(llama_radix_cache_find(cache, b) == 4);
+    assert(llama_radix_cache_find(cache, a) == 6);
+    assert(seq_pos(ctx, seq_id_b).empty());
+    assert(cache.seq_ids_free.size() == 1 && cache.seq_ids_free.back() == seq_id_b);
+
+    // the inner nodes become leaves once their children are evicted
+    assert(llama_radix_cache_evict(cache, ctx, 100) == 6);
+    assert(cache.root.children.empty() && cache.n_tokens == 0 && cache.n_evicted == 3);
+    assert(cache.seq_ids_free.size() == 3);
+
+    // running out of sequence ids evicts the least recently used leaf
+    const std::vector<std::vector<llama_token>> prompts = {
+        { 30, 31, 32 }, { 40, 41, 42 }, { 50, 51, 52 }, { 60, 61, 62 },
+    };
+    for (const auto & prompt : prompts) {
+        llama_kv_cache_seq_rm(ctx, 0, -1, -1);
+        decode(ctx, 0, prompt, 0);
+        assert(llama_radix_cache_insert(cache, ctx, 0, prompt) == 3);
+    }
+    assert(cache.n_tokens == 9);
+    assert(llama_radix_cache_find(cache, prompts[0]) == 0);
+    assert(llama_radix_cache_find(cache, prompts[1]) == 3);
+    assert(llama_radix_cache_find(cache, prompts[3]) == 3);
+}
+
+static void test_evict_n_tokens_max(llama_context * ctx) {
+    llama_kv_cache_clear(ctx);
+
+    llama_radix_cache_params params;
+    params.n_tokens_max = 8;
+    params.seq_id_base  = 10;
+    params.n_seq        = 8;
+
+    llama_radix_cache cache;
+    llama_radix_cache_init(cache, params);
+
+    const std::vector<std::vector<llama_token>> prompts = {
+        { 30, 31, 32 }, { 40, 41, 42 }, { 50, 51, 52 },
+    };
+
+    llama_kv_cache_seq_rm(ctx, 0, -1, -1);
+    decode(ctx, 0, prompts[0], 0);
+    llama_radix_cache_insert(cache, ctx, 0, prompts[0]);
+    llama_kv_cache_seq_rm(ctx, 0, -1, -1);
+    decode(ctx, 0, prompts[1], 0);
+    llama_radix_cache_insert(cache, ctx, 0, prompts[1]);
+
+    llama_kv_cache_seq_rm(ctx, 1, -1, -1);
+    assert(llama_radix_cache_attach(cache, ctx, 1, prompts[0]) == 3);
+
+    // holding too many tokens evicts the least recently used leaf, never the prompt just added
+    llama_kv_cache_seq_rm(ctx, 0, -1, -1);
+    decode(ctx, 0, prompts[2], 0);
+    assert(llama_radix_cache_insert(cache, ctx, 0, prompts[2]) == 3);
+    assert(cache.n_tokens == 6);
+    assert(llama_radix_cache_find(cache, prompts[0]) == 3);
+    assert(llama_radix_cache_find(cache, prompts[1]) == 0);
+    assert(llama_radix_cache_find(cache, prompts[2]) == 3);
+}
+
+int main(void) {
+    const char * fname = "test-radix-cache.gguf";
+
+    write_random_model(fname);
+
+    llama_backend_init();
+
+    llama_model_params mparams = llama_model_default_params();
+    llama_model * model = llama_load_model_from_file(fname, mparams);
+    assert(model != nullptr);
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx   = 256;
+    cparams.n_batch = 256;
+
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+    assert(ctx != nullptr);
+
+    test_insert_split_match(ctx);
+    test_evict_lru(ctx);
+    test_evict_n_tokens_max(ctx);
+
+    llama_free(ctx);
+    llama_free_model(model);
+    llama_backend_free();
+
+    std::remove(fname);
+
+    printf("OK\n");
+
+    return 0;
+}
@@ -0,0 +1,107 @@
+// check GGML_OP_SET_ROWS on the CPU against the same rows written with ggml_cpy into views of the destination
+
+#include "ggml.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph * graph, int n_threads) {
+    struct ggml_cplan plan = ggml_graph_plan(graph, n_threads, nullptr);
+
+    if (plan.work_size > 0) {
+        buf.resize(plan.work_size);
+        plan.work_data = buf.data();
+    }
+
+    ggml_graph_compute(graph, &plan);
+}
+
+// n: cols, m: rows of the destination, r: rows to set, t: transposed destination (non-contiguous rows)
+static bool test_set_rows(ggml_type type, int n, int m, int r, bool t, int n_threads) {
+    struct ggml_init_params params = {
+        /* .mem_size   = */ 16*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    struct ggml_context * ctx = ggml_init(params);
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    // the destination is stored with m rows of n columns, or n rows of m columns when transposed
+    const int64_t ne0 = t ? m : n;
+    const int64_t ne1 = t ? n : m;
+
+    std::vector<float> dst_f32(ne0*ne1);
+    for (float & v : dst_f32) {
+        v = dist(rng);
+    }
+
+    struct ggml_tensor * dst = ggml_new_tensor_2d(ctx, type, ne0, ne1);
+    ggml_quantize_chunk(type, dst_f32.data(), dst->data, 0, ne1, ne0, nullptr);
+
+    struct ggml_tensor * dst_ref = ggml_dup_tensor(ctx, dst);
+    memcpy(dst_ref->data, dst->data, ggml_nbytes(dst));
+
+    struct ggml_tensor * src = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n, r);
+    for (int64_t i = 0; i < ggml_nelements(src); i++) {
+        ((float *) src->data)[i] = dist(rng);
+    }
+
+    // distinct rows, the order of the writes to the same row is not defined
+    std::vector<int32_t> ids(m);
+    for (int i = 0; i < m; i++) {
+        ids[i] = i;
+    }
+    std::shuffle(ids.begin(), ids.end(), rng);
+
+    struct ggml_tensor * rows = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, r);
+    memcpy(rows->data, ids.data(), r*sizeof(int32_t));
+
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+
+    ggml_build_forward_expand(gf, ggml_set_rows(ctx, t ? ggml_transpose(ctx, dst) : dst, src, rows));
+
+    // reference: copy each source row into its destination row
+    for (int k = 0; k < r; k++) {
+        struct ggml_tensor * src_row = ggml_view_1d(ctx, src, n, k*src->nb[1]);
+        struct ggml_tensor * dst_row = t
+            ? ggml_view_2d(ctx, dst_ref, 1, n, dst_ref->nb[1], ids[k]*ggml_element_size(dst_ref)) // a column of the stored matrix
+            : ggml_view_1d(ctx, dst_ref, n, ids[k]*dst_ref->nb[1]);
+        ggml_build_forward_expand(gf, ggml_cpy(ctx, src_row, dst_row));
+    }
+
+    std::vector<uint8_t> work_buffer;
+    ggml_graph_compute_helper(work_buffer, gf, n_threads);
+
+    const bool ok = memcmp(dst->data, dst_ref->data, ggml_nbytes(dst)) == 0;
+
+    printf("%s: type = %s, n = %d, m = %d, r = %d, t = %d, n_threads = %d: %s\n",
+            __func__, ggml_type_name(type), n, m, r, t, n_threads, ok ? "OK" : "FAIL");
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+int main(int /*argc*/, const char ** /*argv*/) {
+    bool ok = true;
+
+    for (int n_threads : {1, 4}) {
+        for (ggml_type type : {GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_Q8_0, GGML_TYPE_Q4_0}) {
+            ok = test_set_rows(type, 256, 16, 5, false, n_threads) && ok;
+        }
+        for (ggml_type type : {GGML_TYPE_F32, GGML_TYPE_F16}) {
+            ok = test_set_rows(type, 64, 16, 5, true, n_threads) && ok;
+        }
+    }
+
+    ggml_quantize_free();
+
+    return ok ? 0 : 1;
+}